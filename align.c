@@ -31,7 +31,11 @@
  */
 
 #include <stdio.h>
+#if NO_MPI
+#include "nompi.h"
+#else
 #include <mpi.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -44,6 +48,15 @@
 #include <sched.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
 
 #include "imio.h"
 #include "dt.h"
@@ -53,9 +66,18 @@
 
 #define LINE_LENGTH 256
 #define MAX_SPEC        1024
-#define CONSTRAINED (1.0e+30)
 #define UNSPECIFIED (1.0e+30)
 #define MAX_LABEL_LENGTH  255
+#define SIMD_NONE       0
+#define SIMD_AVX2       1
+#define SIMD_AVX512     2
+#define REDUCE_SEPARATE 0
+#define REDUCE_FUSED    1
+#define REDUCE_LAGGED   2
+#define SOLVER_GD       0
+#define SOLVER_CG       1
+#define ACTIVE_CHECK_ITERATIONS 64 /* iterations between updates of the
+                                      active set */
 #define QUOTE(str)    #str
 #define EXPAND_AND_QUOTE(str) QUOTE(str)
 
@@ -84,14 +106,19 @@ typedef struct Node
                     if x > 0.5*UNSPECIFIED, then Node is not valid
                     for the image */
         float y; /* current y position of this Node */
-        float fx; /* force in x direction;
-                     if fx > 0.5*CONSTRAINED, Node is not allowed to
-                     move in the x direction */
-        float fy; /* force in y direction;
-                     if fy > 0.5*CONSTRAINED, Node is not allowed to
-                     move in the y direction */
 } Node;
 
+typedef struct Force
+{
+        float fx; /* force in x direction */
+        float fy; /* force in y direction */
+} Force;
+
+/* bits of the per-node flags of an image */
+#define NODE_VALID      0x1 /* node is valid for the image */
+#define NODE_MOVE_X     0x2 /* node is valid and not constrained in x */
+#define NODE_MOVE_Y     0x4 /* node is valid and not constrained in y */
+
 typedef struct Image
 {
         int next; /* index of next image in hash bucket */
@@ -102,11 +129,30 @@ typedef struct Image
                         /*    positions (expressed in pixels) */
         int fixed; /* true if this image is fixed in position */
         int owner; /* which process owns the image */
+        int active; /* false if the image has stopped moving and is
+                       skipped by the iterations (only with -active_set) */
+        Node *checkNodes; /* positions at the last active set check */
+        unsigned char *cellValid; /* true for each grid cell whose four
+                                     corner nodes have positions */
+        Node *foldNodes; /* positions of the nodes when they were last
+                            checked for folds (only with -fold_tolerance) */
+        unsigned char *foldMoved; /* true for each node that moved more
+                                     than foldTolerance since then */
+        double intraEnergy; /* energy of the image's own springs when
+                               last computed */
+        float maxForce; /* largest damped force on a node when last
+                           computed */
         int needed; /* true if this image is needed in this process */
         unsigned char *sendTo;/* bitmask of the processes that this image should
                                  be sent to */
         int nx, ny;     /* number of nodes in x and y at current level */
         Node *nodes;    /* nodes in the image at current level */
+        Force *forces;  /* forces on the nodes (only for owned images) */
+        Force *prevForces; /* forces of the previous iteration and */
+        Force *directions; /* search directions (only for owned images
+                              with -solver cg) */
+        unsigned char *nodeFlags; /* NODE_* flags of each node (only for
+                                     owned images) */
         Node *initialNodes; /* the initial node positions for the current step;
                                used only if recovery from a fold is necessary */
         Point **absolutePositions;
@@ -134,8 +180,21 @@ typedef struct IntraImageMap
         int *nSprings;  /* number of springs at each level */
         struct IntraImageSpring **springs;
         /* array of springs at each level */
+        float **stencils;
+        /* the same springs at each level rearranged by node for the
+           vectorized force computation; for each of the
+           INTRA_DIRECTIONS directions there is an array of spring
+           constants followed by an array of nominal distances, each
+           indexed by the first node of the spring (0 if absent) */
 } IntraImageMap;
 
+/* directions of the intra-image springs from their first node */
+#define INTRA_NE        0
+#define INTRA_E         1
+#define INTRA_SE        2
+#define INTRA_S         3
+#define INTRA_DIRECTIONS 4
+
 typedef struct IntraImageSpring
 {
         int index0; /* index of first point in image */
@@ -152,11 +211,20 @@ typedef struct InterImageMap
         float energyFactor; /* either 0.0 or 1.0; determines whether this entry
                                contributes to the energy sum on this node */
         float k; /* overall spring constant for this map */
+        double energy; /* energy of the map when last computed */
 
         int *nStrips;    /* number of strips at each level */
         struct InterImageStrip **strips; /* all strips at each level */
         int *nSprings;   /* number of springs at each level */
         struct InterImageSpring **springs; /* all springs at each level */
+
+        MapElement *map; /* the map as read, held only while the
+                            springs of one level are built, or NULL */
+        int mLevel;      /* level of map */
+        int mw, mh;      /* dimensions of map */
+        int mxMin, myMin; /* offset of map */
+        float *dist;     /* distance of each map point at the map's
+                            resolution to the nearest valid point */
 } InterImageMap;
 
 typedef struct InterImageStrip
@@ -193,6 +261,14 @@ typedef struct CommPhase
         int nReceives; /* number of MPI_Recv's */
         int *floatsToReceive; /* number of floats to receive for each MPI_Recv */
         int *nImagesToReceive; /* number of images to receive for each MPI_Recv */
+        int *floatsToSend; /* number of floats to send for each MPI_Send */
+        float **sendBuffers; /* buffer for each MPI_Isend
+                                (only in non-blocking mode) */
+        float **receiveBuffers; /* buffer for each MPI_Irecv
+                                   (only in non-blocking mode) */
+        float *reactionSendBuffer; /* reaction forces on the received
+                                      images (only with -reaction_forces) */
+        float *reactionReceiveBuffer; /* reaction forces on the sent images */
 } CommPhase;
 
 typedef struct SpringForce
@@ -221,6 +297,10 @@ char fontFileName[PATH_MAX];
 char outputName[PATH_MAX];
 char outputLogPrefix[PATH_MAX];
 int outputIncremental = 0;
+int outputWriters = 0;   /* number of background threads writing the
+                            output maps; 0 writes them synchronously */
+int outputAggregate = 0; /* if true, each process writes all of its
+                            output maps into a single file */
 char outputGridName[PATH_MAX];
 int outputGridWidth = 1024;
 int outputGridHeight = 1024;
@@ -241,6 +321,12 @@ int nFixedImages = 0;
 char **fixedImages = 0;
 int showConstraints = 0;
 int epochIterations = 512;
+int nThreads = 1;      /* number of threads used for the relaxation
+                          within this process */
+int simdLevel = -1;    /* vector instructions used for the spring forces
+                          and position updates (one of SIMD_*);
+                          -1 selects the best one the processor supports */
+char *simdNames[] = { "none", "avx2", "avx512" };
 
 int nImages = 0;
 Image *images = 0;
@@ -261,6 +347,174 @@ int nPhases;
 CommPhase *commPhases;
 int bufferSize = 0;
 float *buffer = 0;
+int balancePartition = 0; /* true if the images are divided among the
+                              processes by their predicted work rather
+                              than by their number */
+int planProcesses = 0;  /* if positive, only estimate the resources needed
+                           by a run on this many processes, and exit */
+int nonblockingComm = 0; /* true if positions are exchanged with
+                            non-blocking messages overlapped with
+                            the force computation */
+int nCommRequests = 0;
+MPI_Request *commRequests = NULL;
+int commPending = 0;   /* true if a non-blocking exchange of positions
+                          has been started but not yet finished */
+int reactionForces = 0; /* true if each map between images of different
+                           processes is evaluated only by the owner of
+                           its source image, which returns the forces on
+                           the target image to that image's owner */
+int nReactionRequests = 0;
+MPI_Request *reactionRequests = NULL;
+int reduceMode = REDUCE_SEPARATE; /* how the per-iteration global sums
+                                     are combined (one of REDUCE_*) */
+char *reduceNames[] = { "separate", "fused", "lagged" };
+int solver = SOLVER_GD; /* method used to relax the springs (one of SOLVER_*) */
+char *solverNames[] = { "gd", "cg" };
+float activeThreshold = 0.0; /* if positive, images that move less than
+                                this many pixels between active set
+                                checks are frozen */
+MPI_Op iterationSumsOp;
+double reduceSend[3];    /* maximum force, energy, and control flags */
+double reduceReceive[3];
+MPI_Request reduceRequest;
+int reductionPending = 0; /* true if a lagged reduction of the
+                             iteration sums is still in flight */
+
+/* thread pool used to spread the per-iteration work of this process
+   across several cores; thread 0 is always the main thread */
+pthread_t *workerThreads = NULL;
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolStartCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDoneCond = PTHREAD_COND_INITIALIZER;
+int poolGeneration = 0;
+int poolPending = 0;
+void (*poolFunc)(int thread, void *arg) = NULL;
+void *poolArg = NULL;
+
+/* a file of output maps waiting to be written by one of the
+   output writer threads */
+typedef struct OutputJob
+{
+        struct OutputJob *next;
+        char fn[PATH_MAX];
+        int level;
+        int nMaps;   /* more than one only with -output_aggregate */
+        int *image;  /* image of each map */
+        int *nx, *ny;
+        MapElement **maps;
+} OutputJob;
+
+pthread_t *outputWriterThreads = NULL;
+pthread_mutex_t outputMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t outputWorkCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t outputDoneCond = PTHREAD_COND_INITIALIZER;
+OutputJob *outputQueueHead = NULL;
+OutputJob *outputQueueTail = NULL;
+int outputJobsPending = 0; /* queued or being written */
+char outputWriteError[PATH_MAX+256]; /* first write failure, reported
+                                        by the main thread */
+
+/* division of the owned images and maps among the threads;
+   each thread exclusively owns the forces of the images in
+   [threadFirstImage[t], threadLastImage[t]], so the maps that lie
+   within one such block can be evaluated without conflicts;
+   the maps that straddle two blocks are handled afterwards
+   by the main thread */
+int *threadFirstImage = NULL;
+int *threadLastImage = NULL;
+int *imageThread = NULL;
+int *nThreadMaps = NULL;
+int **threadMaps = NULL;
+int nCrossThreadMaps = 0;
+int *crossThreadMaps = NULL;
+double *threadIntraEnergy = NULL;
+double *threadInterEnergy = NULL;
+float *threadMaxF = NULL;
+int *threadFoldImage = NULL; /* first fold found by each thread */
+int *threadFoldNode = NULL;
+double *threadGG = NULL;     /* per-thread sums for the conjugate */
+double *threadGPrevG = NULL; /*   gradient coefficient */
+
+/* which inter-image maps a force computation pass covers */
+#define ALL_MAPS        0
+#define LOCAL_MAPS      1 /* only maps between images of this process */
+#define HALO_MAPS       2 /* only maps to images of other processes */
+
+typedef struct IterationParams
+{
+        int level;
+        int maps; /* one of ALL_MAPS, LOCAL_MAPS, or HALO_MAPS */
+        int allImages; /* true if the inactive images are to be
+                          processed as well */
+        int fixedImages; /* true if the energies of the fixed images,
+                            which cannot change during a step, are
+                            to be recomputed */
+        float dampingFactor;
+        float scale;
+        float maxStepX, maxStepY;
+        float beta; /* conjugate gradient coefficient; 0 restarts
+                       along the steepest descent direction */
+} IterationParams;
+
+/* the state of the iterations of one process at the start of an
+   iteration; a checkpoint file consists of this header, followed by
+   the node positions of each owned image (and their positions at the
+   start of the step if fold recovery is enabled), the overall spring
+   constant of each map, and the springs of each map at the current
+   level */
+typedef struct Checkpoint
+{
+        char magic[4];          /* "ACK1" */
+        int np;                 /* number of processes that wrote it */
+        int p;                  /* rank of the process that wrote it */
+        int step;
+        int iter;
+        int level;
+        int firstImage, lastImage;
+        int nMaps;
+        int hasInitialNodes;
+        int foldRecoveryCount;
+        int nDecrease, nIncrease;
+        int outputRequestedIter;
+        int terminationRequestedIter;
+        int refinementRequestedIter;
+        int nRestarts;
+        int reductionPending;
+        float dampingFactor;
+        double prevTotalEnergy;
+        double epochInitialTotalEnergy;
+        double epochFinalTotalEnergy;
+        double reduced[3];      /* lagged reduction in flight */
+        double elapsed;         /* wall time spent in the step so far */
+        time_t lastOutput;
+} Checkpoint;
+
+/* a spring cache file holds the strips and springs of all the
+   inter-image maps of one process at one level; it consists of this
+   header, one SpringCacheEntry per map, and the arrays themselves,
+   each starting on an 8-byte boundary, so that it can be mapped
+   into memory and used directly */
+#define SPRING_CACHE_VERSION 1
+#define SPRING_CACHE_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+typedef struct SpringCacheHeader
+{
+        char magic[4];          /* "ASC1" */
+        int version;            /* SPRING_CACHE_VERSION */
+        int level;
+        int startLevel, endLevel;
+        int nMaps;
+} SpringCacheHeader;
+
+typedef struct SpringCacheEntry
+{
+        time_t mtime;           /* modification time of the map file */
+        int image0, image1;
+        int nStrips;
+        int nSprings;
+        size_t stripsOffset;    /* offsets from the start of the file */
+        size_t springsOffset;
+} SpringCacheEntry;
 
 FILE *logFile = 0;
 float kAbsolute = 0.0;
@@ -271,6 +525,8 @@ float threshold = 1.0;  /* ppm change per iteration */
 int startLevel = -1;
 int endLevel = -1;
 int nLevels = -1;
+unsigned char *mapSpringsBuilt = NULL; /* true for each level at which the
+                                          inter-image springs exist */
 
 int startFactor;        /* spacing at starting level */
 int endFactor;          /* spacing at end level */
@@ -281,6 +537,58 @@ Step *steps = NULL;
 
 int foldRecovery = 0;
 int foldRecoveryCount = 0;
+
+char checkpointName[PATH_MAX]; /* prefix of the checkpoint files */
+int checkpointInterval = 4;    /* epochs between checkpoints */
+int restartFromCheckpoint = 0; /* true if the run resumes from the
+                                  checkpoint files */
+Checkpoint checkpoint;
+FILE *checkpointFile = NULL;
+
+char springCacheName[PATH_MAX]; /* prefix of the spring cache files */
+char **springCacheBase = NULL;  /* mapped cache file at each level */
+size_t *springCacheSize = NULL;
+
+char realignName[PATH_MAX];     /* prefix of the output maps of a previous
+                                   run to start a re-alignment from */
+char changedListName[PATH_MAX]; /* file listing the images whose inputs
+                                   changed since that run */
+int realignNeighborhood = 2;    /* images this far from a changed image
+                                   in the image list also move */
+int realignLevel = -1;          /* coarsest level relaxed again
+                                   (by default one above the finest) */
+
+int windowFirst = 0;   /* index in the image list of the first image
+                          of the window to be aligned */
+int windowSize = 0;    /* number of images in the window (0 to align
+                          the whole image list) */
+int windowOverlap = 0; /* number of images at the start of the window
+                          that are held at their initial positions */
+
+/* the parts of an iteration timed with -telemetry */
+#define TM_FORCES       0
+#define TM_MAXFORCE     1
+#define TM_UPDATE       2 /* position update, and the conjugate direction */
+#define TM_COMM         3 /* exchange of positions and reaction forces */
+#define TM_COLLECTIVE   4 /* global reductions of the iteration sums */
+#define TM_IO           5
+#define TM_DELTAS       6
+#define TM_FOLDS        7
+#define TM_OTHER        8
+#define N_TM_PHASES     9
+char *telemetryPhaseNames[N_TM_PHASES] = { "forces", "maxforce", "update", "comm",
+                                           "collective", "io", "deltas", "folds",
+                                           "other" };
+char telemetryName[PATH_MAX]; /* prefix of the telemetry files */
+int telemetryInterval = 1000; /* iterations between telemetry records */
+FILE *telemetryFile = NULL;
+double telemetryLast;          /* time at the end of the last timed part */
+double telemetryTime[N_TM_PHASES]; /* seconds in each part during this step */
+double telemetryBytesSent[N_TM_PHASES];
+double telemetryBytesReceived[N_TM_PHASES];
+double telemetryNodes;   /* nodes and inter-image springs whose forces */
+double telemetrySprings; /*   were computed during this step */
+
 int foldDetected = 0;
 int minImageWithFold = -1;
 int foldImage = -1;
@@ -290,7 +598,15 @@ int foldX = 0;
 int foldY = 0;
 float foldAbsoluteX = 0.0;
 float foldAbsoluteY = 0.0;
-float foldRadius = 32.0;
+float foldRadius = 32.0;    /* radius, in nodes, of the region restored
+                               by -fold_recovery_local */
+int foldRecoveryLocal = 0;  /* true if fold recovery restores only the
+                               neighborhood of the fold */
+float foldTolerance = 0.0;  /* if positive, only the cells with a node that
+                               moved more than this many pixels since it
+                               was last checked are checked for folds */
+int foldNodesValid = 0;     /* true if foldNodes hold positions from
+                               an earlier check in the current step */
 
 int minimizeArea = 0;
 
@@ -376,6 +692,12 @@ unsigned char colorCode[10][3] =
 void Error (char *fmt, ...);
 void Log (char *fmt, ...);
 void Output (int level, int iter);
+void StartOutputWriters ();
+void *OutputWriterMain (void *arg);
+void QueueOutput (OutputJob *job);
+void FinishOutput ();
+int WriteOutputJob (OutputJob *job, char *msg);
+void FreeOutputJob (OutputJob *job);
 void GetGridScale (float *pScale,
                    float *pOffsetX, float *pOffsetY,
                    int gridWidth, int gridHeight,
@@ -402,10 +724,38 @@ void hsv_to_rgb (unsigned char* r, unsigned char *g, unsigned char *b,
 void DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
               int imageWidth, int imageHeight,
               unsigned char r, unsigned char g, unsigned char b);
+void ReadMapSpringData (InterImageMap *m, char *fn);
+void ReleaseMapSpringData (InterImageMap *m);
+void BuildMapSprings (int level);
+SpringCacheEntry *OpenSpringCache (int level);
+void WriteSpringCache (int level);
+void ReleaseLevel (int level);
 void UpdateDeltas (int level, int iter);
+void CellValidityTask (int thread, void *arg);
+void UpdateDeltasTask (int thread, void *arg);
+void UpdateMapDeltas (InterImageMap *m, int level);
+int ExtrapolateTarget (Node *nodes1, int nx1, int ny1, int irx, int iry,
+                       float rrx, float rry, float *prx, float *pry);
 void RefinePositions (int prevLevel, int level);
 void PlanCommunications (int level);
 void CommunicatePositions (int level);
+void PartitionImages (char *mapNames, float *mapParams);
+void Plan (char *mapNames, float *mapParams);
+void SelectRealignImages (char *mapNames);
+void StartCommunication (int level);
+void ConjugateSumsTask (int thread, void *arg);
+int MapIsActive (InterImageMap *m);
+void UpdateActiveSet (int level, float stepScale, int init);
+void ConjugateDirectionTask (int thread, void *arg);
+void WriteCheckpoint (int level, Checkpoint *ckpt);
+void OpenCheckpoint ();
+void LoadCheckpoint (int level);
+void ReduceIterationSums (void *in, void *inout, int *len, MPI_Datatype *type);
+void DiscardReduction ();
+void ProgressCommunication ();
+void ClearReactionForces ();
+void ExchangeReactionForces ();
+void FinishCommunication (int level);
 unsigned int Hash (char *s);
 unsigned int HashMap (char *s, int nx, int ny);
 int CreateDirectories (char *fn);
@@ -414,7 +764,15 @@ void ComputeSpringConstants (int level, int iter);
 int Extrapolate (float *prx, float *pry, float *prc,
                  int ix, int iy, float arrx, float arry,
                  MapElement* map, int mw, int mh, float threshold);
-void RecoverFromFold (int level);
+void RecoverFromFold (int level, int local);
+void StartTelemetry ();
+void TelemetryLap (int phase);
+void TelemetryBytes (int phase, double sent, double received);
+void TelemetryWork (IterationParams *ip);
+void WriteTelemetry (int step, int level, int iter);
+void FinishTelemetryStep (int step, int level, int iter);
+void FoldCheckTask (int thread, void *arg);
+int FindFold (int i);
 double PerpDist (double x1, double y1, double x2, double y2, double s);
 void PointProjectionOnLine (Point p0, Point p1, Point q, Point *proj);
 double Angle (double x0, double y0,
@@ -428,9 +786,46 @@ void ConvexHull (int n, Point *pts,
                  int *hn, Point *hpts);
 double MinimumAreaRectangle (int n, Point *pts, Point *corners);
 int CompareSpringForces (const void *p0, const void *p1);
-void ConstrainNodes (int imageNum, Node *nodes, int nx, int ny, int factor,
+void ConstrainNodes (int imageNum, Node *nodes, unsigned char *flags,
+                     int nx, int ny, int factor,
                      int nConstraints, double *constraints,
                      double *coeff);
+void InitNodeFlags (unsigned char *flags, Node *nodes, int nNodes);
+float *BuildStencil (int nSprings, IntraImageSpring *springs, int nx, int ny);
+void SelectSimd ();
+double ComputeStencilForces (Node *nodes, Force *forces, float *stencil,
+                             int nx, int ny, float kIntraThisImage);
+double StencilRowForces (Node *nodes, Force *forces, float *k, float *nomD,
+                         int i0, int n, int offset, float kIntraThisImage);
+#if HAVE_X86_SIMD
+double StencilRowForcesAVX2 (Node *nodes, Force *forces, float *k, float *nomD,
+                             int i0, int n, int offset, float kIntraThisImage)
+        __attribute__((target("avx2")));
+double StencilRowForcesAVX512 (Node *nodes, Force *forces, float *k, float *nomD,
+                               int i0, int n, int offset, float kIntraThisImage)
+        __attribute__((target("avx512f")));
+int MaxForceAVX2 (Force *forces, unsigned char *flags, int nNodes, float *maxF2)
+        __attribute__((target("avx2")));
+int MaxForceAVX512 (Force *forces, unsigned char *flags, int nNodes, float *maxF2)
+        __attribute__((target("avx512f")));
+int UpdatePositionsAVX2 (Node *nodes, Force *forces, unsigned char *flags, int nNodes,
+                         float scale, float maxStepX, float maxStepY)
+        __attribute__((target("avx2")));
+int UpdatePositionsAVX512 (Node *nodes, Force *forces, unsigned char *flags, int nNodes,
+                           float scale, float maxStepX, float maxStepY)
+        __attribute__((target("avx512f")));
+#endif
+void StartThreads ();
+void *ThreadMain (void *arg);
+void RunThreads (void (*func)(int thread, void *arg), void *arg);
+void PlanThreads (int level);
+double ComputeImageForces (int i, int level);
+double ComputeMapForces (InterImageMap *m, int level);
+float ComputeMaxForce (int i, float dampingFactor);
+void UpdatePositions (int i, float scale, float maxStepX, float maxStepY);
+void ComputeForcesTask (int thread, void *arg);
+void MaxForceTask (int thread, void *arg);
+void UpdatePositionsTask (int thread, void *arg);
 
 
 int
@@ -446,12 +841,10 @@ main (int argc, char **argv)
         int n;
         int w, h;
         float rx, ry, rc;
-        int irx, iry;
         float rrx, rry;
         float r00, r01, r10, r11;
         float xv, yv;
         Node *node;
-        int dx, dy;
         double totalEnergy;
         double prevTotalEnergy;
         double deltaEnergy;
@@ -459,24 +852,16 @@ main (int argc, char **argv)
         double epochInitialTotalEnergy;
         double epochFinalTotalEnergy;
         int iter;
-        float deltaX, deltaY;
         float nomD;
-        float d;
-        float force;
-        float kdx, kdy;
         float dampingFactor;
         MPI_Status status;
         int nDecrease;
         int nIncrease;
-        float forceOverD;
-        float dfx, dfy;
         unsigned char red, green, blue;
         float angle;
         float mag;
-        int nNodes;
         int nFloats;
         Node *p00, *p10, *p01, *p11;
-        float kIntraThisImage;
         struct stat sb;
         int ixv, iyv;
         int ind;
@@ -489,7 +874,6 @@ main (int argc, char **argv)
         float maxF;
         float globalMaxF;
         char hostName[256];
-        double basis;
         float maxStepX, maxStepY;
         int nx, ny, nz;
         int level;
@@ -517,6 +901,7 @@ main (int argc, char **argv)
         char *modelNames;
         char line[LINE_LENGTH];
         int nItems;
+        int imageIndex;
         char imageName[PATH_MAX];
         int imageNameLen;
         int width, height;
@@ -526,7 +911,6 @@ main (int argc, char **argv)
         double kFactor;
         char modelName[PATH_MAX];
         int modelNameLen;
-        int firstImage, lastImage;
         int mapNamesSize;
         int mapNamesPos;
         char *mapNames = 0;
@@ -540,24 +924,13 @@ main (int argc, char **argv)
         char msg2[PATH_MAX+256];
         MapElement *map;
         int mFactor;
-        int stripsSize;
-        int springsSize;
-        int springsPos;
-        int prevX, prevY;
-        int irrx, irry;
-        int firstInStrip;
         InterImageMap *m;
-        InterImageStrip *strip;
-        InterImageSpring *s;
         int fixedImageNameSize;
-        Node *nodes0, *nodes1;
         Point *ipt;
         double cost, sint;
-        Node *nodes;
         int phase;
         int op;
         int y0;
-        int nx1, ny1;
         CommPhase *cp;
         int separation;
         int mp;
@@ -567,24 +940,21 @@ main (int argc, char **argv)
         int terminationRequestedIter;
         int refinementRequestedIter;
         int controlFlag;
+        int fileFlags;
+        int rIter;
+        double reduced[3];
+        int cgRestart;
+        double prevGG;
+        double cgSums[2], cgGlobalSums[2];
+        int nRestarts;
+        double stepStartTime;
+        int firstIter;
         Point *mpts;
         float *mptsc;
-        int ns;
-        int *pnStrips;
-        InterImageStrip **pStrips;
         int *pnSprings;
-        InterImageSpring **pSprings;
-        int nStrips;
-        InterImageStrip *strips;
-        InterImageSpring *springs;
         int mx, my;
         IntraImageSpring **piSprings;
         MapElement *initialMap;
-        int nSprings;
-        IntraImageSpring *iSprings;
-        float msk;
-        float sk;
-        int sme;
         int prevLevel;
         int step;
         cpu_set_t cpumask;
@@ -601,11 +971,9 @@ main (int argc, char **argv)
         int eFactor;
         int rFactor;
         int count;
-        int count1, count2;
         unsigned char *imask;
         size_t imbpl;
         int maskWidth, maskHeight;
-        int ixMin, ixMax, iyMin, iyMax;
         char gridName[PATH_MAX];
         float outputGridScale;
         float outputGridOffsetX, outputGridOffsetY;
@@ -613,6 +981,9 @@ main (int argc, char **argv)
         float foldGridOffsetX, foldGridOffsetY;
         double consX0[1024], consY0[1024], consX1[1024], consY1[1024];
         Point *initialPos;
+        int threadSupport;
+        IterationParams ip;
+        double intraEnergy, interEnergy;
         /* DECLS */
 
 #if 0
@@ -708,13 +1079,16 @@ main (int argc, char **argv)
         exit(0);
 #endif
 
-        /* initialize MPI */
-        if (MPI_Init(&argc, &argv) != MPI_SUCCESS)
+        /* initialize MPI; only the main thread of each process
+           makes MPI calls */
+        if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &threadSupport) != MPI_SUCCESS)
                 Error("Could not do MPI_Init\n");
         if (MPI_Comm_size(MPI_COMM_WORLD, &np) != MPI_SUCCESS)
                 Error("Could not do MPI_Comm_size\n");
         if (MPI_Comm_rank(MPI_COMM_WORLD, &p) != MPI_SUCCESS)
                 Error("Could not do MPI_Comm_rank\n");
+        if (MPI_Op_create(ReduceIterationSums, 1, &iterationSumsOp) != MPI_SUCCESS)
+                Error("Could not create reduction operator\n");
         //  if (MPI_Errhandler_set(MPI_COMM_WORLD, MPI_ERRORS_RETURN) != MPI_SUCCESS)
         //    Error("Could not set MPI_ERRORS_RETURN.\n");
 
@@ -746,6 +1120,11 @@ main (int argc, char **argv)
                 strcpy(fontFileName, EXPAND_AND_QUOTE(FONT_FILE));
                 outputName[0] = '\0';
                 outputLogPrefix[0] = '\0';
+                checkpointName[0] = '\0';
+                springCacheName[0] = '\0';
+                telemetryName[0] = '\0';
+                realignName[0] = '\0';
+                changedListName[0] = '\0';
                 outputGridName[0] = '\0';
                 outputGridFocusImage[0] = '\0';
                 outputSpringsName[0] = '\0';
@@ -847,6 +1226,125 @@ main (int argc, char **argv)
                         }
                         else if (strcmp(argv[i], "-incremental") == 0)
                                 outputIncremental = 1;
+                        else if (strcmp(argv[i], "-output_writers") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &outputWriters) != 1 ||
+                                    outputWriters < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-output_aggregate") == 0)
+                                outputAggregate = 1;
+                        else if (strcmp(argv[i], "-checkpoint") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                strcpy(checkpointName, argv[i]);
+                        }
+                        else if (strcmp(argv[i], "-checkpoint_interval") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &checkpointInterval) != 1 ||
+                                    checkpointInterval < 1)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-restart") == 0)
+                                restartFromCheckpoint = 1;
+                        else if (strcmp(argv[i], "-spring_cache") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                strcpy(springCacheName, argv[i]);
+                        }
+                        else if (strcmp(argv[i], "-telemetry") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                strcpy(telemetryName, argv[i]);
+                        }
+                        else if (strcmp(argv[i], "-telemetry_interval") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &telemetryInterval) != 1 ||
+                                    telemetryInterval <= 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-realign") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                strcpy(realignName, argv[i]);
+                        }
+                        else if (strcmp(argv[i], "-changed_list") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                strcpy(changedListName, argv[i]);
+                        }
+                        else if (strcmp(argv[i], "-neighborhood") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &realignNeighborhood) != 1 ||
+                                    realignNeighborhood < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-window") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d,%d", &windowFirst, &windowSize) != 2 ||
+                                    windowFirst < 0 || windowSize <= 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-window_overlap") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &windowOverlap) != 1 ||
+                                    windowOverlap < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-realign_level") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &realignLevel) != 1 ||
+                                    realignLevel < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
                         else if (strcmp(argv[i], "-output_grid") == 0)
                         {
                                 if (++i == argc)
@@ -955,10 +1453,106 @@ main (int argc, char **argv)
                                         break;
                                 }
                         }
+                        else if (strcmp(argv[i], "-fold_recovery_local") == 0)
+                                foldRecoveryLocal = 1;
+                        else if (strcmp(argv[i], "-fold_tolerance") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%f", &foldTolerance) != 1 ||
+                                    foldTolerance < 0.0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
                         else if (strcmp(argv[i], "-minimize_area") == 0)
                                 minimizeArea = 1;
                         else if (strcmp(argv[i], "-output_fold_maps") == 0)
                                 outputFoldMaps = 1;
+                        else if (strcmp(argv[i], "-threads") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &nThreads) != 1 ||
+                                    nThreads < 1)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-nonblocking") == 0)
+                                nonblockingComm = 1;
+                        else if (strcmp(argv[i], "-reaction_forces") == 0)
+                                reactionForces = 1;
+                        else if (strcmp(argv[i], "-balance") == 0)
+                                balancePartition = 1;
+                        else if (strcmp(argv[i], "-plan") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%d", &planProcesses) != 1 ||
+                                    planProcesses <= 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-solver") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                for (solver = SOLVER_CG; solver >= 0; --solver)
+                                        if (strcmp(argv[i], solverNames[solver]) == 0)
+                                                break;
+                                if (solver < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-active_set") == 0)
+                        {
+                                if (++i == argc ||
+                                    sscanf(argv[i], "%f", &activeThreshold) != 1 ||
+                                    activeThreshold < 0.0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-reduce") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                for (reduceMode = REDUCE_LAGGED; reduceMode >= 0; --reduceMode)
+                                        if (strcmp(argv[i], reduceNames[reduceMode]) == 0)
+                                                break;
+                                if (reduceMode < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
+                        else if (strcmp(argv[i], "-simd") == 0)
+                        {
+                                if (++i == argc)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                                for (simdLevel = SIMD_AVX512; simdLevel >= 0; --simdLevel)
+                                        if (strcmp(argv[i], simdNames[simdLevel]) == 0)
+                                                break;
+                                if (simdLevel < 0)
+                                {
+                                        error = 1;
+                                        break;
+                                }
+                        }
                         else
                         {
                                 fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
@@ -982,8 +1576,39 @@ main (int argc, char **argv)
                         fprintf(stderr, "              [-fixed image_name]\n");
                         fprintf(stderr, "              [-constraints constraints_prefix]\n");
                         fprintf(stderr, "              [-fold_recovery count]\n");
+                        fprintf(stderr, "              [-fold_radius nodes]\n");
+                        fprintf(stderr, "              [-fold_recovery_local]\n");
+                        fprintf(stderr, "              [-fold_tolerance pixels]\n");
                         fprintf(stderr, "              [-output_fold_maps]\n");
                         fprintf(stderr, "              [-output_log]\n");
+                        fprintf(stderr, "              [-output_writers threads]\n");
+                        fprintf(stderr, "              [-output_aggregate]\n");
+                        fprintf(stderr, "              [-threads threads_per_process]\n");
+                        fprintf(stderr, "              [-simd none|avx2|avx512]\n");
+                        fprintf(stderr, "              [-nonblocking]\n");
+                        fprintf(stderr, "              [-reaction_forces]\n");
+                        fprintf(stderr, "              [-balance]\n");
+                        fprintf(stderr, "              [-plan processes]\n");
+                        fprintf(stderr, "              [-reduce separate|fused|lagged]\n");
+                        fprintf(stderr, "              [-solver gd|cg]\n");
+                        fprintf(stderr, "              [-active_set threshold_pixels]\n");
+                        fprintf(stderr, "              [-checkpoint checkpoint_prefix]\n");
+                        fprintf(stderr, "              [-checkpoint_interval epochs]\n");
+                        fprintf(stderr, "              [-restart]\n");
+                        fprintf(stderr, "              [-spring_cache cache_prefix]\n");
+                        fprintf(stderr, "              [-telemetry telemetry_prefix]\n");
+                        fprintf(stderr, "              [-telemetry_interval iterations]\n");
+                        fprintf(stderr, "              [-realign previous_output_prefix]\n");
+                        fprintf(stderr, "              [-changed_list changed_images_file]\n");
+                        fprintf(stderr, "              [-neighborhood images]\n");
+                        fprintf(stderr, "              [-realign_level level]\n");
+                        fprintf(stderr, "              [-window first_image,images]\n");
+                        fprintf(stderr, "              [-window_overlap images]\n");
+                        fprintf(stderr, "With -output_aggregate, process p writes output_prefix/aggregate.pp.maps\n");
+                        fprintf(stderr, "instead of one image_name.map per image: the .map files of its images,\n");
+                        fprintf(stderr, "each with its own M1 header, concatenated in image order.\n");
+                        fprintf(stderr, "split_maps output_prefix aggregate_file ... turns them back\n");
+                        fprintf(stderr, "into image_name.map files.\n");
                         exit(1);
                 }
 
@@ -1005,6 +1630,15 @@ main (int argc, char **argv)
                    a schedule file contains 1 line per step in the format:
                      level kIntra kInter [kAbsolute [min_iter [threshold [dampingFactor [clampX clampY]]]]]
 
+                   a stack too large to be held in memory can be aligned
+                   as a sequence of overlapping windows, one run per window:
+                     -window 0,W -output block0/
+                     -window S,W -window_overlap W-S -initial_maps block0/ -output block1/
+                     -window 2S,W -window_overlap W-S -initial_maps block1/ -output block2/
+                     ...
+                   only the images and maps within the window are loaded,
+                   and the overlap images are held where the previous
+                   window put them
                  */
 
                 /* check that at least minimal parameters were supplied */
@@ -1016,6 +1650,8 @@ main (int argc, char **argv)
                         Error("At least one of -output or -outputgrid must be specified.\n");
                 if (schedule[0] == '\0')
                         Error("-schedule must be specified\n");
+                if (restartFromCheckpoint && checkpointName[0] == '\0')
+                        Error("-restart requires -checkpoint\n");
 
                 /* check if output log name was provided */
                 if ( outputLogPrefix[0] == '\0' )
@@ -1070,6 +1706,23 @@ main (int argc, char **argv)
                 if (nSteps == 0)
                         Error("At least one step must be listed in schedule file %s\n",
                               schedule);
+
+                if (realignName[0] != '\0')
+                {
+                        /* the previous output is already aligned at the
+                           coarse levels, so only the finest levels are
+                           relaxed again, starting from that output */
+                        if (realignLevel < 0)
+                                realignLevel = steps[nSteps-1].level + 1;
+                        for (i = 0; i < nSteps && steps[i].level > realignLevel; ++i) ;
+                        if (i == nSteps)
+                                Error("No step of the schedule is at or below level %d\n",
+                                      realignLevel);
+                        nSteps -= i;
+                        memmove(steps, &steps[i], nSteps * sizeof(Step));
+                        if (initialMapsName[0] == '\0')
+                                strcpy(initialMapsName, realignName);
+                }
         }
 
         /* broadcast the info */
@@ -1081,6 +1734,8 @@ main (int argc, char **argv)
             MPI_Bcast(fontFileName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(outputName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&outputIncremental, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&outputWriters, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&outputAggregate, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(outputGridName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&outputGridWidth, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&outputGridHeight, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
@@ -1097,8 +1752,31 @@ main (int argc, char **argv)
             MPI_Bcast(&nSteps, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&foldRecovery, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&foldRadius, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldRecoveryLocal, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldTolerance, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&minimizeArea, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&outputFoldMaps, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&nThreads, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&simdLevel, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&nonblockingComm, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&reactionForces, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&balancePartition, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&planProcesses, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&reduceMode, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&solver, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&activeThreshold, 1, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(checkpointName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&checkpointInterval, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&restartFromCheckpoint, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(springCacheName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(telemetryName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&telemetryInterval, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(realignName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(changedListName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&realignNeighborhood, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&windowFirst, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&windowSize, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&windowOverlap, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&fontWidth, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
             MPI_Bcast(&fontHeight, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
                 Error("Broadcast of parameters failed.\n");
@@ -1146,10 +1824,18 @@ main (int argc, char **argv)
                 modelNamesSize = 0;
                 modelNamesPos = 0;
                 modelNames = 0;
+                imageIndex = 0;
                 while (fgets(line, LINE_LENGTH, f) != NULL)
                 {
                         if (line[0] == '\0' || line[0] == '#')
                                 continue;
+                        if (windowSize > 0 &&
+                            (imageIndex < windowFirst || imageIndex >= windowFirst + windowSize))
+                        {
+                                ++imageIndex;
+                                continue;
+                        }
+                        ++imageIndex;
                         width = -1;
                         height = -1;
                         rotation = 0.0;
@@ -1208,6 +1894,9 @@ main (int argc, char **argv)
                         ++nImages;
                 }
                 fclose(f);
+                if (nImages == 0)
+                        Error("No images in %s%s\n", imageListName,
+                              windowSize > 0 ? " within the window" : "");
 
                 imageParamsSize = imageParamsPos;
                 imageParams = (float *) realloc(imageParams, imageParamsSize * sizeof(float));
@@ -1261,6 +1950,12 @@ main (int argc, char **argv)
         startLevel = steps[0].level;
         endLevel = steps[nSteps-1].level;
         nLevels = startLevel - endLevel + 1;
+        mapSpringsBuilt = (unsigned char *) malloc(nLevels);
+        memset(mapSpringsBuilt, 0, nLevels);
+        springCacheBase = (char **) malloc(nLevels * sizeof(char *));
+        memset(springCacheBase, 0, nLevels * sizeof(char *));
+        springCacheSize = (size_t *) malloc(nLevels * sizeof(size_t));
+        memset(springCacheSize, 0, nLevels * sizeof(size_t));
         startFactor = 1 << startLevel;
         endFactor = 1 << endLevel;
         for (i = 0; i < nImages; ++i)
@@ -1281,6 +1976,17 @@ main (int argc, char **argv)
                 images[i].nx = (images[i].width + startFactor - 1) / startFactor + 1;
                 images[i].ny = (images[i].height + startFactor - 1) / startFactor + 1;
                 images[i].nodes = 0;
+                images[i].active = 1;
+                images[i].checkNodes = 0;
+                images[i].cellValid = 0;
+                images[i].foldNodes = 0;
+                images[i].foldMoved = 0;
+                images[i].intraEnergy = 0.0;
+                images[i].maxForce = 0.0;
+                images[i].forces = 0;
+                images[i].prevForces = 0;
+                images[i].directions = 0;
+                images[i].nodeFlags = 0;
                 images[i].initialNodes = 0;
                 images[i].absolutePositions = 0;
                 images[i].initialPositions = 0;
@@ -1295,25 +2001,6 @@ main (int argc, char **argv)
         }
         free(imageParams);
 
-        for (i = 0; i < np; ++i)
-        {
-                firstImage = (i * nImages) / np;
-                lastImage = ((i+1) * nImages / np) - 1;
-                for (j = firstImage; j <= lastImage; ++j)
-                {
-                        images[j].owner = i;
-                        images[j].needed = 0;
-                        if (i == p)
-                        {
-                                images[j].sendTo = (unsigned char *)
-                                                   malloc((np + 7) >> 3);
-                                memset(images[j].sendTo, 0,
-                                       (np + 7) >> 3);
-                        }
-                }
-        }
-        myFirstImage = (p * nImages) / np;
-        myLastImage = ((p+1) * nImages / np) - 1;
         for (i = 0; i < nFixedImages; ++i)
         {
                 hv = Hash(fixedImages[i]) % nImages;
@@ -1323,13 +2010,24 @@ main (int argc, char **argv)
                                 images[j].fixed = 1;
                                 break;
                         }
-                if (j < 0)
+                if (j < 0 && windowSize == 0)
                         Error("Could not find fixed image %s in set of images.\n",
                               fixedImages[i]);
         }
 
-        Log("On node %d first = %d last = %d (nz = %d)\n",
-            p, myFirstImage, myLastImage, nImages);
+        /* the start of a window overlaps the previous window,
+           whose result it must not disturb */
+        if (windowSize > 0 && windowFirst > 0)
+        {
+                for (i = 0; i < windowOverlap && i < nImages; ++i)
+                        images[i].fixed = 1;
+                Log("Aligning images %d to %d of the image list, holding the first %d fixed\n",
+                    windowFirst, windowFirst + nImages - 1, i);
+        }
+
+        StartThreads();
+        StartOutputWriters();
+        SelectSimd();
 
         /* set trigger and termination files */
         sprintf(triggerName, "%strigger", outputName);
@@ -1358,11 +2056,28 @@ main (int argc, char **argv)
                         if (nItems == 3)
                                 weight = 1.0;
 
-                        imageNameLen0 = strlen(imageName0);
-                        imageNameLen1 = strlen(imageName1);
-                        pairNameLen = strlen(pairName);
-                        totalLength = imageNameLen0 + imageNameLen1 + pairNameLen;
-                        while (mapNamesPos + totalLength + 3 >= mapNamesSize)
+                        /* leave out the maps that reach outside the window */
+                        if (windowSize > 0)
+                        {
+                                hv = Hash(imageName0) % nImages;
+                                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                                        if (strcmp(images[j].name, imageName0) == 0)
+                                                break;
+                                if (j < 0)
+                                        continue;
+                                hv = Hash(imageName1) % nImages;
+                                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                                        if (strcmp(images[j].name, imageName1) == 0)
+                                                break;
+                                if (j < 0)
+                                        continue;
+                        }
+
+                        imageNameLen0 = strlen(imageName0);
+                        imageNameLen1 = strlen(imageName1);
+                        pairNameLen = strlen(pairName);
+                        totalLength = imageNameLen0 + imageNameLen1 + pairNameLen;
+                        while (mapNamesPos + totalLength + 3 >= mapNamesSize)
                         {
                                 mapNamesSize = (mapNamesSize > 0) ? mapNamesSize * 2 : 1024;
                                 mapNames = (char *) realloc(mapNames, mapNamesSize);
@@ -1404,6 +2119,29 @@ main (int argc, char **argv)
             MPI_Bcast(mapNames, mapNamesSize, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
                 Error("Broadcast of mapParams and mapNames failed.\n");
 
+        if (realignName[0] != '\0')
+                SelectRealignImages(mapNames);
+
+        /* with -plan, nothing beyond the map headers is read */
+        if (planProcesses > 0)
+        {
+                if (p == 0)
+                {
+                        Plan(mapNames, mapParams);
+                        printf("Plan for %d processes written to the log of process 0\n",
+                               planProcesses);
+                }
+                Log("FINALIZING\n");
+                MPI_Finalize();
+                fclose(logFile);
+                return(0);
+        }
+
+        /* divide the images among the processes */
+        PartitionImages(mapNames, mapParams);
+        Log("On node %d first = %d last = %d (nz = %d)\n",
+            p, myFirstImage, myLastImage, nImages);
+
         Log("Going to initialize the commPhases array\n");
         /* initialize the commPhases array */
         commPhases = (CommPhase*) malloc(2 * np * sizeof(CommPhase));
@@ -1428,6 +2166,11 @@ main (int argc, char **argv)
                 cp->nReceives = 0;
                 cp->floatsToReceive = NULL;
                 cp->nImagesToReceive = NULL;
+                cp->floatsToSend = NULL;
+                cp->sendBuffers = NULL;
+                cp->receiveBuffers = NULL;
+                cp->reactionSendBuffer = NULL;
+                cp->reactionReceiveBuffer = NULL;
         }
 
         if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
@@ -1486,6 +2229,21 @@ main (int argc, char **argv)
                 if (image1 < 0)
                         Error("Could not find destination image for map %s\n", pairName);
 
+                /* a map between two images that stay put contributes
+                   nothing to a re-alignment or a window */
+                if (found && (realignName[0] != '\0' || windowSize > 0) &&
+                    images[image0].fixed && images[image1].fixed)
+                        found = 0;
+
+                if (found && reactionForces && images[image0].owner != p)
+                {
+                        /* the owner of the source image evaluates this map;
+                           it only needs the positions of our image */
+                        op = images[image0].owner;
+                        images[image1].sendTo[op >> 3] |= 0x80 >> (op & 7);
+                        found = 0;
+                }
+
                 if (found)
                 {
                         images[image0].needed = 1;
@@ -1506,6 +2264,7 @@ main (int argc, char **argv)
                         m->energyFactor = (image0 >= myFirstImage &&
                                            image0 <= myLastImage) ? 1.0 : 0.0;
                         m->k = weight;
+                        m->energy = 0.0;
                         m->nStrips = (int *) malloc(nLevels * sizeof(int));
                         memset(m->nStrips, 0, nLevels * sizeof(int));
                         m->strips = (InterImageStrip**)
@@ -1516,8 +2275,11 @@ main (int argc, char **argv)
                         m->springs = (InterImageSpring**)
                                      malloc(nLevels * sizeof(InterImageSpring*));
                         memset(m->springs, 0, nLevels * sizeof(InterImageSpring*));
+                        m->map = NULL;
+                        m->dist = NULL;
 
-                        if (images[image0].owner != images[image1].owner)
+                        if (images[image0].owner != images[image1].owner &&
+                            !reactionForces)
                         {
                                 if (images[image0].owner == p)
                                 {
@@ -1661,6 +2423,8 @@ main (int argc, char **argv)
                         iim->springs = (IntraImageSpring**)
                                        malloc(nLevels * sizeof(IntraImageSpring*));
                         memset(iim->springs, 0, nLevels * sizeof(IntraImageSpring*));
+                        iim->stencils = (float **) malloc(nLevels * sizeof(float *));
+                        memset(iim->stencils, 0, nLevels * sizeof(float *));
                         for (level = startLevel; level >= endLevel; --level)
                         {
                                 factor = 1 << level;
@@ -1822,6 +2586,9 @@ main (int argc, char **argv)
                                                  mptsc[iis->index0] : mptsc[iis->index1];
                                         ++iis;
                                 }
+                                if (simdLevel != SIMD_NONE)
+                                        iim->stencils[startLevel - level] =
+                                                BuildStencil(*pnSprings, *piSprings, nx, ny);
                                 if (level == startLevel)
                                         iim->points = mpts;
                                 else
@@ -1940,14 +2707,23 @@ main (int argc, char **argv)
                         continue;
                 }
 
+                images[i].forces = (Force *) malloc(nx * ny * sizeof(Force));
+                memset(images[i].forces, 0, nx * ny * sizeof(Force));
+                if (solver == SOLVER_CG)
+                {
+                        images[i].prevForces = (Force *) malloc(nx * ny * sizeof(Force));
+                        memset(images[i].prevForces, 0, nx * ny * sizeof(Force));
+                        images[i].directions = (Force *) malloc(nx * ny * sizeof(Force));
+                        memset(images[i].directions, 0, nx * ny * sizeof(Force));
+                }
+                images[i].nodeFlags = (unsigned char *) malloc(nx * ny);
+
                 // reset the nodes
                 for (y = 0; y < ny; ++y)
                         for (x = 0; x < nx; ++x)
                         {
                                 node[y * nx + x].x = UNSPECIFIED;
                                 node[y * nx + x].y = UNSPECIFIED;
-                                node[y * nx + x].fx = 0.0;
-                                node[y * nx + x].fy = 0.0;
                         }
 
                 // mark the valid map nodes
@@ -1999,6 +2775,7 @@ main (int argc, char **argv)
                                 }
                         }
                 Log("Finished marking the valid map nodes for image %s\n", images[i].name);
+                InitNodeFlags(images[i].nodeFlags, node, nx * ny);
 
                 /* check what constraints are present */
                 if (constraintName[0] != '\0')
@@ -2065,7 +2842,7 @@ main (int argc, char **argv)
 
                 if (nConstraints[i] > 0)
                         ConstrainNodes(i,
-                                       node, nx, ny, startFactor,
+                                       node, images[i].nodeFlags, nx, ny, startFactor,
                                        nConstraints[i],
                                        constraints[i],
                                        constrainingCoeff[i]);
@@ -2318,358 +3095,15 @@ computeInitialPositionsFromConstraints:
                         {
                                 if (node->x > 0.5 * UNSPECIFIED)
                                         continue;
-                                if (node->fx < 0.5 * CONSTRAINED)
+                                if (images[i].nodeFlags[y * nx + x] & NODE_MOVE_X)
                                         node->x = initialPos->x;
-                                if (node->fy < 0.5 * CONSTRAINED)
+                                if (images[i].nodeFlags[y * nx + x] & NODE_MOVE_Y)
                                         node->y = initialPos->y;
                                 Log("IMAGE %d: set node (%d %d) initial position to (%f %f)\n",
                                     i, x, y, node->x, node->y);
                         }
         }
 
-        Log("Initializing maps\n");
-        /* initialize the maps that are needed */
-        map = NULL;
-        for (i = 0; i < nMaps; ++i)
-        {
-                sprintf(fn, "%s%s.map", mapsName, maps[i].name);
-                if (!ReadMap(fn, &map, &mLevel,
-                             &mw, &mh, &mxMin, &myMin,
-                             imName0, imName1,
-                             msg))
-                        Error("Could not read map %s:\n  error: %s\n",
-                              fn, msg);
-                mFactor = 1 << mLevel;
-                m = &maps[i];
-
-                /* create an array with coverage corresponding to the
-                   startLevel, and resolution determined by the mLevel
-                   fill in the entries with a 1 if the map has nonzero c
-                   fill in the other entries with 0
-                   compute distance
-                   let the threshold be a factor from sqrt(2)/2 to sqrt(2)
-                     of the distance from grid point to grid point in terms
-                   of the map spacing; we let this be sqrt(2) at the
-                     startLevel to always have at least 4 springs; and reduce
-                     the value to sqrt(2)/2 at the endLevel)
-                   at each level determine if the distance is less than
-                   or equal to the threshold; if so, make a spring
-                 */
-                factor = 1 << startLevel;
-                dnx = (images[m->image0].width + factor - 1) / factor;
-                dny = (images[m->image0].height + factor - 1) / factor;
-                dnx = dnx * factor / mFactor + 1;
-                dny = dny * factor / mFactor + 1;
-                mbpl = (dnx + 7) >> 3;
-                mask = (unsigned char *) malloc(dny * mbpl);
-                memset(mask, 0, dny * mbpl);
-                count1  = 0;
-                count2 = 0;
-#if 1
-                if (strcmp(m->name, "z033_z034") == 0 ||
-                    strcmp(m->name, "z034_z035") == 0)
-                        Log("MAP %s:\n", m->name);
-#endif
-                for (y = 0; y < mh; ++y)
-                        for (x = 0; x < mw; ++x)
-                        {
-#if 1
-                                if (strcmp(m->name, "z033_z034") == 0 ||
-                                    strcmp(m->name, "z034_z035") == 0)
-                                        Log("map[%d*mw+%d].x = %f .y = %f .c = %f\n",
-                                            y, x, map[y*mw+x].x, map[y*mw+x].y, map[y*mw+x].c);
-#endif
-                                if (map[y*mw+x].c > 0.0)
-                                {
-                                        ixv = x + mxMin;
-                                        iyv = y + myMin;
-                                        ++count2;
-                                        if (ixv >= 0 && ixv < dnx &&
-                                            iyv >= 0 && iyv < dny)
-                                        {
-                                                mask[iyv*mbpl+(ixv >> 3)] |= 0x80 >> (ixv & 7);
-                                                ++count1;
-                                        }
-                                }
-                        }
-                Log("For map %s count1 = %d count2 = %d mw=%d mh=%d mw*mh = %d dnx*dny = %d  dnx=%d dny=%d mxMin=%d myMin=%d\n",
-                    m->name, count1, count2, mw, mh, mw * mh, dnx * dny,
-                    dnx, dny, mxMin, myMin);
-                dist = (float *) malloc(dny * dnx * sizeof(float));
-                computeDistance(CHESSBOARD_DISTANCE, dnx, dny, mask, dist);
-#if 1
-                if (strcmp(m->name, "z033_z034") == 0 ||
-                    strcmp(m->name, "z034_z035") == 0)
-                {
-                        Log("MAP %s:\n", m->name);
-                        for (iyv = 0; iyv < dny; ++iyv)
-                                for (ixv = 0; ixv < dnx; ++ixv)
-                                        Log("dist[%d,%d] = %f\n",
-                                            ixv, iyv, dist[iyv*dnx+ixv]);
-                }
-#endif
-
-                imask = images[m->image0].mask;
-                rnx = (images[m->image0].width + eFactor - 1) / eFactor;
-                rny = (images[m->image0].height + eFactor - 1) / eFactor;
-                imbpl = (rnx + 7) >> 3;
-                for (level = startLevel; level >= endLevel; --level)
-                {
-                        factor = 1 << level;
-                        threshold = ((float) factor) / mFactor;
-
-                        pnStrips = &(m->nStrips[startLevel - level]);
-                        pStrips = &(m->strips[startLevel - level]);
-                        pnSprings = &(m->nSprings[startLevel - level]);
-                        pSprings = &(m->springs[startLevel - level]);
-
-                        *pnStrips = 0;
-                        *pStrips = NULL;
-                        *pnSprings = 0;
-                        *pSprings = NULL;
-
-                        nx = (images[m->image0].width + factor - 1) / factor + 1;
-                        ny = (images[m->image0].height + factor - 1) / factor + 1;
-                        nx1 = (images[m->image1].width + factor - 1) / factor + 1;
-                        ny1 = (images[m->image1].height + factor - 1) / factor + 1;
-#if PDEBUG
-                        poix = (int) floor(poixv / factor + 0.5);
-                        poiy = (int) floor(poiyv / factor + 0.5);
-                        Log("at level %d poix = %d poiy = %d  nx=%d ny=%d nx1=%d ny1=%d\n",
-                            level, poix, poiy, nx, ny, nx1, ny1);
-#endif
-                        stripsSize = 0;
-                        springsSize = 0;
-                        count1 = 0;
-                        count2 = 0;
-                        for (y = 0; y < ny; ++y)
-                        {
-                                firstInStrip = 1;
-                                iyMin = (y - 1) * factor / eFactor;
-                                if (iyMin < 0)
-                                        iyMin = 0;
-                                iyMax = (y + 1) * factor / eFactor - 1;
-                                if (iyMax >= rny)
-                                        iyMax = rny - 1;
-                                yv = ((float) (y * factor)) / mFactor;
-                                for (x = 0; x < nx; ++x)
-                                {
-                                        // check if the mask supports having a spring
-                                        //    at this node
-
-                                        ixMin = (x - 1) * factor / eFactor;
-                                        if (ixMin < 0)
-                                                ixMin = 0;
-                                        ixMax = (x + 1) * factor / eFactor - 1;
-                                        if (ixMax >= rnx)
-                                                ixMax = rnx - 1;
-                                        valid = (imask == NULL);
-                                        for (iyv = iyMin; iyv <= iyMax && !valid; ++iyv)
-                                                for (ixv = ixMin; ixv <= ixMax && !valid; ++ixv)
-                                                        if (imask[iyv*imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
-                                                                valid = 1;
-#if DEBUG
-#if PDEBUG
-                                        if (m->image0 == ioi && x == poix && y == poiy)
-#endif
-                                        Log("cons point at level %d x = %d y = %d ixMin = %d ixMax = %d iyMin = %d iyMax = %d  valid = %d  imask = %p rnx = %d rny = %d\n",
-                                            level, x, y,
-                                            ixMin, ixMax, iyMin, iyMax,
-                                            valid, imask, rnx, rny);
-#endif
-                                        if (!valid)
-                                        {
-                                                firstInStrip = 1;
-                                                continue;
-                                        }
-                                        ++count1;
-
-                                        xv = ((float) (x * factor)) / mFactor;
-                                        ixv = (int) floor(xv);
-                                        iyv = (int) floor(yv);
-#if DEBUG
-#if PDEBUG
-                                        if (m->image0 == ioi && x == poix && y == poiy)
-#endif
-                                        Log("cons spring at level %d x = %d y = %d xv = %f yv = %f ixv = %d iyv = %d dnx = %d dny = %d dist = %f thresh = %f\n",
-                                            level, x, y, xv, yv, ixv, iyv,
-                                            dnx, dny,
-                                            ixv >= 0 && ixv < dnx && iyv >= 0 && iyv < dny ?
-                                            dist[iyv*dnx+ixv] : -999.0,
-                                            threshold);
-#endif
-                                        if (ixv < 0 || ixv >= dnx ||
-                                            iyv < 0 || iyv >= dny ||
-                                            dist[iyv*dnx+ixv] > threshold)
-                                        {
-#if 0
-                                                if (strcmp(m->name, "z3803_z3807") == 0)
-                                                        Log("dist[%d*dnx+%d]=%f > %f\n",
-                                                            iyv, ixv, dist[iyv*dnx+ixv], threshold);
-#endif
-                                                firstInStrip = 1;
-                                                continue;
-                                        }
-                                        ++count2;
-                                        rrx = xv - ixv;
-                                        rry = yv - iyv;
-                                        ixv -= mxMin;
-                                        iyv -= myMin;
-                                        if (ixv >= 0 && ixv < mw-1 &&
-                                            iyv >= 0 && iyv < mh-1 &&
-                                            map[iyv*mw+ixv].c > 0.0 &&
-                                            map[(iyv+1)*mw+ixv].c > 0.0 &&
-                                            map[iyv*mw+ixv+1].c > 0.0 &&
-                                            map[(iyv+1)*mw+ixv+1].c > 0.0)
-                                        {
-                                                rx00 = map[iyv*mw+ixv].x;
-                                                ry00 = map[iyv*mw+ixv].y;
-                                                rx01 = map[(iyv+1)*mw+ixv].x;
-                                                ry01 = map[(iyv+1)*mw+ixv].y;
-                                                rx10 = map[iyv*mw+ixv+1].x;
-                                                ry10 = map[iyv*mw+ixv+1].y;
-                                                rx11 = map[(iyv+1)*mw+ixv+1].x;
-                                                ry11 = map[(iyv+1)*mw+ixv+1].y;
-                                                rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-                                                     - rx10 * rrx * (rry - 1.0)
-                                                     - rx01 * (rrx - 1.0) * rry
-                                                     + rx11 * rrx * rry;
-                                                ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-                                                     - ry10 * rrx * (rry - 1.0)
-                                                     - ry01 * (rrx - 1.0) * rry
-                                                     + ry11 * rrx * rry;
-#if DEBUG
-#if PDEBUG
-                                                if (m->image0 == ioi && x == poix && y == poiy)
-#endif
-                                                Log("RXY: ixv = %d iyv = %d rx00=%f ry00=%f rx01=%f ry01=%f rx10=%f ry10=%f rx11=%f ry11=%f rrx=%f rry=%f rx=%f ry=%f\n",
-                                                    ixv, iyv, rx00, ry00, rx01, ry01, rx10, ry10, rx11, ry11, rrx, rry, rx, ry);
-#endif
-                                        }
-                                        else
-                                        {
-#if DEBUG
-#if PDEBUG
-                                                if (m->image0 == ioi && x == poix && y == poiy)
-#endif
-
-                                                Log("Attempting to extrapolate\n");
-#endif
-                                                if (!Extrapolate(&rx, &ry, &rc,
-                                                                 ixv, iyv, rrx, rry,
-                                                                 map, mw, mh, threshold))
-                                                {
-                                                        firstInStrip = 1;
-                                                        continue;
-                                                }
-#if DEBUG
-#if PDEBUG
-                                                if (m->image0 == ioi && x == poix && y == poiy)
-#endif
-                                                Log("Extrapolated: ixv=%d iyv=%d rrx=%f rry=%f mw=%d mh=%d rx=%f ry=%f\n",
-                                                    ixv, iyv, rrx, rry, mw, mh, rx, ry);
-#endif
-                                        }
-                                        rx = rx * mFactor / factor;
-                                        ry = ry * mFactor / factor;
-                                        irx = floor(rx + 0.5);
-                                        if (irx < 0)
-                                                irx = 0;
-                                        if (irx >= nx1)
-                                                irx = nx1 - 1;
-                                        iry = floor(ry + 0.5);
-                                        if (iry < 0)
-                                                iry = 0;
-                                        if (iry >= ny1)
-                                                iry = ny1 - 1;
-#if DEBUG
-#if PDEBUG
-                                        if (m->image0 == ioi && x == poix && y == poiy ||
-                                            m->image1 == ioi && irx == poix && iry == poiy)
-#endif
-                                        Log("spring at lvl = %d from im %d x = %d y = %d xv = %f yv = %f ixv = %d iyv = %d rrx = %f rry = %f to im %d rx = %f ry = %f irx = %d iry = %d\n",
-                                            level, m->image0, x, y, xv, yv, ixv, iyv, rrx, rry,
-                                            m->image1, rx, ry, irx, iry);
-#endif
-
-                                        rrx = rx - irx;
-                                        rry = ry - iry;
-                                        if (rrx < -1.6383 || rrx > 1.6383 ||
-                                            rry < -1.6383 || rry > 1.6383)
-                                        {
-                                                firstInStrip = 1;
-                                                continue;
-                                        }
-
-                                        if (firstInStrip)
-                                        {
-                                                firstInStrip = 0;
-                                                if (++*pnStrips > stripsSize)
-                                                {
-                                                        stripsSize = (stripsSize == 0) ? ny : 2 * stripsSize;
-                                                        *pStrips = (InterImageStrip*)
-                                                                   realloc(*pStrips, stripsSize*sizeof(InterImageStrip));
-                                                }
-                                                strip = &((*pStrips)[*pnStrips - 1]);
-                                                strip->nSprings = 1;
-                                                strip->x0 = x;
-                                                strip->y0 = y;
-                                                strip->x1 = irx;
-                                                strip->y1 = iry;
-                                                prevX = irx;
-                                                prevY = iry;
-                                        }
-                                        else
-                                                ++(strip->nSprings);
-                                        if (++*pnSprings > springsSize)
-                                        {
-                                                springsSize = (springsSize == 0) ? nx*ny : 2 * springsSize;
-                                                *pSprings = (InterImageSpring*)
-                                                            realloc(*pSprings, springsSize*sizeof(InterImageSpring));
-                                        }
-                                        s = &((*pSprings)[*pnSprings-1]);
-                                        s->dx = 0;
-                                        s->dy = 0;
-                                        s->k = 255;
-                                        dx = irx - prevX;
-                                        dy = iry - prevY;
-                                        if (dx < -8 || dx > 7 ||
-                                            dy < -8 || dy > 7)
-                                                Error("Map is too divergent for internal representation: dx = %d dy = %d\n",
-                                                      dx, dy);
-                                        s->dxy1 = ((dx + 8) << 4) | (dy + 8);
-                                        irrx = floor(20000.0 * rrx + 0.5);
-                                        irry = floor(20000.0 * rry + 0.5);
-                                        if (irrx < -32768 || irrx > 32767)
-                                                Error("Internal error: irrx is out-of-range: %d\n", irrx);
-                                        if (irry < -32768 || irry > 32767)
-                                                Error("Internal error: irry is out-of-range: %d\n", irry);
-                                        s->irrx = irrx;
-                                        s->irry = irry;
-                                        prevX = irx;
-                                        prevY = iry;
-                                }
-                        }
-                        Log("For map %s at level %d, count1 = %d  count2 = %d  total = %d\n",
-                            m->name, level, count1, count2, nx * ny);
-                        if (*pnStrips != 0)
-                                *pStrips = (InterImageStrip*)
-                                           realloc(*pStrips, *pnStrips * sizeof(InterImageStrip));
-                        if (*pnSprings != 0)
-                                *pSprings = (InterImageSpring*)
-                                            realloc(*pSprings, *pnSprings * sizeof(InterImageSpring));
-#if 0
-                        else
-                                Error("No springs were generated from map %s at level %d\n",
-                                      m->name, level);
-#endif
-                }
-                free(dist);
-                free(mask);
-        }
-        free(map);
-        map = NULL;
-
         /* compute absolute positions if needed */
         for (step = 0; step < nSteps; ++step)
         {
@@ -2866,6 +3300,9 @@ computeInitialPositionsFromConstraints:
                 map = NULL;
         }
 
+        if (restartFromCheckpoint)
+                OpenCheckpoint();
+
         prevLevel = -1;
         for (step = 0; step < nSteps; ++step)
         {
@@ -2876,11 +3313,23 @@ computeInitialPositionsFromConstraints:
                 if (level != prevLevel)
                 {
                         if (prevLevel >= 0)
+                        {
                                 RefinePositions(prevLevel, level);
+                                for (i = step; i < nSteps && steps[i].level != prevLevel; ++i) ;
+                                if (i == nSteps)
+                                        ReleaseLevel(prevLevel);
+                        }
                         PlanCommunications(level);
+                        PlanThreads(level);
                         prevLevel = level;
                 }
 
+                /* when resuming, the steps before the one that was
+                   checkpointed only need to set up their levels */
+                if (restartFromCheckpoint && step < checkpoint.step)
+                        continue;
+                BuildMapSprings(level);
+
                 if (foldRecovery > 0)
                 {
                         // make a backup copy of the point positions in case
@@ -2901,8 +3350,10 @@ computeInitialPositionsFromConstraints:
                 kAbsolute = steps[step].kAbsolute;
                 threshold = steps[step].threshold;
                 factor = 1 << level;
+                StartTelemetry();
 
 restartStep:
+                DiscardReduction();
                 if (steps[step].dampingFactor > 0.0)
                 {
                         fixedDamping = steps[step].dampingFactor;
@@ -2925,21 +3376,76 @@ restartStep:
                 nDecrease = 0;
                 nIncrease = 0;
                 foldDetected = 0;
-                for (iter = 0;; ++iter)
+                foldNodesValid = 0;
+                cgRestart = 1;
+                prevGG = 0.0;
+                memset(reduced, 0, 3 * sizeof(double));
+                nRestarts = 0;
+                stepStartTime = MPI_Wtime();
+                firstIter = 0;
+                if (restartFromCheckpoint)
+                {
+                        LoadCheckpoint(level);
+                        firstIter = checkpoint.iter;
+                        foldRecoveryCount = checkpoint.foldRecoveryCount;
+                        dampingFactor = checkpoint.dampingFactor;
+                        nDecrease = checkpoint.nDecrease;
+                        nIncrease = checkpoint.nIncrease;
+                        outputRequestedIter = checkpoint.outputRequestedIter;
+                        terminationRequestedIter = checkpoint.terminationRequestedIter;
+                        refinementRequestedIter = checkpoint.refinementRequestedIter;
+                        nRestarts = checkpoint.nRestarts;
+                        prevTotalEnergy = checkpoint.prevTotalEnergy;
+                        epochInitialTotalEnergy = checkpoint.epochInitialTotalEnergy;
+                        epochFinalTotalEnergy = checkpoint.epochFinalTotalEnergy;
+                        lastOutput = checkpoint.lastOutput;
+                        stepStartTime -= checkpoint.elapsed;
+                        restartFromCheckpoint = 0;
+                }
+                for (iter = firstIter;; ++iter)
                 {
 #if DEBUG
                         Log("Starting iteration %d\n", iter);
 #endif
-                        CommunicatePositions(level);
+                        TelemetryLap(TM_OTHER);
+                        if (telemetryFile != NULL && iter > firstIter &&
+                            iter % telemetryInterval == 0)
+                                WriteTelemetry(step, level, iter);
+                        /* save the state periodically so that an
+                           interrupted run can be resumed */
+                        if (checkpointName[0] != '\0' && iter > firstIter &&
+                            iter % (checkpointInterval * epochIterations) == 0)
+                        {
+                                checkpoint.step = step;
+                                checkpoint.iter = iter;
+                                checkpoint.foldRecoveryCount = foldRecoveryCount;
+                                checkpoint.nDecrease = nDecrease;
+                                checkpoint.nIncrease = nIncrease;
+                                checkpoint.outputRequestedIter = outputRequestedIter;
+                                checkpoint.terminationRequestedIter = terminationRequestedIter;
+                                checkpoint.refinementRequestedIter = refinementRequestedIter;
+                                checkpoint.nRestarts = nRestarts;
+                                checkpoint.dampingFactor = dampingFactor;
+                                checkpoint.prevTotalEnergy = prevTotalEnergy;
+                                checkpoint.epochInitialTotalEnergy = epochInitialTotalEnergy;
+                                checkpoint.epochFinalTotalEnergy = epochFinalTotalEnergy;
+                                checkpoint.elapsed = MPI_Wtime() - stepStartTime;
+                                checkpoint.lastOutput = lastOutput;
+                                WriteCheckpoint(level, &checkpoint);
+                                TelemetryLap(TM_IO);
+                        }
+                        StartCommunication(level);
+                        TelemetryLap(TM_COMM);
 
                         /* output the grids if requested */
                         if (outputGridName[0] != '\0' &&
                             outputGridInterval > 0 &&
                             iter % outputGridInterval == 0)
                         {
+                                FinishCommunication(level);
                                 sprintf(gridName, "%sstep%.2d.i%.6d.pnm",
                                         outputGridName, step, iter);
-                                if (iter == 0)
+                                if (iter == firstIter)
                                         GetGridScale(&outputGridScale,
                                                      &outputGridOffsetX, &outputGridOffsetY,
                                                      outputGridWidth, outputGridHeight,
@@ -2957,9 +3463,13 @@ restartStep:
                                            outputGridLabel);
                         }
 
+                        TelemetryLap(TM_IO);
+
                         /* check for folds periodically */
                         if (iter % epochIterations == 0)
                         {
+                                FinishCommunication(level);
+                                TelemetryLap(TM_COMM);
                                 if (CheckForFolds(level, iter))
                                 {
                                         foldDetected = 1;
@@ -2993,7 +3503,12 @@ restartStep:
                                         {
                                                 if (foldRecoveryCount >= foldRecovery)
                                                         Error("Maximum number of fold recoveries exceeded.\n");
-                                                RecoverFromFold(level);
+                                                /* a fold still there at the first
+                                                   check after a local recovery
+                                                   needs the whole step redone */
+                                                RecoverFromFold(level,
+                                                                foldRecoveryLocal &&
+                                                                iter > firstIter);
                                                 ++foldRecoveryCount;
                                                 goto restartStep;
                                         }
@@ -3001,13 +3516,21 @@ restartStep:
                                 }
                         }
 
-                        /* update all deltas periodically */
+                        /* update all deltas periodically; this changes
+                           the energy function, so any conjugate
+                           direction is no longer meaningful */
+                        TelemetryLap(TM_FOLDS);
                         if (iter % epochIterations == 0)
+                        {
                                 UpdateDeltas(level, iter);
+                                cgRestart = 1;
+                                TelemetryLap(TM_DELTAS);
+                        }
 
                         if (outputSpringsName[0] != '\0' &&
                             step == 6 && (iter % 100) == 0)
                         {
+                                FinishCommunication(level);
                                 GetGridScale(&outputGridScale,
                                              &outputGridOffsetX, &outputGridOffsetY,
                                              outputGridWidth, outputGridHeight,
@@ -3023,228 +3546,206 @@ restartStep:
                                               outputGridScale,
                                               outputGridOffsetX, outputGridOffsetY,
                                               outputGridFocusImage, outputGridFocusDepth);
+                                TelemetryLap(TM_IO);
                         }
 
-                        /* update all forces, also computing energy */
-                        energy = 0.0;
-                        basis = energy;
-                        for (i = myFirstImage; i <= myLastImage; ++i)
+                        /* update all forces, also computing energy;
+                           if the positions of the images of other processes
+                           are still in flight, do everything that does not
+                           depend on them first */
+                        if (reactionForces)
+                                ClearReactionForces();
+                        ip.level = level;
+                        ip.dampingFactor = dampingFactor;
+                        ip.maps = commPending ? LOCAL_MAPS : ALL_MAPS;
+                        /* with -active_set, every image takes part in
+                           the iterations at which the set is revised */
+                        ip.allImages = activeThreshold == 0.0 ||
+                                       iter % ACTIVE_CHECK_ITERATIONS == 0;
+                        ip.fixedImages = iter == firstIter;
+                        RunThreads(ComputeForcesTask, &ip);
+                        intraEnergy = 0.0;
+                        interEnergy = 0.0;
+                        for (i = 0; i < nThreads; ++i)
                         {
-                                nx = images[i].nx;
-                                ny = images[i].ny;
-#if PDEBUG
-                                poix = (int) floor(poixv / factor + 0.5);
-                                poiy = (int) floor(poiyv / factor + 0.5);
-#endif
-                                if (images[i].absolutePositions != NULL)
+                                intraEnergy += threadIntraEnergy[i];
+                                interEnergy += threadInterEnergy[i];
+                        }
+                        /* the maps that straddle the image blocks of two
+                           threads are done serially */
+                        for (i = 0; i < nCrossThreadMaps; ++i)
+                        {
+                                m = &maps[crossThreadMaps[i]];
+                                if (commPending &&
+                                    (images[m->image0].owner != p ||
+                                     images[m->image1].owner != p))
+                                        continue;
+                                if (ip.allImages || MapIsActive(m))
+                                        m->energy = ComputeMapForces(m, level);
+                                interEnergy += m->energy;
+                        }
+                        if (commPending)
+                        {
+                                TelemetryLap(TM_FORCES);
+                                FinishCommunication(level);
+                                TelemetryLap(TM_COMM);
+                                ip.maps = HALO_MAPS;
+                                RunThreads(ComputeForcesTask, &ip);
+                                for (i = 0; i < nThreads; ++i)
+                                        interEnergy += threadInterEnergy[i];
+                                for (i = 0; i < nCrossThreadMaps; ++i)
                                 {
-                                        /* compute absolute location forces */
-                                        node = images[i].nodes;
-                                        absPos = images[i].absolutePositions[startLevel - level];
-                                        for (y = 0; y < ny; ++y)
-                                                for (x = 0; x < nx; ++x, ++node, ++absPos)
-                                                {
-                                                        if (node->x > 0.5 * UNSPECIFIED)
-                                                                continue;
-                                                        if (absPos->x < 0.5 * UNSPECIFIED)
-                                                                deltaX = absPos->x - node->x;
-                                                        else
-                                                                deltaX = 0.0;
-                                                        if (absPos->y < 0.5 * UNSPECIFIED)
-                                                                deltaY = absPos->y - node->y;
-                                                        else
-                                                                deltaY = 0;
-                                                        if (node->fx < 0.5 * CONSTRAINED)
-                                                                node->fx = kAbsolute * deltaX;
-                                                        if (node->fy < 0.5 * CONSTRAINED)
-                                                                node->fy = kAbsolute * deltaY;
-                                                        energy += kAbsolute * (deltaX * deltaX + deltaY * deltaY);
-                                                        if (isinf(energy) || isnan(energy))
-                                                                abort();
-                                                        //			if (x == 0 && y == 0)
-                                                        //			  Log("ENERGY COMP %f %f %f %f %f %f %f %f\n",
-                                                        //			      kAbsolute, deltaX, deltaY, absPos->x, absPos->y,
-                                                        //			      node->x, node->y, energy);
-                                                }
+                                        m = &maps[crossThreadMaps[i]];
+                                        if (images[m->image0].owner == p &&
+                                            images[m->image1].owner == p)
+                                                continue;
+                                        if (ip.allImages || MapIsActive(m))
+                                                m->energy = ComputeMapForces(m, level);
+                                        interEnergy += m->energy;
                                 }
-                                else
+                        }
+                        TelemetryLap(TM_FORCES);
+                        if (reactionForces)
+                        {
+                                ExchangeReactionForces();
+                                TelemetryLap(TM_COMM);
+                        }
+                        if (telemetryFile != NULL)
+                                TelemetryWork(&ip);
+                        /* the energy is summed per image and per map,
+                           so it may differ in its last bits from a
+                           single running sum over all springs */
+                        energy = intraEnergy + interEnergy;
+                        if (p == 0 && iter % 100 == 0)
+                        {
+                                Log("intra-energy = %f  (kIntra = %f)\n", intraEnergy, kIntra);
+                                Log("inter-energy = %f  (kInter = %f)\n", interEnergy, kInter);
+                        }
+
+                        /* with -solver cg, step along a conjugate direction
+                           (Polak-Ribiere with restarts) instead of along
+                           the forces themselves */
+                        if (solver == SOLVER_CG)
+                        {
+                                RunThreads(ConjugateSumsTask, &ip);
+                                cgSums[0] = 0.0;
+                                cgSums[1] = 0.0;
+                                for (i = 0; i < nThreads; ++i)
                                 {
-                                        /* zero all forces */
-                                        node = images[i].nodes;
-                                        for (y = 0; y < ny; ++y)
-                                                for (x = 0; x < nx; ++x, ++node)
-                                                {
-                                                        if (node->fx < 0.5 * CONSTRAINED)
-                                                                node->fx = 0.0;
-                                                        if (node->fy < 0.5 * CONSTRAINED)
-                                                                node->fy = 0.0;
-                                                }
+                                        cgSums[0] += threadGG[i];
+                                        cgSums[1] += threadGPrevG[i];
                                 }
+                                TelemetryLap(TM_UPDATE);
+                                if (MPI_Allreduce(cgSums, cgGlobalSums, 2, MPI_DOUBLE, MPI_SUM,
+                                                  MPI_COMM_WORLD) != MPI_SUCCESS)
+                                        Error("Could not sum up conjugate gradient terms.\n");
+                                TelemetryLap(TM_COLLECTIVE);
+                                TelemetryBytes(TM_COLLECTIVE, 2 * sizeof(double),
+                                               2 * sizeof(double));
+                                ip.beta = 0.0;
+                                if (!cgRestart && prevGG > 0.0 &&
+                                    cgGlobalSums[0] > cgGlobalSums[1])
+                                        ip.beta = (cgGlobalSums[0] - cgGlobalSums[1]) / prevGG;
+                                if (ip.beta == 0.0)
+                                        ++nRestarts;
+                                prevGG = cgGlobalSums[0];
+                                cgRestart = 0;
+                                RunThreads(ConjugateDirectionTask, &ip);
+                                TelemetryLap(TM_UPDATE);
+                        }
 
-                                /* add in intra-section forces */
-                                kIntraThisImage = kIntra * images[i].kFactor;
-                                iim = images[i].map;
-                                nodes = images[i].nodes;
-                                nSprings = iim->nSprings[startLevel - level];
-                                iSprings = iim->springs[startLevel - level];
-                                for (k = 0; k < nSprings; ++k)
+                        RunThreads(MaxForceTask, &ip);
+                        maxF = 0.0;
+                        for (i = 0; i < nThreads; ++i)
+                                if (threadMaxF[i] > maxF)
+                                        maxF = threadMaxF[i];
+                        TelemetryLap(TM_MAXFORCE);
+
+                        /* at the end of each epoch process 0 checks
+                           for requests to output or terminate */
+                        fileFlags = 0;
+                        if (p == 0 && iter % epochIterations == epochIterations-1)
+                        {
+                                if (triggerName[0] != '\0' &&
+                                    stat(triggerName, &sb) == 0 &&
+                                    sb.st_mtime > lastOutput)
                                 {
-                                        iis = &(iSprings[k]);
-                                        if (nodes[iis->index0].x > 0.5 * UNSPECIFIED ||
-                                            nodes[iis->index1].x > 0.5 * UNSPECIFIED)
-                                                continue;
-                                        deltaX = nodes[iis->index1].x - nodes[iis->index0].x;
-                                        deltaY = nodes[iis->index1].y - nodes[iis->index0].y;
-                                        d = sqrt(deltaX * deltaX + deltaY * deltaY);
-                                        sk = kIntraThisImage * iis->k;
-                                        force = sk * (d - iis->nomD);
-                                        energy += force * (d - iis->nomD);
-                                        if (isinf(energy) || isnan(energy))
-                                                abort();
-                                        if (d != 0.0)
-                                        {
-                                                forceOverD = force / d;
-                                                dfx = forceOverD * deltaX;
-                                                dfy = forceOverD * deltaY;
-                                                nodes[iis->index0].fx += dfx;
-                                                nodes[iis->index0].fy += dfy;
-                                                nodes[iis->index1].fx -= dfx;
-                                                nodes[iis->index1].fy -= dfy;
-                                        }
-#if DEBUG
-#if PDEBUG
-                                        if (i == ioi &&
-                                            (iis->index0 % images[i].nx == poix &&
-                                             iis->index0 / images[i].nx == poiy ||
-                                             iis->index1 % images[i].nx == poix &&
-                                             iis->index1 / images[i].nx == poiy))
-#endif
-                                        Log("intraforce: %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) dist %f nom %f force (%f %f)\n",
-                                            i, iis->index0 % images[i].nx, iis->index0 / images[i].nx,
-                                            i, iis->index1 % images[i].nx, iis->index1 / images[i].nx,
-                                            nodes[iis->index0].x, nodes[iis->index0].y,
-                                            nodes[iis->index1].x, nodes[iis->index1].y,
-                                            d, iis->nomD,
-                                            d != 0.0 ? dfx : 1000000000.0,
-                                            d != 0.0 ? dfy : 1000000000.0);
-#endif
+                                        Log("Update of file %s forced write of output images.\n",
+                                            triggerName);
+                                        fileFlags |= 4;
+                                        lastOutput = sb.st_mtime;
                                 }
+                                if (termName[0] != '\0' &&
+                                    (f = fopen(termName, "r")) != NULL)
+                                {
+                                        fclose(f);
+                                        Log("Presence of file %s forcing termination.\n", termName);
+                                        fileFlags |= 2;
+                                }
+                                TelemetryLap(TM_IO);
                         }
-                        if (p == 0 && iter % 100 == 0)
+
+                        /* rIter is the iteration whose global sums are
+                           used below; with -reduce lagged it trails the
+                           current one so that the reduction can proceed in
+                           the background */
+                        rIter = iter;
+                        if (reduceMode == REDUCE_SEPARATE)
                         {
-                                Log("intra-energy = %f  (kIntra = %f)\n", energy - basis, kIntra);
-                                Log("energy = %f basis = %f\n", energy, basis);
+                                /* find global maximum */
+                                if (MPI_Allreduce(&maxF, &globalMaxF, 1, MPI_FLOAT, MPI_MAX,
+                                                  MPI_COMM_WORLD) != MPI_SUCCESS)
+                                        Error("Could not find global maximum force\n");
                         }
-                        //	  nodes0 = images[0].nodes;
-                        //	  nx = images[0].nx;
-                        //	  if (iter == 0)
-                        //	    Log("PTEST %f %f\n", nodes[2*nx].x, nodes[2*nx].y);
-
-                        /* add in inter-image forces (one spring method) */
-                        basis = energy;
-                        for (i = 0; i < nMaps; ++i)
+                        else
                         {
-                                m = &maps[i];
-                                msk = kInter * m->k;
-                                if (msk == 0.0)
-                                        continue;
-                                sme = m->energyFactor != 0.0;
-                                nStrips = m->nStrips[startLevel - level];
-                                strips = m->strips[startLevel - level];
-                                springs = m->springs[startLevel - level];
-                                nodes0 = images[m->image0].nodes;
-                                if (nodes0 == NULL)
-                                        abort();
-                                nodes1 = images[m->image1].nodes;
-                                nx = images[m->image0].nx;
-                                nx1 = images[m->image1].nx;
-                                springsPos = 0;
-                                for (j = 0; j < nStrips; ++j)
+                                if (reduceMode == REDUCE_LAGGED && reductionPending)
                                 {
-                                        if (nodes0 == NULL)
-                                                abort();
-                                        strip = &(strips[j]);
-                                        ns = strip->nSprings;
-                                        x = strip->x0;
-                                        y = strip->y0;
-                                        irx = strip->x1;
-                                        iry = strip->y1;
-                                        for (k = 0; k < ns; ++k, ++x)
-                                        {
-                                                s = &(springs[springsPos++]);
-                                                irx += ((s->dxy1) >> 4) - 8;
-                                                iry += ((s->dxy1) & 0xf) - 8;
-                                                if (nodes0[y*nx+x].x > 0.5 * UNSPECIFIED ||
-                                                    nodes1[iry*nx1+irx].x > 0.5 * UNSPECIFIED)
-                                                        continue;
-                                                xv = nodes1[iry*nx1+irx].x + 0.00005 * s->dx;
-                                                yv = nodes1[iry*nx1+irx].y + 0.00005 * s->dy;
-                                                deltaX = xv - nodes0[y*nx + x].x;
-                                                deltaY = yv - nodes0[y*nx + x].y;
-                                                sk = (s->k / 255.0) * msk;
-                                                kdx = sk * deltaX;
-                                                kdy = sk * deltaY;
-#if DEBUG
-#if PDEBUG
-                                                if (m->image0 == ioi && x == poix && y == poiy ||
-                                                    m->image1 == ioi && irx == poix && iry == poiy)
-#endif
-                                                Log("interforce %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) (%d %d) (%f %f) (%f %f) (%f %f)\n",
-                                                    m->image0, x, y,
-                                                    m->image1, irx, iry,
-                                                    nodes0[y*nx+x].x, nodes0[y*nx+x].y,
-                                                    xv, yv,
-                                                    irx, iry,
-                                                    nodes1[iry*nx1+irx].x, nodes1[iry*nx1+irx].y,
-                                                    0.00005 * s->dx, 0.00005 * s->dy,
-                                                    kdx, kdy);
-#endif
-                                                if (nodes0 == NULL)
-                                                        abort();
-                                                nodes0[y*nx + x].fx += kdx;
-                                                nodes0[y*nx + x].fy += kdy;
-                                                if (sme)
-                                                        energy += sk * (deltaX * deltaX + deltaY * deltaY);
-                                                if (isinf(energy) || isnan(energy))
-                                                        abort();
-                                                nodes1[iry*nx1 + irx].fx -= kdx;
-                                                nodes1[iry*nx1 + irx].fy -= kdy;
-                                        }
+                                        /* the reduction in flight still reads
+                                           reduceSend, so it must complete before
+                                           reduceSend is refilled */
+                                        if (MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE) !=
+                                            MPI_SUCCESS)
+                                                Error("Could not reduce iteration sums.\n");
+                                        memcpy(reduced, reduceReceive, 3 * sizeof(double));
+                                        reductionPending = 0;
+                                        rIter = iter - 1;
                                 }
-                        }
-                        if (p == 0 && iter % 100 == 0)
-                                Log("inter-energy = %f  (kInter = %f)\n", energy - basis, kInter);
-
-                        maxF = 0.0;
-                        for (i = myFirstImage; i <= myLastImage; ++i)
-                        {
-                                if (images[i].fixed)
-                                        continue;
-                                nNodes = images[i].nx * images[i].ny;
-                                node = images[i].nodes;
-                                for (k = 0; k < nNodes; ++k, ++node)
+                                reduceSend[0] = maxF;
+                                reduceSend[1] = energy;
+                                reduceSend[2] = fileFlags;
+                                if (reduceMode == REDUCE_FUSED)
                                 {
-                                        if (node->x > 0.5 * UNSPECIFIED)
-                                                continue;
-                                        if (node->fx < 0.5 * CONSTRAINED)
-                                                if (node->fy < 0.5 * CONSTRAINED)
-                                                        force = dampingFactor * hypot(node->fx, node->fy);
-                                                else
-                                                        force = dampingFactor * fabsf(node->fx);
-                                        else
-                                        if (node->fy < 0.5 * CONSTRAINED)
-                                                force = dampingFactor * fabsf(node->fy);
-                                        else
-                                                continue;
-                                        if (force > maxF)
-                                                maxF = force;
+                                        if (MPI_Allreduce(reduceSend, reduced, 3, MPI_DOUBLE,
+                                                          iterationSumsOp, MPI_COMM_WORLD) != MPI_SUCCESS)
+                                                Error("Could not reduce iteration sums.\n");
+                                }
+                                else
+                                {
+                                        if (rIter == iter)
+                                        {
+                                                /* nothing is in flight at the start of a step,
+                                                   but the step size must agree everywhere */
+                                                reduced[0] = maxF;
+                                                if (MPI_Allreduce(&reduceSend[0], &reduced[0], 1, MPI_DOUBLE,
+                                                                  MPI_MAX, MPI_COMM_WORLD) != MPI_SUCCESS)
+                                                        Error("Could not find global maximum force\n");
+                                                rIter = -1;
+                                        }
+                                        if (MPI_Iallreduce(reduceSend, reduceReceive, 3, MPI_DOUBLE,
+                                                           iterationSumsOp, MPI_COMM_WORLD,
+                                                           &reduceRequest) != MPI_SUCCESS)
+                                                Error("Could not start reduction of iteration sums.\n");
+                                        reductionPending = 1;
                                 }
+                                globalMaxF = reduced[0];
                         }
-
-                        /* find global maximum */
-                        if (MPI_Allreduce(&maxF, &globalMaxF, 1, MPI_FLOAT, MPI_MAX,
-                                          MPI_COMM_WORLD) != MPI_SUCCESS)
-                                Error("Could not find global maximum force\n");
+                        TelemetryLap(TM_COLLECTIVE);
+                        if (reduceMode == REDUCE_SEPARATE)
+                                TelemetryBytes(TM_COLLECTIVE, sizeof(float), sizeof(float));
+                        else
+                                TelemetryBytes(TM_COLLECTIVE, 3 * sizeof(double),
+                                               3 * sizeof(double));
 
                         /* update all positions */
                         if (globalMaxF > 0.5)
@@ -3261,114 +3762,83 @@ restartStep:
                                 maxStepY = 0.0;
                         else
                                 maxStepY = 0.1 * factor;
-                        for (i = myFirstImage; i <= myLastImage; ++i)
+                        ip.scale = scale;
+                        ip.maxStepX = maxStepX;
+                        ip.maxStepY = maxStepY;
+                        RunThreads(UpdatePositionsTask, &ip);
+                        if (activeThreshold > 0.0 &&
+                            iter % ACTIVE_CHECK_ITERATIONS == 0)
                         {
-                                if (images[i].fixed)
-                                        continue;
-                                nNodes = images[i].nx * images[i].ny;
-                                node = images[i].nodes;
-                                for (k = 0; k < nNodes; ++k, ++node)
-                                {
-                                        if (node->x > 0.5 * UNSPECIFIED)
-                                                continue;
-                                        if (node->fx < 0.5 * CONSTRAINED)
-                                        {
-                                                deltaX = scale * node->fx;
-                                                if (deltaX > maxStepX)
-                                                        deltaX = maxStepX;
-                                                else if (deltaX < -maxStepX)
-                                                        deltaX = -maxStepX;
-                                                node->x += deltaX;
-
-                                        }
-                                        if (node->fy < 0.5 * CONSTRAINED)
-                                        {
-                                                deltaY = scale * node->fy;
-                                                if (deltaY > maxStepY)
-                                                        deltaY = maxStepY;
-                                                else if (deltaY < -maxStepY)
-                                                        deltaY = -maxStepY;
-                                                node->y += deltaY;
-                                        }
-#if DEBUG
-#if PDEBUG
-                                        if (i == ioi && k % images[i].nx == poix &&
-                                            k / images[i].nx == poiy)
-#endif
-                                        Log("moving point %d(%d,%d) at (%f %f) by (%f %f) to (%f %f) force (%f %f)\n",
-                                            i, k % images[i].nx, k / images[i].nx,
-                                            node->x - deltaX, node->y - deltaY,
-                                            deltaX, deltaY,
-                                            node->x, node->y,
-                                            node->fx, node->fy);
-#endif
-                                }
+                                UpdateActiveSet(level, scale / dampingFactor, iter == firstIter);
+                                cgRestart = 1;
                         }
+                        TelemetryLap(TM_UPDATE);
 
-                        if (MPI_Allreduce(&energy, &totalEnergy, 1, MPI_DOUBLE,
-                                          MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
-                                Error("Could not sum up energies.\n");
+                        if (reduceMode == REDUCE_SEPARATE)
+                        {
+                                if (MPI_Allreduce(&energy, &totalEnergy, 1, MPI_DOUBLE,
+                                                  MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
+                                        Error("Could not sum up energies.\n");
+                                TelemetryLap(TM_COLLECTIVE);
+                                TelemetryBytes(TM_COLLECTIVE, sizeof(double), sizeof(double));
+                        }
+                        else
+                        {
+                                if (rIter < 0)
+                                        continue;
+                                totalEnergy = reduced[1];
+                        }
                         /*	  if (p == 0 && (iter % 1000) == 999) */
-                        if (p == 0 && iter % 100 == 0)
+                        if (p == 0 && rIter % 100 == 0)
                                 Log("After %d iterations, total energy is %f  (df = %f mgf = %f)\n",
-                                    iter, totalEnergy, dampingFactor, globalMaxF);
+                                    rIter, totalEnergy, dampingFactor, globalMaxF);
                         deltaEnergy = totalEnergy - prevTotalEnergy;
                         prevTotalEnergy = totalEnergy;
-                        if (iter % epochIterations == 0)
+                        if (rIter % epochIterations == 0)
                                 epochInitialTotalEnergy = totalEnergy;
 
                         // check periodically for termination conditions
-                        if (iter % epochIterations == epochIterations-1)
+                        if (rIter % epochIterations == epochIterations-1)
                         {
-                                if (p == 0)
-                                {
-                                        controlFlag = 0;
-                                        if (triggerName[0] != '\0' &&
-                                            stat(triggerName, &sb) == 0 &&
-                                            sb.st_mtime > lastOutput)
-                                        {
-                                                Log("Update of file %s forced write of output images.\n",
-                                                    triggerName);
-                                                controlFlag |= 4;
-                                                lastOutput = sb.st_mtime;
-                                        }
-                                        if (termName[0] != '\0' &&
-                                            (f = fopen(termName, "r")) != NULL)
-                                        {
-                                                fclose(f);
-                                                Log("Presence of file %s forcing termination.\n", termName);
-                                                controlFlag |= 2;
-                                        }
-                                        if (iter >= steps[step].minIter &&
-                                            (epochInitialTotalEnergy - totalEnergy <
-                                             totalEnergy * threshold * 0.000001 * epochIterations ||
-                                             epochFinalTotalEnergy - totalEnergy <
-                                             totalEnergy * threshold * 0.000001 * epochIterations ||
-                                             totalEnergy < 0.000001))
-                                                controlFlag |= 1;
-                                }
+                                /* the energies are the same in all processes,
+                                   so when the sums are combined each process
+                                   can decide on its own */
+                                if (reduceMode == REDUCE_SEPARATE)
+                                        controlFlag = fileFlags;
+                                else
+                                        controlFlag = (int) reduced[2];
+                                if ((p == 0 || reduceMode != REDUCE_SEPARATE) &&
+                                    rIter >= steps[step].minIter &&
+                                    (epochInitialTotalEnergy - totalEnergy <
+                                     totalEnergy * threshold * 0.000001 * epochIterations ||
+                                     epochFinalTotalEnergy - totalEnergy <
+                                     totalEnergy * threshold * 0.000001 * epochIterations ||
+                                     totalEnergy < 0.000001))
+                                        controlFlag |= 1;
                                 epochFinalTotalEnergy = totalEnergy;
-                                if (MPI_Bcast(&controlFlag, 1, MPI_INT, 0, MPI_COMM_WORLD) !=
+                                if (reduceMode == REDUCE_SEPARATE &&
+                                    MPI_Bcast(&controlFlag, 1, MPI_INT, 0, MPI_COMM_WORLD) !=
                                     MPI_SUCCESS)
                                         Error("Could not broadcast control flag.\n");
                                 if (controlFlag & 4)
-                                        outputRequestedIter = iter;
+                                        outputRequestedIter = rIter;
                                 if (controlFlag & 2)
-                                        terminationRequestedIter = iter;
+                                        terminationRequestedIter = rIter;
                                 if (controlFlag & 1)
-                                        refinementRequestedIter = iter;
+                                        refinementRequestedIter = rIter;
                         }
 
                         if (deltaEnergy > 0.0)
                         {
                                 nDecrease = 0;
                                 ++nIncrease;
+                                cgRestart = 1;
                                 if (nIncrease > 1000 ||
                                     nIncrease > 10 && deltaEnergy > totalEnergy ||
                                     deltaEnergy > 1000.0 * totalEnergy)
                                         Error("Alignment is diverging instead of converging.\n");
 
-                                if ((iter < 100 || nIncrease < 2) && fixedDamping == 0.0)
+                                if ((rIter < 100 || nIncrease < 2) && fixedDamping == 0.0)
                                 {
                                         dampingFactor *= 0.5;
                                         if (dampingFactor < 0.000001)
@@ -3393,22 +3863,26 @@ restartStep:
                            between instabilities is about 70, and we want to output/terminate
                            when the state is not near an instability */
                         if (outputRequestedIter >= 0 &&
-                            (nDecrease == 32 || iter > outputRequestedIter + 128))
+                            (nDecrease == 32 || rIter > outputRequestedIter + 128))
                         {
+                                TelemetryLap(TM_OTHER);
                                 Output(level, iter+1);
+                                TelemetryLap(TM_IO);
                                 outputRequestedIter = -1;
                         }
                         if (terminationRequestedIter >= 0 &&
-                            (nDecrease == 32 || iter > terminationRequestedIter + 128))
+                            (nDecrease == 32 || rIter > terminationRequestedIter + 128))
                                 break;
                         if (refinementRequestedIter >= 0 &&
-                            (nDecrease == 32 || iter > refinementRequestedIter + 128))
+                            (nDecrease == 32 || rIter > refinementRequestedIter + 128))
                                 Log("Refinement (requested at iter %d, nDecrease = %d)\n",
                                     refinementRequestedIter, nDecrease);
                         else
                                 continue;
 
 finalFoldCheck:
+                        TelemetryLap(TM_OTHER);
+                        foldNodesValid = 0;
                         if (CheckForFolds(level, iter))
                         {
                                 foldDetected = 1;
@@ -3442,13 +3916,18 @@ finalFoldCheck:
                                 {
                                         if (foldRecoveryCount >= foldRecovery)
                                                 Error("Maximum number of fold recoveries exceeded.\n");
-                                        RecoverFromFold(level);
+                                        RecoverFromFold(level,
+                                                        foldRecoveryLocal &&
+                                                        iter > firstIter);
                                         ++foldRecoveryCount;
                                         goto restartStep;
                                 }
                         }
                         break;
                 }
+                DiscardReduction();
+                if (telemetryFile != NULL)
+                        FinishTelemetryStep(step, level, iter);
 
                 if (foldDetected)
                 {
@@ -3458,7 +3937,12 @@ finalFoldCheck:
                 }
 
                 if (p == 0)
+                {
                         Log("Finished alignment at step %d (level %d).\n", step, level);
+                        Log("Step %d statistics: solver %s, %d iterations (%d restarts), %.3f s, final energy %f\n",
+                            step, solverNames[solver], iter + 1, nRestarts,
+                            MPI_Wtime() - stepStartTime, totalEnergy);
+                }
 
                 if (terminationRequestedIter >= 0)
                         break;
@@ -3498,7 +3982,10 @@ finalFoldCheck:
                 }
         }
 
+        FinishOutput();
         Log("FINALIZING\n");
+        if (telemetryFile != NULL)
+                fclose(telemetryFile);
         MPI_Finalize();
         fclose(logFile);
         if ( foldDetected )
@@ -3511,13 +3998,13 @@ Output (int level, int iter)
 {
         int x, y;
         int i;
-        char fn[PATH_MAX];
         char dirName[PATH_MAX];
         Node *nodes;
         Node *node;
         int nx, ny;
         MapElement *map;
-        char msg[PATH_MAX+256];
+        OutputJob *job;
+        int nJobMaps;
         double a[6];
         int nPts;
         Point *pts;
@@ -3706,6 +4193,15 @@ Output (int level, int iter)
         else
                 sprintf(dirName, "%sl%.2di%.6d",
                         outputName, level, iter);
+        if (outputName[0] == '\0' || myLastImage < myFirstImage)
+                return;
+
+        /* the maps are computed from the nodes now, but may be written
+           later by the output writer threads, while the next step is
+           already moving the nodes; an earlier output must be complete
+           first, as it may have gone to the same files */
+        FinishOutput();
+        job = NULL;
         for (i = myFirstImage; i <= myLastImage; ++i)
         {
                 nx = images[i].nx;
@@ -3713,36 +4209,202 @@ Output (int level, int iter)
                 Log("Going to output section %s  nx = %d ny = %d\n",
                     images[i].name, nx, ny);
 
-                if (outputName[0] != '\0')
+                if (job == NULL)
                 {
-                        sprintf(fn, "%s/%s.map", dirName, images[i].name);
-                        if (!CreateDirectories(fn))
-                                Error("Could not create directories for %s\n", fn);
-                        map = malloc(nx * ny * sizeof(MapElement));
-                        node = images[i].nodes;
-                        for (y = 0; y < ny; ++y)
-                                for (x = 0; x < nx; ++x)
+                        nJobMaps = outputAggregate ? myLastImage - myFirstImage + 1 : 1;
+                        job = (OutputJob *) malloc(sizeof(OutputJob));
+                        job->level = level;
+                        job->nMaps = 0;
+                        job->image = (int *) malloc(nJobMaps * sizeof(int));
+                        job->nx = (int *) malloc(nJobMaps * sizeof(int));
+                        job->ny = (int *) malloc(nJobMaps * sizeof(int));
+                        job->maps = (MapElement **) malloc(nJobMaps * sizeof(MapElement *));
+                        if ((outputAggregate ?
+                             snprintf(job->fn, PATH_MAX, "%s/aggregate.%.2d.maps",
+                                      dirName, p) :
+                             snprintf(job->fn, PATH_MAX, "%s/%s.map",
+                                      dirName, images[i].name)) >= PATH_MAX)
+                                Error("Output map path in %s is too long\n", dirName);
+                        if (!CreateDirectories(job->fn))
+                                Error("Could not create directories for %s\n", job->fn);
+                }
+                map = malloc(nx * ny * sizeof(MapElement));
+                node = images[i].nodes;
+                for (y = 0; y < ny; ++y)
+                        for (x = 0; x < nx; ++x)
+                        {
+                                if (node->x < 0.5 * UNSPECIFIED)
                                 {
-                                        if (node->x < 0.5 * UNSPECIFIED)
-                                        {
-                                                map[y * nx + x].x = a[0] * node->x + a[1] * node->y + a[2];
-                                                map[y * nx + x].y = a[3] * node->x + a[4] * node->y + a[5];
-                                                map[y * nx + x].c = 1.0;
-                                        }
-                                        else
-                                        {
-                                                map[y * nx + x].x = 0.0;
-                                                map[y * nx + x].y = 0.0;
-                                                map[y * nx + x].c = 0.0;
-                                        }
-                                        ++node;
+                                        map[y * nx + x].x = a[0] * node->x + a[1] * node->y + a[2];
+                                        map[y * nx + x].y = a[3] * node->x + a[4] * node->y + a[5];
+                                        map[y * nx + x].c = 1.0;
+                                }
+                                else
+                                {
+                                        map[y * nx + x].x = 0.0;
+                                        map[y * nx + x].y = 0.0;
+                                        map[y * nx + x].c = 0.0;
                                 }
-                        if (!WriteMap(fn, map, level, nx, ny, 0, 0, images[i].name, "align",
+                                ++node;
+                        }
+                job->image[job->nMaps] = i;
+                job->nx[job->nMaps] = nx;
+                job->ny[job->nMaps] = ny;
+                job->maps[job->nMaps] = map;
+                if (++job->nMaps == nJobMaps)
+                {
+                        QueueOutput(job);
+                        job = NULL;
+                }
+        }
+}
+
+void
+StartOutputWriters ()
+{
+        int t;
+
+        if (outputWriters <= 0)
+                return;
+        Log("Starting %d output writer threads\n", outputWriters);
+        outputWriteError[0] = '\0';
+        outputWriterThreads = (pthread_t *) malloc(outputWriters * sizeof(pthread_t));
+        for (t = 0; t < outputWriters; ++t)
+                if (pthread_create(&outputWriterThreads[t], NULL, OutputWriterMain, NULL) != 0)
+                        Error("Could not create output writer thread %d\n", t);
+}
+
+void *
+OutputWriterMain (void *arg)
+{
+        OutputJob *job;
+        char msg[PATH_MAX+256];
+        int ok;
+
+        for (;;)
+        {
+                pthread_mutex_lock(&outputMutex);
+                while (outputQueueHead == NULL)
+                        pthread_cond_wait(&outputWorkCond, &outputMutex);
+                job = outputQueueHead;
+                outputQueueHead = job->next;
+                if (outputQueueHead == NULL)
+                        outputQueueTail = NULL;
+                pthread_mutex_unlock(&outputMutex);
+
+                ok = WriteOutputJob(job, msg);
+
+                pthread_mutex_lock(&outputMutex);
+                if (!ok && outputWriteError[0] == '\0')
+                        snprintf(outputWriteError, sizeof(outputWriteError),
+                                 "Could not write map file %s: %.200s",
+                                 job->fn, msg);
+                if (--outputJobsPending == 0)
+                        pthread_cond_broadcast(&outputDoneCond);
+                pthread_mutex_unlock(&outputMutex);
+                FreeOutputJob(job);
+        }
+        return(NULL);
+}
+
+/* writes the job right away if there are no output writer
+   threads, and otherwise hands it over to them; either way
+   the job is freed once it has been written */
+void
+QueueOutput (OutputJob *job)
+{
+        char msg[PATH_MAX+256];
+
+        if (outputWriters <= 0)
+        {
+                if (!WriteOutputJob(job, msg))
+                        Error("Could not write map file %s: %s\n", job->fn, msg);
+                FreeOutputJob(job);
+                return;
+        }
+
+        job->next = NULL;
+        pthread_mutex_lock(&outputMutex);
+        if (outputWriteError[0] != '\0')
+        {
+                pthread_mutex_unlock(&outputMutex);
+                Error("%s\n", outputWriteError);
+        }
+        if (outputQueueTail != NULL)
+                outputQueueTail->next = job;
+        else
+                outputQueueHead = job;
+        outputQueueTail = job;
+        ++outputJobsPending;
+        pthread_cond_signal(&outputWorkCond);
+        pthread_mutex_unlock(&outputMutex);
+}
+
+/* waits until the output writer threads have written all queued maps */
+void
+FinishOutput ()
+{
+        if (outputWriters <= 0)
+                return;
+        pthread_mutex_lock(&outputMutex);
+        while (outputJobsPending > 0)
+                pthread_cond_wait(&outputDoneCond, &outputMutex);
+        pthread_mutex_unlock(&outputMutex);
+        if (outputWriteError[0] != '\0')
+                Error("%s\n", outputWriteError);
+}
+
+/* an aggregated file holds the maps of the process's images, in
+   order, each written by WriteMapToStream exactly as it would be
+   written to its own .map file; ReadMapFromStream reads them back
+   one at a time */
+int
+WriteOutputJob (OutputJob *job, char *msg)
+{
+        FILE *f;
+        int i;
+
+        if (!outputAggregate)
+                return(WriteMap(job->fn, job->maps[0], job->level,
+                                job->nx[0], job->ny[0], 0, 0,
+                                images[job->image[0]].name, "align",
+                                UncompressedMap, msg));
+
+        f = fopen(job->fn, "wb");
+        if (f == NULL)
+        {
+                sprintf(msg, "Cannot open file %s for writing\n", job->fn);
+                return(0);
+        }
+        for (i = 0; i < job->nMaps; ++i)
+                if (!WriteMapToStream(f, job->fn, job->maps[i], job->level,
+                                      job->nx[i], job->ny[i], 0, 0,
+                                      images[job->image[i]].name, "align",
                                       UncompressedMap, msg))
-                                Error("Could not write map file %s: %s\n", fn, msg);
-                        free(map);
+                {
+                        fclose(f);
+                        return(0);
                 }
+        if (fclose(f) != 0)
+        {
+                sprintf(msg, "Could not close file %s\n", job->fn);
+                return(0);
         }
+        return(1);
+}
+
+void
+FreeOutputJob (OutputJob *job)
+{
+        int i;
+
+        for (i = 0; i < job->nMaps; ++i)
+                free(job->maps[i]);
+        free(job->maps);
+        free(job->image);
+        free(job->nx);
+        free(job->ny);
+        free(job);
 }
 
 void
@@ -4171,8 +4833,8 @@ OutputGrid (char *name,
                         {
                                 if (node[y*nx+x].x > 0.5 * UNSPECIFIED)
                                         continue;
-                                if (node[y*nx+x].fx > 0.5 * CONSTRAINED ||
-                                    node[y*nx+x].fy < 0.5 * CONSTRAINED)
+                                if (!(images[i].nodeFlags[y*nx+x] & NODE_MOVE_X) ||
+                                    (images[i].nodeFlags[y*nx+x] & NODE_MOVE_Y))
                                 {
                                         ix = (int) (scale * factor * node[y*nx+x].x + offsetX);
                                         iy = (int) (scale * factor * node[y*nx+x].y + offsetY);
@@ -5007,953 +5669,2855 @@ DrawLine(unsigned char *img, float px0, float py0, float px1, float py1,
         }
 }
 
+/* read the map of m and compute the distance from each of its
+   points to the nearest point with nonzero confidence; both are kept
+   in m only until the springs of the current level have been built */
 void
-UpdateDeltas (int level, int iter)
+ReadMapSpringData (InterImageMap *m, char *fn)
 {
-        InterImageMap *m;
-        int i, j, k;
         int x, y;
-        float rrx, rry;
-        Node *nodes1;
-        float rx00, rx01, rx10, rx11;
-        float ry00, ry01, ry10, ry11;
-        float rx, ry;
-        int nx, ny;
-        int irx, iry;
-        int ix, iy;
-        int nx1, ny1;
-        InterImageSpring *s;
-        InterImageStrip *strip;
-        float deltaX, deltaY;
-        int springsPos;
-        int ns;
-        int nStrips;
-        InterImageStrip *strips;
-        InterImageSpring *springs;
-        int dx, dy;
-        float d;
-        float w, tw;
-        float trx, try;
-        int irxp, iryp;
-        float rrxp, rryp;
+        int factor;
+        char msg[PATH_MAX+256];
+        char imName0[PATH_MAX], imName1[PATH_MAX];
+        int mw, mh;
+        int mxMin, myMin;
+        int mFactor;
+        int dnx, dny;
+        size_t mbpl;
+        unsigned char *mask;
+        float *dist;
+        int count1, count2;
+        int ixv, iyv;
+        MapElement *map;
 
-        for (i = 0; i < nMaps; ++i)
-        {
-                m = &maps[i];
-                nx1 = images[m->image1].nx;
-                ny1 = images[m->image1].ny;
-                nodes1 = images[m->image1].nodes;
-
-                springsPos = 0;
-                nStrips = m->nStrips[startLevel - level];
-                strips = m->strips[startLevel - level];
-                springs = m->springs[startLevel - level];
-                for (j = 0; j < nStrips; ++j)
+        if (!ReadMap(fn, &m->map, &m->mLevel,
+                     &m->mw, &m->mh, &m->mxMin, &m->myMin,
+                     imName0, imName1,
+                     msg))
+                Error("Could not read map %s:\n  error: %s\n",
+                      fn, msg);
+        map = m->map;
+        mw = m->mw;
+        mh = m->mh;
+        mxMin = m->mxMin;
+        myMin = m->myMin;
+        mFactor = 1 << m->mLevel;
+
+        /* create an array with coverage corresponding to the
+           startLevel, and resolution determined by the mLevel
+           fill in the entries with a 1 if the map has nonzero c
+           fill in the other entries with 0
+           compute distance
+           let the threshold be a factor from sqrt(2)/2 to sqrt(2)
+             of the distance from grid point to grid point in terms
+           of the map spacing; we let this be sqrt(2) at the
+             startLevel to always have at least 4 springs; and reduce
+             the value to sqrt(2)/2 at the endLevel)
+           at each level determine if the distance is less than
+           or equal to the threshold; if so, make a spring
+         */
+        factor = 1 << startLevel;
+        dnx = (images[m->image0].width + factor - 1) / factor;
+        dny = (images[m->image0].height + factor - 1) / factor;
+        dnx = dnx * factor / mFactor + 1;
+        dny = dny * factor / mFactor + 1;
+        mbpl = (dnx + 7) >> 3;
+        mask = (unsigned char *) malloc(dny * mbpl);
+        memset(mask, 0, dny * mbpl);
+        count1  = 0;
+        count2 = 0;
+#if 1
+        if (strcmp(m->name, "z033_z034") == 0 ||
+            strcmp(m->name, "z034_z035") == 0)
+                Log("MAP %s:\n", m->name);
+#endif
+        for (y = 0; y < mh; ++y)
+                for (x = 0; x < mw; ++x)
                 {
-                        strip = &(strips[j]);
-                        ns = strip->nSprings;
-                        x = strip->x0;
-                        y = strip->y0;
-                        ix = strip->x1;
-                        iy = strip->y1;
-                        for (k = 0; k < ns; ++k)
-                        {
-                                s = &(springs[springsPos++]);
-                                ix += ((s->dxy1) >> 4) - 8;
-                                iy += ((s->dxy1) & 0xf) - 8;
-                                rrx = s->irrx / 20000.0;
-                                rry = s->irry / 20000.0;
-                                irx = ix;
-                                iry = iy;
-                                if (rrx < 0.0)
-                                {
-                                        --irx;
-                                        rrx += 1.0;
-                                }
-                                if (rry < 0.0)
-                                {
-                                        --iry;
-                                        rry += 1.0;
-                                }
-                                if (irx >= 0 && irx < nx1-1 &&
-                                    iry >= 0 && iry < ny1-1 &&
-                                    (rx00 = nodes1[iry*nx1 + irx].x) <= 0.5 * UNSPECIFIED &&
-                                    (rx01 = nodes1[(iry+1)*nx1+irx].x) <= 0.5 * UNSPECIFIED &&
-                                    (rx10 = nodes1[iry*nx1 + irx+1].x) <= 0.5 * UNSPECIFIED &&
-                                    (rx11 = nodes1[(iry+1)*nx1+irx+1].x) <= 0.5 * UNSPECIFIED)
-                                {
-                                        rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-                                             - rx10 * rrx * (rry - 1.0)
-                                             - rx01 * (rrx - 1.0) * rry
-                                             + rx11 * rrx * rry;
-                                        ry00 = nodes1[iry*nx1 + irx].y;
-                                        ry01 = nodes1[(iry+1)*nx1+irx].y;
-                                        ry10 = nodes1[iry*nx1 + irx+1].y;
-                                        ry11 = nodes1[(iry+1)*nx1+irx+1].y;
-                                        ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-                                             - ry10 * rrx * (rry - 1.0)
-                                             - ry01 * (rrx - 1.0) * rry
-                                             + ry11 * rrx * rry;
-                                }
-                                else
-                                {
-                                        // need to extrapolate
-                                        tw = 0.0;
-                                        trx = 0.0;
-                                        try = 0.0;
-                                        for (dy = -1; dy <= 1; ++dy)
-                                        {
-                                                iryp = iry + dy;
-                                                if (iryp < 0 || iryp >= ny1-1)
-                                                        continue;
-                                                rryp = rry - dy;
-                                                for (dx = -1; dx <= 1; ++dx)
-                                                {
-                                                        if (dx == 0 && dy == 0)
-                                                                continue;
-                                                        irxp = irx + dx;
-                                                        if (irxp < 0 || irxp >= nx1-1)
-                                                                continue;
-                                                        rrxp = rrx - dx;
-                                                        rx00 = nodes1[iryp*nx1 + irxp].x;
-                                                        rx01 = nodes1[(iryp+1)*nx1+irxp].x;
-                                                        rx10 = nodes1[iryp*nx1 + irxp+1].x;
-                                                        rx11 = nodes1[(iryp+1)*nx1+irxp+1].x;
-                                                        ry00 = nodes1[iryp*nx1 + irxp].y;
-                                                        ry01 = nodes1[(iryp+1)*nx1+irxp].y;
-                                                        ry10 = nodes1[iryp*nx1 + irxp+1].y;
-                                                        ry11 = nodes1[(iryp+1)*nx1+irxp+1].y;
-                                                        if (rx00 > 0.5 * UNSPECIFIED ||
-                                                            rx01 > 0.5 * UNSPECIFIED ||
-                                                            rx10 > 0.5 * UNSPECIFIED ||
-                                                            rx11 > 0.5 * UNSPECIFIED)
-                                                                continue;
-                                                        rx = rx00 * (rrxp - 1.0) * (rryp - 1.0)
-                                                             - rx10 * rrxp * (rryp - 1.0)
-                                                             - rx01 * (rrxp - 1.0) * rryp
-                                                             + rx11 * rrxp * rryp;
-                                                        ry = ry00 * (rrxp - 1.0) * (rryp - 1.0)
-                                                             - ry10 * rrxp * (rryp - 1.0)
-                                                             - ry01 * (rrxp - 1.0) * rryp
-                                                             + ry11 * rrxp * rryp;
-                                                        if (dy < 0)
-                                                        {
-                                                                if (dx < 0)
-                                                                        d = hypot(rrxp - 1.0, rryp - 1.0);
-                                                                else if (dx == 0)
-                                                                        d = rryp - 1.0;
-                                                                else
-                                                                        d = hypot(-rrxp, rryp - 1.0);
-                                                        }
-                                                        else if (dy == 0)
-                                                        {
-                                                                if (dx < 0)
-                                                                        d = rrxp - 1.0;
-                                                                else
-                                                                        d = -rrxp;
-                                                        }
-                                                        else
-                                                        {
-                                                                if (dx < 0)
-                                                                        d = hypot(rrxp - 1.0, -rryp);
-                                                                else if (dx == 0)
-                                                                        d = -rryp;
-                                                                else
-                                                                        d = hypot(-rrxp, -rryp);
-                                                        }
-                                                        if (d < 0.000001)
-                                                                w = 1000000.0;
-                                                        else
-                                                                w = 1.0 / d;
-                                                        trx += w * rx;
-                                                        try += w * ry;
-                                                        tw += w;
-                                                }
-                                        }
-                                        if (tw == 0.0)
-                                        {
-                                                s->dx = 0;
-                                                s->dy = 0;
-                                                s->k = 0;
-                                                continue;
-                                        }
-                                        rx = trx / tw;
-                                        ry = try / tw;
-                                }
-                                deltaX = 20000.0 * (rx - nodes1[iy*nx1+ix].x) + 0.5;
-                                deltaY = 20000.0 * (ry - nodes1[iy*nx1+ix].y) + 0.5;
-                                if (deltaX >= -32768.0 && deltaX < 32768.0 &&
-                                    deltaY >= -32768.0 && deltaY < 32768.0)
-                                {
-                                        s->dx = (int) floor(deltaX);
-                                        s->dy = (int) floor(deltaY);
-                                }
-                                else
+#if 1
+                        if (strcmp(m->name, "z033_z034") == 0 ||
+                            strcmp(m->name, "z034_z035") == 0)
+                                Log("map[%d*mw+%d].x = %f .y = %f .c = %f\n",
+                                    y, x, map[y*mw+x].x, map[y*mw+x].y, map[y*mw+x].c);
+#endif
+                        if (map[y*mw+x].c > 0.0)
+                        {
+                                ixv = x + mxMin;
+                                iyv = y + myMin;
+                                ++count2;
+                                if (ixv >= 0 && ixv < dnx &&
+                                    iyv >= 0 && iyv < dny)
                                 {
-                                        s->dx = 0;
-                                        s->dy = 0;
-                                        s->k = 0;
+                                        mask[iyv*mbpl+(ixv >> 3)] |= 0x80 >> (ixv & 7);
+                                        ++count1;
                                 }
                         }
                 }
+        Log("For map %s count1 = %d count2 = %d mw=%d mh=%d mw*mh = %d dnx*dny = %d  dnx=%d dny=%d mxMin=%d myMin=%d\n",
+            m->name, count1, count2, mw, mh, mw * mh, dnx * dny,
+            dnx, dny, mxMin, myMin);
+        dist = (float *) malloc(dny * dnx * sizeof(float));
+        computeDistance(CHESSBOARD_DISTANCE, dnx, dny, mask, dist);
+#if 1
+        if (strcmp(m->name, "z033_z034") == 0 ||
+            strcmp(m->name, "z034_z035") == 0)
+        {
+                Log("MAP %s:\n", m->name);
+                for (iyv = 0; iyv < dny; ++iyv)
+                        for (ixv = 0; ixv < dnx; ++ixv)
+                                Log("dist[%d,%d] = %f\n",
+                                    ixv, iyv, dist[iyv*dnx+ixv]);
         }
+#endif
+        free(mask);
+        m->dist = dist;
 }
 
+/* free the map and distance array read by ReadMapSpringData */
 void
-RefinePositions (int prevLevel, int level)
+ReleaseMapSpringData (InterImageMap *m)
+{
+        free(m->map);
+        m->map = NULL;
+        free(m->dist);
+        m->dist = NULL;
+}
+
+/* build the strips and springs of all the inter-image maps of this
+   process at one level; only the levels the schedule is currently
+   using are held in memory */
+void
+BuildMapSprings (int level)
 {
         int i;
-        int factor1;
+        int x, y;
         int nx, ny;
         int nx1, ny1;
-        int x, y;
-        float xv, yv;
-        int ixv, iyv;
-        float rrx, rry;
-        float rx00, rx01, rx10, rx11;
-        float ry00, ry01, ry10, ry11;
-        float rx, ry;
-        Node *nodes, *nodes1;
-        float dFactor;
+        int lvl;
+        int factor;
         int eFactor;
-        int rFactor;
+        float threshold;
+        char fn[PATH_MAX];
+        MapElement *map;
+        int mw, mh;
+        int mxMin, myMin;
+        int mFactor;
+        InterImageMap *m;
+        int dnx, dny;
+        float *dist;
+        int count1, count2;
         unsigned char *imask;
         int rnx, rny;
-        int imbpl;
+        size_t imbpl;
+        int ixMin, ixMax, iyMin, iyMax;
         int valid;
-        int ix, iy;
-        int count;
-        MapElement *initialMap;
-        int mLevel;
-        int mw, mh;
-        int mxMin, myMin;
-        double scale;
-        Node *node;
-        char imName0[PATH_MAX], imName1[PATH_MAX];
-        char msg[PATH_MAX+256];
-        char fn[PATH_MAX];
-        Point *initialPos;
+        int ixv, iyv;
+        float xv, yv;
+        float rrx, rry;
+        float rx00, rx01, rx10, rx11;
+        float ry00, ry01, ry10, ry11;
+        float rx, ry, rc;
+        int irx, iry;
+        int *pnStrips;
+        InterImageStrip **pStrips;
+        int *pnSprings;
+        InterImageSpring **pSprings;
+        int stripsSize;
+        int springsSize;
+        int firstInStrip;
+        int prevX, prevY;
+        int dx, dy;
+        int irrx, irry;
+        InterImageStrip *strip;
+        InterImageSpring *s;
+        SpringCacheEntry *entries;
+        int nBuilt;
+        struct stat sb;
 
-        factor1 = 1 << level;
-        dFactor = 1 << (prevLevel - level);
+        lvl = startLevel - level;
+        if (mapSpringsBuilt[lvl])
+                return;
         eFactor = 1 << endLevel;
-        rFactor = factor1 / eFactor;
-        for (i = 0; i < nImages; ++i)
+        Log("Initializing maps for level %d\n", level);
+        entries = NULL;
+        if (springCacheName[0] != '\0')
+                entries = OpenSpringCache(level);
+        nBuilt = 0;
+        /* initialize the maps that are needed */
+        for (i = 0; i < nMaps; ++i)
         {
-                if (images[i].owner != p && !images[i].needed)
-                        continue;
-                nx = images[i].nx;
-                ny = images[i].ny;
-                nx1 = (images[i].width + factor1 - 1) / factor1 + 1;
-                ny1 = (images[i].height + factor1 - 1) / factor1 + 1;
-                images[i].nx = nx1;
-                images[i].ny = ny1;
-                nodes = images[i].nodes;
-                nodes1 = (Node*) malloc(nx1 * ny1 * sizeof(Node));
-                images[i].nodes = nodes1;
-                if (images[i].owner != p)
+                if (snprintf(fn, PATH_MAX, "%s%s.map",
+                             mapsName, maps[i].name) >= PATH_MAX)
+                        Error("Map path %s%s.map is too long\n",
+                              mapsName, maps[i].name);
+
+                /* use the cached springs if the map has not
+                   changed since they were made */
+                if (entries != NULL &&
+                    entries[i].image0 == maps[i].image0 &&
+                    entries[i].image1 == maps[i].image1 &&
+                    entries[i].stripsOffset + entries[i].nStrips *
+                    sizeof(InterImageStrip) <= springCacheSize[lvl] &&
+                    entries[i].springsOffset + entries[i].nSprings *
+                    sizeof(InterImageSpring) <= springCacheSize[lvl] &&
+                    stat(fn, &sb) == 0 &&
+                    sb.st_mtime == entries[i].mtime)
                 {
-                        memset(nodes1, 0, nx1 * ny1 * sizeof(Node));
-                        free(nodes);
+                        maps[i].nStrips[lvl] = entries[i].nStrips;
+                        maps[i].strips[lvl] = entries[i].nStrips == 0 ? NULL :
+                                (InterImageStrip *) (springCacheBase[lvl] +
+                                                     entries[i].stripsOffset);
+                        maps[i].nSprings[lvl] = entries[i].nSprings;
+                        maps[i].springs[lvl] = entries[i].nSprings == 0 ? NULL :
+                                (InterImageSpring *) (springCacheBase[lvl] +
+                                                      entries[i].springsOffset);
                         continue;
                 }
+                ++nBuilt;
+                m = &maps[i];
+                /* the map is reread at each level rather than held
+                   until the last one, so that only one map is in
+                   memory at a time */
+                ReadMapSpringData(m, fn);
+                map = m->map;
+                mw = m->mw;
+                mh = m->mh;
+                mxMin = m->mxMin;
+                myMin = m->myMin;
+                dist = m->dist;
+                mFactor = 1 << m->mLevel;
+                factor = 1 << startLevel;
+                dnx = (images[m->image0].width + factor - 1) / factor;
+                dny = (images[m->image0].height + factor - 1) / factor;
+                dnx = dnx * factor / mFactor + 1;
+                dny = dny * factor / mFactor + 1;
 
-                for (y = 0; y < ny1; ++y)
-                        for (x = 0; x < nx1; ++x)
-                        {
-                                nodes1[y * nx1 + x].x = UNSPECIFIED;
-                                nodes1[y * nx1 + x].y = UNSPECIFIED;
-                                nodes1[y * nx1 + x].fx = 0.0;
-                                nodes1[y * nx1 + x].fy = 0.0;
-                        }
-
-                // mark the valid map nodes
-                rnx = (images[i].width + eFactor - 1) / eFactor;
-                rny = (images[i].height + eFactor - 1) / eFactor;
+                imask = images[m->image0].mask;
+                rnx = (images[m->image0].width + eFactor - 1) / eFactor;
+                rny = (images[m->image0].height + eFactor - 1) / eFactor;
                 imbpl = (rnx + 7) >> 3;
-                imask = images[i].mask;
-                for (y = 0; y < ny1; ++y)
-                        for (x = 0; x < nx1; ++x)
+                factor = 1 << level;
+                threshold = ((float) factor) / mFactor;
+
+                pnStrips = &(m->nStrips[startLevel - level]);
+                pStrips = &(m->strips[startLevel - level]);
+                pnSprings = &(m->nSprings[startLevel - level]);
+                pSprings = &(m->springs[startLevel - level]);
+
+                *pnStrips = 0;
+                *pStrips = NULL;
+                *pnSprings = 0;
+                *pSprings = NULL;
+
+                nx = (images[m->image0].width + factor - 1) / factor + 1;
+                ny = (images[m->image0].height + factor - 1) / factor + 1;
+                nx1 = (images[m->image1].width + factor - 1) / factor + 1;
+                ny1 = (images[m->image1].height + factor - 1) / factor + 1;
+#if PDEBUG
+                poix = (int) floor(poixv / factor + 0.5);
+                poiy = (int) floor(poiyv / factor + 0.5);
+                Log("at level %d poix = %d poiy = %d  nx=%d ny=%d nx1=%d ny1=%d\n",
+                    level, poix, poiy, nx, ny, nx1, ny1);
+#endif
+                stripsSize = 0;
+                springsSize = 0;
+                count1 = 0;
+                count2 = 0;
+                for (y = 0; y < ny; ++y)
+                {
+                        firstInStrip = 1;
+                        iyMin = (y - 1) * factor / eFactor;
+                        if (iyMin < 0)
+                                iyMin = 0;
+                        iyMax = (y + 1) * factor / eFactor - 1;
+                        if (iyMax >= rny)
+                                iyMax = rny - 1;
+                        yv = ((float) (y * factor)) / mFactor;
+                        for (x = 0; x < nx; ++x)
                         {
+                                // check if the mask supports having a spring
+                                //    at this node
+
+                                ixMin = (x - 1) * factor / eFactor;
+                                if (ixMin < 0)
+                                        ixMin = 0;
+                                ixMax = (x + 1) * factor / eFactor - 1;
+                                if (ixMax >= rnx)
+                                        ixMax = rnx - 1;
                                 valid = (imask == NULL);
-                                for (iy = 0; !valid && iy < rFactor; ++iy)
-                                {
-                                        iyv = y * rFactor + iy;
-                                        if (iyv >= rny)
-                                                break;
-                                        for (ix = 0; ix < rFactor; ++ix)
-                                        {
-                                                ixv = x * rFactor + ix;
-                                                if (ixv >= rnx)
-                                                        break;
-                                                if (imask[iyv * imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
-                                                {
+                                for (iyv = iyMin; iyv <= iyMax && !valid; ++iyv)
+                                        for (ixv = ixMin; ixv <= ixMax && !valid; ++ixv)
+                                                if (imask[iyv*imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
                                                         valid = 1;
-                                                        break;
-                                                }
-                                        }
+#if DEBUG
+#if PDEBUG
+                                if (m->image0 == ioi && x == poix && y == poiy)
+#endif
+                                Log("cons point at level %d x = %d y = %d ixMin = %d ixMax = %d iyMin = %d iyMax = %d  valid = %d  imask = %p rnx = %d rny = %d\n",
+                                    level, x, y,
+                                    ixMin, ixMax, iyMin, iyMax,
+                                    valid, imask, rnx, rny);
+#endif
+                                if (!valid)
+                                {
+                                        firstInStrip = 1;
+                                        continue;
                                 }
-                                if (valid)
+                                ++count1;
+
+                                xv = ((float) (x * factor)) / mFactor;
+                                ixv = (int) floor(xv);
+                                iyv = (int) floor(yv);
+#if DEBUG
+#if PDEBUG
+                                if (m->image0 == ioi && x == poix && y == poiy)
+#endif
+                                Log("cons spring at level %d x = %d y = %d xv = %f yv = %f ixv = %d iyv = %d dnx = %d dny = %d dist = %f thresh = %f\n",
+                                    level, x, y, xv, yv, ixv, iyv,
+                                    dnx, dny,
+                                    ixv >= 0 && ixv < dnx && iyv >= 0 && iyv < dny ?
+                                    dist[iyv*dnx+ixv] : -999.0,
+                                    threshold);
+#endif
+                                if (ixv < 0 || ixv >= dnx ||
+                                    iyv < 0 || iyv >= dny ||
+                                    dist[iyv*dnx+ixv] > threshold)
                                 {
-                                        nodes1[y * nx1 + x].x = 0.0;
-                                        nodes1[y * nx1 + x].y = 0.0;
-                                        if (x < nx1 - 1)
-                                        {
-                                                nodes1[y * nx1 + x + 1].x = 0.0;
-                                                nodes1[y * nx1 + x + 1].y = 0.0;
-                                        }
-                                        if (y < ny1 - 1)
-                                        {
-                                                nodes1[(y + 1) * nx1 + x].x = 0.0;
-                                                nodes1[(y + 1) * nx1 + x].y = 0.0;
-                                        }
-                                        if (x < nx1 - 1 && y < ny1 - 1)
+#if 0
+                                        if (strcmp(m->name, "z3803_z3807") == 0)
+                                                Log("dist[%d*dnx+%d]=%f > %f\n",
+                                                    iyv, ixv, dist[iyv*dnx+ixv], threshold);
+#endif
+                                        firstInStrip = 1;
+                                        continue;
+                                }
+                                ++count2;
+                                rrx = xv - ixv;
+                                rry = yv - iyv;
+                                ixv -= mxMin;
+                                iyv -= myMin;
+                                if (ixv >= 0 && ixv < mw-1 &&
+                                    iyv >= 0 && iyv < mh-1 &&
+                                    map[iyv*mw+ixv].c > 0.0 &&
+                                    map[(iyv+1)*mw+ixv].c > 0.0 &&
+                                    map[iyv*mw+ixv+1].c > 0.0 &&
+                                    map[(iyv+1)*mw+ixv+1].c > 0.0)
+                                {
+                                        rx00 = map[iyv*mw+ixv].x;
+                                        ry00 = map[iyv*mw+ixv].y;
+                                        rx01 = map[(iyv+1)*mw+ixv].x;
+                                        ry01 = map[(iyv+1)*mw+ixv].y;
+                                        rx10 = map[iyv*mw+ixv+1].x;
+                                        ry10 = map[iyv*mw+ixv+1].y;
+                                        rx11 = map[(iyv+1)*mw+ixv+1].x;
+                                        ry11 = map[(iyv+1)*mw+ixv+1].y;
+                                        rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+                                             - rx10 * rrx * (rry - 1.0)
+                                             - rx01 * (rrx - 1.0) * rry
+                                             + rx11 * rrx * rry;
+                                        ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+                                             - ry10 * rrx * (rry - 1.0)
+                                             - ry01 * (rrx - 1.0) * rry
+                                             + ry11 * rrx * rry;
+#if DEBUG
+#if PDEBUG
+                                        if (m->image0 == ioi && x == poix && y == poiy)
+#endif
+                                        Log("RXY: ixv = %d iyv = %d rx00=%f ry00=%f rx01=%f ry01=%f rx10=%f ry10=%f rx11=%f ry11=%f rrx=%f rry=%f rx=%f ry=%f\n",
+                                            ixv, iyv, rx00, ry00, rx01, ry01, rx10, ry10, rx11, ry11, rrx, rry, rx, ry);
+#endif
+                                }
+                                else
+                                {
+#if DEBUG
+#if PDEBUG
+                                        if (m->image0 == ioi && x == poix && y == poiy)
+#endif
+
+                                        Log("Attempting to extrapolate\n");
+#endif
+                                        if (!Extrapolate(&rx, &ry, &rc,
+                                                         ixv, iyv, rrx, rry,
+                                                         map, mw, mh, threshold))
                                         {
-                                                nodes1[(y + 1) * nx1 + x + 1].x = 0.0;
-                                                nodes1[(y + 1) * nx1 + x + 1].y = 0.0;
+                                                firstInStrip = 1;
+                                                continue;
                                         }
+#if DEBUG
+#if PDEBUG
+                                        if (m->image0 == ioi && x == poix && y == poiy)
+#endif
+                                        Log("Extrapolated: ixv=%d iyv=%d rrx=%f rry=%f mw=%d mh=%d rx=%f ry=%f\n",
+                                            ixv, iyv, rrx, rry, mw, mh, rx, ry);
+#endif
                                 }
-                        }
-
-                if (nConstraints[i] > 0)
-                        ConstrainNodes(i,
-                                       nodes1, nx1, ny1, factor1,
-                                       nConstraints[i],
-                                       constraints[i],
-                                       constrainingCoeff[i]);
+                                rx = rx * mFactor / factor;
+                                ry = ry * mFactor / factor;
+                                irx = floor(rx + 0.5);
+                                if (irx < 0)
+                                        irx = 0;
+                                if (irx >= nx1)
+                                        irx = nx1 - 1;
+                                iry = floor(ry + 0.5);
+                                if (iry < 0)
+                                        iry = 0;
+                                if (iry >= ny1)
+                                        iry = ny1 - 1;
+#if DEBUG
+#if PDEBUG
+                                if (m->image0 == ioi && x == poix && y == poiy ||
+                                    m->image1 == ioi && irx == poix && iry == poiy)
+#endif
+                                Log("spring at lvl = %d from im %d x = %d y = %d xv = %f yv = %f ixv = %d iyv = %d rrx = %f rry = %f to im %d rx = %f ry = %f irx = %d iry = %d\n",
+                                    level, m->image0, x, y, xv, yv, ixv, iyv, rrx, rry,
+                                    m->image1, rx, ry, irx, iry);
+#endif
 
-                if (images[i].fixed && images[i].initialPositions[startLevel - level] != 0)
-                {
-                        node = images[i].nodes;
-                        initialPos = images[i].initialPositions[startLevel - level];
-                        for (y = 0; y < ny1; ++y)
-                                for (x = 0; x < nx1; ++x, ++node, ++initialPos)
+                                rrx = rx - irx;
+                                rry = ry - iry;
+                                if (rrx < -1.6383 || rrx > 1.6383 ||
+                                    rry < -1.6383 || rry > 1.6383)
                                 {
-                                        if (node->x > 0.5 * UNSPECIFIED)
-                                                continue;
-                                        if (node->fx < 0.5 * CONSTRAINED)
-                                                node->x = initialPos->x;
-                                        if (node->fy < 0.5 * CONSTRAINED)
-                                                node->y = initialPos->y;
+                                        firstInStrip = 1;
+                                        continue;
                                 }
-                        continue;
-                }
 
-                count = 0;
-                for (y = 0; y < ny1; ++y)
-                        for (x = 0; x < nx1; ++x)
-                        {
-                                if (nodes1[y * nx1 + x].x > 0.5 * UNSPECIFIED)
-                                        continue;
-                                ++count;
-                                xv = x / dFactor;
-                                yv = y / dFactor;
-                                ixv = (int) floor(xv);
-                                iyv = (int) floor(yv);
-                                rrx = xv - ixv;
-                                rry = yv - iyv;
-                                while (ixv >= nx-1)
+                                if (firstInStrip)
                                 {
-                                        --ixv;
-                                        rrx += 1.0;
+                                        firstInStrip = 0;
+                                        if (++*pnStrips > stripsSize)
+                                        {
+                                                stripsSize = (stripsSize == 0) ? ny : 2 * stripsSize;
+                                                *pStrips = (InterImageStrip*)
+                                                           realloc(*pStrips, stripsSize*sizeof(InterImageStrip));
+                                        }
+                                        strip = &((*pStrips)[*pnStrips - 1]);
+                                        strip->nSprings = 1;
+                                        strip->x0 = x;
+                                        strip->y0 = y;
+                                        strip->x1 = irx;
+                                        strip->y1 = iry;
+                                        prevX = irx;
+                                        prevY = iry;
                                 }
-                                while (iyv >= ny-1)
+                                else
+                                        ++(strip->nSprings);
+                                if (++*pnSprings > springsSize)
                                 {
-                                        --iyv;
-                                        rry += 1.0;
+                                        springsSize = (springsSize == 0) ? nx*ny : 2 * springsSize;
+                                        *pSprings = (InterImageSpring*)
+                                                    realloc(*pSprings, springsSize*sizeof(InterImageSpring));
                                 }
-                                rx00 = nodes[iyv * nx + ixv].x;
-                                ry00 = nodes[iyv * nx + ixv].y;
-                                rx01 = nodes[(iyv+1) * nx + ixv].x;
-                                ry01 = nodes[(iyv+1) * nx + ixv].y;
-                                rx10 = nodes[iyv * nx + ixv + 1].x;
-                                ry10 = nodes[iyv * nx + ixv + 1].y;
-                                rx11 = nodes[(iyv+1) * nx + ixv + 1].x;
-                                ry11 = nodes[(iyv+1) * nx + ixv + 1].y;
-                                if (rx00 > 0.5 * UNSPECIFIED ||
-                                    rx01 > 0.5 * UNSPECIFIED && rry != 0.0 ||
-                                    rx10 > 0.5 * UNSPECIFIED && rrx != 0.0 ||
-                                    rx11 > 0.5 * UNSPECIFIED && rrx != 0.0 && rry != 0.0)
-                                        Error("RefinePositions: could not interpolate from invalid nodes (image = %s x = %d y = %d nx1 = %d ny1 = %d ixv = %d, iyv = %d nx = %d ny = %d xv = %f yv = %f rrx = %f rry = %f dFactor = %f)\n",
-                                              images[i].name, x, y, nx1, ny1,
-                                              ixv, iyv, nx, ny,
-                                              xv, yv, rrx, rry, dFactor);
-                                rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-                                     - rx10 * rrx * (rry - 1.0)
-                                     - rx01 * (rrx - 1.0) * rry
-                                     + rx11 * rrx * rry;
-                                ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-                                     - ry10 * rrx * (rry - 1.0)
-                                     - ry01 * (rrx - 1.0) * rry
-                                     + ry11 * rrx * rry;
-
-                                if (nodes1[y * nx1 + x].fx < 0.5 * CONSTRAINED)
-                                        nodes1[y * nx1 + x].x = dFactor * rx;
-                                //	    else
-                                //	      Log("Constrained x of (%d %d)\n", x, y);
-                                if (nodes1[y * nx1 + x].fy < 0.5 * CONSTRAINED)
-                                        nodes1[y * nx1 + x].y = dFactor * ry;
-                                //	    else
-                                //	      Log("Constrained y of (%d %d)\n", x, y);
-                                //	    Log("Position of (%d %d) set to (%f %f)\n",
-                                //		x, y,
-                                //		nodes1[y * nx1 + x].x,
-                                //		nodes1[y * nx1 + x].y);
+                                s = &((*pSprings)[*pnSprings-1]);
+                                s->dx = 0;
+                                s->dy = 0;
+                                s->k = 255;
+                                dx = irx - prevX;
+                                dy = iry - prevY;
+                                if (dx < -8 || dx > 7 ||
+                                    dy < -8 || dy > 7)
+                                        Error("Map is too divergent for internal representation: dx = %d dy = %d\n",
+                                              dx, dy);
+                                s->dxy1 = ((dx + 8) << 4) | (dy + 8);
+                                irrx = floor(20000.0 * rrx + 0.5);
+                                irry = floor(20000.0 * rry + 0.5);
+                                if (irrx < -32768 || irrx > 32767)
+                                        Error("Internal error: irrx is out-of-range: %d\n", irrx);
+                                if (irry < -32768 || irry > 32767)
+                                        Error("Internal error: irry is out-of-range: %d\n", irry);
+                                s->irrx = irrx;
+                                s->irry = irry;
+                                prevX = irx;
+                                prevY = iry;
                         }
-                Log("Refined map of image %s (%d of %d nodes valid)\n",
-                    images[i].name, count, nx1*ny1);
-                free(nodes);
+                }
+                Log("For map %s at level %d, count1 = %d  count2 = %d  total = %d\n",
+                    m->name, level, count1, count2, nx * ny);
+                if (*pnStrips != 0)
+                        *pStrips = (InterImageStrip*)
+                                   realloc(*pStrips, *pnStrips * sizeof(InterImageStrip));
+                if (*pnSprings != 0)
+                        *pSprings = (InterImageSpring*)
+                                    realloc(*pSprings, *pnSprings * sizeof(InterImageSpring));
+#if 0
+                else
+                        Error("No springs were generated from map %s at level %d\n",
+                              m->name, level);
+#endif
+                ReleaseMapSpringData(m);
+        }
+        mapSpringsBuilt[lvl] = 1;
+        if (springCacheName[0] != '\0')
+        {
+                Log("Used cached springs for %d of %d maps at level %d\n",
+                    nMaps - nBuilt, nMaps, level);
+                if (nBuilt > 0)
+                        WriteSpringCache(level);
+        }
+}
+
+/* map this process's spring cache file for a level into memory;
+   returns its table of entries, or NULL if there is no usable cache */
+SpringCacheEntry *
+OpenSpringCache (int level)
+{
+        char fn[PATH_MAX];
+        int fd;
+        struct stat sb;
+        char *base;
+        SpringCacheHeader *header;
+        int lvl;
+
+        lvl = startLevel - level;
+        if (snprintf(fn, PATH_MAX, "%s.l%d.%.2d.cache",
+                     springCacheName, level, p) >= PATH_MAX)
+                Error("Spring cache name %s is too long\n", springCacheName);
+        fd = open(fn, O_RDONLY);
+        if (fd < 0)
+                return(NULL);
+        if (fstat(fd, &sb) != 0 ||
+            sb.st_size < sizeof(SpringCacheHeader) + nMaps * sizeof(SpringCacheEntry))
+        {
+                close(fd);
+                return(NULL);
+        }
+        /* the springs are modified as the iterations proceed, so
+           the mapping is private to this process */
+        base = (char *) mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+                return(NULL);
+        header = (SpringCacheHeader *) base;
+        if (memcmp(header->magic, "ASC1", 4) != 0 ||
+            header->version != SPRING_CACHE_VERSION ||
+            header->level != level ||
+            header->startLevel != startLevel ||
+            header->endLevel != endLevel ||
+            header->nMaps != nMaps)
+        {
+                Log("Ignoring out-of-date spring cache %s\n", fn);
+                munmap(base, sb.st_size);
+                return(NULL);
         }
+        springCacheBase[lvl] = base;
+        springCacheSize[lvl] = sb.st_size;
+        return((SpringCacheEntry *) (base + SPRING_CACHE_ALIGN(sizeof(SpringCacheHeader))));
 }
 
 void
-PlanCommunications (int level)
+WriteSpringCache (int level)
 {
-        int phase;
-        CommPhase *cp;
-        int bufferPos;
-        int i, j, k;
-        int nFloats;
+        char fn[PATH_MAX];
+        char tmpName[PATH_MAX];
+        FILE *f;
+        int i;
+        int lvl;
+        int ok;
+        size_t pos;
+        struct stat sb;
+        SpringCacheHeader header;
+        SpringCacheEntry *entries;
+        InterImageMap *m;
+        static char zeros[8];
+
+        lvl = startLevel - level;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "ASC1", 4);
+        header.version = SPRING_CACHE_VERSION;
+        header.level = level;
+        header.startLevel = startLevel;
+        header.endLevel = endLevel;
+        header.nMaps = nMaps;
+
+        entries = (SpringCacheEntry *) malloc(nMaps * sizeof(SpringCacheEntry));
+        memset(entries, 0, nMaps * sizeof(SpringCacheEntry));
+        pos = SPRING_CACHE_ALIGN(sizeof(SpringCacheHeader)) +
+              SPRING_CACHE_ALIGN(nMaps * sizeof(SpringCacheEntry));
+        for (i = 0; i < nMaps; ++i)
+        {
+                m = &maps[i];
+                if (snprintf(fn, PATH_MAX, "%s%s.map",
+                             mapsName, m->name) >= PATH_MAX)
+                        Error("Map path %s%s.map is too long\n",
+                              mapsName, m->name);
+                if (stat(fn, &sb) == 0)
+                        entries[i].mtime = sb.st_mtime;
+                entries[i].image0 = m->image0;
+                entries[i].image1 = m->image1;
+                entries[i].nStrips = m->nStrips[lvl];
+                entries[i].nSprings = m->nSprings[lvl];
+                entries[i].stripsOffset = pos;
+                pos += SPRING_CACHE_ALIGN(m->nStrips[lvl] * sizeof(InterImageStrip));
+                entries[i].springsOffset = pos;
+                pos += SPRING_CACHE_ALIGN(m->nSprings[lvl] * sizeof(InterImageSpring));
+        }
 
-        Log("Planning communication for level %d\n", level);
-        for (phase = 0; phase < nPhases; ++phase)
+        if (snprintf(fn, PATH_MAX, "%s.l%d.%.2d.cache",
+                     springCacheName, level, p) >= PATH_MAX ||
+            snprintf(tmpName, PATH_MAX, "%s.tmp", fn) >= PATH_MAX)
+                Error("Spring cache name %s is too long\n", springCacheName);
+        if (!CreateDirectories(tmpName))
+                Error("Could not create directories for spring cache %s\n", tmpName);
+        f = fopen(tmpName, "wb");
+        if (f == NULL)
+                Error("Could not open spring cache %s\n", tmpName);
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(zeros, 1, SPRING_CACHE_ALIGN(sizeof(header)) - sizeof(header), f) ==
+             SPRING_CACHE_ALIGN(sizeof(header)) - sizeof(header) &&
+             fwrite(entries, sizeof(SpringCacheEntry), nMaps, f) == nMaps &&
+             fwrite(zeros, 1, SPRING_CACHE_ALIGN(nMaps * sizeof(SpringCacheEntry)) -
+                    nMaps * sizeof(SpringCacheEntry), f) ==
+             SPRING_CACHE_ALIGN(nMaps * sizeof(SpringCacheEntry)) - nMaps * sizeof(SpringCacheEntry);
+        for (i = 0; ok && i < nMaps; ++i)
         {
-                // schedule the communication of positions between processors
-                cp = &(commPhases[phase]);
+                m = &maps[i];
+                pos = m->nStrips[lvl] * sizeof(InterImageStrip);
+                ok = fwrite(m->strips[lvl], 1, pos, f) == pos &&
+                     fwrite(zeros, 1, SPRING_CACHE_ALIGN(pos) - pos, f) == SPRING_CACHE_ALIGN(pos) - pos;
+                pos = m->nSprings[lvl] * sizeof(InterImageSpring);
+                ok = ok &&
+                     fwrite(m->springs[lvl], 1, pos, f) == pos &&
+                     fwrite(zeros, 1, SPRING_CACHE_ALIGN(pos) - pos, f) == SPRING_CACHE_ALIGN(pos) - pos;
+        }
+        free(entries);
+        if (fclose(f) != 0 || !ok)
+                Error("Could not write spring cache %s\n", tmpName);
+        if (rename(tmpName, fn) != 0)
+                Error("Could not rename spring cache %s to %s\n", tmpName, fn);
+        Log("Wrote spring cache %s\n", fn);
+}
 
-                // first, the sends
-                cp->nSends = 0;
-                bufferPos = 0;
-                k = 0;
-                for (i = 0; i < cp->nSendImages; ++i)
-                {
-                        j = cp->sendImages[i];
-                        nFloats = images[j].nx * images[j].ny * 2;
-                        if (bufferPos + nFloats > bufferSize)
-                        {
-                                ++(cp->nSends);
-                                cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-                                                                    cp->nSends * sizeof(int));
-                                cp->nImagesToSend[cp->nSends-1] = k;
-                                Log("In phase %d will send %d images to %d in a message of %d floats\n",
-                                    phase, k, cp->otherProcess, bufferPos);
-                                k = 0;
-                                bufferPos = 0;
-                        }
-                        bufferPos += nFloats;
-                        ++k;
-                }
-                if (k > 0)
+/* free the springs and positions that are specific to one level
+   once the remainder of the schedule does not use that level */
+void
+ReleaseLevel (int level)
+{
+        int i;
+        int lvl;
+        InterImageMap *m;
+        IntraImageMap *iim;
+        char *base;
+
+        lvl = startLevel - level;
+        base = springCacheBase[lvl];
+        for (i = 0; i < nMaps; ++i)
+        {
+                m = &maps[i];
+                /* springs that came from the cache are released
+                   with the whole mapping below */
+                if (base == NULL ||
+                    (char *) m->strips[lvl] < base ||
+                    (char *) m->strips[lvl] >= base + springCacheSize[lvl])
+                        free(m->strips[lvl]);
+                m->strips[lvl] = NULL;
+                m->nStrips[lvl] = 0;
+                if (base == NULL ||
+                    (char *) m->springs[lvl] < base ||
+                    (char *) m->springs[lvl] >= base + springCacheSize[lvl])
+                        free(m->springs[lvl]);
+                m->springs[lvl] = NULL;
+                m->nSprings[lvl] = 0;
+        }
+        if (base != NULL)
+        {
+                munmap(base, springCacheSize[lvl]);
+                springCacheBase[lvl] = NULL;
+                springCacheSize[lvl] = 0;
+        }
+        mapSpringsBuilt[lvl] = 0;
+
+        for (i = 0; i < nImages; ++i)
+                for (iim = mapHashTable[i]; iim != NULL; iim = iim->next)
                 {
-                        ++(cp->nSends);
-                        cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
-                                                            cp->nSends * sizeof(int));
-                        cp->nImagesToSend[cp->nSends-1] = k;
-                        Log("In phase %d will send %d images to %d in a final message of %d floats\n",
-                            phase, k, cp->otherProcess, bufferPos);
+                        free(iim->springs[lvl]);
+                        iim->springs[lvl] = NULL;
+                        iim->nSprings[lvl] = 0;
+                        free(iim->stencils[lvl]);
+                        iim->stencils[lvl] = NULL;
                 }
 
-                // next, the receives
-                cp->nReceives = 0;
-                bufferPos = 0;
-                k = 0;
-                for (i = 0; i < cp->nReceiveImages; ++i)
+        for (i = myFirstImage; i <= myLastImage; ++i)
+        {
+                if (images[i].absolutePositions != NULL)
                 {
-                        j = cp->receiveImages[i];
-                        nFloats = images[j].nx * images[j].ny * 2;
-                        if (bufferPos + nFloats > bufferSize)
-                        {
-                                ++(cp->nReceives);
-                                cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-                                                                      cp->nReceives * sizeof(int));
-                                cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-                                                                       cp->nReceives * sizeof(int));
-                                cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-                                cp->nImagesToReceive[cp->nReceives-1] = k;
-                                Log("In phase %d will receive %d images from %d in a message of %d floats\n",
-                                    phase, k, cp->otherProcess, bufferPos);
-                                k = 0;
-                                bufferPos = 0;
-                        }
-                        bufferPos += nFloats;
-                        ++k;
+                        free(images[i].absolutePositions[lvl]);
+                        images[i].absolutePositions[lvl] = NULL;
                 }
-                if (k > 0)
+                if (images[i].initialPositions != NULL)
                 {
-                        ++(cp->nReceives);
-                        cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
-                                                              cp->nReceives * sizeof(int));
-                        cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
-                                                               cp->nReceives * sizeof(int));
-                        cp->floatsToReceive[cp->nReceives-1] = bufferPos;
-                        cp->nImagesToReceive[cp->nReceives-1] = k;
-                        Log("In phase %d will receive %d images from %d in a final message of %d floats\n",
-                            phase, k, cp->otherProcess, bufferPos);
+                        free(images[i].initialPositions[lvl]);
+                        images[i].initialPositions[lvl] = NULL;
                 }
         }
+        Log("Released the springs and positions of level %d\n", level);
 }
 
-
+/* update the target offsets of the inter-image springs of every
+   map from the current positions of the target image nodes */
 void
-CommunicatePositions (int level)
+UpdateDeltas (int level, int iter)
 {
-        /* communicate image positions to other nodes */
-        //      (min(a,b) / sep) & 1 == 0  : first phase
-        //      (min(a,b) / sep) & 1 == 1  : second phase
-
-        //	  0-1,2-3,4-5,6-7,8-9,10-11,12-13      0,2,4,6,8,10,12
-        //        1-2,3-4,5-6,7-8,9-10,11-12,13-14   1,3,5,7,9,11,13
-        //      sep 1,
-
-        //      0-2,1-3,4-6,5-7,8-10,9-11,12-14      0,1,4,5,8,9,12
-        //      2-4,3-5,6-8,7-9,10-12,11-13          2,3,6,7,10,11
-        //      sep 2
-
-        //      0-3,1-4,2-5,6-9,7-10,8-11            0,1,2,6,7,8
-        //      3-6,4-7,5-8,9-12,10-13,11-14         3,4,5,9,10,11
-
-        //      0-4,1-5,2-6,3-7,8-12,9-13,10-14
-        //      4-8,5-9,6-10,7-11
-
-        //      0-5,1-6,2-7,3-8,4-9
-        //      5-10,6-11,7-12,8-13,9-14
-
-        //      0-6,1-7,2-8,3-9,4-10,5-11
-        //      6-12,7-13,8-14
-
-        //      0-7,1-8,2-9,3-10,4-11,5-12,6-13
-        //      7-14
-
-        //      0-8,1-9,2-10,3-11,4-12,5-13,6-14
-        //      none
+        RunThreads(CellValidityTask, NULL);
+        RunThreads(UpdateDeltasTask, &level);
+}
 
-        //      0-9,1-10,2-11,3-12,4-13,5-14
-        //      none
+/* mark the grid cells of the images needed here whose four corner
+   nodes all have positions, so that UpdateMapDeltas need test only
+   one byte before interpolating within a cell */
+void
+CellValidityTask (int thread, void *arg)
+{
+        int i;
+        int x, y;
+        int nx, ny;
+        Node *nodes;
+        unsigned char *valid;
 
-        //      0-10,1-11,2-12,3-13,4-14
-        //      none
+        for (i = thread; i < nImages; i += nThreads)
+        {
+                if (images[i].owner != p && !images[i].needed)
+                        continue;
+                nx = images[i].nx;
+                ny = images[i].ny;
+                nodes = images[i].nodes;
+                images[i].cellValid = (unsigned char *) realloc(images[i].cellValid, nx * ny);
+                valid = images[i].cellValid;
+                for (y = 0; y < ny - 1; ++y)
+                        for (x = 0; x < nx - 1; ++x)
+                                valid[y*nx+x] = nodes[y*nx+x].x <= 0.5 * UNSPECIFIED &&
+                                                nodes[(y+1)*nx+x].x <= 0.5 * UNSPECIFIED &&
+                                                nodes[y*nx+x+1].x <= 0.5 * UNSPECIFIED &&
+                                                nodes[(y+1)*nx+x+1].x <= 0.5 * UNSPECIFIED;
+        }
+}
 
-        //      0-11,1-12,2-13,3-14
-        //      none
+void
+UpdateDeltasTask (int thread, void *arg)
+{
+        int level = *((int *) arg);
+        int i;
 
-        //      0-12,1-13,2-14
-        //      none
+        /* the maps are independent, and vary in size, so they are
+           dealt out round-robin rather than in blocks */
+        for (i = thread; i < nMaps; i += nThreads)
+                UpdateMapDeltas(&maps[i], level);
+}
 
-        //      0-13,1-14
-        //      none
+void
+UpdateMapDeltas (InterImageMap *m, int level)
+{
+        int j, k;
+        int x, y;
+        float rrx, rry;
+        Node *nodes1;
+        unsigned char *valid;
+        Node *n;
+        float rx, ry;
+        int irx, iry;
+        int ix, iy;
+        int nx1, ny1;
+        InterImageSpring *s;
+        InterImageStrip *strip;
+        float deltaX, deltaY;
+        int springsPos;
+        int ns;
+        int nStrips;
+        InterImageStrip *strips;
+        InterImageSpring *springs;
 
-        //      0-14
-        //      none
-        int phase;
-        int op;
-        int subPhase;
-        int i, j, k;
-        int jj;
-        int bufferPos;
-        int nNodes;
-        int its;
-        Node *nodes;
-        MPI_Status status;
+        nx1 = images[m->image1].nx;
+        ny1 = images[m->image1].ny;
+        nodes1 = images[m->image1].nodes;
+        valid = images[m->image1].cellValid;
 
-        for (phase = 0; phase < nPhases; ++phase)
+        springsPos = 0;
+        nStrips = m->nStrips[startLevel - level];
+        strips = m->strips[startLevel - level];
+        springs = m->springs[startLevel - level];
+        for (j = 0; j < nStrips; ++j)
         {
-                if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
-                        Error("MPI_Barrier() failed.\n");
-                op = commPhases[phase].otherProcess;
-                if (op < 0)
-                        continue;
-                for (subPhase = 0; subPhase < 2; ++subPhase)
+                strip = &(strips[j]);
+                ns = strip->nSprings;
+                x = strip->x0;
+                y = strip->y0;
+                ix = strip->x1;
+                iy = strip->y1;
+                for (k = 0; k < ns; ++k)
                 {
-                        if (subPhase ^ (p < op))
+                        s = &(springs[springsPos++]);
+                        ix += ((s->dxy1) >> 4) - 8;
+                        iy += ((s->dxy1) & 0xf) - 8;
+                        rrx = s->irrx / 20000.0;
+                        rry = s->irry / 20000.0;
+                        irx = ix - (rrx < 0.0);
+                        iry = iy - (rry < 0.0);
+                        if (rrx < 0.0)
+                                rrx += 1.0;
+                        if (rry < 0.0)
+                                rry += 1.0;
+                        if ((unsigned) irx < (unsigned) (nx1 - 1) &&
+                            (unsigned) iry < (unsigned) (ny1 - 1) &&
+                            valid[iry*nx1+irx])
                         {
-                                /* send */
-                                for (i = 0; i < commPhases[phase].nSends; ++i)
-                                {
-                                        jj = 0;
-                                        bufferPos = 0;
-                                        for (j = 0; j < commPhases[phase].nImagesToSend[i]; ++j, ++jj)
-                                        {
-                                                its = commPhases[phase].sendImages[jj];
-                                                nNodes = images[its].nx * images[its].ny;
-                                                nodes = images[its].nodes;
-                                                for (k = 0; k < nNodes; ++k)
-                                                {
-                                                        buffer[bufferPos++] = nodes[k].x;
-                                                        buffer[bufferPos++] = nodes[k].y;
-                                                }
-                                        }
-                                        if (MPI_Send(buffer, bufferPos, MPI_FLOAT,
-                                                     op, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-                                                Error("Could not send to process %d\n", op);
-                                }
+                                n = &nodes1[iry*nx1+irx];
+                                rx = n[0].x * (rrx - 1.0) * (rry - 1.0)
+                                     - n[1].x * rrx * (rry - 1.0)
+                                     - n[nx1].x * (rrx - 1.0) * rry
+                                     + n[nx1+1].x * rrx * rry;
+                                ry = n[0].y * (rrx - 1.0) * (rry - 1.0)
+                                     - n[1].y * rrx * (rry - 1.0)
+                                     - n[nx1].y * (rrx - 1.0) * rry
+                                     + n[nx1+1].y * rrx * rry;
+                        }
+                        else if (!ExtrapolateTarget(nodes1, nx1, ny1, irx, iry,
+                                                    rrx, rry, &rx, &ry))
+                        {
+                                s->dx = 0;
+                                s->dy = 0;
+                                s->k = 0;
+                                continue;
+                        }
+                        deltaX = 20000.0 * (rx - nodes1[iy*nx1+ix].x) + 0.5;
+                        deltaY = 20000.0 * (ry - nodes1[iy*nx1+ix].y) + 0.5;
+                        if (deltaX >= -32768.0 && deltaX < 32768.0 &&
+                            deltaY >= -32768.0 && deltaY < 32768.0)
+                        {
+                                s->dx = (int) floor(deltaX);
+                                s->dy = (int) floor(deltaY);
                         }
                         else
                         {
-                                /* receive */
-                                for (i = 0; i < commPhases[phase].nReceives; ++i)
-                                {
-                                        if (MPI_Recv(buffer, commPhases[phase].floatsToReceive[i], MPI_FLOAT,
-                                                     op, 0, MPI_COMM_WORLD, &status) != MPI_SUCCESS)
-                                                Error("Could not receive from process %d\n", op);
-                                        jj = 0;
-                                        bufferPos = 0;
-                                        for (j = 0; j < commPhases[phase].nImagesToReceive[i]; ++j, ++jj)
-                                        {
-                                                its = commPhases[phase].receiveImages[jj];
-                                                nNodes = images[its].nx * images[its].ny;
-                                                nodes = images[its].nodes;
-                                                for (k = 0; k < nNodes; ++k)
-                                                {
-                                                        nodes[k].x =  buffer[bufferPos++];
-                                                        nodes[k].y =  buffer[bufferPos++];
-                                                }
-                                        }
-                                }
+                                s->dx = 0;
+                                s->dy = 0;
+                                s->k = 0;
                         }
                 }
         }
 }
 
-unsigned int
-Hash (char *s)
-{
-        unsigned int v = 0;
-        char *p = s;
-        while (*p != '\0')
-                v = 37 * v + *p++;
-        return(v);
-}
-
-unsigned int
-HashMap (char *s, int nx, int ny)
-{
-        unsigned int v = 0;
-        char *p = s;
-        while (*p != '\0')
-                v = 37 * v + *p++;
-        v = 37 * v + nx;
-        v = 37 * v + ny;
-        return(v);
-}
-
+/* estimate the position of point (irx+rrx, iry+rry) of a target
+   grid whose enclosing cell lacks a valid corner, as the inverse-
+   distance weighted average of the bilinear extrapolations from the
+   valid cells around it; returns 0 if there are none */
 int
-CreateDirectories (char *fn)
+ExtrapolateTarget (Node *nodes1, int nx1, int ny1, int irx, int iry,
+                   float rrx, float rry, float *prx, float *pry)
 {
-        int pos;
-        char dn[PATH_MAX];
-        char *slash;
-        int len;
-        struct stat statBuf;
-        int hv;
-        int i;
+        float rx00, rx01, rx10, rx11;
+        float ry00, ry01, ry10, ry11;
+        float rx, ry;
+        int dx, dy;
+        float d;
+        float w, tw;
+        float trx, try;
+        int irxp, iryp;
+        float rrxp, rryp;
 
-        for (pos = 0;
-             (slash = strchr(&fn[pos], '/')) != NULL;
-             pos = len + 1)
+        tw = 0.0;
+        trx = 0.0;
+        try = 0.0;
+        for (dy = -1; dy <= 1; ++dy)
         {
-                len = slash - fn;
-                if (len == 0)
+                iryp = iry + dy;
+                if (iryp < 0 || iryp >= ny1-1)
                         continue;
-                strncpy(dn, fn, len);
-                dn[len] = '\0';
-
-                /* check if in hash table */
-                hv = 0;
-                for (i = 0; i < len; ++i)
-                        hv = 239*hv + dn[i];
-                hv &= DIR_HASH_SIZE-1;
-                i = hv;
-                while (dirHash[i] != NULL)
+                rryp = rry - dy;
+                for (dx = -1; dx <= 1; ++dx)
                 {
-                        if (strcmp(dirHash[i], dn) == 0)
-                                break;
-                        i = (i + 1) & (DIR_HASH_SIZE-1);
-                        if (i == hv)
+                        if (dx == 0 && dy == 0)
+                                continue;
+                        irxp = irx + dx;
+                        if (irxp < 0 || irxp >= nx1-1)
+                                continue;
+                        rrxp = rrx - dx;
+                        rx00 = nodes1[iryp*nx1 + irxp].x;
+                        rx01 = nodes1[(iryp+1)*nx1+irxp].x;
+                        rx10 = nodes1[iryp*nx1 + irxp+1].x;
+                        rx11 = nodes1[(iryp+1)*nx1+irxp+1].x;
+                        ry00 = nodes1[iryp*nx1 + irxp].y;
+                        ry01 = nodes1[(iryp+1)*nx1+irxp].y;
+                        ry10 = nodes1[iryp*nx1 + irxp+1].y;
+                        ry11 = nodes1[(iryp+1)*nx1+irxp+1].y;
+                        if (rx00 > 0.5 * UNSPECIFIED ||
+                            rx01 > 0.5 * UNSPECIFIED ||
+                            rx10 > 0.5 * UNSPECIFIED ||
+                            rx11 > 0.5 * UNSPECIFIED)
+                                continue;
+                        rx = rx00 * (rrxp - 1.0) * (rryp - 1.0)
+                             - rx10 * rrxp * (rryp - 1.0)
+                             - rx01 * (rrxp - 1.0) * rryp
+                             + rx11 * rrxp * rryp;
+                        ry = ry00 * (rrxp - 1.0) * (rryp - 1.0)
+                             - ry10 * rrxp * (rryp - 1.0)
+                             - ry01 * (rrxp - 1.0) * rryp
+                             + ry11 * rrxp * rryp;
+                        if (dy < 0)
                         {
-                                Log("Directory hash table is full!\n");
-                                return(0);
+                                if (dx < 0)
+                                        d = hypot(rrxp - 1.0, rryp - 1.0);
+                                else if (dx == 0)
+                                        d = rryp - 1.0;
+                                else
+                                        d = hypot(-rrxp, rryp - 1.0);
                         }
-                }
-                if (dirHash[i] != NULL)
-                        continue;
-                dirHash[i] = (char *) malloc(strlen(dn)+1);
-                strcpy(dirHash[i], dn);
-
-                if (stat(dn, &statBuf) == 0)
-                {
-                        if (S_ISDIR(statBuf.st_mode) ||
-                            S_ISLNK(statBuf.st_mode))
-                                continue;
-                        Log("Output path component %s is not a directory\n", dn);
-                        return(0);
-                }
-                if (errno != ENOENT)
-                {
-                        Log("Could not stat directory %s\n", dn);
-                        return(0);
-                }
-
-                if (mkdir(dn, 0775) != 0 && errno != EEXIST)
-                {
-                        Log("Could not create directory %s\n", dn);
-                        return(0);
+                        else if (dy == 0)
+                        {
+                                if (dx < 0)
+                                        d = rrxp - 1.0;
+                                else
+                                        d = -rrxp;
+                        }
+                        else
+                        {
+                                if (dx < 0)
+                                        d = hypot(rrxp - 1.0, -rryp);
+                                else if (dx == 0)
+                                        d = -rryp;
+                                else
+                                        d = hypot(-rrxp, -rryp);
+                        }
+                        if (d < 0.000001)
+                                w = 1000000.0;
+                        else
+                                w = 1.0 / d;
+                        trx += w * rx;
+                        try += w * ry;
+                        tw += w;
                 }
         }
+        if (tw == 0.0)
+                return(0);
+        *prx = trx / tw;
+        *pry = try / tw;
         return(1);
 }
 
-int
-CheckForFolds (int level, int iter)
+void
+RefinePositions (int prevLevel, int level)
 {
         int i;
+        int factor1;
         int nx, ny;
+        int nx1, ny1;
         int x, y;
         float xv, yv;
-        Node *nodes;
-        float ax, ay;
-        float bx, by;
+        int ixv, iyv;
+        float rrx, rry;
+        float rx00, rx01, rx10, rx11;
+        float ry00, ry01, ry10, ry11;
+        float rx, ry;
+        Node *nodes, *nodes1;
+        float dFactor;
+        int eFactor;
+        int rFactor;
+        unsigned char *imask;
+        int rnx, rny;
+        int imbpl;
+        int valid;
         int ix, iy;
-        int processWithFold;
+        int count;
+        MapElement *initialMap;
+        int mLevel;
+        int mw, mh;
+        int mxMin, myMin;
+        double scale;
+        Node *node;
+        char imName0[PATH_MAX], imName1[PATH_MAX];
+        char msg[PATH_MAX+256];
+        char fn[PATH_MAX];
+        Point *initialPos;
 
-        foldImage = nImages;
-        for (i = myFirstImage; i <= myLastImage; ++i)
+        factor1 = 1 << level;
+        dFactor = 1 << (prevLevel - level);
+        eFactor = 1 << endLevel;
+        rFactor = factor1 / eFactor;
+        for (i = 0; i < nImages; ++i)
         {
+                if (images[i].owner != p && !images[i].needed)
+                        continue;
                 nx = images[i].nx;
                 ny = images[i].ny;
+                nx1 = (images[i].width + factor1 - 1) / factor1 + 1;
+                ny1 = (images[i].height + factor1 - 1) / factor1 + 1;
+                images[i].nx = nx1;
+                images[i].ny = ny1;
                 nodes = images[i].nodes;
-                for (y = 0; y < ny; ++y)
-                        for (x = 0; x < nx; ++x)
+                nodes1 = (Node*) malloc(nx1 * ny1 * sizeof(Node));
+                images[i].nodes = nodes1;
+                if (images[i].owner != p)
+                {
+                        memset(nodes1, 0, nx1 * ny1 * sizeof(Node));
+                        free(nodes);
+                        continue;
+                }
+                free(images[i].forces);
+                images[i].forces = (Force *) malloc(nx1 * ny1 * sizeof(Force));
+                memset(images[i].forces, 0, nx1 * ny1 * sizeof(Force));
+                if (solver == SOLVER_CG)
+                {
+                        free(images[i].prevForces);
+                        images[i].prevForces = (Force *) malloc(nx1 * ny1 * sizeof(Force));
+                        memset(images[i].prevForces, 0, nx1 * ny1 * sizeof(Force));
+                        free(images[i].directions);
+                        images[i].directions = (Force *) malloc(nx1 * ny1 * sizeof(Force));
+                        memset(images[i].directions, 0, nx1 * ny1 * sizeof(Force));
+                }
+                free(images[i].nodeFlags);
+                images[i].nodeFlags = (unsigned char *) malloc(nx1 * ny1);
+
+                for (y = 0; y < ny1; ++y)
+                        for (x = 0; x < nx1; ++x)
                         {
-                                xv = nodes[y * nx + x].x;
-                                if (xv > 0.5 * UNSPECIFIED)
-                                        continue;
-                                yv = nodes[y * nx + x].y;
-                                if (x > 0)
+                                nodes1[y * nx1 + x].x = UNSPECIFIED;
+                                nodes1[y * nx1 + x].y = UNSPECIFIED;
+                        }
+
+                // mark the valid map nodes
+                rnx = (images[i].width + eFactor - 1) / eFactor;
+                rny = (images[i].height + eFactor - 1) / eFactor;
+                imbpl = (rnx + 7) >> 3;
+                imask = images[i].mask;
+                for (y = 0; y < ny1; ++y)
+                        for (x = 0; x < nx1; ++x)
+                        {
+                                valid = (imask == NULL);
+                                for (iy = 0; !valid && iy < rFactor; ++iy)
                                 {
-                                        ax = nodes[y * nx + x - 1].x - xv;
-                                        ay = nodes[y * nx + x - 1].y - yv;
-                                        if (y > 0)
-                                        {
-                                                bx = nodes[(y-1) * nx + x].x - xv;
-                                                by = nodes[(y-1) * nx + x].y - yv;
-                                                if (ax < 0.5 * UNSPECIFIED &&
-                                                    bx < 0.5 * UNSPECIFIED &&
-                                                    ax * by - ay * bx <= 0.0)
-                                                        goto foldError;
-                                        }
-                                        if (y < ny - 1)
+                                        iyv = y * rFactor + iy;
+                                        if (iyv >= rny)
+                                                break;
+                                        for (ix = 0; ix < rFactor; ++ix)
                                         {
-                                                bx = nodes[(y+1) * nx + x].x - xv;
-                                                by = nodes[(y+1) * nx + x].y - yv;
-                                                if (ax < 0.5 * UNSPECIFIED &&
-                                                    bx < 0.5 * UNSPECIFIED &&
-                                                    ax * by - ay * bx >= 0.0)
-                                                        goto foldError;
+                                                ixv = x * rFactor + ix;
+                                                if (ixv >= rnx)
+                                                        break;
+                                                if (imask[iyv * imbpl + (ixv >> 3)] & (0x80 >> (ixv & 7)))
+                                                {
+                                                        valid = 1;
+                                                        break;
+                                                }
                                         }
                                 }
-                                if (x < nx - 1)
+                                if (valid)
                                 {
-                                        ax = nodes[y * nx + x + 1].x - xv;
-                                        ay = nodes[y * nx + x + 1].y - yv;
-                                        if (y > 0)
+                                        nodes1[y * nx1 + x].x = 0.0;
+                                        nodes1[y * nx1 + x].y = 0.0;
+                                        if (x < nx1 - 1)
                                         {
-                                                bx = nodes[(y-1) * nx + x].x - xv;
-                                                by = nodes[(y-1) * nx + x].y - yv;
-                                                if (ax < 0.5 * UNSPECIFIED &&
-                                                    bx < 0.5 * UNSPECIFIED &&
-                                                    ax * by - ay * bx >= 0.0)
-                                                        goto foldError;
+                                                nodes1[y * nx1 + x + 1].x = 0.0;
+                                                nodes1[y * nx1 + x + 1].y = 0.0;
                                         }
-                                        if (y < ny - 1)
+                                        if (y < ny1 - 1)
                                         {
-                                                bx = nodes[(y+1) * nx + x].x - xv;
-                                                by = nodes[(y+1) * nx + x].y - yv;
-                                                if (ax < 0.5 * UNSPECIFIED &&
-                                                    bx < 0.5 * UNSPECIFIED &&
-                                                    ax * by - ay * bx <= 0.0)
-                                                        goto foldError;
+                                                nodes1[(y + 1) * nx1 + x].x = 0.0;
+                                                nodes1[(y + 1) * nx1 + x].y = 0.0;
                                         }
-                                }
+                                        if (x < nx1 - 1 && y < ny1 - 1)
+                                        {
+                                                nodes1[(y + 1) * nx1 + x + 1].x = 0.0;
+                                                nodes1[(y + 1) * nx1 + x + 1].y = 0.0;
+                                        }
+                                }
                         }
-        }
-        goto globalFoldCheck;
-
-foldError:
-        foldImage = i;
-        foldWidth = (1 << level) * 32;
-        foldHeight = (1 << level) * 32;
-        foldX = (1 << level) * x;
-        foldY = (1 << level) * y;
-        foldAbsoluteX = nodes[y * nx + x].x;
-        foldAbsoluteY = nodes[y * nx + x].y;
-        Log("Fold detected in map of image %s at (%f %f) (%d(%d %d)) at iteration %d\n",
-            images[i].name,
-            (1 << level) * ((double) x), (1 << level) * ((double) y),
-            level, x, y, iter);
-#if 0
-        Log("DUMPING FOLDED MAP for %s:\n", images[i].name);
-        for (iy = 0; iy < ny; ++iy)
-                for (ix = 0; ix < nx; ++ix)
-                        Log("x = %d y = %d:  mapx = %f mapy = %f\n",
-                            ix, iy, nodes[iy*nx+ix].x, nodes[iy*nx+ix].y);
-#endif
-
-globalFoldCheck:
-        if (MPI_Allreduce(&foldImage, &minImageWithFold, 1, MPI_INT,
-                          MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("MPI_Allreduce: could not check for folds.\n");
-        if (minImageWithFold >= nImages)
-                return(0);
-
-        // broadcast the fold location
-        processWithFold = images[minImageWithFold].owner;
-        if (MPI_Bcast(&foldImage, 1, MPI_INT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldWidth, 1, MPI_INT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldHeight, 1, MPI_INT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldX, 1, MPI_INT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldY, 1, MPI_INT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldAbsoluteX, 1, MPI_FLOAT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
-            MPI_Bcast(&foldAbsoluteX, 1, MPI_FLOAT,
-                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("Could not broadcast fold location\n");
-        return(1);
-}
-
-int
-Extrapolate (float *prx, float *pry, float *prc,
-             int ix, int iy, float arrx, float arry,
-             MapElement* map, int mw, int mh, float threshold)
-{
-        float rx = 0.0;
-        float ry = 0.0;
-        float rc = 1.0;
-        float totalWeight = 0.0;
-        int maxDelta = ((int) ceil(threshold)) + 2;
-        float rrx, rry;
-        int dx, dy;
-        int ixv, iyv;
-        float rx00, rx01, rx10, rx11;
-        float ry00, ry01, ry10, ry11;
-        float rc00, rc01, rc10, rc11;
-        float weight;
-        float rcMin;
-        float d;
-        float xn, yn;
-        float xf, yf;
 
-        for (dy = -maxDelta; dy <= maxDelta; ++dy)
-        {
-                iyv = iy + dy;
-                if (iyv < 0 || iyv >= mh-1)
-                        continue;
-                rry = arry - dy;
+                InitNodeFlags(images[i].nodeFlags, nodes1, nx1 * ny1);
+                if (nConstraints[i] > 0)
+                        ConstrainNodes(i,
+                                       nodes1, images[i].nodeFlags, nx1, ny1, factor1,
+                                       nConstraints[i],
+                                       constraints[i],
+                                       constrainingCoeff[i]);
 
-                for (dx = -maxDelta; dx <= maxDelta; ++dx)
+                if (images[i].fixed && images[i].initialPositions[startLevel - level] != 0)
                 {
-                        ixv = ix + dx;
-                        if (ixv < 0 || ixv >= mw-1 ||
-                            map[iyv*mw+ixv].c == 0.0 ||
-                            map[(iyv+1)*mw+ixv].c == 0.0 ||
-                            map[iyv*mw+ixv+1].c == 0.0 ||
-                            map[(iyv+1)*mw+ixv+1].c == 0.0)
-                                continue;
-
-                        rrx = arrx - dx;
-
-                        rx00 = map[iyv*mw+ixv].x;
-                        ry00 = map[iyv*mw+ixv].y;
-                        rc00 = map[iyv*mw+ixv].c;
-                        rx01 = map[(iyv+1)*mw+ixv].x;
-                        ry01 = map[(iyv+1)*mw+ixv].y;
-                        rc01 = map[(iyv+1)*mw+ixv].c;
-                        rx10 = map[iyv*mw+ixv+1].x;
-                        ry10 = map[iyv*mw+ixv+1].y;
-                        rc10 = map[iyv*mw+ixv+1].c;
-                        rx11 = map[(iyv+1)*mw+ixv+1].x;
-                        ry11 = map[(iyv+1)*mw+ixv+1].y;
-                        rc11 = map[(iyv+1)*mw+ixv+1].c;
-
-                        if (dx == 0 && dy == 0)
-                                weight = M_SQRT2;
-                        else
-                                weight = 1.0 / hypot((float) dx, (float) dy);
+                        node = images[i].nodes;
+                        initialPos = images[i].initialPositions[startLevel - level];
+                        for (y = 0; y < ny1; ++y)
+                                for (x = 0; x < nx1; ++x, ++node, ++initialPos)
+                                {
+                                        if (node->x > 0.5 * UNSPECIFIED)
+                                                continue;
+                                        if (images[i].nodeFlags[y * nx1 + x] & NODE_MOVE_X)
+                                                node->x = initialPos->x;
+                                        if (images[i].nodeFlags[y * nx1 + x] & NODE_MOVE_Y)
+                                                node->y = initialPos->y;
+                                }
+                        continue;
+                }
 
-                        // compute d, the weight to be given to the far-field vs
-                        //    near-field extrapolation;   d is roughly the distance
-                        //    from the map element to the point to be extrapolated,
-                        //    but bounded between 0.0 and 1.0
-                        if (rrx >= 1.0)
-                                if (rry >= 1.0)
-                                        if (rrx >= 2.0 || rry >= 2.0)
-                                                d = 1.0;
-                                        else
-                                                d = hypot(rrx - 1.0, rry - 1.0);
-                                else if (rry < 0.0)
-                                        if (rrx >= 2.0 || rry <= -1.0)
-                                                d = 1.0;
-                                        else
-                                                d = hypot(rrx - 1.0, rry);
-                                else
-                                        d = rrx - 1.0;
-                        else if (rrx < 0.0)
-                                if (rry >= 1.0)
-                                        if (rrx <= -1.0 || rry >= 2.0)
-                                                d = 1.0;
-                                        else
-                                                d = hypot(rrx, rry - 1.0);
-                                else if (rry < 0.0)
-                                        if (rrx <= -1.0 || rry <= -1.0)
-                                                d = 1.0;
-                                        else
-                                                d = hypot(rrx, rry);
-                                else
-                                        d = -rrx;
-                        else
-                        if (rry >= 1.0)
-                                d = rry - 1.0;
-                        else if (rry < 0.0)
-                                d = -rry;
-                        else
-                                d = 0.0;
-                        if (d > 1.0)
-                                d = 1.0;
-                        // near-field extrapolation
-                        if (d < 1.0)
+                count = 0;
+                for (y = 0; y < ny1; ++y)
+                        for (x = 0; x < nx1; ++x)
                         {
-                                xn = rx00 * (rrx - 1.0) * (rry - 1.0)
+                                if (nodes1[y * nx1 + x].x > 0.5 * UNSPECIFIED)
+                                        continue;
+                                ++count;
+                                xv = x / dFactor;
+                                yv = y / dFactor;
+                                ixv = (int) floor(xv);
+                                iyv = (int) floor(yv);
+                                rrx = xv - ixv;
+                                rry = yv - iyv;
+                                while (ixv >= nx-1)
+                                {
+                                        --ixv;
+                                        rrx += 1.0;
+                                }
+                                while (iyv >= ny-1)
+                                {
+                                        --iyv;
+                                        rry += 1.0;
+                                }
+                                rx00 = nodes[iyv * nx + ixv].x;
+                                ry00 = nodes[iyv * nx + ixv].y;
+                                rx01 = nodes[(iyv+1) * nx + ixv].x;
+                                ry01 = nodes[(iyv+1) * nx + ixv].y;
+                                rx10 = nodes[iyv * nx + ixv + 1].x;
+                                ry10 = nodes[iyv * nx + ixv + 1].y;
+                                rx11 = nodes[(iyv+1) * nx + ixv + 1].x;
+                                ry11 = nodes[(iyv+1) * nx + ixv + 1].y;
+                                if (rx00 > 0.5 * UNSPECIFIED ||
+                                    rx01 > 0.5 * UNSPECIFIED && rry != 0.0 ||
+                                    rx10 > 0.5 * UNSPECIFIED && rrx != 0.0 ||
+                                    rx11 > 0.5 * UNSPECIFIED && rrx != 0.0 && rry != 0.0)
+                                        Error("RefinePositions: could not interpolate from invalid nodes (image = %s x = %d y = %d nx1 = %d ny1 = %d ixv = %d, iyv = %d nx = %d ny = %d xv = %f yv = %f rrx = %f rry = %f dFactor = %f)\n",
+                                              images[i].name, x, y, nx1, ny1,
+                                              ixv, iyv, nx, ny,
+                                              xv, yv, rrx, rry, dFactor);
+                                rx = rx00 * (rrx - 1.0) * (rry - 1.0)
                                      - rx10 * rrx * (rry - 1.0)
                                      - rx01 * (rrx - 1.0) * rry
                                      + rx11 * rrx * rry;
-                                yn = ry00 * (rrx - 1.0) * (rry - 1.0)
+                                ry = ry00 * (rrx - 1.0) * (rry - 1.0)
                                      - ry10 * rrx * (rry - 1.0)
                                      - ry01 * (rrx - 1.0) * rry
                                      + ry11 * rrx * rry;
+
+                                if (images[i].nodeFlags[y * nx1 + x] & NODE_MOVE_X)
+                                        nodes1[y * nx1 + x].x = dFactor * rx;
+                                //	    else
+                                //	      Log("Constrained x of (%d %d)\n", x, y);
+                                if (images[i].nodeFlags[y * nx1 + x] & NODE_MOVE_Y)
+                                        nodes1[y * nx1 + x].y = dFactor * ry;
+                                //	    else
+                                //	      Log("Constrained y of (%d %d)\n", x, y);
+                                //	    Log("Position of (%d %d) set to (%f %f)\n",
+                                //		x, y,
+                                //		nodes1[y * nx1 + x].x,
+                                //		nodes1[y * nx1 + x].y);
                         }
+                Log("Refined map of image %s (%d of %d nodes valid)\n",
+                    images[i].name, count, nx1*ny1);
+                free(nodes);
+        }
+}
+
+/* decide which images move when re-aligning from a previous run: those
+   listed in the changed list, or else those with a map that is newer
+   than their previous output map (or without a previous output map),
+   together with the images within realignNeighborhood of them in
+   the image list; all other images are fixed at their previous
+   positions */
+void
+SelectRealignImages (char *mapNames)
+{
+        int i, j;
+        int hv;
+        int pos;
+        int image0, image1;
+        int nChanged, nMovable;
+        unsigned char *changed;
+        time_t *outputTime;
+        char fn[PATH_MAX];
+        char line[LINE_LENGTH];
+        char name[PATH_MAX];
+        char *imageName0, *imageName1, *pairName;
+        struct stat sb;
+        FILE *f;
+
+        changed = (unsigned char *) malloc(nImages);
+        memset(changed, 0, nImages);
+        if (p == 0)
+        {
+                outputTime = (time_t *) malloc(nImages * sizeof(time_t));
+                for (i = 0; i < nImages; ++i)
+                {
+                        if (snprintf(fn, PATH_MAX, "%s%s.map",
+                                     realignName, images[i].name) >= PATH_MAX)
+                                Error("Map path %s%s.map is too long\n",
+                                      realignName, images[i].name);
+                        if (stat(fn, &sb) == 0)
+                                outputTime[i] = sb.st_mtime;
                         else
-                                xn = yn = 0.0;
-                        // far-field extrapolation
-                        if (d > 0.0)
                         {
-                                xf = 0.5 * ((rx10 - rx00) + (rx11 - rx01)) * (rrx - 0.5) +
-                                     0.5 * ((rx01 - rx00) + (rx11 - rx10)) * (rry - 0.5) +
-                                     0.25 * (rx00 + rx10 + rx01 + rx11);
-                                yf = 0.5 * ((ry01 - ry00) + (ry11 - ry10)) * (rry - 0.5) +
-                                     0.5 * ((ry10 - ry00) + (ry11 - ry01)) * (rrx - 0.5) +
-                                     0.25 * (ry00 + ry10 + ry01 + ry11);
+                                Log("No previous output map %s, so image %s will move\n",
+                                    fn, images[i].name);
+                                changed[i] = 1;
                         }
-                        else
-                                xf = yf = 0.0;
-                        // actual extrapolation is a weighted average of the near- and
-                        //    far-field extrapolations
-                        rx += weight * ((1.0 - d) * xn + d * xf);
-                        ry += weight * ((1.0 - d) * yn + d * yf);
-                        rcMin = rc00;
+                }
+
+                if (changedListName[0] != '\0')
+                {
+                        f = fopen(changedListName, "r");
+                        if (f == NULL)
+                                Error("Could not open changed image list %s\n",
+                                      changedListName);
+                        while (fgets(line, LINE_LENGTH, f) != NULL)
+                        {
+                                if (sscanf(line, "%s", name) != 1)
+                                        continue;
+                                hv = Hash(name) % nImages;
+                                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                                        if (strcmp(images[j].name, name) == 0)
+                                                break;
+                                if (j < 0)
+                                        Error("Could not find changed image %s in set of images.\n",
+                                              name);
+                                changed[j] = 1;
+                        }
+                        fclose(f);
+                }
+                else
+                {
+                        pos = 0;
+                        for (i = 0; i < nMaps; ++i)
+                        {
+                                imageName0 = &mapNames[pos];
+                                pos += strlen(imageName0) + 1;
+                                imageName1 = &mapNames[pos];
+                                pos += strlen(imageName1) + 1;
+                                pairName = &mapNames[pos];
+                                pos += strlen(pairName) + 1;
+
+                                hv = Hash(imageName0) % nImages;
+                                for (image0 = imageHashTable[hv]; image0 >= 0;
+                                     image0 = images[image0].next)
+                                        if (strcmp(images[image0].name, imageName0) == 0)
+                                                break;
+                                hv = Hash(imageName1) % nImages;
+                                for (image1 = imageHashTable[hv]; image1 >= 0;
+                                     image1 = images[image1].next)
+                                        if (strcmp(images[image1].name, imageName1) == 0)
+                                                break;
+                                if (image0 < 0 || image1 < 0)
+                                        continue;
+                                if (snprintf(fn, PATH_MAX, "%s%s.map",
+                                             mapsName, pairName) >= PATH_MAX)
+                                        Error("Map path %s%s.map is too long\n",
+                                              mapsName, pairName);
+                                if (stat(fn, &sb) != 0)
+                                        continue;
+                                if ((!changed[image0] && sb.st_mtime > outputTime[image0]) ||
+                                    (!changed[image1] && sb.st_mtime > outputTime[image1]))
+                                {
+                                        Log("Map %s is newer than the previous output\n",
+                                            pairName);
+                                        changed[image0] = 1;
+                                        changed[image1] = 1;
+                                }
+                        }
+                }
+                free(outputTime);
+        }
+        if (MPI_Bcast(changed, nImages, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Broadcast of changed images failed.\n");
+
+        nChanged = 0;
+        nMovable = 0;
+        for (i = 0; i < nImages; ++i)
+        {
+                if (changed[i])
+                        ++nChanged;
+                for (j = i - realignNeighborhood; j <= i + realignNeighborhood; ++j)
+                        if (j >= 0 && j < nImages && changed[j])
+                                break;
+                if (j <= i + realignNeighborhood && !images[i].fixed)
+                        ++nMovable;
+                else
+                        images[i].fixed = 1;
+        }
+        free(changed);
+        Log("Re-alignment: %d images changed, %d of %d images move\n",
+            nChanged, nMovable, nImages);
+}
+
+void
+PartitionImages (char *mapNames, float *mapParams)
+{
+        int i, j, k;
+        int b;
+        int lo, hi;
+        int best, closest;
+        int hv;
+        int image0, image1;
+        int mapNamesPos;
+        int *first;
+        double *work;
+        double *prefix;
+        double *cut;
+        double nodes;
+        double target, slack;
+        double total;
+        double maxWork, evenMaxWork, rankWork;
+        char *name0, *name1;
+
+        /* estimate the work done for each image in an iteration at the
+           finest level: one unit per node for the position update,
+           4 per node for its intra-image springs, and one per node
+           for each inter-image map from it; the maps that cross the
+           boundary before each image are weighted the same way */
+        work = (double *) malloc(nImages * sizeof(double));
+        prefix = (double *) malloc((nImages + 1) * sizeof(double));
+        cut = (double *) malloc((nImages + 1) * sizeof(double));
+        memset(cut, 0, (nImages + 1) * sizeof(double));
+        for (i = 0; i < nImages; ++i)
+                work[i] = 5.0 * ((images[i].width + endFactor - 1) / endFactor + 1) *
+                          ((images[i].height + endFactor - 1) / endFactor + 1);
+        mapNamesPos = 0;
+        for (k = 0; k < nMaps; ++k)
+        {
+                name0 = &mapNames[mapNamesPos];
+                mapNamesPos += strlen(name0) + 1;
+                name1 = &mapNames[mapNamesPos];
+                mapNamesPos += strlen(name1) + 1;
+                mapNamesPos += strlen(&mapNames[mapNamesPos]) + 1;
+                if (mapParams[k] == 0.0)
+                        continue;
+                image0 = -1;
+                hv = Hash(name0) % nImages;
+                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                        if (strcmp(images[j].name, name0) == 0)
+                        {
+                                image0 = j;
+                                break;
+                        }
+                image1 = -1;
+                hv = Hash(name1) % nImages;
+                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                        if (strcmp(images[j].name, name1) == 0)
+                        {
+                                image1 = j;
+                                break;
+                        }
+                if (image0 < 0 || image1 < 0)
+                        continue;
+                nodes = ((images[image0].width + endFactor - 1) / endFactor + 1) *
+                        ((images[image0].height + endFactor - 1) / endFactor + 1);
+                work[image0] += nodes;
+                lo = image0 < image1 ? image0 : image1;
+                hi = image0 < image1 ? image1 : image0;
+                cut[lo + 1] += nodes;
+                cut[hi + 1] -= nodes;
+        }
+        prefix[0] = 0.0;
+        for (i = 0; i < nImages; ++i)
+        {
+                prefix[i + 1] = prefix[i] + work[i];
+                cut[i + 1] += cut[i];
+        }
+        total = prefix[nImages];
+
+        /* place the boundaries between processes; with -balance each
+           boundary is put where the maps crossing it carry the least
+           work among the positions within 2% of a process's share of
+           the ideal split point */
+        first = (int *) malloc((np + 1) * sizeof(int));
+        for (k = 0; k <= np; ++k)
+                first[k] = (k * nImages) / np;
+        evenMaxWork = 0.0;
+        for (k = 0; k < np; ++k)
+                if (prefix[first[k+1]] - prefix[first[k]] > evenMaxWork)
+                        evenMaxWork = prefix[first[k+1]] - prefix[first[k]];
+        if (balancePartition && nImages >= np)
+        {
+                slack = 0.02 * total / np;
+                for (k = 1; k < np; ++k)
+                {
+                        target = total * k / np;
+                        lo = first[k-1] + 1;
+                        hi = nImages - (np - k);
+                        closest = lo;
+                        for (b = lo; b <= hi; ++b)
+                                if (fabs(prefix[b] - target) < fabs(prefix[closest] - target))
+                                        closest = b;
+                        best = closest;
+                        for (b = lo; b <= hi; ++b)
+                                if (fabs(prefix[b] - target) <= slack &&
+                                    (cut[b] < cut[best] ||
+                                     cut[b] == cut[best] &&
+                                     fabs(prefix[b] - target) < fabs(prefix[best] - target)))
+                                        best = b;
+                        first[k] = best;
+                }
+        }
+
+        for (i = 0; i < np; ++i)
+                for (j = first[i]; j < first[i+1]; ++j)
+                {
+                        images[j].owner = i;
+                        images[j].needed = 0;
+                        if (i == p)
+                        {
+                                images[j].sendTo = (unsigned char *)
+                                                   malloc((np + 7) >> 3);
+                                memset(images[j].sendTo, 0,
+                                       (np + 7) >> 3);
+                        }
+                }
+        myFirstImage = first[p];
+        myLastImage = first[p+1] - 1;
+
+        /* report the predicted work so that the number of processes
+           can be chosen sensibly */
+        if (p == 0)
+        {
+                maxWork = 0.0;
+                for (k = 0; k < np; ++k)
+                {
+                        rankWork = prefix[first[k+1]] - prefix[first[k]];
+                        if (rankWork > maxWork)
+                                maxWork = rankWork;
+                        Log("Process %d: images %d to %d, predicted work %.0f (%.2f of average), boundary maps %.0f\n",
+                            k, first[k], first[k+1] - 1, rankWork,
+                            total > 0.0 ? rankWork * np / total : 0.0,
+                            k < np - 1 ? cut[first[k+1]] : 0.0);
+                }
+                if (total > 0.0)
+                        Log("Predicted load imbalance (maximum/average work) is %.3f; with an equal number of images per process it is %.3f\n",
+                            maxWork * np / total, evenMaxWork * np / total);
+        }
+
+        free(first);
+        free(work);
+        free(prefix);
+        free(cut);
+}
+
+/* estimates, from the image list and the headers of the maps
+   alone, the size of the problem at each level, and the memory
+   and communication each of planProcesses processes would need;
+   the counts of inter-image springs are upper bounds, as the
+   parts of the maps without valid entries are not known; the
+   memory estimate follows what align holds at its peak: the node
+   arrays, the springs of a single level, since each level is released
+   once it is finished, and one map, since the maps are read one at a
+   time while the springs are built */
+void
+Plan (char *mapNames, float *mapParams)
+{
+        int runProcesses;
+        int i, j, k;
+        int lvl;
+        int level;
+        int factor;
+        int hv;
+        int mapNamesPos;
+        char *name0, *name1, *pairName;
+        char fn[PATH_MAX];
+        char msg[PATH_MAX+256];
+        char imName0[PATH_MAX], imName1[PATH_MAX];
+        int mLevel, mw, mh, mxMin, myMin;
+        int mFactor;
+        int image0, image1;
+        int owner0, owner1;
+        int nx, ny;
+        int cx, cy;
+        double xMin, xMax, yMin, yMax;
+        double n;
+        double springs;
+        double mapBytes;
+        double nodeBytes;
+        double *imageNodes;     /* [image * nLevels + lvl] */
+        double *rankNodes;      /* [rank * nLevels + lvl] */
+        double *rankSprings;
+        double *rankSent;       /* bytes per iteration */
+        double *rankReceived;
+        double *rankMemory;
+        double *rankLevelMemory; /* [rank * nLevels + lvl]: springs */
+        double *rankLargestMap;
+        double *rankBuffers;
+        double totalNodes, totalSprings, totalSent;
+        double maxNodes, maxSprings, maxSent, maxReceived;
+        double maxMemory;
+        int maxMemoryRank;
+        double levelMemory;
+        int peakLevel;
+        int nPlanMaps;
+        unsigned char *sent;    /* [image * np + rank]: positions of
+                                   the image go to the rank */
+
+        runProcesses = np;
+        np = planProcesses;
+        Log("Planning the alignment of %d images with %d maps on %d processes (levels %d to %d)\n",
+            nImages, nMaps, np, startLevel, endLevel);
+        PartitionImages(mapNames, mapParams);
+
+        imageNodes = (double *) malloc(nImages * nLevels * sizeof(double));
+        rankNodes = (double *) malloc(np * nLevels * sizeof(double));
+        rankSprings = (double *) malloc(np * nLevels * sizeof(double));
+        rankSent = (double *) malloc(np * nLevels * sizeof(double));
+        rankReceived = (double *) malloc(np * nLevels * sizeof(double));
+        rankMemory = (double *) malloc(np * sizeof(double));
+        rankLevelMemory = (double *) malloc(np * nLevels * sizeof(double));
+        rankLargestMap = (double *) malloc(np * sizeof(double));
+        rankBuffers = (double *) malloc(np * sizeof(double));
+        memset(rankNodes, 0, np * nLevels * sizeof(double));
+        memset(rankSprings, 0, np * nLevels * sizeof(double));
+        memset(rankSent, 0, np * nLevels * sizeof(double));
+        memset(rankReceived, 0, np * nLevels * sizeof(double));
+        memset(rankMemory, 0, np * sizeof(double));
+        memset(rankLevelMemory, 0, np * nLevels * sizeof(double));
+        memset(rankLargestMap, 0, np * sizeof(double));
+        memset(rankBuffers, 0, np * sizeof(double));
+        sent = (unsigned char *) malloc(nImages * np);
+        memset(sent, 0, nImages * np);
+
+        /* the node arrays of the owned images, and the intra-image
+           springs, of which there are at most 4 per node, at each level */
+        nodeBytes = 3 * sizeof(Node) + 2;
+        if (solver == SOLVER_CG)
+                nodeBytes += 2 * sizeof(Force);
+        if (activeThreshold > 0.0)
+                nodeBytes += sizeof(Node);
+        if (foldTolerance > 0.0)
+                nodeBytes += sizeof(Node) + 1;
+        for (i = 0; i < nImages; ++i)
+        {
+                for (lvl = 0; lvl < nLevels; ++lvl)
+                {
+                        factor = 1 << (startLevel - lvl);
+                        n = ((images[i].width + factor - 1) / factor + 1) *
+                            ((images[i].height + factor - 1) / factor + 1);
+                        imageNodes[i * nLevels + lvl] = n;
+                        rankNodes[images[i].owner * nLevels + lvl] += n;
+                        rankLevelMemory[images[i].owner * nLevels + lvl] +=
+                                4 * n * sizeof(IntraImageSpring);
+                }
+                rankMemory[images[i].owner] += nodeBytes * imageNodes[i * nLevels + nLevels - 1];
+        }
+
+        /* the inter-image springs are made for the nodes of the source
+           image that fall within the extent of the map; both processes
+           of a map that crosses a boundary hold and evaluate it, unless
+           the reaction forces are exchanged instead */
+        nPlanMaps = 0;
+        mapNamesPos = 0;
+        for (k = 0; k < nMaps; ++k)
+        {
+                name0 = &mapNames[mapNamesPos];
+                mapNamesPos += strlen(name0) + 1;
+                name1 = &mapNames[mapNamesPos];
+                mapNamesPos += strlen(name1) + 1;
+                pairName = &mapNames[mapNamesPos];
+                mapNamesPos += strlen(pairName) + 1;
+
+                image0 = -1;
+                hv = Hash(name0) % nImages;
+                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                        if (strcmp(images[j].name, name0) == 0)
+                        {
+                                image0 = j;
+                                break;
+                        }
+                if (image0 < 0)
+                        Error("Could not find source image for map %s\n", pairName);
+                image1 = -1;
+                hv = Hash(name1) % nImages;
+                for (j = imageHashTable[hv]; j >= 0; j = images[j].next)
+                        if (strcmp(images[j].name, name1) == 0)
+                        {
+                                image1 = j;
+                                break;
+                        }
+                if (image1 < 0)
+                        Error("Could not find destination image for map %s\n", pairName);
+                if ((realignName[0] != '\0' || windowSize > 0) &&
+                    images[image0].fixed && images[image1].fixed)
+                        continue;
+                ++nPlanMaps;
+
+                if (snprintf(fn, PATH_MAX, "%s%s.map",
+                             mapsName, pairName) >= PATH_MAX)
+                        Error("Map path %s%s.map is too long\n",
+                              mapsName, pairName);
+                if (!ReadMapHeader(fn, &mLevel, &mw, &mh, &mxMin, &myMin,
+                                   imName0, imName1, msg))
+                        Error("Could not read map %s:\n  error: %s\n", fn, msg);
+                mFactor = 1 << mLevel;
+                xMin = (double) mxMin * mFactor;
+                xMax = (double) (mxMin + mw - 1) * mFactor;
+                yMin = (double) myMin * mFactor;
+                yMax = (double) (myMin + mh - 1) * mFactor;
+
+                owner0 = images[image0].owner;
+                owner1 = images[image1].owner;
+
+                /* the map and the distance array ReadMapSpringData
+                   makes from it */
+                factor = 1 << startLevel;
+                mapBytes = (double) mw * mh * sizeof(MapElement) +
+                           (((images[image0].width + factor - 1) / factor) *
+                            factor / mFactor + 1.0) *
+                           (((images[image0].height + factor - 1) / factor) *
+                            factor / mFactor + 1.0) * sizeof(float);
+                if (mapBytes > rankLargestMap[owner0])
+                        rankLargestMap[owner0] = mapBytes;
+                if (owner1 != owner0 && !reactionForces &&
+                    mapBytes > rankLargestMap[owner1])
+                        rankLargestMap[owner1] = mapBytes;
+
+                for (lvl = 0; lvl < nLevels; ++lvl)
+                {
+                        factor = 1 << (startLevel - lvl);
+                        nx = (images[image0].width + factor - 1) / factor + 1;
+                        ny = (images[image0].height + factor - 1) / factor + 1;
+                        cx = (int) floor(xMax / factor);
+                        if (cx > nx - 1)
+                                cx = nx - 1;
+                        cx -= xMin > 0.0 ? (int) ceil(xMin / factor) : 0;
+                        cy = (int) floor(yMax / factor);
+                        if (cy > ny - 1)
+                                cy = ny - 1;
+                        cy -= yMin > 0.0 ? (int) ceil(yMin / factor) : 0;
+                        springs = (cx >= 0 && cy >= 0) ? (cx + 1.0) * (cy + 1.0) : 0.0;
+                        rankSprings[owner0 * nLevels + lvl] += springs;
+                        rankLevelMemory[owner0 * nLevels + lvl] +=
+                                springs * sizeof(InterImageSpring);
+                        if (owner1 != owner0 && !reactionForces)
+                        {
+                                rankSprings[owner1 * nLevels + lvl] += springs;
+                                rankLevelMemory[owner1 * nLevels + lvl] +=
+                                        springs * sizeof(InterImageSpring);
+                        }
+                }
+                if (owner1 != owner0)
+                {
+                        sent[image1 * np + owner0] = 1;
+                        if (!reactionForces)
+                                sent[image0 * np + owner1] = 1;
+                }
+        }
+
+        /* positions of the images needed by other processes, and
+           the reaction forces coming back, at each iteration */
+        for (i = 0; i < nImages; ++i)
+                for (k = 0; k < np; ++k)
+                {
+                        if (!sent[i * np + k])
+                                continue;
+                        for (lvl = 0; lvl < nLevels; ++lvl)
+                        {
+                                n = 2 * sizeof(float) * imageNodes[i * nLevels + lvl];
+                                if (reactionForces)
+                                        n *= 2;
+                                rankSent[images[i].owner * nLevels + lvl] += n;
+                                rankReceived[k * nLevels + lvl] += n;
+                        }
+                        n = imageNodes[i * nLevels + nLevels - 1];
+                        rankMemory[k] += sizeof(Node) * n;
+                        if (reactionForces)
+                                rankMemory[k] += sizeof(Force) * n;
+                        n *= 2 * sizeof(float);
+                        if (nonblockingComm || reactionForces)
+                        {
+                                rankBuffers[images[i].owner] += n;
+                                rankBuffers[k] += n;
+                        }
+                }
+        for (k = 0; k < np; ++k)
+                rankMemory[k] += rankBuffers[k] + 4096 * 1024 * sizeof(float);
+
+        for (lvl = 0; lvl < nLevels; ++lvl)
+        {
+                level = startLevel - lvl;
+                totalNodes = 0.0;
+                totalSprings = 0.0;
+                totalSent = 0.0;
+                maxNodes = 0.0;
+                maxSprings = 0.0;
+                maxSent = 0.0;
+                maxReceived = 0.0;
+                for (k = 0; k < np; ++k)
+                {
+                        totalNodes += rankNodes[k * nLevels + lvl];
+                        totalSprings += rankSprings[k * nLevels + lvl];
+                        totalSent += rankSent[k * nLevels + lvl];
+                        if (rankNodes[k * nLevels + lvl] > maxNodes)
+                                maxNodes = rankNodes[k * nLevels + lvl];
+                        if (rankSprings[k * nLevels + lvl] > maxSprings)
+                                maxSprings = rankSprings[k * nLevels + lvl];
+                        if (rankSent[k * nLevels + lvl] > maxSent)
+                                maxSent = rankSent[k * nLevels + lvl];
+                        if (rankReceived[k * nLevels + lvl] > maxReceived)
+                                maxReceived = rankReceived[k * nLevels + lvl];
+                }
+                Log("Level %d: %.0f nodes (at most %.0f per process), %.0f inter-image springs evaluated (at most %.0f per process)\n",
+                    level, totalNodes, maxNodes, totalSprings, maxSprings);
+                Log("Level %d: %.3f MB exchanged per iteration (at most %.3f MB sent and %.3f MB received per process)\n",
+                    level, totalSent / 1048576.0, maxSent / 1048576.0, maxReceived / 1048576.0);
+        }
+
+        maxMemory = 0.0;
+        maxMemoryRank = 0;
+        for (k = 0; k < np; ++k)
+        {
+                levelMemory = 0.0;
+                peakLevel = endLevel;
+                for (lvl = 0; lvl < nLevels; ++lvl)
+                        if (rankLevelMemory[k * nLevels + lvl] > levelMemory)
+                        {
+                                levelMemory = rankLevelMemory[k * nLevels + lvl];
+                                peakLevel = startLevel - lvl;
+                        }
+                Log("Process %d: about %.1f MB of nodes and buffers, %.1f MB of springs at level %d, and %.1f MB for the largest map\n",
+                    k, rankMemory[k] / 1048576.0, levelMemory / 1048576.0,
+                    peakLevel, rankLargestMap[k] / 1048576.0);
+                rankMemory[k] += levelMemory + rankLargestMap[k];
+                if (rankMemory[k] > maxMemory)
+                {
+                        maxMemory = rankMemory[k];
+                        maxMemoryRank = k;
+                }
+        }
+        Log("Largest estimated memory is %.1f MB on process %d (%d maps)\n",
+            maxMemory / 1048576.0, maxMemoryRank, nPlanMaps);
+
+        free(imageNodes);
+        free(rankNodes);
+        free(rankSprings);
+        free(rankSent);
+        free(rankReceived);
+        free(rankMemory);
+        free(rankLevelMemory);
+        free(rankLargestMap);
+        free(rankBuffers);
+        free(sent);
+        np = runProcesses;
+}
+
+void
+PlanCommunications (int level)
+{
+        int phase;
+        CommPhase *cp;
+        int bufferPos;
+        int i, j, k;
+        int nFloats;
+
+        Log("Planning communication for level %d\n", level);
+        nCommRequests = 0;
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                // schedule the communication of positions between processors
+                cp = &(commPhases[phase]);
+
+                // release the message buffers of the previous level
+                if (cp->sendBuffers != NULL)
+                        for (i = 0; i < cp->nSends; ++i)
+                                free(cp->sendBuffers[i]);
+                if (cp->receiveBuffers != NULL)
+                        for (i = 0; i < cp->nReceives; ++i)
+                                free(cp->receiveBuffers[i]);
+
+                // first, the sends
+                cp->nSends = 0;
+                bufferPos = 0;
+                k = 0;
+                for (i = 0; i < cp->nSendImages; ++i)
+                {
+                        j = cp->sendImages[i];
+                        nFloats = images[j].nx * images[j].ny * 2;
+                        if (bufferPos + nFloats > bufferSize)
+                        {
+                                ++(cp->nSends);
+                                cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
+                                                                    cp->nSends * sizeof(int));
+                                cp->nImagesToSend[cp->nSends-1] = k;
+                                cp->floatsToSend = (int *) realloc(cp->floatsToSend,
+                                                                   cp->nSends * sizeof(int));
+                                cp->floatsToSend[cp->nSends-1] = bufferPos;
+                                Log("In phase %d will send %d images to %d in a message of %d floats\n",
+                                    phase, k, cp->otherProcess, bufferPos);
+                                k = 0;
+                                bufferPos = 0;
+                        }
+                        bufferPos += nFloats;
+                        ++k;
+                }
+                if (k > 0)
+                {
+                        ++(cp->nSends);
+                        cp->nImagesToSend = (int *) realloc(cp->nImagesToSend,
+                                                            cp->nSends * sizeof(int));
+                        cp->nImagesToSend[cp->nSends-1] = k;
+                        cp->floatsToSend = (int *) realloc(cp->floatsToSend,
+                                                           cp->nSends * sizeof(int));
+                        cp->floatsToSend[cp->nSends-1] = bufferPos;
+                        Log("In phase %d will send %d images to %d in a final message of %d floats\n",
+                            phase, k, cp->otherProcess, bufferPos);
+                }
+
+                // next, the receives
+                cp->nReceives = 0;
+                bufferPos = 0;
+                k = 0;
+                for (i = 0; i < cp->nReceiveImages; ++i)
+                {
+                        j = cp->receiveImages[i];
+                        nFloats = images[j].nx * images[j].ny * 2;
+                        if (bufferPos + nFloats > bufferSize)
+                        {
+                                ++(cp->nReceives);
+                                cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
+                                                                      cp->nReceives * sizeof(int));
+                                cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
+                                                                       cp->nReceives * sizeof(int));
+                                cp->floatsToReceive[cp->nReceives-1] = bufferPos;
+                                cp->nImagesToReceive[cp->nReceives-1] = k;
+                                Log("In phase %d will receive %d images from %d in a message of %d floats\n",
+                                    phase, k, cp->otherProcess, bufferPos);
+                                k = 0;
+                                bufferPos = 0;
+                        }
+                        bufferPos += nFloats;
+                        ++k;
+                }
+                if (k > 0)
+                {
+                        ++(cp->nReceives);
+                        cp->floatsToReceive = (int *) realloc(cp->floatsToReceive,
+                                                              cp->nReceives * sizeof(int));
+                        cp->nImagesToReceive = (int *) realloc(cp->nImagesToReceive,
+                                                               cp->nReceives * sizeof(int));
+                        cp->floatsToReceive[cp->nReceives-1] = bufferPos;
+                        cp->nImagesToReceive[cp->nReceives-1] = k;
+                        Log("In phase %d will receive %d images from %d in a final message of %d floats\n",
+                            phase, k, cp->otherProcess, bufferPos);
+                }
+
+                if (nonblockingComm)
+                {
+                        /* every message in flight needs its own buffer */
+                        cp->sendBuffers = (float **) realloc(cp->sendBuffers,
+                                                             (cp->nSends + 1) * sizeof(float *));
+                        for (i = 0; i < cp->nSends; ++i)
+                                cp->sendBuffers[i] = (float *) malloc(cp->floatsToSend[i] *
+                                                                      sizeof(float));
+                        cp->receiveBuffers = (float **) realloc(cp->receiveBuffers,
+                                                                (cp->nReceives + 1) * sizeof(float *));
+                        for (i = 0; i < cp->nReceives; ++i)
+                                cp->receiveBuffers[i] = (float *) malloc(cp->floatsToReceive[i] *
+                                                                         sizeof(float));
+                        nCommRequests += cp->nSends + cp->nReceives;
+                }
+        }
+        if (nonblockingComm)
+                commRequests = (MPI_Request *) realloc(commRequests,
+                                                       (nCommRequests + 1) * sizeof(MPI_Request));
+
+        if (reactionForces)
+        {
+                /* the reaction forces go back the way the positions came,
+                   in messages of the same sizes */
+                nReactionRequests = 0;
+                for (phase = 0; phase < nPhases; ++phase)
+                {
+                        cp = &(commPhases[phase]);
+                        nFloats = 0;
+                        for (i = 0; i < cp->nReceiveImages; ++i)
+                        {
+                                j = cp->receiveImages[i];
+                                nFloats += images[j].nx * images[j].ny * 2;
+                                free(images[j].forces);
+                                images[j].forces = (Force *) malloc(images[j].nx * images[j].ny *
+                                                                    sizeof(Force));
+                        }
+                        cp->reactionSendBuffer = (float *) realloc(cp->reactionSendBuffer,
+                                                                   (nFloats + 1) * sizeof(float));
+                        nFloats = 0;
+                        for (i = 0; i < cp->nSendImages; ++i)
+                        {
+                                j = cp->sendImages[i];
+                                nFloats += images[j].nx * images[j].ny * 2;
+                        }
+                        cp->reactionReceiveBuffer = (float *) realloc(cp->reactionReceiveBuffer,
+                                                                      (nFloats + 1) * sizeof(float));
+                        nReactionRequests += cp->nSends + cp->nReceives;
+                }
+                reactionRequests = (MPI_Request *) realloc(reactionRequests,
+                                                           (nReactionRequests + 1) *
+                                                           sizeof(MPI_Request));
+        }
+}
+
+/* clear the reaction forces on the images received from other
+   processes before the maps are evaluated */
+void
+ClearReactionForces ()
+{
+        int phase;
+        int i, j;
+        CommPhase *cp;
+
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                for (i = 0; i < cp->nReceiveImages; ++i)
+                {
+                        j = cp->receiveImages[i];
+                        memset(images[j].forces, 0,
+                               images[j].nx * images[j].ny * sizeof(Force));
+                }
+        }
+}
+
+/* send the forces that the maps evaluated here exert on images of
+   other processes to their owners, and add the forces that other
+   processes computed on our images */
+void
+ExchangeReactionForces ()
+{
+        int phase;
+        int i, k;
+        int nr;
+        int pos;
+        int its;
+        int nNodes;
+        Force *forces;
+        float *buf;
+        CommPhase *cp;
+
+        nr = 0;
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                if (cp->otherProcess < 0)
+                        continue;
+                pos = 0;
+                for (i = 0; i < cp->nSends; ++i)
+                {
+                        if (MPI_Irecv(cp->reactionReceiveBuffer + pos, cp->floatsToSend[i],
+                                      MPI_FLOAT, cp->otherProcess, 1, MPI_COMM_WORLD,
+                                      &reactionRequests[nr++]) != MPI_SUCCESS)
+                                Error("Could not receive reaction forces from process %d\n",
+                                      cp->otherProcess);
+                        pos += cp->floatsToSend[i];
+                }
+        }
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                if (cp->otherProcess < 0)
+                        continue;
+                buf = cp->reactionSendBuffer;
+                pos = 0;
+                for (i = 0; i < cp->nReceiveImages; ++i)
+                {
+                        its = cp->receiveImages[i];
+                        nNodes = images[its].nx * images[its].ny;
+                        forces = images[its].forces;
+                        for (k = 0; k < nNodes; ++k)
+                        {
+                                buf[pos++] = forces[k].fx;
+                                buf[pos++] = forces[k].fy;
+                        }
+                }
+                pos = 0;
+                for (i = 0; i < cp->nReceives; ++i)
+                {
+                        if (MPI_Isend(buf + pos, cp->floatsToReceive[i], MPI_FLOAT,
+                                      cp->otherProcess, 1, MPI_COMM_WORLD,
+                                      &reactionRequests[nr++]) != MPI_SUCCESS)
+                                Error("Could not send reaction forces to process %d\n",
+                                      cp->otherProcess);
+                        pos += cp->floatsToReceive[i];
+                }
+        }
+        if (MPI_Waitall(nr, reactionRequests, MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+                Error("Could not complete the exchange of reaction forces.\n");
+        if (telemetryFile != NULL)
+                for (phase = 0; phase < nPhases; ++phase)
+                {
+                        cp = &(commPhases[phase]);
+                        if (cp->otherProcess < 0)
+                                continue;
+                        for (i = 0; i < cp->nReceives; ++i)
+                                TelemetryBytes(TM_COMM, cp->floatsToReceive[i] * sizeof(float), 0.0);
+                        for (i = 0; i < cp->nSends; ++i)
+                                TelemetryBytes(TM_COMM, 0.0, cp->floatsToSend[i] * sizeof(float));
+                }
+
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                if (cp->otherProcess < 0)
+                        continue;
+                buf = cp->reactionReceiveBuffer;
+                pos = 0;
+                for (i = 0; i < cp->nSendImages; ++i)
+                {
+                        its = cp->sendImages[i];
+                        nNodes = images[its].nx * images[its].ny;
+                        forces = images[its].forces;
+                        for (k = 0; k < nNodes; ++k)
+                        {
+                                forces[k].fx += buf[pos++];
+                                forces[k].fy += buf[pos++];
+                        }
+                }
+        }
+}
+
+
+void
+CommunicatePositions (int level)
+{
+        /* communicate image positions to other nodes */
+        //      (min(a,b) / sep) & 1 == 0  : first phase
+        //      (min(a,b) / sep) & 1 == 1  : second phase
+
+        //	  0-1,2-3,4-5,6-7,8-9,10-11,12-13      0,2,4,6,8,10,12
+        //        1-2,3-4,5-6,7-8,9-10,11-12,13-14   1,3,5,7,9,11,13
+        //      sep 1,
+
+        //      0-2,1-3,4-6,5-7,8-10,9-11,12-14      0,1,4,5,8,9,12
+        //      2-4,3-5,6-8,7-9,10-12,11-13          2,3,6,7,10,11
+        //      sep 2
+
+        //      0-3,1-4,2-5,6-9,7-10,8-11            0,1,2,6,7,8
+        //      3-6,4-7,5-8,9-12,10-13,11-14         3,4,5,9,10,11
+
+        //      0-4,1-5,2-6,3-7,8-12,9-13,10-14
+        //      4-8,5-9,6-10,7-11
+
+        //      0-5,1-6,2-7,3-8,4-9
+        //      5-10,6-11,7-12,8-13,9-14
+
+        //      0-6,1-7,2-8,3-9,4-10,5-11
+        //      6-12,7-13,8-14
+
+        //      0-7,1-8,2-9,3-10,4-11,5-12,6-13
+        //      7-14
+
+        //      0-8,1-9,2-10,3-11,4-12,5-13,6-14
+        //      none
+
+        //      0-9,1-10,2-11,3-12,4-13,5-14
+        //      none
+
+        //      0-10,1-11,2-12,3-13,4-14
+        //      none
+
+        //      0-11,1-12,2-13,3-14
+        //      none
+
+        //      0-12,1-13,2-14
+        //      none
+
+        //      0-13,1-14
+        //      none
+
+        //      0-14
+        //      none
+        int phase;
+        int op;
+        int subPhase;
+        int i, j, k;
+        int jj;
+        int bufferPos;
+        int nNodes;
+        int its;
+        Node *nodes;
+        MPI_Status status;
+
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                if (MPI_Barrier(MPI_COMM_WORLD) != MPI_SUCCESS)
+                        Error("MPI_Barrier() failed.\n");
+                op = commPhases[phase].otherProcess;
+                if (op < 0)
+                        continue;
+                for (subPhase = 0; subPhase < 2; ++subPhase)
+                {
+                        if (subPhase ^ (p < op))
+                        {
+                                /* send */
+                                jj = 0;
+                                for (i = 0; i < commPhases[phase].nSends; ++i)
+                                {
+                                        bufferPos = 0;
+                                        for (j = 0; j < commPhases[phase].nImagesToSend[i]; ++j, ++jj)
+                                        {
+                                                its = commPhases[phase].sendImages[jj];
+                                                nNodes = images[its].nx * images[its].ny;
+                                                nodes = images[its].nodes;
+                                                for (k = 0; k < nNodes; ++k)
+                                                {
+                                                        buffer[bufferPos++] = nodes[k].x;
+                                                        buffer[bufferPos++] = nodes[k].y;
+                                                }
+                                        }
+                                        if (MPI_Send(buffer, bufferPos, MPI_FLOAT,
+                                                     op, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+                                                Error("Could not send to process %d\n", op);
+                                }
+                        }
+                        else
+                        {
+                                /* receive */
+                                jj = 0;
+                                for (i = 0; i < commPhases[phase].nReceives; ++i)
+                                {
+                                        if (MPI_Recv(buffer, commPhases[phase].floatsToReceive[i], MPI_FLOAT,
+                                                     op, 0, MPI_COMM_WORLD, &status) != MPI_SUCCESS)
+                                                Error("Could not receive from process %d\n", op);
+                                        bufferPos = 0;
+                                        for (j = 0; j < commPhases[phase].nImagesToReceive[i]; ++j, ++jj)
+                                        {
+                                                its = commPhases[phase].receiveImages[jj];
+                                                nNodes = images[its].nx * images[its].ny;
+                                                nodes = images[its].nodes;
+                                                for (k = 0; k < nNodes; ++k)
+                                                {
+                                                        nodes[k].x =  buffer[bufferPos++];
+                                                        nodes[k].y =  buffer[bufferPos++];
+                                                }
+                                        }
+                                }
+                        }
+                }
+        }
+}
+
+void
+StartCommunication (int level)
+{
+        int phase;
+        int op;
+        int i, j, k;
+        int jj;
+        int nr;
+        int bufferPos;
+        int nNodes;
+        int its;
+        Node *nodes;
+        float *buf;
+        CommPhase *cp;
+
+        if (telemetryFile != NULL)
+                for (phase = 0; phase < nPhases; ++phase)
+                {
+                        cp = &(commPhases[phase]);
+                        if (cp->otherProcess < 0)
+                                continue;
+                        for (i = 0; i < cp->nSends; ++i)
+                                TelemetryBytes(TM_COMM, cp->floatsToSend[i] * sizeof(float), 0.0);
+                        for (i = 0; i < cp->nReceives; ++i)
+                                TelemetryBytes(TM_COMM, 0.0, cp->floatsToReceive[i] * sizeof(float));
+                }
+
+        if (!nonblockingComm)
+        {
+                CommunicatePositions(level);
+                return;
+        }
+
+        /* post all the receives first, so that the sends can
+           complete as soon as possible */
+        nr = 0;
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                op = cp->otherProcess;
+                if (op < 0)
+                        continue;
+                for (i = 0; i < cp->nReceives; ++i)
+                        if (MPI_Irecv(cp->receiveBuffers[i], cp->floatsToReceive[i], MPI_FLOAT,
+                                      op, 0, MPI_COMM_WORLD, &commRequests[nr++]) != MPI_SUCCESS)
+                                Error("Could not post receive from process %d\n", op);
+        }
+
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                op = cp->otherProcess;
+                if (op < 0)
+                        continue;
+                jj = 0;
+                for (i = 0; i < cp->nSends; ++i)
+                {
+                        buf = cp->sendBuffers[i];
+                        bufferPos = 0;
+                        for (j = 0; j < cp->nImagesToSend[i]; ++j, ++jj)
+                        {
+                                its = cp->sendImages[jj];
+                                nNodes = images[its].nx * images[its].ny;
+                                nodes = images[its].nodes;
+                                for (k = 0; k < nNodes; ++k)
+                                {
+                                        buf[bufferPos++] = nodes[k].x;
+                                        buf[bufferPos++] = nodes[k].y;
+                                }
+                        }
+                        if (MPI_Isend(buf, bufferPos, MPI_FLOAT,
+                                      op, 0, MPI_COMM_WORLD, &commRequests[nr++]) != MPI_SUCCESS)
+                                Error("Could not send to process %d\n", op);
+                }
+        }
+        commPending = 1;
+}
+
+/* combine the per-iteration values of all processes in one
+   reduction: the maximum force, the total energy, and the union
+   of the control flags */
+void
+ReduceIterationSums (void *in, void *inout, int *len, MPI_Datatype *type)
+{
+        double *a = (double *) in;
+        double *b = (double *) inout;
+        int i;
+
+        for (i = 0; i + 2 < *len; i += 3)
+        {
+                if (a[i] > b[i])
+                        b[i] = a[i];
+                b[i+1] += a[i+1];
+                b[i+2] = (double) ((int) a[i+2] | (int) b[i+2]);
+        }
+}
+
+void
+DiscardReduction ()
+{
+        if (reductionPending &&
+            MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+                Error("Could not complete reduction of iteration sums.\n");
+        reductionPending = 0;
+}
+
+void
+WriteCheckpoint (int level, Checkpoint *ckpt)
+{
+        char fn[PATH_MAX];
+        char tmpName[PATH_MAX];
+        FILE *f;
+        int i;
+        int nNodes;
+        int ok;
+        InterImageMap *m;
+        int lvl;
+
+        /* a lagged reduction that is in flight is completed
+           here and its result saved along with everything else */
+        ckpt->reductionPending = reductionPending;
+        if (reductionPending)
+        {
+                if (MPI_Wait(&reduceRequest, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+                        Error("Could not complete reduction of iteration sums.\n");
+                memcpy(ckpt->reduced, reduceReceive, 3 * sizeof(double));
+        }
+
+        memcpy(ckpt->magic, "ACK1", 4);
+        ckpt->np = np;
+        ckpt->p = p;
+        ckpt->level = level;
+        ckpt->firstImage = myFirstImage;
+        ckpt->lastImage = myLastImage;
+        ckpt->nMaps = nMaps;
+        ckpt->hasInitialNodes = foldRecovery > 0;
+
+        /* write to a temporary file first so that a failure
+           while writing leaves the previous checkpoint intact */
+        if (snprintf(fn, PATH_MAX, "%s.%.2d.ckpt",
+                     checkpointName, p) >= PATH_MAX ||
+            snprintf(tmpName, PATH_MAX, "%s.tmp", fn) >= PATH_MAX)
+                Error("Checkpoint name %s is too long\n", checkpointName);
+        if (!CreateDirectories(tmpName))
+                Error("Could not create directories for checkpoint file %s\n", tmpName);
+        f = fopen(tmpName, "wb");
+        if (f == NULL)
+                Error("Could not open checkpoint file %s\n", tmpName);
+        ok = fwrite(ckpt, sizeof(Checkpoint), 1, f) == 1;
+        for (i = myFirstImage; ok && i <= myLastImage; ++i)
+        {
+                nNodes = images[i].nx * images[i].ny;
+                ok = fwrite(images[i].nodes, sizeof(Node), nNodes, f) == nNodes &&
+                     (!ckpt->hasInitialNodes ||
+                      fwrite(images[i].initialNodes, sizeof(Node), nNodes, f) == nNodes);
+        }
+        lvl = startLevel - level;
+        for (i = 0; ok && i < nMaps; ++i)
+        {
+                m = &maps[i];
+                ok = fwrite(&(m->k), sizeof(float), 1, f) == 1 &&
+                     fwrite(m->springs[lvl], sizeof(InterImageSpring),
+                            m->nSprings[lvl], f) == m->nSprings[lvl];
+        }
+        if (fclose(f) != 0 || !ok)
+                Error("Could not write checkpoint file %s\n", tmpName);
+        if (rename(tmpName, fn) != 0)
+                Error("Could not rename checkpoint file %s to %s\n", tmpName, fn);
+        if (p == 0)
+                Log("Wrote checkpoint at step %d iteration %d\n", ckpt->step, ckpt->iter);
+}
+
+/* read the header of this process's checkpoint file, and check that
+   all processes are resuming from the same point */
+void
+OpenCheckpoint ()
+{
+        char fn[PATH_MAX];
+        int local[2], lo[2], hi[2];
+
+        if (snprintf(fn, PATH_MAX, "%s.%.2d.ckpt",
+                     checkpointName, p) >= PATH_MAX)
+                Error("Checkpoint name %s is too long\n", checkpointName);
+        checkpointFile = fopen(fn, "rb");
+        if (checkpointFile == NULL)
+                Error("Could not open checkpoint file %s\n", fn);
+        if (fread(&checkpoint, sizeof(Checkpoint), 1, checkpointFile) != 1 ||
+            memcmp(checkpoint.magic, "ACK1", 4) != 0)
+                Error("Checkpoint file %s is not valid\n", fn);
+        if (checkpoint.np != np || checkpoint.p != p ||
+            checkpoint.firstImage != myFirstImage ||
+            checkpoint.lastImage != myLastImage ||
+            checkpoint.nMaps != nMaps)
+                Error("Checkpoint file %s was written with a different process layout\n", fn);
+        if (checkpoint.step >= nSteps)
+                Error("Checkpoint file %s is for step %d, but there are only %d steps\n",
+                      fn, checkpoint.step, nSteps);
+
+        local[0] = checkpoint.step;
+        local[1] = checkpoint.iter;
+        if (MPI_Allreduce(local, lo, 2, MPI_INT, MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Allreduce(local, hi, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Could not compare checkpoints.\n");
+        if (lo[0] != hi[0] || lo[1] != hi[1])
+                Error("Checkpoint files are from different iterations; the run was probably interrupted while writing them.\n");
+        if (p == 0)
+                Log("Resuming from checkpoint at step %d iteration %d\n",
+                    checkpoint.step, checkpoint.iter);
+}
+
+void
+LoadCheckpoint (int level)
+{
+        int i;
+        int nNodes;
+        int ok;
+        InterImageMap *m;
+        int lvl;
+
+        if (checkpoint.level != level)
+                Error("Checkpoint is for level %d, but step %d is at level %d\n",
+                      checkpoint.level, checkpoint.step, level);
+        ok = 1;
+        for (i = myFirstImage; ok && i <= myLastImage; ++i)
+        {
+                nNodes = images[i].nx * images[i].ny;
+                ok = fread(images[i].nodes, sizeof(Node), nNodes,
+                           checkpointFile) == nNodes;
+                if (ok && checkpoint.hasInitialNodes)
+                {
+                        images[i].initialNodes = (Node *) realloc(images[i].initialNodes,
+                                                                  nNodes * sizeof(Node));
+                        ok = fread(images[i].initialNodes, sizeof(Node), nNodes,
+                                   checkpointFile) == nNodes;
+                }
+        }
+        lvl = startLevel - level;
+        for (i = 0; ok && i < nMaps; ++i)
+        {
+                m = &maps[i];
+                ok = fread(&(m->k), sizeof(float), 1, checkpointFile) == 1 &&
+                     fread(m->springs[lvl], sizeof(InterImageSpring),
+                           m->nSprings[lvl], checkpointFile) == m->nSprings[lvl];
+        }
+        if (!ok)
+                Error("Checkpoint file is truncated\n");
+        fclose(checkpointFile);
+        checkpointFile = NULL;
+
+        reductionPending = checkpoint.reductionPending;
+        reduceRequest = MPI_REQUEST_NULL;
+        memcpy(reduceReceive, checkpoint.reduced, 3 * sizeof(double));
+}
+
+void
+ProgressCommunication ()
+{
+        int flag;
+
+        /* give the MPI library a chance to move the messages
+           along; only the main thread may call this */
+        if (commPending &&
+            MPI_Testall(nCommRequests, commRequests, &flag,
+                        MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+                Error("MPI_Testall failed.\n");
+}
+
+void
+FinishCommunication (int level)
+{
+        int phase;
+        int i, j, k;
+        int jj;
+        int bufferPos;
+        int nNodes;
+        int its;
+        Node *nodes;
+        float *buf;
+        CommPhase *cp;
+
+        if (!commPending)
+                return;
+        if (MPI_Waitall(nCommRequests, commRequests,
+                        MPI_STATUSES_IGNORE) != MPI_SUCCESS)
+                Error("Could not complete the exchange of positions.\n");
+        for (phase = 0; phase < nPhases; ++phase)
+        {
+                cp = &(commPhases[phase]);
+                if (cp->otherProcess < 0)
+                        continue;
+                jj = 0;
+                for (i = 0; i < cp->nReceives; ++i)
+                {
+                        buf = cp->receiveBuffers[i];
+                        bufferPos = 0;
+                        for (j = 0; j < cp->nImagesToReceive[i]; ++j, ++jj)
+                        {
+                                its = cp->receiveImages[jj];
+                                nNodes = images[its].nx * images[its].ny;
+                                nodes = images[its].nodes;
+                                for (k = 0; k < nNodes; ++k)
+                                {
+                                        nodes[k].x = buf[bufferPos++];
+                                        nodes[k].y = buf[bufferPos++];
+                                }
+                        }
+                }
+        }
+        commPending = 0;
+}
+
+unsigned int
+Hash (char *s)
+{
+        unsigned int v = 0;
+        char *p = s;
+        while (*p != '\0')
+                v = 37 * v + *p++;
+        return(v);
+}
+
+unsigned int
+HashMap (char *s, int nx, int ny)
+{
+        unsigned int v = 0;
+        char *p = s;
+        while (*p != '\0')
+                v = 37 * v + *p++;
+        v = 37 * v + nx;
+        v = 37 * v + ny;
+        return(v);
+}
+
+int
+CreateDirectories (char *fn)
+{
+        int pos;
+        char dn[PATH_MAX];
+        char *slash;
+        int len;
+        struct stat statBuf;
+        int hv;
+        int i;
+
+        for (pos = 0;
+             (slash = strchr(&fn[pos], '/')) != NULL;
+             pos = len + 1)
+        {
+                len = slash - fn;
+                if (len == 0)
+                        continue;
+                strncpy(dn, fn, len);
+                dn[len] = '\0';
+
+                /* check if in hash table */
+                hv = 0;
+                for (i = 0; i < len; ++i)
+                        hv = 239*hv + dn[i];
+                hv &= DIR_HASH_SIZE-1;
+                i = hv;
+                while (dirHash[i] != NULL)
+                {
+                        if (strcmp(dirHash[i], dn) == 0)
+                                break;
+                        i = (i + 1) & (DIR_HASH_SIZE-1);
+                        if (i == hv)
+                        {
+                                Log("Directory hash table is full!\n");
+                                return(0);
+                        }
+                }
+                if (dirHash[i] != NULL)
+                        continue;
+                dirHash[i] = (char *) malloc(strlen(dn)+1);
+                strcpy(dirHash[i], dn);
+
+                if (stat(dn, &statBuf) == 0)
+                {
+                        if (S_ISDIR(statBuf.st_mode) ||
+                            S_ISLNK(statBuf.st_mode))
+                                continue;
+                        Log("Output path component %s is not a directory\n", dn);
+                        return(0);
+                }
+                if (errno != ENOENT)
+                {
+                        Log("Could not stat directory %s\n", dn);
+                        return(0);
+                }
+
+                if (mkdir(dn, 0775) != 0 && errno != EEXIST)
+                {
+                        Log("Could not create directory %s\n", dn);
+                        return(0);
+                }
+        }
+        return(1);
+}
+
+int
+CheckForFolds (int level, int iter)
+{
+        int i;
+        int t;
+        int nx;
+        int x, y;
+        Node *nodes;
+        int ix, iy;
+        int processWithFold;
+
+        RunThreads(FoldCheckTask, NULL);
+        foldNodesValid = foldTolerance > 0.0;
+
+        /* the threads have contiguous blocks of images in order, so
+           the first thread to find a fold found the same one as a
+           serial scan would */
+        foldImage = nImages;
+        for (t = 0; t < nThreads; ++t)
+                if (threadFoldImage[t] >= 0)
+                        break;
+        if (t == nThreads)
+                goto globalFoldCheck;
+        i = threadFoldImage[t];
+        nx = images[i].nx;
+        nodes = images[i].nodes;
+        x = threadFoldNode[t] % nx;
+        y = threadFoldNode[t] / nx;
+
+        foldImage = i;
+        foldWidth = (1 << level) * 32;
+        foldHeight = (1 << level) * 32;
+        foldX = (1 << level) * x;
+        foldY = (1 << level) * y;
+        foldAbsoluteX = nodes[y * nx + x].x;
+        foldAbsoluteY = nodes[y * nx + x].y;
+        Log("Fold detected in map of image %s at (%f %f) (%d(%d %d)) at iteration %d\n",
+            images[i].name,
+            (1 << level) * ((double) x), (1 << level) * ((double) y),
+            level, x, y, iter);
+#if 0
+        Log("DUMPING FOLDED MAP for %s:\n", images[i].name);
+        for (iy = 0; iy < images[i].ny; ++iy)
+                for (ix = 0; ix < nx; ++ix)
+                        Log("x = %d y = %d:  mapx = %f mapy = %f\n",
+                            ix, iy, nodes[iy*nx+ix].x, nodes[iy*nx+ix].y);
+#endif
+
+globalFoldCheck:
+        if (MPI_Allreduce(&foldImage, &minImageWithFold, 1, MPI_INT,
+                          MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("MPI_Allreduce: could not check for folds.\n");
+        if (minImageWithFold >= nImages)
+                return(0);
+
+        // broadcast the fold location
+        processWithFold = images[minImageWithFold].owner;
+        if (MPI_Bcast(&foldImage, 1, MPI_INT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldWidth, 1, MPI_INT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldHeight, 1, MPI_INT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldX, 1, MPI_INT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldY, 1, MPI_INT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldAbsoluteX, 1, MPI_FLOAT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Bcast(&foldAbsoluteY, 1, MPI_FLOAT,
+                      processWithFold, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Could not broadcast fold location\n");
+        return(1);
+}
+
+void
+FoldCheckTask (int thread, void *arg)
+{
+        int i;
+        int k;
+
+        threadFoldImage[thread] = -1;
+        for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+                if ((k = FindFold(i)) >= 0)
+                {
+                        threadFoldImage[thread] = i;
+                        threadFoldNode[thread] = k;
+                        return;
+                }
+}
+
+/* return the index of the first node of image i at which the mesh
+   is folded, or -1 if there is none; with -fold_tolerance, only the
+   nodes next to a node that moved appreciably since it was last
+   checked are examined */
+int
+FindFold (int i)
+{
+        int nx, ny;
+        int x, y;
+        int k;
+        int nNodes;
+        float xv, yv;
+        Node *nodes;
+        Node *foldNodes;
+        unsigned char *moved;
+        float ax, ay;
+        float bx, by;
+
+        nx = images[i].nx;
+        ny = images[i].ny;
+        nNodes = nx * ny;
+        nodes = images[i].nodes;
+        moved = NULL;
+        if (foldTolerance > 0.0)
+        {
+                if (!foldNodesValid)
+                {
+                        images[i].foldNodes = (Node *) realloc(images[i].foldNodes,
+                                                               nNodes * sizeof(Node));
+                        memcpy(images[i].foldNodes, nodes, nNodes * sizeof(Node));
+                }
+                else
+                {
+                        images[i].foldMoved = (unsigned char *) realloc(images[i].foldMoved,
+                                                                        nNodes);
+                        moved = images[i].foldMoved;
+                        foldNodes = images[i].foldNodes;
+                        for (k = 0; k < nNodes; ++k)
+                        {
+                                moved[k] = fabsf(nodes[k].x - foldNodes[k].x) > foldTolerance ||
+                                           fabsf(nodes[k].y - foldNodes[k].y) > foldTolerance;
+                                if (moved[k])
+                                        foldNodes[k] = nodes[k];
+                        }
+                }
+        }
+
+        for (y = 0; y < ny; ++y)
+                for (x = 0; x < nx; ++x)
+                {
+                        k = y * nx + x;
+                        if (moved != NULL && !moved[k] &&
+                            (x == 0 || !moved[k-1]) && (x == nx - 1 || !moved[k+1]) &&
+                            (y == 0 || !moved[k-nx]) && (y == ny - 1 || !moved[k+nx]))
+                                continue;
+                        xv = nodes[k].x;
+                        if (xv > 0.5 * UNSPECIFIED)
+                                continue;
+                        yv = nodes[k].y;
+                        if (x > 0)
+                        {
+                                ax = nodes[k - 1].x - xv;
+                                ay = nodes[k - 1].y - yv;
+                                if (y > 0)
+                                {
+                                        bx = nodes[k - nx].x - xv;
+                                        by = nodes[k - nx].y - yv;
+                                        if (ax < 0.5 * UNSPECIFIED &&
+                                            bx < 0.5 * UNSPECIFIED &&
+                                            ax * by - ay * bx <= 0.0)
+                                                return(k);
+                                }
+                                if (y < ny - 1)
+                                {
+                                        bx = nodes[k + nx].x - xv;
+                                        by = nodes[k + nx].y - yv;
+                                        if (ax < 0.5 * UNSPECIFIED &&
+                                            bx < 0.5 * UNSPECIFIED &&
+                                            ax * by - ay * bx >= 0.0)
+                                                return(k);
+                                }
+                        }
+                        if (x < nx - 1)
+                        {
+                                ax = nodes[k + 1].x - xv;
+                                ay = nodes[k + 1].y - yv;
+                                if (y > 0)
+                                {
+                                        bx = nodes[k - nx].x - xv;
+                                        by = nodes[k - nx].y - yv;
+                                        if (ax < 0.5 * UNSPECIFIED &&
+                                            bx < 0.5 * UNSPECIFIED &&
+                                            ax * by - ay * bx >= 0.0)
+                                                return(k);
+                                }
+                                if (y < ny - 1)
+                                {
+                                        bx = nodes[k + nx].x - xv;
+                                        by = nodes[k + nx].y - yv;
+                                        if (ax < 0.5 * UNSPECIFIED &&
+                                            bx < 0.5 * UNSPECIFIED &&
+                                            ax * by - ay * bx <= 0.0)
+                                                return(k);
+                                }
+                        }
+                }
+        return(-1);
+}
+
+int
+Extrapolate (float *prx, float *pry, float *prc,
+             int ix, int iy, float arrx, float arry,
+             MapElement* map, int mw, int mh, float threshold)
+{
+        float rx = 0.0;
+        float ry = 0.0;
+        float rc = 1.0;
+        float totalWeight = 0.0;
+        int maxDelta = ((int) ceil(threshold)) + 2;
+        float rrx, rry;
+        int dx, dy;
+        int ixv, iyv;
+        float rx00, rx01, rx10, rx11;
+        float ry00, ry01, ry10, ry11;
+        float rc00, rc01, rc10, rc11;
+        float weight;
+        float rcMin;
+        float d;
+        float xn, yn;
+        float xf, yf;
+
+        for (dy = -maxDelta; dy <= maxDelta; ++dy)
+        {
+                iyv = iy + dy;
+                if (iyv < 0 || iyv >= mh-1)
+                        continue;
+                rry = arry - dy;
+
+                for (dx = -maxDelta; dx <= maxDelta; ++dx)
+                {
+                        ixv = ix + dx;
+                        if (ixv < 0 || ixv >= mw-1 ||
+                            map[iyv*mw+ixv].c == 0.0 ||
+                            map[(iyv+1)*mw+ixv].c == 0.0 ||
+                            map[iyv*mw+ixv+1].c == 0.0 ||
+                            map[(iyv+1)*mw+ixv+1].c == 0.0)
+                                continue;
+
+                        rrx = arrx - dx;
+
+                        rx00 = map[iyv*mw+ixv].x;
+                        ry00 = map[iyv*mw+ixv].y;
+                        rc00 = map[iyv*mw+ixv].c;
+                        rx01 = map[(iyv+1)*mw+ixv].x;
+                        ry01 = map[(iyv+1)*mw+ixv].y;
+                        rc01 = map[(iyv+1)*mw+ixv].c;
+                        rx10 = map[iyv*mw+ixv+1].x;
+                        ry10 = map[iyv*mw+ixv+1].y;
+                        rc10 = map[iyv*mw+ixv+1].c;
+                        rx11 = map[(iyv+1)*mw+ixv+1].x;
+                        ry11 = map[(iyv+1)*mw+ixv+1].y;
+                        rc11 = map[(iyv+1)*mw+ixv+1].c;
+
+                        if (dx == 0 && dy == 0)
+                                weight = M_SQRT2;
+                        else
+                                weight = 1.0 / hypot((float) dx, (float) dy);
+
+                        // compute d, the weight to be given to the far-field vs
+                        //    near-field extrapolation;   d is roughly the distance
+                        //    from the map element to the point to be extrapolated,
+                        //    but bounded between 0.0 and 1.0
+                        if (rrx >= 1.0)
+                                if (rry >= 1.0)
+                                        if (rrx >= 2.0 || rry >= 2.0)
+                                                d = 1.0;
+                                        else
+                                                d = hypot(rrx - 1.0, rry - 1.0);
+                                else if (rry < 0.0)
+                                        if (rrx >= 2.0 || rry <= -1.0)
+                                                d = 1.0;
+                                        else
+                                                d = hypot(rrx - 1.0, rry);
+                                else
+                                        d = rrx - 1.0;
+                        else if (rrx < 0.0)
+                                if (rry >= 1.0)
+                                        if (rrx <= -1.0 || rry >= 2.0)
+                                                d = 1.0;
+                                        else
+                                                d = hypot(rrx, rry - 1.0);
+                                else if (rry < 0.0)
+                                        if (rrx <= -1.0 || rry <= -1.0)
+                                                d = 1.0;
+                                        else
+                                                d = hypot(rrx, rry);
+                                else
+                                        d = -rrx;
+                        else
+                        if (rry >= 1.0)
+                                d = rry - 1.0;
+                        else if (rry < 0.0)
+                                d = -rry;
+                        else
+                                d = 0.0;
+                        if (d > 1.0)
+                                d = 1.0;
+                        // near-field extrapolation
+                        if (d < 1.0)
+                        {
+                                xn = rx00 * (rrx - 1.0) * (rry - 1.0)
+                                     - rx10 * rrx * (rry - 1.0)
+                                     - rx01 * (rrx - 1.0) * rry
+                                     + rx11 * rrx * rry;
+                                yn = ry00 * (rrx - 1.0) * (rry - 1.0)
+                                     - ry10 * rrx * (rry - 1.0)
+                                     - ry01 * (rrx - 1.0) * rry
+                                     + ry11 * rrx * rry;
+                        }
+                        else
+                                xn = yn = 0.0;
+                        // far-field extrapolation
+                        if (d > 0.0)
+                        {
+                                xf = 0.5 * ((rx10 - rx00) + (rx11 - rx01)) * (rrx - 0.5) +
+                                     0.5 * ((rx01 - rx00) + (rx11 - rx10)) * (rry - 0.5) +
+                                     0.25 * (rx00 + rx10 + rx01 + rx11);
+                                yf = 0.5 * ((ry01 - ry00) + (ry11 - ry10)) * (rry - 0.5) +
+                                     0.5 * ((ry10 - ry00) + (ry11 - ry01)) * (rrx - 0.5) +
+                                     0.25 * (ry00 + ry10 + ry01 + ry11);
+                        }
+                        else
+                                xf = yf = 0.0;
+                        // actual extrapolation is a weighted average of the near- and
+                        //    far-field extrapolations
+                        rx += weight * ((1.0 - d) * xn + d * xf);
+                        ry += weight * ((1.0 - d) * yn + d * yf);
+                        rcMin = rc00;
                         if (rc01 < rcMin)
                                 rcMin = rc01;
                         if (rc10 < rcMin)
@@ -5962,478 +8526,1777 @@ Extrapolate (float *prx, float *pry, float *prc,
                                 rcMin = rc11;
                         rc += weight * rcMin;
 
-#if DEBUG
-                        if (debugExtrapolate)
+#if DEBUG
+                        if (debugExtrapolate)
+                        {
+                                Log("extrap rx00=%f rx01=%f rx10=%f rx11=%f\n",
+                                    rx00, rx01, rx10, rx11);
+                                Log("extrap ry00=%f ry01=%f ry10=%f ry11=%f\n",
+                                    ry00, ry01, ry10, ry11);
+                                Log("extrap term: dx=%d dy=%d rrx=%f rry=%f weight=%f drx=%f dry=%f\n",
+                                    dx, dy, rrx, rry, weight,
+                                    (1.0 - d) * xn + d * xf,
+                                    (1.0 - d) * yn + d * yf);
+                        }
+#endif
+
+                        totalWeight += weight;
+                }
+        }
+        if (totalWeight == 0.0)
+                return(0);
+        *prx = rx / totalWeight;
+        *pry = ry / totalWeight;
+        *prc = rc / totalWeight;
+        return(1);
+}
+
+void
+RecoverFromFold (int level, int local)
+{
+        float myWorstK;
+        int myWorstMap;
+        float worstK;
+        MapElement *map;
+        InterImageMap *m;
+        int nStrips;
+        InterImageStrip *strips;
+        InterImageStrip *strip;
+        InterImageSpring *springs;
+        InterImageSpring *s;
+        Node *nodes0;
+        int i, j, k;
+        int ns;
+        char *worstMapName;
+        int worstMapNameSize;
+        int imageNameSize;
+        float area;
+        float l0, l1, l2, l3;
+        float xv, yv;
+        int nx, ny;
+        int nx1;
+        int springsPos;
+        int dPoints;
+        int x, y;
+        int irx, iry;
+        float x0, x1, x2, x3;
+        float y0, y1, y2, y3;
+        int processWithWorstMap;
+        int minProcessWithWorstMap;
+        int lvl;
+        int dLevel;
+        unsigned char *cancel;
+        int processWithFold;
+        unsigned char *myVector, *markedVector;
+        int nExpansions;
+        int expansion;
+        int nNodes;
+        float radius2;
+
+        // decide which nearby InterImageMap has the lowest weight
+
+        // mark the folded image
+        for (i = 0; i < nImages; ++i)
+                images[i].marked = (i == foldImage);
+        myVector = (unsigned char *) malloc(nImages);
+        markedVector = (unsigned char *) malloc(nImages);
+
+        nExpansions = 2;
+        for (expansion = 0; expansion < nExpansions; ++expansion)
+        {
+                memset(myVector, 0, nImages);
+                // find all maps involving a marked image
+                myWorstK = 1.0e+30;
+                myWorstMap = -1;
+                for (i = 0; i < nMaps; ++i)
+                {
+                        m = &maps[i];
+                        if (m->k != 0.0 && (images[m->image0].marked ||
+                                            images[m->image1].marked))
+                        {
+                                if (m->k < myWorstK)
+                                {
+                                        myWorstMap = i;
+                                        myWorstK = m->k;
+                                }
+                                myVector[m->image0] = 1;
+                                myVector[m->image1] = 1;
+                        }
+                }
+
+                // also mark all the images connected by a map
+                if (MPI_Allreduce(myVector, markedVector, nImages, MPI_BYTE,
+                                  MPI_BOR, MPI_COMM_WORLD) != MPI_SUCCESS)
+                        Error("MPI_Allreduce: could not 'or' marked vector.\n");
+                for (i = 0; i < nImages; ++i)
+                        if (markedVector[i])
+                                images[i].marked = 1;
+        }
+        free(myVector);
+        free(markedVector);
+
+        // find the worst map
+        if (MPI_Allreduce(&myWorstK, &worstK, 1, MPI_FLOAT,
+                          MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("MPI_Allreduce: could not find min k.\n");
+        Log("myWorstK = %f worstK = %f\n", myWorstK, worstK);
+        if (myWorstK == worstK)
+                processWithWorstMap = p;
+        else
+                processWithWorstMap = np;
+        if (MPI_Allreduce(&processWithWorstMap, &minProcessWithWorstMap,
+                          1, MPI_INT, MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("MPI_Allreduce: could not find process with worst map.\n");
+        if (p == minProcessWithWorstMap)
+        {
+                if (myWorstMap < 0)
+                        Error("Internal error: myWorstMap < 0\n");
+                worstMapNameSize = strlen(maps[myWorstMap].name) + 1;
+        }
+        if (MPI_Bcast(&worstMapNameSize, 1, MPI_INT,
+                      minProcessWithWorstMap, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Could not broadcast worst map name size\n");
+
+        worstMapName = (char *) malloc(worstMapNameSize);
+        if (p == minProcessWithWorstMap)
+                strcpy(worstMapName, maps[myWorstMap].name);
+        if (MPI_Bcast(worstMapName, worstMapNameSize, MPI_CHAR,
+                      minProcessWithWorstMap, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Could not broadcast worstMapName\n");
+
+        if (p == 0)
+                Log("Discarding map %s with weight %f to try to eliminate fold\n",
+                    worstMapName, worstK);
+
+        for (i = 0; i < nMaps; ++i)
+                if (strcmp(maps[i].name, worstMapName) == 0)
+                        maps[i].k = 0.0;
+        free(worstMapName);
+
+        // restore point positions
+        if (local)
+        {
+                /* only the nodes of the images near the fold that lie
+                   within foldRadius nodes of it are put back (node
+                   positions are in units of the current grid spacing);
+                   the rest of the stack keeps its progress */
+                radius2 = foldRadius * foldRadius;
+                for (i = myFirstImage; i <= myLastImage; ++i)
+                {
+                        if (!images[i].marked)
+                                continue;
+                        nNodes = images[i].nx * images[i].ny;
+                        for (k = 0; k < nNodes; ++k)
                         {
-                                Log("extrap rx00=%f rx01=%f rx10=%f rx11=%f\n",
-                                    rx00, rx01, rx10, rx11);
-                                Log("extrap ry00=%f ry01=%f ry10=%f ry11=%f\n",
-                                    ry00, ry01, ry10, ry11);
-                                Log("extrap term: dx=%d dy=%d rrx=%f rry=%f weight=%f drx=%f dry=%f\n",
-                                    dx, dy, rrx, rry, weight,
-                                    (1.0 - d) * xn + d * xf,
-                                    (1.0 - d) * yn + d * yf);
+                                xv = images[i].nodes[k].x;
+                                yv = images[i].nodes[k].y;
+                                if (xv > 0.5 * UNSPECIFIED ||
+                                    (xv - foldAbsoluteX) * (xv - foldAbsoluteX) +
+                                    (yv - foldAbsoluteY) * (yv - foldAbsoluteY) > radius2)
+                                        continue;
+                                images[i].nodes[k] = images[i].initialNodes[k];
                         }
-#endif
+                }
+                return;
+        }
+        for (i = myFirstImage; i <= myLastImage; ++i)
+        {
+                nx = images[i].nx;
+                ny = images[i].ny;
+                memcpy(images[i].nodes, images[i].initialNodes,
+                       nx * ny * sizeof(Node));
+        }
+}
+
+/* called at the start of each step; opens the telemetry file
+   on first use and clears the accumulated times and counts */
+void
+StartTelemetry ()
+{
+        char fn[PATH_MAX];
+        int phase;
+
+        if (telemetryName[0] == '\0')
+                return;
+        if (telemetryFile == NULL)
+        {
+                if (snprintf(fn, PATH_MAX, "%s.%.2d.csv",
+                             telemetryName, p) >= PATH_MAX)
+                        Error("Telemetry name %s is too long\n", telemetryName);
+                telemetryFile = fopen(fn, "w");
+                if (telemetryFile == NULL)
+                        Error("Could not open telemetry file %s\n", fn);
+                fprintf(telemetryFile, "step,level,iter,elapsed_s");
+                for (phase = 0; phase < N_TM_PHASES; ++phase)
+                        fprintf(telemetryFile, ",%s_s", telemetryPhaseNames[phase]);
+                fprintf(telemetryFile, ",comm_sent_bytes,comm_received_bytes,"
+                        "collective_sent_bytes,collective_received_bytes,"
+                        "nodes,springs\n");
+        }
+        for (phase = 0; phase < N_TM_PHASES; ++phase)
+        {
+                telemetryTime[phase] = 0.0;
+                telemetryBytesSent[phase] = 0.0;
+                telemetryBytesReceived[phase] = 0.0;
+        }
+        telemetryNodes = 0.0;
+        telemetrySprings = 0.0;
+        telemetryLast = MPI_Wtime();
+}
+
+/* charges the time since the last call to the given part
+   of the iteration */
+void
+TelemetryLap (int phase)
+{
+        double now;
+
+        if (telemetryFile == NULL)
+                return;
+        now = MPI_Wtime();
+        telemetryTime[phase] += now - telemetryLast;
+        telemetryLast = now;
+}
+
+void
+TelemetryBytes (int phase, double sent, double received)
+{
+        if (telemetryFile == NULL)
+                return;
+        telemetryBytesSent[phase] += sent;
+        telemetryBytesReceived[phase] += received;
+}
+
+/* counts the nodes and springs whose forces the iteration
+   described by ip has just computed */
+void
+TelemetryWork (IterationParams *ip)
+{
+        int i;
+        int level;
+
+        level = ip->level;
+        for (i = myFirstImage; i <= myLastImage; ++i)
+                if (images[i].fixed ? ip->fixedImages :
+                    ip->allImages || images[i].active)
+                        telemetryNodes += images[i].nx * images[i].ny;
+        for (i = 0; i < nMaps; ++i)
+                if (ip->allImages || MapIsActive(&maps[i]))
+                        telemetrySprings += maps[i].nSprings[startLevel - level];
+}
+
+void
+WriteTelemetry (int step, int level, int iter)
+{
+        double elapsed;
+        int phase;
+
+        elapsed = 0.0;
+        for (phase = 0; phase < N_TM_PHASES; ++phase)
+                elapsed += telemetryTime[phase];
+        fprintf(telemetryFile, "%d,%d,%d,%.6f", step, level, iter, elapsed);
+        for (phase = 0; phase < N_TM_PHASES; ++phase)
+                fprintf(telemetryFile, ",%.6f", telemetryTime[phase]);
+        fprintf(telemetryFile, ",%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+                telemetryBytesSent[TM_COMM], telemetryBytesReceived[TM_COMM],
+                telemetryBytesSent[TM_COLLECTIVE], telemetryBytesReceived[TM_COLLECTIVE],
+                telemetryNodes, telemetrySprings);
+        fflush(telemetryFile);
+}
+
+/* writes the final record of a step, and logs on process 0 how
+   evenly the time of each part was spread over the processes */
+void
+FinishTelemetryStep (int step, int level, int iter)
+{
+        double minTime[N_TM_PHASES], sumTime[N_TM_PHASES];
+        struct
+        {
+                double value;
+                int rank;
+        } localMax[N_TM_PHASES], maxTime[N_TM_PHASES];
+        double mean;
+        int phase;
+
+        TelemetryLap(TM_OTHER);
+        WriteTelemetry(step, level, iter);
+
+        for (phase = 0; phase < N_TM_PHASES; ++phase)
+        {
+                localMax[phase].value = telemetryTime[phase];
+                localMax[phase].rank = p;
+        }
+        if (MPI_Reduce(telemetryTime, minTime, N_TM_PHASES, MPI_DOUBLE, MPI_MIN,
+                       0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Reduce(telemetryTime, sumTime, N_TM_PHASES, MPI_DOUBLE, MPI_SUM,
+                       0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+            MPI_Reduce(localMax, maxTime, N_TM_PHASES, MPI_DOUBLE_INT, MPI_MAXLOC,
+                       0, MPI_COMM_WORLD) != MPI_SUCCESS)
+                Error("Could not reduce telemetry.\n");
+        if (p == 0)
+        {
+                Log("Step %d telemetry (seconds per process):\n", step);
+                Log("  %-10s %10s %10s %10s %9s %8s\n",
+                    "part", "min", "mean", "max", "max/mean", "slowest");
+                for (phase = 0; phase < N_TM_PHASES; ++phase)
+                {
+                        mean = sumTime[phase] / np;
+                        Log("  %-10s %10.3f %10.3f %10.3f %9.2f %8d\n",
+                            telemetryPhaseNames[phase], minTime[phase], mean,
+                            maxTime[phase].value,
+                            mean > 0.0 ? maxTime[phase].value / mean : 1.0,
+                            maxTime[phase].rank);
+                }
+        }
+        telemetryLast = MPI_Wtime();
+}
+
+void
+ConvexHull (int n, Point *pts,
+            int *hn, Point *hpts)
+{
+        int i;
+        int k = 0;
+        int t;
+
+        // Sort points lexicographically
+        qsort(pts, n, sizeof(Point), ComparePoints);
+
+        // Build lower hull
+        for (i = 0; i < n; ++i)
+        {
+                while (k >= 2 && Cross(hpts[k-2].x, hpts[k-2].y,
+                                       hpts[k-1].x, hpts[k-1].y,
+                                       pts[i].x, pts[i].y) <= 0.0)
+                        --k;
+                hpts[k++] = pts[i];
+        }
+
+        // Build upper hull
+        t = k + 1;
+        for (i = n - 2; i >= 0; --i)
+        {
+                while (k >= t && Cross(hpts[k-2].x, hpts[k-2].y,
+                                       hpts[k-1].x, hpts[k-1].y,
+                                       pts[i].x, pts[i].y) <= 0.0)
+                        --k;
+                hpts[k++] = pts[i];
+        }
+
+        *hn = k-1;
+}
+
+int
+ComparePoints (const void *p0, const void *p1)
+{
+        if (((const Point *) p0)->x < ((const Point *) p1)->x)
+                return(-1);
+        else if (((const Point *) p0)->x > ((const Point *) p1)->x)
+                return(1);
+        else if (((const Point *) p0)->y < ((const Point *) p1)->y)
+                return(-1);
+        else if (((const Point *) p0)->y > ((const Point *) p1)->y)
+                return(1);
+        else
+                return(0);
+}
+
+
+double
+Cross (double x0, double y0,
+       double x1, double y1,
+       double x2, double y2)
+{
+        return ((x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0));
+}
+
+
+
+double
+MinimumAreaRectangle (int n, Point *p, Point *corners)
+{
+        int i, j, k, m;
+        double alpha, beta, gamma, delta;
+        double slope;
+        double d1, d2;
+        double A, Amin;
+        int start;
+        Point p2;
+
+        /* convert pts to have the point with the smallest y coordinate first */
+        start = 0;
+        for (i = 1; i < n; ++i)
+                if (p[i].y < p[start].y ||
+                    p[i].y == p[start].y && p[i].x < p[start].x)
+                        start = i;
+        printf("start = %d\n", start);
+
+        alpha = 0.0;
+        beta = Angle(p[start].x, p[start].y,
+                     p[(start + 1) % n].x, p[(start + 1) % n].y,
+                     p[(start + 2) % n].x, p[(start + 2) % n].y);
+        gamma = beta;
+        delta = beta;
+        j = k = m = 1;
+        Amin = 1.0e+30;
+        /* find area of encasing rectangle anchored on each edge */
+        for (i = 0; i < n; ++i)
+        {
+                /* find angle of rotation of next edge of polygon */
+                if (i > 0)
+                        alpha += Angle(p[(start + i + n - 1) % n].x, p[(start + i + n - 1) % n].y,
+                                       p[(start + i) % n].x, p[(start + i) % n].y,
+                                       p[(start + i + 1) % n].x, p[(start + i + 1) % n].y);
+
+                /* find a vertex on first perpendicular line of support */
+                while (beta < alpha + M_PI / 2.0)
+                {
+                        ++j;
+                        beta += Angle(p[(start + j + n - 1) % n].x, p[(start + j + n - 1) % n].y,
+                                      p[(start + j) % n].x, p[(start + j) % n].y,
+                                      p[(start + j + 1) % n].x, p[(start + j + 1) % n].y);
+                }
+
+                /* find a vertex on parallel line of support */
+                while (gamma < alpha + M_PI)
+                {
+                        ++k;
+                        gamma += Angle(p[(start + k + n - 1) % n].x, p[(start + k + n - 1) % n].y,
+                                       p[(start + k) % n].x, p[(start + k) % n].y,
+                                       p[(start + k + 1) % n].x, p[(start + k + 1) % n].y);
+                }
+
+                /* find a vertex on second perpendicular line of support */
+                while (delta < alpha + 3.0 * M_PI / 2.0)
+                {
+                        ++m;
+                        delta += Angle(p[(start + m + n - 1) % n].x, p[(start + m + n - 1) % n].y,
+                                       p[(start + m) % n].x, p[(start + m) % n].y,
+                                       p[(start + m + 1) % n].x, p[(start + m + 1) % n].y);
+                }
+
+                /* find distances between parallel and perpendicular lines of support */
+                if (p[(start + i + 1) % n].x == p[(start + i) % n].x)
+                {
+                        d1 = fabs(p[(start + k) % n].x - p[(start + i) % n].x);
+                        d2 = fabs(p[(start + m) % n].y - p[(start + j) % n].y);
+                }
+                else if (p[(start + i + 1) % n].y == p[(start + i) % n].y)
+                {
+                        d1 = fabs(p[(start + k) % n].y - p[(start + i) % n].y);
+                        d2 = fabs(p[(start + m) % n].x - p[(start + j) % n].x);
+                }
+                else
+                {
+                        slope = (p[(start + i + 1) % n].y- p[(start + i) %n].y) /
+                                (p[(start + i + 1) % n].x - p[(start + i) % n].x);
+                        d1 = PerpDist(p[(start + i) % n].x, p[(start + i) % n].y,
+                                      p[(start + k) % n].x, p[(start + k) % n].y,
+                                      slope);
+                        d2 = PerpDist(p[(start + j) % n].x, p[(start + j) % n].y,
+                                      p[(start + m) % n].x, p[(start + m) % n].y,
+                                      -1.0 / slope);
+                }
+
+                /* compute area of encasing rectangle anchored on current edge */
+                A = d1 * d2;
+                printf("i = %d  d1 = %f d2 = %f A = %f\n", i, d1, d2, A);
+                if (i == 0 || A < Amin)
+                {
+                        Amin = A;
+                        printf("PTi = %f %f\n", p[(start + i) % n].x, p[(start + i) % n].y);
+                        printf("PTi+1 = %f %f\n", p[(start + i + 1) % n].x, p[(start + i + 1) % n].y);
+                        printf("PTj = %f %f\n", p[(start + j) % n].x, p[(start + j) % n].y);
+                        printf("PTk = %f %f\n", p[(start + k) % n].x, p[(start + k) % n].y);
+                        printf("PTm = %f %f\n", p[(start + m) % n].x, p[(start + m) % n].y);
+                        p2.x = p[(start + k) % n].x + (p[(start + i + 1) % n].x -
+                                                       p[(start + i) % n].x);
+                        p2.y = p[(start + k) % n].y + (p[(start + i + 1) % n].y -
+                                                       p[(start + i) % n].y);
+                        printf("PT2 = %f %f\n", p2.x, p2.y);
 
-                        totalWeight += weight;
+                        PointProjectionOnLine(p[(start + i) % n],
+                                              p[(start + i + 1) % n],
+                                              p[(start + j) % n],
+                                              &corners[0]);
+                        PointProjectionOnLine(p[(start + i) % n],
+                                              p[(start + i + 1) % n],
+                                              p[(start + m) % n],
+                                              &corners[1]);
+                        PointProjectionOnLine(p[(start + k) % n],
+                                              p2,
+                                              p[(start + m) % n],
+                                              &corners[2]);
+                        PointProjectionOnLine(p[(start + k) % n],
+                                              p2,
+                                              p[(start + j) % n],
+                                              &corners[3]);
                 }
         }
-        if (totalWeight == 0.0)
-                return(0);
-        *prx = rx / totalWeight;
-        *pry = ry / totalWeight;
-        *prc = rc / totalWeight;
-        return(1);
+        return(Amin);
 }
 
 void
-RecoverFromFold (int level)
+PointProjectionOnLine (Point p0, Point p1, Point q, Point *proj)
 {
-        float myWorstK;
-        int myWorstMap;
-        float worstK;
-        MapElement *map;
-        InterImageMap *m;
-        int nStrips;
-        InterImageStrip *strips;
-        InterImageStrip *strip;
-        InterImageSpring *springs;
-        InterImageSpring *s;
-        Node *nodes0;
-        int i, j, k;
-        int ns;
-        char *worstMapName;
-        int worstMapNameSize;
-        int imageNameSize;
-        float area;
-        float l0, l1, l2, l3;
-        float xv, yv;
-        int nx, ny;
-        int nx1;
-        int springsPos;
-        int dPoints;
-        int x, y;
-        int irx, iry;
-        float x0, x1, x2, x3;
-        float y0, y1, y2, y3;
-        int processWithWorstMap;
-        int minProcessWithWorstMap;
-        int lvl;
-        int dLevel;
-        unsigned char *cancel;
-        int processWithFold;
-        unsigned char *myVector, *markedVector;
-        int nExpansions;
-        int expansion;
+        double dx, dy;
+        double u;
 
-        // decide which nearby InterImageMap has the lowest weight
+        dx = p1.x - p0.x;
+        dy = p1.y - p0.y;
+        u = ((q.x - p0.x) * dx + (q.y - p0.y) * dy) / (dx * dx + dy * dy);
+        proj->x = p0.x + u * dx;
+        proj->y = p0.y + u * dy;
+}
 
-        // mark the folded image
-        for (i = 0; i < nImages; ++i)
-                images[i].marked = (i == foldImage);
-        myVector = (unsigned char *) malloc(nImages);
-        markedVector = (unsigned char *) malloc(nImages);
+double
+PerpDist (double x1, double y1, double x2, double y2, double s)
+{
+        return(fabs(s * (x2 - x1) - y2 + y1) / sqrt(s*s + 1.0));
+}
 
-        nExpansions = 2;
-        for (expansion = 0; expansion < nExpansions; ++expansion)
+double
+Angle (double x0, double y0,
+       double x1, double y1,
+       double x2, double y2)
+{
+        double a = atan2(y2 - y1, x2 - x1) - atan2(y1 - y0, x1 - x0);
+        if (a > M_PI)
+                a -= 2.0 * M_PI;
+        else if (a < -M_PI)
+                a += 2.0 * M_PI;
+        return(a);
+}
+
+void
+ConstrainNodes (int imageNum,
+                Node *nodes, unsigned char *flags, int nx, int ny, int factor,
+                int nConstraints, double *constraints,
+                double *coeff)
+{
+        int i,j,k;
+        int x, y;
+        int ix, iy;
+        int *assigned;
+        float *nodeDistance;
+        int *nodeConstraint;
+        int closestX, closestY;
+        float distance;
+        float dist;
+        float dx, dy;
+
+        //  Log("ConstrainNodes called; nx = %d ny = %d; nConstraints = %d\n",
+        //      nx, ny, nConstraints);
+        assigned = (int *) malloc(nConstraints * sizeof(int));
+        memset(assigned, 0, nConstraints * sizeof(int));
+        nodeDistance = (float *) malloc(nx * ny * sizeof(float));
+        nodeConstraint = (int *) malloc(nx * ny * sizeof(int));
+
+        // make 4 assignment passes
+        for (i = 0; i < 4; ++i)
         {
-                memset(myVector, 0, nImages);
-                // find all maps involving a marked image
-                myWorstK = 1.0e+30;
-                myWorstMap = -1;
-                for (i = 0; i < nMaps; ++i)
+                for (y = 0; y < ny; ++y)
+                        for (x = 0; x < nx; ++x)
+                        {
+                                nodeDistance[y*nx+x] = 1000000000.0;
+                                nodeConstraint[y*nx+x] = -1;
+                        }
+
+                // for each constraint
+                for (j = 0; j < nConstraints; ++j)
                 {
-                        m = &maps[i];
-                        if (m->k != 0.0 && (images[m->image0].marked ||
-                                            images[m->image1].marked))
+                        if (assigned[j])
+                                continue;
+                        ix = (int) (constraints[j*4] / factor);
+                        iy = (int) (constraints[j*4+1] / factor);
+                        // choose the closest unconstrained node
+                        closestX = -1;
+                        closestY = -1;
+                        distance = 1000000000.0;
+                        for (k = 0; k < 4; ++k)
                         {
-                                if (m->k < myWorstK)
+                                x = ix + (k & 1);
+                                y = iy + (k >> 1);
+                                if (x < 0 || x >= nx ||
+                                    y < 0 || y >= ny ||
+                                    nodes[y*nx+x].x > 0.5 * UNSPECIFIED ||
+                                    !(flags[y*nx+x] & NODE_MOVE_X) ||
+                                    !(flags[y*nx+x] & NODE_MOVE_Y))
                                 {
-                                        myWorstMap = i;
-                                        myWorstK = m->k;
+                                        //		  Log("Skipping node %d %d because .x = %f flags = %d\n",
+                                        //		      x, y, nodes[y*nx+x].x, flags[y*nx+x]);
+                                        continue;
                                 }
-                                myVector[m->image0] = 1;
-                                myVector[m->image1] = 1;
+
+                                dist = hypot(constraints[j*4] - x * factor,
+                                             constraints[j*4+1] - y * factor);
+                                if (dist < distance)
+                                {
+                                        closestX = x;
+                                        closestY = y;
+                                        distance = dist;
+                                }
+                        }
+
+                        if (closestX >= 0 &&
+                            distance < nodeDistance[closestY*nx + closestX])
+                        {
+                                nodeConstraint[closestY * nx + closestX] = j;
+                                nodeDistance[closestY*nx + closestX] = distance;
                         }
                 }
 
-                // also mark all the images connected by a map
-                if (MPI_Allreduce(myVector, markedVector, nImages, MPI_BYTE,
-                                  MPI_BOR, MPI_COMM_WORLD) != MPI_SUCCESS)
-                        Error("MPI_Allreduce: could not 'or' marked vector.\n");
-                for (i = 0; i < nImages; ++i)
-                        if (markedVector[i])
-                                images[i].marked = 1;
+                for (y = 0; y < ny; ++y)
+                        for (x = 0; x < nx; ++x)
+                                if (nodeConstraint[y * nx + x] >= 0)
+                                {
+                                        j = nodeConstraint[y * nx + x];
+                                        dx = factor * x - constraints[j*4];
+                                        dy = factor * y - constraints[j*4+1];
+                                        nodes[y*nx+x].x = (constraints[j*4+2] +
+                                                           coeff[1] * dx + coeff[2] * dy) / factor;
+                                        nodes[y*nx+x].y = (constraints[j*4+3] +
+                                                           coeff[7] * dx + coeff[8] * dy) / factor;
+                                        Log("Constraining node (%d %d) of image %d to (%f %f) (pixel %f %f)\n",
+                                            x, y, imageNum,
+                                            nodes[y*nx+x].x, nodes[y*nx+x].y,
+                                            factor * nodes[y*nx+x].x, factor * nodes[y*nx+x].y);
+                                        flags[y*nx+x] &= ~(NODE_MOVE_X | NODE_MOVE_Y);
+                                        assigned[j] = 1;
+                                }
         }
-        free(myVector);
-        free(markedVector);
 
-        // find the worst map
-        if (MPI_Allreduce(&myWorstK, &worstK, 1, MPI_FLOAT,
-                          MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("MPI_Allreduce: could not find min k.\n");
-        Log("myWorstK = %f worstK = %f\n", myWorstK, worstK);
-        if (myWorstK == worstK)
-                processWithWorstMap = p;
-        else
-                processWithWorstMap = np;
-        if (MPI_Allreduce(&processWithWorstMap, &minProcessWithWorstMap,
-                          1, MPI_INT, MPI_MIN, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("MPI_Allreduce: could not find process with worst map.\n");
-        if (p == minProcessWithWorstMap)
+        free(assigned);
+        free(nodeDistance);
+        free(nodeConstraint);
+}
+
+void
+StartThreads ()
+{
+        int t;
+        pthread_attr_t attr;
+
+        threadFirstImage = (int *) malloc(nThreads * sizeof(int));
+        threadLastImage = (int *) malloc(nThreads * sizeof(int));
+        nThreadMaps = (int *) malloc(nThreads * sizeof(int));
+        memset(nThreadMaps, 0, nThreads * sizeof(int));
+        threadMaps = (int **) malloc(nThreads * sizeof(int *));
+        memset(threadMaps, 0, nThreads * sizeof(int *));
+        threadIntraEnergy = (double *) malloc(nThreads * sizeof(double));
+        threadInterEnergy = (double *) malloc(nThreads * sizeof(double));
+        threadMaxF = (float *) malloc(nThreads * sizeof(float));
+        threadFoldImage = (int *) malloc(nThreads * sizeof(int));
+        threadFoldNode = (int *) malloc(nThreads * sizeof(int));
+        threadGG = (double *) malloc(nThreads * sizeof(double));
+        threadGPrevG = (double *) malloc(nThreads * sizeof(double));
+        imageThread = (int *) malloc(nImages * sizeof(int));
+        for (t = 0; t < nImages; ++t)
+                imageThread[t] = -1;
+        if (nThreads <= 1)
+                return;
+
+        Log("Starting %d worker threads\n", nThreads - 1);
+        workerThreads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+        if (pthread_attr_init(&attr) != 0)
+                Error("pthread_attr_init failed\n");
+        for (t = 1; t < nThreads; ++t)
+                if (pthread_create(&workerThreads[t], &attr, ThreadMain, (void *) (long) t) != 0)
+                        Error("Could not create worker thread %d\n", t);
+        pthread_attr_destroy(&attr);
+}
+
+void *
+ThreadMain (void *arg)
+{
+        int thread = (int) (long) arg;
+        int generation = 0;
+
+        for (;;)
+        {
+                pthread_mutex_lock(&poolMutex);
+                while (poolGeneration == generation)
+                        pthread_cond_wait(&poolStartCond, &poolMutex);
+                generation = poolGeneration;
+                pthread_mutex_unlock(&poolMutex);
+
+                (*poolFunc)(thread, poolArg);
+
+                pthread_mutex_lock(&poolMutex);
+                if (--poolPending == 0)
+                        pthread_cond_signal(&poolDoneCond);
+                pthread_mutex_unlock(&poolMutex);
+        }
+        return(NULL);
+}
+
+void
+RunThreads (void (*func)(int thread, void *arg), void *arg)
+{
+        /* run func on all threads of this process, with the
+           calling thread acting as thread 0, and wait for all of
+           them to finish */
+        if (nThreads <= 1)
+        {
+                (*func)(0, arg);
+                return;
+        }
+        pthread_mutex_lock(&poolMutex);
+        poolFunc = func;
+        poolArg = arg;
+        poolPending = nThreads - 1;
+        ++poolGeneration;
+        pthread_cond_broadcast(&poolStartCond);
+        pthread_mutex_unlock(&poolMutex);
+
+        (*func)(0, arg);
+
+        pthread_mutex_lock(&poolMutex);
+        while (poolPending > 0)
+                pthread_cond_wait(&poolDoneCond, &poolMutex);
+        pthread_mutex_unlock(&poolMutex);
+}
+
+void
+PlanThreads (int level)
+{
+        int t;
+        int i;
+        long long totalNodes;
+        long long cumNodes;
+        int t0, t1;
+        int owner;
+        InterImageMap *m;
+
+        /* divide the owned images into contiguous blocks of
+           approximately equal numbers of nodes */
+        totalNodes = 0;
+        for (i = myFirstImage; i <= myLastImage; ++i)
+                totalNodes += images[i].nx * images[i].ny;
+        cumNodes = 0;
+        t = 0;
+        threadFirstImage[0] = myFirstImage;
+        for (i = myFirstImage; i <= myLastImage; ++i)
+        {
+                if (t < nThreads - 1 && i > threadFirstImage[t] &&
+                    cumNodes >= (t + 1) * totalNodes / nThreads)
+                {
+                        threadLastImage[t] = i - 1;
+                        ++t;
+                        threadFirstImage[t] = i;
+                }
+                imageThread[i] = t;
+                cumNodes += images[i].nx * images[i].ny;
+        }
+        threadLastImage[t] = myLastImage;
+        for (++t; t < nThreads; ++t)
         {
-                if (myWorstMap < 0)
-                        Error("Internal error: myWorstMap < 0\n");
-                worstMapNameSize = strlen(maps[myWorstMap].name) + 1;
+                /* more threads than images; leave these idle */
+                threadFirstImage[t] = myLastImage + 1;
+                threadLastImage[t] = myLastImage;
         }
-        if (MPI_Bcast(&worstMapNameSize, 1, MPI_INT,
-                      minProcessWithWorstMap, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("Could not broadcast worst map name size\n");
 
-        worstMapName = (char *) malloc(worstMapNameSize);
-        if (p == minProcessWithWorstMap)
-                strcpy(worstMapName, maps[myWorstMap].name);
-        if (MPI_Bcast(worstMapName, worstMapNameSize, MPI_CHAR,
-                      minProcessWithWorstMap, MPI_COMM_WORLD) != MPI_SUCCESS)
-                Error("Could not broadcast worstMapName\n");
+        /* assign each map to the thread that owns the forces of
+           both of its images; forces on images owned by other
+           processes are never used, so those do not count */
+        for (t = 0; t < nThreads; ++t)
+        {
+                free(threadMaps[t]);
+                threadMaps[t] = (int *) malloc((nMaps + 1) * sizeof(int));
+                nThreadMaps[t] = 0;
+        }
+        free(crossThreadMaps);
+        crossThreadMaps = (int *) malloc((nMaps + 1) * sizeof(int));
+        nCrossThreadMaps = 0;
+        /* with -reaction_forces the forces on a target image of
+           another process are accumulated here too, so such an image
+           belongs to the thread of the first map that reaches it */
+        for (i = 0; i < nImages; ++i)
+                if (images[i].owner != p)
+                        imageThread[i] = -1;
+        for (i = 0; i < nMaps; ++i)
+        {
+                m = &maps[i];
+                if (reactionForces && images[m->image1].owner != p &&
+                    imageThread[m->image1] < 0)
+                        imageThread[m->image1] = imageThread[m->image0];
+                t0 = images[m->image0].owner == p ? imageThread[m->image0] : -1;
+                t1 = images[m->image1].owner == p || reactionForces ?
+                     imageThread[m->image1] : -1;
+                if (t0 < 0)
+                        owner = t1;
+                else if (t1 < 0 || t1 == t0)
+                        owner = t0;
+                else
+                        owner = -1;
+                if (owner >= 0)
+                        threadMaps[owner][nThreadMaps[owner]++] = i;
+                else
+                        crossThreadMaps[nCrossThreadMaps++] = i;
+        }
+        if (nThreads > 1)
+                for (t = 0; t < nThreads; ++t)
+                        Log("Thread %d at level %d has images %d to %d and %d maps (%d maps shared)\n",
+                            t, level, threadFirstImage[t], threadLastImage[t],
+                            nThreadMaps[t], nCrossThreadMaps);
+}
 
-        if (p == 0)
-                Log("Discarding map %s with weight %f to try to eliminate fold\n",
-                    worstMapName, worstK);
+void
+ComputeForcesTask (int thread, void *arg)
+{
+        IterationParams *ip = (IterationParams *) arg;
+        int i;
+        int halo;
+        InterImageMap *m;
+        double energy;
 
-        for (i = 0; i < nMaps; ++i)
-                if (strcmp(maps[i].name, worstMapName) == 0)
-                        maps[i].k = 0.0;
-        free(worstMapName);
+        energy = 0.0;
+        if (ip->maps != HALO_MAPS)
+                for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+                {
+                        /* an inactive image does not move, so the energy
+                           of its own springs is unchanged */
+                        if (images[i].fixed ? ip->fixedImages :
+                            ip->allImages || images[i].active)
+                                images[i].intraEnergy = ComputeImageForces(i, ip->level);
+                        energy += images[i].intraEnergy;
+                        if (thread == 0)
+                                ProgressCommunication();
+                }
+        threadIntraEnergy[thread] = energy;
 
-        // restore point positions
-        for (i = myFirstImage; i <= myLastImage; ++i)
+        energy = 0.0;
+        for (i = 0; i < nThreadMaps[thread]; ++i)
         {
-                nx = images[i].nx;
-                ny = images[i].ny;
-                memcpy(images[i].nodes, images[i].initialNodes,
-                       nx * ny * sizeof(Node));
+                m = &maps[threadMaps[thread][i]];
+                if (ip->maps != ALL_MAPS)
+                {
+                        halo = images[m->image0].owner != p ||
+                               images[m->image1].owner != p;
+                        if (halo != (ip->maps == HALO_MAPS))
+                                continue;
+                }
+                if (ip->allImages || MapIsActive(m))
+                        m->energy = ComputeMapForces(m, ip->level);
+                energy += m->energy;
         }
+        threadInterEnergy[thread] = energy;
 }
 
 void
-ConvexHull (int n, Point *pts,
-            int *hn, Point *hpts)
+MaxForceTask (int thread, void *arg)
 {
+        IterationParams *ip = (IterationParams *) arg;
         int i;
-        int k = 0;
-        int t;
+        float maxF, force;
 
-        // Sort points lexicographically
-        qsort(pts, n, sizeof(Point), ComparePoints);
-
-        // Build lower hull
-        for (i = 0; i < n; ++i)
+        maxF = 0.0;
+        for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
         {
-                while (k >= 2 && Cross(hpts[k-2].x, hpts[k-2].y,
-                                       hpts[k-1].x, hpts[k-1].y,
-                                       pts[i].x, pts[i].y) <= 0.0)
-                        --k;
-                hpts[k++] = pts[i];
+                if (!ip->allImages && !images[i].active)
+                        continue;
+                force = ComputeMaxForce(i, ip->dampingFactor);
+                images[i].maxForce = force;
+                if (force > maxF)
+                        maxF = force;
         }
+        threadMaxF[thread] = maxF;
+}
 
-        // Build upper hull
-        t = k + 1;
-        for (i = n - 2; i >= 0; --i)
+/* sums over the movable coordinates of the owned images of
+   g.g and g.gPrev, where g is the current force (the negative
+   gradient of the energy) and gPrev the one of the previous
+   iteration */
+void
+ConjugateSumsTask (int thread, void *arg)
+{
+        IterationParams *ip = (IterationParams *) arg;
+        int i, k;
+        int nNodes;
+        Force *g, *gPrev;
+        unsigned char *flags;
+        double gg, gPrevG;
+
+        gg = 0.0;
+        gPrevG = 0.0;
+        for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
         {
-                while (k >= t && Cross(hpts[k-2].x, hpts[k-2].y,
-                                       hpts[k-1].x, hpts[k-1].y,
-                                       pts[i].x, pts[i].y) <= 0.0)
-                        --k;
-                hpts[k++] = pts[i];
+                if (images[i].fixed || (!ip->allImages && !images[i].active))
+                        continue;
+                nNodes = images[i].nx * images[i].ny;
+                g = images[i].forces;
+                gPrev = images[i].prevForces;
+                flags = images[i].nodeFlags;
+                for (k = 0; k < nNodes; ++k)
+                {
+                        if (flags[k] & NODE_MOVE_X)
+                        {
+                                gg += g[k].fx * g[k].fx;
+                                gPrevG += gPrev[k].fx * g[k].fx;
+                        }
+                        if (flags[k] & NODE_MOVE_Y)
+                        {
+                                gg += g[k].fy * g[k].fy;
+                                gPrevG += gPrev[k].fy * g[k].fy;
+                        }
+                }
         }
+        threadGG[thread] = gg;
+        threadGPrevG[thread] = gPrevG;
+}
 
-        *hn = k-1;
+/* forms the new search direction d = g + beta * d, remembers g
+   for the next iteration, and leaves d in the force array so
+   that the step is taken along it */
+void
+ConjugateDirectionTask (int thread, void *arg)
+{
+        IterationParams *ip = (IterationParams *) arg;
+        int i, k;
+        int nNodes;
+        Force *g, *gPrev, *d;
+        float beta;
+
+        beta = ip->beta;
+        for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+        {
+                if (images[i].fixed || (!ip->allImages && !images[i].active))
+                        continue;
+                nNodes = images[i].nx * images[i].ny;
+                g = images[i].forces;
+                gPrev = images[i].prevForces;
+                d = images[i].directions;
+                for (k = 0; k < nNodes; ++k)
+                {
+                        gPrev[k] = g[k];
+                        d[k].fx = g[k].fx + beta * d[k].fx;
+                        d[k].fy = g[k].fy + beta * d[k].fy;
+                        g[k] = d[k];
+                }
+        }
 }
 
+/* a map needs to be evaluated unless all of its images are owned
+   by this process and inactive, in which case neither its energy
+   nor any force that matters can have changed */
 int
-ComparePoints (const void *p0, const void *p1)
+MapIsActive (InterImageMap *m)
 {
-        if (((const Point *) p0)->x < ((const Point *) p1)->x)
-                return(-1);
-        else if (((const Point *) p0)->x > ((const Point *) p1)->x)
-                return(1);
-        else if (((const Point *) p0)->y < ((const Point *) p1)->y)
-                return(-1);
-        else if (((const Point *) p0)->y > ((const Point *) p1)->y)
-                return(1);
-        else
-                return(0);
+        return(images[m->image0].owner != p || images[m->image0].active ||
+               images[m->image1].owner != p || images[m->image1].active);
 }
 
+/* decide which images take part in the next iterations: an image
+   is frozen when, at the rate its nodes moved since the last check,
+   none of them would move by activeThreshold pixels in an epoch, and
+   is reactivated when its forces are large enough that it would;
+   stepScale converts a damped force into a step */
+void
+UpdateActiveSet (int level, float stepScale, int init)
+{
+        int i, k;
+        int nNodes;
+        Node *nodes, *checkNodes;
+        float move, d;
+        int nActive, nFrozen, nWoken;
 
-double
-Cross (double x0, double y0,
-       double x1, double y1,
-       double x2, double y2)
+        nActive = 0;
+        nFrozen = 0;
+        nWoken = 0;
+        for (i = myFirstImage; i <= myLastImage; ++i)
+        {
+                nNodes = images[i].nx * images[i].ny;
+                nodes = images[i].nodes;
+                if (init)
+                {
+                        images[i].checkNodes = (Node *) realloc(images[i].checkNodes,
+                                                                nNodes * sizeof(Node));
+                        memcpy(images[i].checkNodes, nodes, nNodes * sizeof(Node));
+                        images[i].active = 1;
+                        continue;
+                }
+                checkNodes = images[i].checkNodes;
+                move = 0.0;
+                for (k = 0; k < nNodes; ++k)
+                {
+                        if (nodes[k].x > 0.5 * UNSPECIFIED)
+                                continue;
+                        d = fabsf(nodes[k].x - checkNodes[k].x);
+                        if (d > move)
+                                move = d;
+                        d = fabsf(nodes[k].y - checkNodes[k].y);
+                        if (d > move)
+                                move = d;
+                }
+                memcpy(checkNodes, nodes, nNodes * sizeof(Node));
+                move *= (1 << level) * epochIterations / ACTIVE_CHECK_ITERATIONS;
+
+                if (images[i].fixed)
+                        images[i].active = 0;
+                else if (images[i].active)
+                {
+                        if (move < activeThreshold)
+                        {
+                                images[i].active = 0;
+                                ++nFrozen;
+                        }
+                }
+                else if (epochIterations * stepScale * images[i].maxForce *
+                         (1 << level) >= activeThreshold)
+                {
+                        images[i].active = 1;
+                        ++nWoken;
+                }
+                if (images[i].active)
+                        ++nActive;
+        }
+        if (nFrozen > 0 || nWoken > 0)
+                Log("Active set: %d of %d images active (%d frozen, %d reactivated)\n",
+                    nActive, myLastImage - myFirstImage + 1, nFrozen, nWoken);
+}
+
+void
+UpdatePositionsTask (int thread, void *arg)
 {
-        return ((x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0));
+        IterationParams *ip = (IterationParams *) arg;
+        int i;
+
+        for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+                if (ip->allImages || images[i].active)
+                        UpdatePositions(i, ip->scale, ip->maxStepX, ip->maxStepY);
 }
 
+double
+ComputeImageForces (int i, int level)
+{
+        int nx, ny;
+        int x, y;
+        int k;
+        Node *node;
+        Node *nodes;
+        Force *nodeForce;
+        Force *forces;
+        Point *absPos;
+        float deltaX, deltaY;
+        float kIntraThisImage;
+        IntraImageMap *iim;
+        IntraImageSpring *iis;
+        IntraImageSpring *iSprings;
+        int nSprings;
+        float d;
+        float sk;
+        float force;
+        float forceOverD;
+        float dfx, dfy;
+        double energy;
+#if PDEBUG
+        int factor = 1 << level;
+#endif
 
+        energy = 0.0;
+        nx = images[i].nx;
+        ny = images[i].ny;
+        forces = images[i].forces;
+#if PDEBUG
+        poix = (int) floor(poixv / factor + 0.5);
+        poiy = (int) floor(poiyv / factor + 0.5);
+#endif
+        if (images[i].absolutePositions != NULL)
+        {
+                /* compute absolute location forces */
+                node = images[i].nodes;
+                nodeForce = forces;
+                absPos = images[i].absolutePositions[startLevel - level];
+                for (y = 0; y < ny; ++y)
+                        for (x = 0; x < nx; ++x, ++node, ++nodeForce, ++absPos)
+                        {
+                                if (node->x > 0.5 * UNSPECIFIED)
+                                        continue;
+                                if (absPos->x < 0.5 * UNSPECIFIED)
+                                        deltaX = absPos->x - node->x;
+                                else
+                                        deltaX = 0.0;
+                                if (absPos->y < 0.5 * UNSPECIFIED)
+                                        deltaY = absPos->y - node->y;
+                                else
+                                        deltaY = 0;
+                                nodeForce->fx = kAbsolute * deltaX;
+                                nodeForce->fy = kAbsolute * deltaY;
+                                energy += kAbsolute * (deltaX * deltaX + deltaY * deltaY);
+                                if (isinf(energy) || isnan(energy))
+                                        abort();
+                                //			if (x == 0 && y == 0)
+                                //			  Log("ENERGY COMP %f %f %f %f %f %f %f %f\n",
+                                //			      kAbsolute, deltaX, deltaY, absPos->x, absPos->y,
+                                //			      node->x, node->y, energy);
+                        }
+        }
+        else
+                /* zero all forces */
+                memset(forces, 0, nx * ny * sizeof(Force));
+
+        /* add in intra-section forces */
+        kIntraThisImage = kIntra * images[i].kFactor;
+        iim = images[i].map;
+        nodes = images[i].nodes;
+        if (simdLevel != SIMD_NONE)
+        {
+                energy += ComputeStencilForces(nodes, forces,
+                                               iim->stencils[startLevel - level],
+                                               nx, ny, kIntraThisImage);
+                if (isinf(energy) || isnan(energy))
+                        abort();
+                return(energy);
+        }
+        nSprings = iim->nSprings[startLevel - level];
+        iSprings = iim->springs[startLevel - level];
+        for (k = 0; k < nSprings; ++k)
+        {
+                iis = &(iSprings[k]);
+                if (nodes[iis->index0].x > 0.5 * UNSPECIFIED ||
+                    nodes[iis->index1].x > 0.5 * UNSPECIFIED)
+                        continue;
+                deltaX = nodes[iis->index1].x - nodes[iis->index0].x;
+                deltaY = nodes[iis->index1].y - nodes[iis->index0].y;
+                d = sqrt(deltaX * deltaX + deltaY * deltaY);
+                sk = kIntraThisImage * iis->k;
+                force = sk * (d - iis->nomD);
+                energy += force * (d - iis->nomD);
+                if (isinf(energy) || isnan(energy))
+                        abort();
+                if (d != 0.0)
+                {
+                        forceOverD = force / d;
+                        dfx = forceOverD * deltaX;
+                        dfy = forceOverD * deltaY;
+                        forces[iis->index0].fx += dfx;
+                        forces[iis->index0].fy += dfy;
+                        forces[iis->index1].fx -= dfx;
+                        forces[iis->index1].fy -= dfy;
+                }
+#if DEBUG
+#if PDEBUG
+                if (i == ioi &&
+                    (iis->index0 % images[i].nx == poix &&
+                     iis->index0 / images[i].nx == poiy ||
+                     iis->index1 % images[i].nx == poix &&
+                     iis->index1 / images[i].nx == poiy))
+#endif
+                Log("intraforce: %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) dist %f nom %f force (%f %f)\n",
+                    i, iis->index0 % images[i].nx, iis->index0 / images[i].nx,
+                    i, iis->index1 % images[i].nx, iis->index1 / images[i].nx,
+                    nodes[iis->index0].x, nodes[iis->index0].y,
+                    nodes[iis->index1].x, nodes[iis->index1].y,
+                    d, iis->nomD,
+                    d != 0.0 ? dfx : 1000000000.0,
+                    d != 0.0 ? dfy : 1000000000.0);
+#endif
+        }
+        return(energy);
+}
 
 double
-MinimumAreaRectangle (int n, Point *p, Point *corners)
+ComputeMapForces (InterImageMap *m, int level)
 {
-        int i, j, k, m;
-        double alpha, beta, gamma, delta;
-        double slope;
-        double d1, d2;
-        double A, Amin;
-        int start;
-        Point p2;
+        int j, k;
+        int x, y;
+        int irx, iry;
+        int nx, nx1;
+        int ns;
+        int nStrips;
+        int springsPos;
+        int sme;
+        int src, tgt;
+        float msk, sk;
+        float xv, yv;
+        float deltaX, deltaY;
+        float kdx, kdy;
+        Node *nodes0, *nodes1;
+        Force *forces0, *forces1;
+        InterImageStrip *strips;
+        InterImageStrip *strip;
+        InterImageSpring *springs;
+        InterImageSpring *s;
+        double energy;
+#if PDEBUG
+        int factor = 1 << level;
 
-        /* convert pts to have the point with the smallest y coordinate first */
-        start = 0;
-        for (i = 1; i < n; ++i)
-                if (p[i].y < p[start].y ||
-                    p[i].y == p[start].y && p[i].x < p[start].x)
-                        start = i;
-        printf("start = %d\n", start);
+        poix = (int) floor(poixv / factor + 0.5);
+        poiy = (int) floor(poiyv / factor + 0.5);
+#endif
 
-        alpha = 0.0;
-        beta = Angle(p[start].x, p[start].y,
-                     p[(start + 1) % n].x, p[(start + 1) % n].y,
-                     p[(start + 2) % n].x, p[(start + 2) % n].y);
-        gamma = beta;
-        delta = beta;
-        j = k = m = 1;
-        Amin = 1.0e+30;
-        /* find area of encasing rectangle anchored on each edge */
-        for (i = 0; i < n; ++i)
+        energy = 0.0;
+        msk = kInter * m->k;
+        if (msk == 0.0)
+                return(0.0);
+        sme = m->energyFactor != 0.0;
+        /* only accumulate forces on the movable images that this
+           process owns, and with -reaction_forces on the target images
+           it will send them back to; other forces are never used */
+        src = images[m->image0].owner == p && !images[m->image0].fixed;
+        tgt = (images[m->image1].owner == p || reactionForces) &&
+              !images[m->image1].fixed;
+        nStrips = m->nStrips[startLevel - level];
+        strips = m->strips[startLevel - level];
+        springs = m->springs[startLevel - level];
+        nodes0 = images[m->image0].nodes;
+        if (nodes0 == NULL)
+                abort();
+        nodes1 = images[m->image1].nodes;
+        forces0 = images[m->image0].forces;
+        forces1 = images[m->image1].forces;
+        nx = images[m->image0].nx;
+        nx1 = images[m->image1].nx;
+        springsPos = 0;
+        for (j = 0; j < nStrips; ++j)
         {
-                /* find angle of rotation of next edge of polygon */
-                if (i > 0)
-                        alpha += Angle(p[(start + i + n - 1) % n].x, p[(start + i + n - 1) % n].y,
-                                       p[(start + i) % n].x, p[(start + i) % n].y,
-                                       p[(start + i + 1) % n].x, p[(start + i + 1) % n].y);
-
-                /* find a vertex on first perpendicular line of support */
-                while (beta < alpha + M_PI / 2.0)
+                strip = &(strips[j]);
+                ns = strip->nSprings;
+                x = strip->x0;
+                y = strip->y0;
+                irx = strip->x1;
+                iry = strip->y1;
+                for (k = 0; k < ns; ++k, ++x)
                 {
-                        ++j;
-                        beta += Angle(p[(start + j + n - 1) % n].x, p[(start + j + n - 1) % n].y,
-                                      p[(start + j) % n].x, p[(start + j) % n].y,
-                                      p[(start + j + 1) % n].x, p[(start + j + 1) % n].y);
+                        s = &(springs[springsPos++]);
+                        irx += ((s->dxy1) >> 4) - 8;
+                        iry += ((s->dxy1) & 0xf) - 8;
+                        if (nodes0[y*nx+x].x > 0.5 * UNSPECIFIED ||
+                            nodes1[iry*nx1+irx].x > 0.5 * UNSPECIFIED)
+                                continue;
+                        xv = nodes1[iry*nx1+irx].x + 0.00005 * s->dx;
+                        yv = nodes1[iry*nx1+irx].y + 0.00005 * s->dy;
+                        deltaX = xv - nodes0[y*nx + x].x;
+                        deltaY = yv - nodes0[y*nx + x].y;
+                        sk = (s->k / 255.0) * msk;
+                        kdx = sk * deltaX;
+                        kdy = sk * deltaY;
+#if DEBUG
+#if PDEBUG
+                        if (m->image0 == ioi && x == poix && y == poiy ||
+                            m->image1 == ioi && irx == poix && iry == poiy)
+#endif
+                        Log("interforce %d(%d,%d) - %d(%d,%d): (%f %f) to (%f %f) (%d %d) (%f %f) (%f %f) (%f %f)\n",
+                            m->image0, x, y,
+                            m->image1, irx, iry,
+                            nodes0[y*nx+x].x, nodes0[y*nx+x].y,
+                            xv, yv,
+                            irx, iry,
+                            nodes1[iry*nx1+irx].x, nodes1[iry*nx1+irx].y,
+                            0.00005 * s->dx, 0.00005 * s->dy,
+                            kdx, kdy);
+#endif
+                        if (src)
+                        {
+                                forces0[y*nx + x].fx += kdx;
+                                forces0[y*nx + x].fy += kdy;
+                        }
+                        if (sme)
+                                energy += sk * (deltaX * deltaX + deltaY * deltaY);
+                        if (isinf(energy) || isnan(energy))
+                                abort();
+                        if (tgt)
+                        {
+                                forces1[iry*nx1 + irx].fx -= kdx;
+                                forces1[iry*nx1 + irx].fy -= kdy;
+                        }
                 }
+        }
+        return(energy);
+}
+
+float
+ComputeMaxForce (int i, float dampingFactor)
+{
+        int k;
+        int nNodes;
+        Force *nodeForce;
+        unsigned char *flags;
+        float force;
+        float maxF;
+        float maxF2;
+
+        maxF = 0.0;
+        if (images[i].fixed)
+                return(maxF);
+        nNodes = images[i].nx * images[i].ny;
+        flags = images[i].nodeFlags;
+        k = 0;
+#if HAVE_X86_SIMD
+        if (simdLevel != SIMD_NONE)
+        {
+                maxF2 = 0.0;
+                if (simdLevel == SIMD_AVX512)
+                        k = MaxForceAVX512(images[i].forces, flags, nNodes, &maxF2);
+                else
+                        k = MaxForceAVX2(images[i].forces, flags, nNodes, &maxF2);
+                maxF = dampingFactor * sqrt(maxF2);
+        }
+#endif
+        nodeForce = &(images[i].forces[k]);
+        for (; k < nNodes; ++k, ++nodeForce)
+        {
+                if (flags[k] & NODE_MOVE_X)
+                        if (flags[k] & NODE_MOVE_Y)
+                                force = dampingFactor * hypot(nodeForce->fx, nodeForce->fy);
+                        else
+                                force = dampingFactor * fabsf(nodeForce->fx);
+                else
+                if (flags[k] & NODE_MOVE_Y)
+                        force = dampingFactor * fabsf(nodeForce->fy);
+                else
+                        continue;
+                if (force > maxF)
+                        maxF = force;
+        }
+        return(maxF);
+}
 
-                /* find a vertex on parallel line of support */
-                while (gamma < alpha + M_PI)
-                {
-                        ++k;
-                        gamma += Angle(p[(start + k + n - 1) % n].x, p[(start + k + n - 1) % n].y,
-                                       p[(start + k) % n].x, p[(start + k) % n].y,
-                                       p[(start + k + 1) % n].x, p[(start + k + 1) % n].y);
-                }
+void
+UpdatePositions (int i, float scale, float maxStepX, float maxStepY)
+{
+        int k;
+        int nNodes;
+        Node *node;
+        Force *nodeForce;
+        unsigned char *flags;
+        float deltaX, deltaY;
 
-                /* find a vertex on second perpendicular line of support */
-                while (delta < alpha + 3.0 * M_PI / 2.0)
+        if (images[i].fixed)
+                return;
+        nNodes = images[i].nx * images[i].ny;
+        flags = images[i].nodeFlags;
+        k = 0;
+#if HAVE_X86_SIMD
+        if (simdLevel == SIMD_AVX512)
+                k = UpdatePositionsAVX512(images[i].nodes, images[i].forces, flags, nNodes,
+                                          scale, maxStepX, maxStepY);
+        else if (simdLevel == SIMD_AVX2)
+                k = UpdatePositionsAVX2(images[i].nodes, images[i].forces, flags, nNodes,
+                                        scale, maxStepX, maxStepY);
+#endif
+        node = &(images[i].nodes[k]);
+        nodeForce = &(images[i].forces[k]);
+        for (; k < nNodes; ++k, ++node, ++nodeForce)
+        {
+                if (!(flags[k] & NODE_VALID))
+                        continue;
+                deltaX = 0.0;
+                deltaY = 0.0;
+                if (flags[k] & NODE_MOVE_X)
                 {
-                        ++m;
-                        delta += Angle(p[(start + m + n - 1) % n].x, p[(start + m + n - 1) % n].y,
-                                       p[(start + m) % n].x, p[(start + m) % n].y,
-                                       p[(start + m + 1) % n].x, p[(start + m + 1) % n].y);
-                }
+                        deltaX = scale * nodeForce->fx;
+                        if (deltaX > maxStepX)
+                                deltaX = maxStepX;
+                        else if (deltaX < -maxStepX)
+                                deltaX = -maxStepX;
+                        node->x += deltaX;
 
-                /* find distances between parallel and perpendicular lines of support */
-                if (p[(start + i + 1) % n].x == p[(start + i) % n].x)
-                {
-                        d1 = fabs(p[(start + k) % n].x - p[(start + i) % n].x);
-                        d2 = fabs(p[(start + m) % n].y - p[(start + j) % n].y);
                 }
-                else if (p[(start + i + 1) % n].y == p[(start + i) % n].y)
+                if (flags[k] & NODE_MOVE_Y)
                 {
-                        d1 = fabs(p[(start + k) % n].y - p[(start + i) % n].y);
-                        d2 = fabs(p[(start + m) % n].x - p[(start + j) % n].x);
+                        deltaY = scale * nodeForce->fy;
+                        if (deltaY > maxStepY)
+                                deltaY = maxStepY;
+                        else if (deltaY < -maxStepY)
+                                deltaY = -maxStepY;
+                        node->y += deltaY;
                 }
+#if DEBUG
+#if PDEBUG
+                if (i == ioi && k % images[i].nx == poix &&
+                    k / images[i].nx == poiy)
+#endif
+                Log("moving point %d(%d,%d) at (%f %f) by (%f %f) to (%f %f) force (%f %f)\n",
+                    i, k % images[i].nx, k / images[i].nx,
+                    node->x - deltaX, node->y - deltaY,
+                    deltaX, deltaY,
+                    node->x, node->y,
+                    nodeForce->fx, nodeForce->fy);
+#endif
+        }
+}
+
+void
+InitNodeFlags (unsigned char *flags, Node *nodes, int nNodes)
+{
+        int k;
+
+        /* all valid nodes are free to move until they are constrained */
+        for (k = 0; k < nNodes; ++k)
+                if (nodes[k].x > 0.5 * UNSPECIFIED)
+                        flags[k] = 0;
                 else
-                {
-                        slope = (p[(start + i + 1) % n].y- p[(start + i) %n].y) /
-                                (p[(start + i + 1) % n].x - p[(start + i) % n].x);
-                        d1 = PerpDist(p[(start + i) % n].x, p[(start + i) % n].y,
-                                      p[(start + k) % n].x, p[(start + k) % n].y,
-                                      slope);
-                        d2 = PerpDist(p[(start + j) % n].x, p[(start + j) % n].y,
-                                      p[(start + m) % n].x, p[(start + m) % n].y,
-                                      -1.0 / slope);
-                }
+                        flags[k] = NODE_VALID | NODE_MOVE_X | NODE_MOVE_Y;
+}
 
-                /* compute area of encasing rectangle anchored on current edge */
-                A = d1 * d2;
-                printf("i = %d  d1 = %f d2 = %f A = %f\n", i, d1, d2, A);
-                if (i == 0 || A < Amin)
-                {
-                        Amin = A;
-                        printf("PTi = %f %f\n", p[(start + i) % n].x, p[(start + i) % n].y);
-                        printf("PTi+1 = %f %f\n", p[(start + i + 1) % n].x, p[(start + i + 1) % n].y);
-                        printf("PTj = %f %f\n", p[(start + j) % n].x, p[(start + j) % n].y);
-                        printf("PTk = %f %f\n", p[(start + k) % n].x, p[(start + k) % n].y);
-                        printf("PTm = %f %f\n", p[(start + m) % n].x, p[(start + m) % n].y);
-                        p2.x = p[(start + k) % n].x + (p[(start + i + 1) % n].x -
-                                                       p[(start + i) % n].x);
-                        p2.y = p[(start + k) % n].y + (p[(start + i + 1) % n].y -
-                                                       p[(start + i) % n].y);
-                        printf("PT2 = %f %f\n", p2.x, p2.y);
+float *
+BuildStencil (int nSprings, IntraImageSpring *springs, int nx, int ny)
+{
+        int k;
+        int n;
+        int dir;
+        int offset;
+        float *stencil;
 
-                        PointProjectionOnLine(p[(start + i) % n],
-                                              p[(start + i + 1) % n],
-                                              p[(start + j) % n],
-                                              &corners[0]);
-                        PointProjectionOnLine(p[(start + i) % n],
-                                              p[(start + i + 1) % n],
-                                              p[(start + m) % n],
-                                              &corners[1]);
-                        PointProjectionOnLine(p[(start + k) % n],
-                                              p2,
-                                              p[(start + m) % n],
-                                              &corners[2]);
-                        PointProjectionOnLine(p[(start + k) % n],
-                                              p2,
-                                              p[(start + j) % n],
-                                              &corners[3]);
-                }
+        n = nx * ny;
+        stencil = (float *) malloc(2 * INTRA_DIRECTIONS * n * sizeof(float));
+        memset(stencil, 0, 2 * INTRA_DIRECTIONS * n * sizeof(float));
+        for (k = 0; k < nSprings; ++k)
+        {
+                offset = springs[k].index1 - springs[k].index0;
+                if (offset == nx)
+                        dir = INTRA_S;
+                else if (offset == 1)
+                        dir = INTRA_E;
+                else if (offset == nx + 1)
+                        dir = INTRA_SE;
+                else if (offset == 1 - nx)
+                        dir = INTRA_NE;
+                else
+                        Error("Internal error: unexpected intra-image spring from %d to %d\n",
+                              springs[k].index0, springs[k].index1);
+                stencil[2 * dir * n + springs[k].index0] = springs[k].k;
+                stencil[(2 * dir + 1) * n + springs[k].index0] = springs[k].nomD;
         }
-        return(Amin);
+        return(stencil);
 }
 
 void
-PointProjectionOnLine (Point p0, Point p1, Point q, Point *proj)
+SelectSimd ()
 {
-        double dx, dy;
-        double u;
-
-        dx = p1.x - p0.x;
-        dy = p1.y - p0.y;
-        u = ((q.x - p0.x) * dx + (q.y - p0.y) * dy) / (dx * dx + dy * dy);
-        proj->x = p0.x + u * dx;
-        proj->y = p0.y + u * dy;
+        int best;
+
+        best = SIMD_NONE;
+#if HAVE_X86_SIMD && !DEBUG
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+                best = SIMD_AVX512;
+        else if (__builtin_cpu_supports("avx2"))
+                best = SIMD_AVX2;
+#endif
+        if (simdLevel > best)
+                Log("Vector instructions %s are not available on this processor.\n",
+                    simdNames[simdLevel]);
+        if (simdLevel < 0 || simdLevel > best)
+                simdLevel = best;
+        Log("Using vector instructions: %s\n", simdNames[simdLevel]);
 }
 
 double
-PerpDist (double x1, double y1, double x2, double y2, double s)
+ComputeStencilForces (Node *nodes, Force *forces, float *stencil,
+                      int nx, int ny, float kIntraThisImage)
 {
-        return(fabs(s * (x2 - x1) - y2 + y1) / sqrt(s*s + 1.0));
+        int y;
+        int n;
+        double energy;
+        double (*rowForces)(Node *, Force *, float *, float *, int, int, int, float);
+
+        /* the springs of each direction within a row are independent,
+           so they are processed a vector at a time */
+        rowForces = StencilRowForces;
+#if HAVE_X86_SIMD
+        if (simdLevel == SIMD_AVX512)
+                rowForces = StencilRowForcesAVX512;
+        else if (simdLevel == SIMD_AVX2)
+                rowForces = StencilRowForcesAVX2;
+#endif
+        n = nx * ny;
+        energy = 0.0;
+        for (y = 0; y < ny; ++y)
+        {
+                if (y > 0)
+                        energy += (*rowForces)(nodes, forces,
+                                               &stencil[2 * INTRA_NE * n],
+                                               &stencil[(2 * INTRA_NE + 1) * n],
+                                               y * nx, nx - 1, 1 - nx, kIntraThisImage);
+                energy += (*rowForces)(nodes, forces,
+                                       &stencil[2 * INTRA_E * n],
+                                       &stencil[(2 * INTRA_E + 1) * n],
+                                       y * nx, nx - 1, 1, kIntraThisImage);
+                if (y < ny - 1)
+                {
+                        energy += (*rowForces)(nodes, forces,
+                                               &stencil[2 * INTRA_SE * n],
+                                               &stencil[(2 * INTRA_SE + 1) * n],
+                                               y * nx, nx - 1, nx + 1, kIntraThisImage);
+                        energy += (*rowForces)(nodes, forces,
+                                               &stencil[2 * INTRA_S * n],
+                                               &stencil[(2 * INTRA_S + 1) * n],
+                                               y * nx, nx, nx, kIntraThisImage);
+                }
+        }
+        return(energy);
 }
 
 double
-Angle (double x0, double y0,
-       double x1, double y1,
-       double x2, double y2)
+StencilRowForces (Node *nodes, Force *forces, float *k, float *nomD,
+                  int i0, int n, int offset, float kIntraThisImage)
 {
-        double a = atan2(y2 - y1, x2 - x1) - atan2(y1 - y0, x1 - x0);
-        if (a > M_PI)
-                a -= 2.0 * M_PI;
-        else if (a < -M_PI)
-                a += 2.0 * M_PI;
-        return(a);
-}
+        int i, j;
+        float deltaX, deltaY;
+        float d;
+        float force;
+        float forceOverD;
+        float dfx, dfy;
+        double energy;
 
-void
-ConstrainNodes (int imageNum,
-                Node *nodes, int nx, int ny, int factor,
-                int nConstraints, double *constraints,
-                double *coeff)
-{
-        int i,j,k;
-        int x, y;
-        int ix, iy;
-        int *assigned;
-        float *nodeDistance;
-        int *nodeConstraint;
-        int closestX, closestY;
-        float distance;
-        float dist;
-        float dx, dy;
+        /* compute the forces of the n springs from nodes i0 to i0+n-1
+           to the nodes offset from them */
+        energy = 0.0;
+        for (i = i0; i < i0 + n; ++i)
+        {
+                j = i + offset;
+                if (nodes[i].x > 0.5 * UNSPECIFIED ||
+                    nodes[j].x > 0.5 * UNSPECIFIED)
+                        continue;
+                deltaX = nodes[j].x - nodes[i].x;
+                deltaY = nodes[j].y - nodes[i].y;
+                d = sqrt(deltaX * deltaX + deltaY * deltaY);
+                force = kIntraThisImage * k[i] * (d - nomD[i]);
+                energy += force * (d - nomD[i]);
+                if (d != 0.0)
+                {
+                        forceOverD = force / d;
+                        dfx = forceOverD * deltaX;
+                        dfy = forceOverD * deltaY;
+                        forces[i].fx += dfx;
+                        forces[i].fy += dfy;
+                        forces[j].fx -= dfx;
+                        forces[j].fy -= dfy;
+                }
+        }
+        return(energy);
+}
 
-        //  Log("ConstrainNodes called; nx = %d ny = %d; nConstraints = %d\n",
-        //      nx, ny, nConstraints);
-        assigned = (int *) malloc(nConstraints * sizeof(int));
-        memset(assigned, 0, nConstraints * sizeof(int));
-        nodeDistance = (float *) malloc(nx * ny * sizeof(float));
-        nodeConstraint = (int *) malloc(nx * ny * sizeof(int));
+#if HAVE_X86_SIMD
+/* The vectorized kernels below work directly on the interleaved
+   (x, y) pairs of the Node and Force arrays, so each AVX2 vector
+   holds 4 nodes and each AVX-512 vector holds 8 nodes.  They return
+   after the last full vector and leave the remainder to the scalar
+   code. */
 
-        // make 4 assignment passes
-        for (i = 0; i < 4; ++i)
+double
+StencilRowForcesAVX2 (Node *nodes, Force *forces, float *k, float *nomD,
+                      int i0, int n, int offset, float kIntraThisImage)
+{
+        int m;
+        int i;
+        __m256 limit, kImage, zero, energy;
+        __m256 p0, p1, valid, delta, sq, d, kk, nd, stretch, force, df;
+        __m128 k4, nd4;
+        float e[8];
+
+        limit = _mm256_set1_ps(0.5 * UNSPECIFIED);
+        kImage = _mm256_set1_ps(kIntraThisImage);
+        zero = _mm256_setzero_ps();
+        energy = zero;
+        for (m = 0; m + 4 <= n; m += 4)
         {
-                for (y = 0; y < ny; ++y)
-                        for (x = 0; x < nx; ++x)
-                        {
-                                nodeDistance[y*nx+x] = 1000000000.0;
-                                nodeConstraint[y*nx+x] = -1;
-                        }
+                i = i0 + m;
+                p0 = _mm256_loadu_ps(&nodes[i].x);
+                p1 = _mm256_loadu_ps(&nodes[i + offset].x);
+                valid = _mm256_and_ps(_mm256_cmp_ps(_mm256_moveldup_ps(p0), limit, _CMP_LE_OQ),
+                                      _mm256_cmp_ps(_mm256_moveldup_ps(p1), limit, _CMP_LE_OQ));
+                delta = _mm256_sub_ps(p1, p0);
+                sq = _mm256_mul_ps(delta, delta);
+                d = _mm256_sqrt_ps(_mm256_add_ps(sq, _mm256_permute_ps(sq, 0xb1)));
+                k4 = _mm_loadu_ps(&k[i]);
+                nd4 = _mm_loadu_ps(&nomD[i]);
+                kk = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_unpacklo_ps(k4, k4)),
+                                          _mm_unpackhi_ps(k4, k4), 1);
+                nd = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_unpacklo_ps(nd4, nd4)),
+                                          _mm_unpackhi_ps(nd4, nd4), 1);
+                stretch = _mm256_sub_ps(d, nd);
+                force = _mm256_mul_ps(_mm256_mul_ps(kImage, kk), stretch);
+                energy = _mm256_add_ps(energy,
+                                       _mm256_and_ps(valid, _mm256_mul_ps(force, stretch)));
+                valid = _mm256_and_ps(valid, _mm256_cmp_ps(d, zero, _CMP_NEQ_OQ));
+                df = _mm256_and_ps(valid, _mm256_mul_ps(_mm256_div_ps(force, d), delta));
+                _mm256_storeu_ps(&forces[i].fx,
+                                 _mm256_add_ps(_mm256_loadu_ps(&forces[i].fx), df));
+                _mm256_storeu_ps(&forces[i + offset].fx,
+                                 _mm256_sub_ps(_mm256_loadu_ps(&forces[i + offset].fx), df));
+        }
+        /* every spring was counted in both its x and its y lane */
+        _mm256_storeu_ps(e, energy);
+        return(0.5 * ((e[0] + e[1]) + (e[2] + e[3]) + (e[4] + e[5]) + (e[6] + e[7])) +
+               StencilRowForces(nodes, forces, k, nomD, i0 + m, n - m, offset,
+                                kIntraThisImage));
+}
 
-                // for each constraint
-                for (j = 0; j < nConstraints; ++j)
-                {
-                        if (assigned[j])
-                                continue;
-                        ix = (int) (constraints[j*4] / factor);
-                        iy = (int) (constraints[j*4+1] / factor);
-                        // choose the closest unconstrained node
-                        closestX = -1;
-                        closestY = -1;
-                        distance = 1000000000.0;
-                        for (k = 0; k < 4; ++k)
-                        {
-                                x = ix + (k & 1);
-                                y = iy + (k >> 1);
-                                if (x < 0 || x >= nx ||
-                                    y < 0 || y >= ny ||
-                                    nodes[y*nx+x].x > 0.5 * UNSPECIFIED ||
-                                    nodes[y*nx+x].fx > 0.5 * CONSTRAINED ||
-                                    nodes[y*nx+x].fy > 0.5 * CONSTRAINED)
-                                {
-                                        //		  Log("Skipping node %d %d because .x = %f .fx = %f .fy = %f\n",
-                                        //		      x, y, nodes[y*nx+x].x, nodes[y*nx+x].fx, nodes[y*nx+x].fy);
-                                        continue;
-                                }
+double
+StencilRowForcesAVX512 (Node *nodes, Force *forces, float *k, float *nomD,
+                        int i0, int n, int offset, float kIntraThisImage)
+{
+        int m;
+        int i;
+        __m512 limit, kImage, zero, energy;
+        __m512 p0, p1, delta, sq, d, kk, nd, stretch, force, df;
+        __m512i pairs;
+        __mmask16 valid;
+
+        limit = _mm512_set1_ps(0.5 * UNSPECIFIED);
+        kImage = _mm512_set1_ps(kIntraThisImage);
+        zero = _mm512_setzero_ps();
+        pairs = _mm512_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7);
+        energy = zero;
+        for (m = 0; m + 8 <= n; m += 8)
+        {
+                i = i0 + m;
+                p0 = _mm512_loadu_ps(&nodes[i].x);
+                p1 = _mm512_loadu_ps(&nodes[i + offset].x);
+                valid = _mm512_cmp_ps_mask(_mm512_moveldup_ps(p0), limit, _CMP_LE_OQ) &
+                        _mm512_cmp_ps_mask(_mm512_moveldup_ps(p1), limit, _CMP_LE_OQ);
+                delta = _mm512_sub_ps(p1, p0);
+                sq = _mm512_mul_ps(delta, delta);
+                d = _mm512_sqrt_ps(_mm512_add_ps(sq, _mm512_permute_ps(sq, 0xb1)));
+                kk = _mm512_permutexvar_ps(pairs, _mm512_castps256_ps512(_mm256_loadu_ps(&k[i])));
+                nd = _mm512_permutexvar_ps(pairs, _mm512_castps256_ps512(_mm256_loadu_ps(&nomD[i])));
+                stretch = _mm512_sub_ps(d, nd);
+                force = _mm512_mul_ps(_mm512_mul_ps(kImage, kk), stretch);
+                energy = _mm512_mask_add_ps(energy, valid, energy,
+                                            _mm512_mul_ps(force, stretch));
+                valid &= _mm512_cmp_ps_mask(d, zero, _CMP_NEQ_OQ);
+                df = _mm512_maskz_mul_ps(valid, _mm512_div_ps(force, d), delta);
+                _mm512_storeu_ps(&forces[i].fx,
+                                 _mm512_add_ps(_mm512_loadu_ps(&forces[i].fx), df));
+                _mm512_storeu_ps(&forces[i + offset].fx,
+                                 _mm512_sub_ps(_mm512_loadu_ps(&forces[i + offset].fx), df));
+        }
+        /* every spring was counted in both its x and its y lane */
+        return(0.5 * _mm512_reduce_add_ps(energy) +
+               StencilRowForces(nodes, forces, k, nomD, i0 + m, n - m, offset,
+                                kIntraThisImage));
+}
 
-                                dist = hypot(constraints[j*4] - x * factor,
-                                             constraints[j*4+1] - y * factor);
-                                if (dist < distance)
-                                {
-                                        closestX = x;
-                                        closestY = y;
-                                        distance = dist;
-                                }
-                        }
+int
+MaxForceAVX2 (Force *forces, unsigned char *flags, int nNodes, float *maxF2)
+{
+        int k;
+        int f4;
+        __m256i bits;
+        __m256 move, f, sq, maxSq;
+        float v[8];
+
+        bits = _mm256_setr_epi32(NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y);
+        maxSq = _mm256_setzero_ps();
+        for (k = 0; k + 4 <= nNodes; k += 4)
+        {
+                memcpy(&f4, &flags[k], 4);
+                move = _mm256_castsi256_ps(
+                        _mm256_cmpeq_epi32(_mm256_and_si256(
+                                                   _mm256_cvtepu8_epi32(_mm_unpacklo_epi8(_mm_cvtsi32_si128(f4),
+                                                                                          _mm_cvtsi32_si128(f4))),
+                                                   bits),
+                                           bits));
+                f = _mm256_and_ps(move, _mm256_loadu_ps(&forces[k].fx));
+                sq = _mm256_mul_ps(f, f);
+                maxSq = _mm256_max_ps(maxSq, _mm256_add_ps(sq, _mm256_permute_ps(sq, 0xb1)));
+        }
+        _mm256_storeu_ps(v, maxSq);
+        for (f4 = 0; f4 < 8; ++f4)
+                if (v[f4] > *maxF2)
+                        *maxF2 = v[f4];
+        return(k);
+}
 
-                        if (closestX >= 0 &&
-                            distance < nodeDistance[closestY*nx + closestX])
-                        {
-                                nodeConstraint[closestY * nx + closestX] = j;
-                                nodeDistance[closestY*nx + closestX] = distance;
-                        }
-                }
+int
+MaxForceAVX512 (Force *forces, unsigned char *flags, int nNodes, float *maxF2)
+{
+        int k;
+        long long f8;
+        __m512i bits;
+        __mmask16 move;
+        __m512 f, sq, maxSq;
+
+        bits = _mm512_setr_epi32(NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y);
+        maxSq = _mm512_setzero_ps();
+        for (k = 0; k + 8 <= nNodes; k += 8)
+        {
+                memcpy(&f8, &flags[k], 8);
+                move = _mm512_test_epi32_mask(
+                        _mm512_cvtepu8_epi32(_mm_unpacklo_epi8(_mm_cvtsi64_si128(f8),
+                                                               _mm_cvtsi64_si128(f8))),
+                        bits);
+                f = _mm512_maskz_loadu_ps(move, &forces[k].fx);
+                sq = _mm512_mul_ps(f, f);
+                maxSq = _mm512_max_ps(maxSq, _mm512_add_ps(sq, _mm512_permute_ps(sq, 0xb1)));
+        }
+        if (_mm512_reduce_max_ps(maxSq) > *maxF2)
+                *maxF2 = _mm512_reduce_max_ps(maxSq);
+        return(k);
+}
 
-                for (y = 0; y < ny; ++y)
-                        for (x = 0; x < nx; ++x)
-                                if (nodeConstraint[y * nx + x] >= 0)
-                                {
-                                        j = nodeConstraint[y * nx + x];
-                                        dx = factor * x - constraints[j*4];
-                                        dy = factor * y - constraints[j*4+1];
-                                        nodes[y*nx+x].x = (constraints[j*4+2] +
-                                                           coeff[1] * dx + coeff[2] * dy) / factor;
-                                        nodes[y*nx+x].y = (constraints[j*4+3] +
-                                                           coeff[7] * dx + coeff[8] * dy) / factor;
-                                        Log("Constraining node (%d %d) of image %d to (%f %f) (pixel %f %f)\n",
-                                            x, y, imageNum,
-                                            nodes[y*nx+x].x, nodes[y*nx+x].y,
-                                            factor * nodes[y*nx+x].x, factor * nodes[y*nx+x].y);
-                                        nodes[y*nx+x].fx = (j + 1) * CONSTRAINED;
-                                        nodes[y*nx+x].fy = (j + 1) * CONSTRAINED;
-                                        assigned[j] = 1;
-                                }
+int
+UpdatePositionsAVX2 (Node *nodes, Force *forces, unsigned char *flags, int nNodes,
+                     float scale, float maxStepX, float maxStepY)
+{
+        int k;
+        int f4;
+        __m256i bits;
+        __m256 s, maxStep, minStep, move, step;
+
+        bits = _mm256_setr_epi32(NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y);
+        s = _mm256_set1_ps(scale);
+        maxStep = _mm256_setr_ps(maxStepX, maxStepY, maxStepX, maxStepY,
+                                 maxStepX, maxStepY, maxStepX, maxStepY);
+        minStep = _mm256_sub_ps(_mm256_setzero_ps(), maxStep);
+        for (k = 0; k + 4 <= nNodes; k += 4)
+        {
+                memcpy(&f4, &flags[k], 4);
+                move = _mm256_castsi256_ps(
+                        _mm256_cmpeq_epi32(_mm256_and_si256(
+                                                   _mm256_cvtepu8_epi32(_mm_unpacklo_epi8(_mm_cvtsi32_si128(f4),
+                                                                                          _mm_cvtsi32_si128(f4))),
+                                                   bits),
+                                           bits));
+                step = _mm256_mul_ps(s, _mm256_loadu_ps(&forces[k].fx));
+                step = _mm256_min_ps(_mm256_max_ps(step, minStep), maxStep);
+                _mm256_storeu_ps(&nodes[k].x,
+                                 _mm256_add_ps(_mm256_loadu_ps(&nodes[k].x),
+                                               _mm256_and_ps(move, step)));
         }
+        return(k);
+}
 
-        free(assigned);
-        free(nodeDistance);
-        free(nodeConstraint);
+int
+UpdatePositionsAVX512 (Node *nodes, Force *forces, unsigned char *flags, int nNodes,
+                       float scale, float maxStepX, float maxStepY)
+{
+        int k;
+        long long f8;
+        __m512i bits;
+        __mmask16 move;
+        __m512 s, maxStep, minStep, step, pos;
+
+        bits = _mm512_setr_epi32(NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y,
+                                 NODE_MOVE_X, NODE_MOVE_Y, NODE_MOVE_X, NODE_MOVE_Y);
+        s = _mm512_set1_ps(scale);
+        maxStep = _mm512_setr_ps(maxStepX, maxStepY, maxStepX, maxStepY,
+                                 maxStepX, maxStepY, maxStepX, maxStepY,
+                                 maxStepX, maxStepY, maxStepX, maxStepY,
+                                 maxStepX, maxStepY, maxStepX, maxStepY);
+        minStep = _mm512_sub_ps(_mm512_setzero_ps(), maxStep);
+        for (k = 0; k + 8 <= nNodes; k += 8)
+        {
+                memcpy(&f8, &flags[k], 8);
+                move = _mm512_test_epi32_mask(
+                        _mm512_cvtepu8_epi32(_mm_unpacklo_epi8(_mm_cvtsi64_si128(f8),
+                                                               _mm_cvtsi64_si128(f8))),
+                        bits);
+                step = _mm512_mul_ps(s, _mm512_loadu_ps(&forces[k].fx));
+                step = _mm512_min_ps(_mm512_max_ps(step, minStep), maxStep);
+                pos = _mm512_loadu_ps(&nodes[k].x);
+                _mm512_storeu_ps(&nodes[k].x, _mm512_mask_add_ps(pos, move, pos, step));
+        }
+        return(k);
 }
+#endif
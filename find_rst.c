@@ -110,6 +110,12 @@ typedef struct Pair {
   char *pairName;
 } Pair;
 
+typedef struct PairPosition {
+  int pn;			/* index into the pairs array */
+  int z[2];			/* sections of the pair's image and
+				   reference in name order, lower first */
+} PairPosition;
+
 typedef struct Task {
   /* NOTE: any new fields added to this struct should
      be also added to PackTask and UnpackTask */ 
@@ -152,6 +158,9 @@ Result* results = 0;
 #define DIR_HASH_SIZE	8192
 char *dirHash[DIR_HASH_SIZE];
 char summaryName[PATH_MAX] = "";
+int affinity = 0;		/* if true, pairs are delegated in z-chains
+				   with affinity keys rather than in the
+				   order of the pairs file */
 
 /* GLOBAL VARIABLES FOR MASTER & WORKER */
 Context c;
@@ -193,6 +202,10 @@ void UnpackResult ();
 int Compare (const void *x, const void *y);
 int SortByName (const void *x, const void *y);
 int SortByQuality (const void *x, const void *y);
+int SortByString (const void *x, const void *y);
+int SortByPosition (const void *x, const void *y);
+void OrderPairs (Pair *pairs, int nPairs, int nChains,
+		 int *order, int (*section)[2]);
 int ParseRange (char *s, int *pos, int *minValue, int *maxValue);
 int ParseValue (char *s, int *pos, int *value);
 size_t CountBits (unsigned char *p, size_t n);
@@ -314,6 +327,8 @@ MasterTask (int argc,
   char outputDirName[PATH_MAX];
   int pn;
   char line[LINE_LENGTH+1];
+  int *order;
+  int (*section)[2];
 
   error = 0;
   c.type = 'p';
@@ -601,6 +616,8 @@ MasterTask (int argc,
       c.type = 't';
     else if (strcmp(argv[i], "-update") == 0)
       c.update = 1;
+    else if (strcmp(argv[i], "-affinity") == 0)
+      affinity = 1;
     else if (strcmp(argv[i], "-partial") == 0)
       c.partial = 1;
   
@@ -634,6 +651,7 @@ MasterTask (int argc,
       fprintf(stderr, "            [-min_scale_separation <percent>]\n");
       fprintf(stderr, "            [-update]\n");
       fprintf(stderr, "            [-partial]\n");
+      fprintf(stderr, "            [-affinity]\n");
       fprintf(stderr, "            [-logs <log_file_prefix>]\n");
       exit(1);
     }
@@ -714,8 +732,16 @@ MasterTask (int argc,
   t.pair.imageMinX = t.pair.imageMaxX = t.pair.imageMinY = t.pair.imageMaxY = -1;
   t.pair.refMinX = t.pair.refMaxX = t.pair.refMinY = t.pair.refMaxY = -1;
   Log("nPairs = %d\n", nPairs);
-  for (pn = 0; pn < nPairs; ++pn)
+  order = (int *) malloc(nPairs * sizeof(int));
+  section = (int (*)[2]) malloc(nPairs * 2 * sizeof(int));
+  if (affinity)
+    OrderPairs(pairs, nPairs, c.nWorkers, order, section);
+  else
+    for (i = 0; i < nPairs; ++i)
+      order[i] = i;
+  for (i = 0; i < nPairs; ++i)
     {
+      pn = order[i];
       memcpy(&(t.pair), &(pairs[pn]), sizeof(Pair));
 
       // make sure that output directories exist
@@ -724,9 +750,13 @@ MasterTask (int argc,
 	continue;
 
       Log("Delegating pair %d\n", pn);
+      if (affinity)
+	par_set_affinity(2, section[pn]);
       par_delegate_task();
     }
   par_finish();
+  free(order);
+  free(section);
 
   if (summaryName[0] != '\0')
     {
@@ -2492,6 +2522,124 @@ SortByName (const void *x, const void *y)
   return(strcmp(rx->pair.imageName, ry->pair.imageName));
 }
 
+/* compares two strings, treating each run of digits as a number
+   so that, for example, s9 sorts before s10; strings that differ
+   only in leading zeros are ordered as by strcmp */
+int
+SortByString (const void *x, const void *y)
+{
+  const char *s0, *s1;
+  const char *a, *b;
+  const char *ea, *eb;
+
+  s0 = *((char **) x);
+  s1 = *((char **) y);
+  a = s0;
+  b = s1;
+  while (*a != '\0' && *b != '\0')
+    if (*a >= '0' && *a <= '9' && *b >= '0' && *b <= '9')
+      {
+	while (*a == '0')
+	  ++a;
+	while (*b == '0')
+	  ++b;
+	for (ea = a; *ea >= '0' && *ea <= '9'; ++ea) ;
+	for (eb = b; *eb >= '0' && *eb <= '9'; ++eb) ;
+	if (ea - a != eb - b)
+	  return(ea - a < eb - b ? -1 : 1);
+	for (; a < ea; ++a, ++b)
+	  if (*a != *b)
+	    return(*a < *b ? -1 : 1);
+      }
+    else if (*a != *b)
+      return(((unsigned char) *a) - ((unsigned char) *b));
+    else
+      {
+	++a;
+	++b;
+      }
+  if (*a != *b)
+    return(((unsigned char) *a) - ((unsigned char) *b));
+  return(strcmp(s0, s1));
+}
+
+int
+SortByPosition (const void *x, const void *y)
+{
+  PairPosition *px, *py;
+  px = (PairPosition *) x;
+  py = (PairPosition *) y;
+  if (px->z[0] != py->z[0])
+    return(px->z[0] - py->z[0]);
+  if (px->z[1] != py->z[1])
+    return(px->z[1] - py->z[1]);
+  return(px->pn - py->pn);
+}
+
+/* OrderPairs decides the order in which the pairs are delegated.
+   Each image is numbered by its position in name order (with numbers
+   within the names compared by value), and
+   section[pn] receives the numbers of pair pn's image and reference.
+   The pairs are sorted into a chain along z; the chain is cut into
+   nChains runs of consecutive pairs, and the runs are interleaved in
+   order[] so that each worker can follow one run. */
+void
+OrderPairs (Pair *pairs, int nPairs, int nChains,
+	    int *order, int (*section)[2])
+{
+  int i, j, k;
+  int n;
+  int pn;
+  int nNames;
+  char **names;
+  char **found;
+  PairPosition *pp;
+  int runLength;
+
+  if (nPairs == 0)
+    return;
+  names = (char **) malloc(2 * nPairs * sizeof(char *));
+  for (pn = 0; pn < nPairs; ++pn)
+    {
+      names[2*pn] = pairs[pn].imageName;
+      names[2*pn+1] = pairs[pn].refName;
+    }
+  qsort(names, 2*nPairs, sizeof(char *), SortByString);
+  nNames = 0;
+  for (i = 0; i < 2*nPairs; ++i)
+    if (nNames == 0 || strcmp(names[i], names[nNames-1]) != 0)
+      names[nNames++] = names[i];
+
+  pp = (PairPosition *) malloc(nPairs * sizeof(PairPosition));
+  for (pn = 0; pn < nPairs; ++pn)
+    {
+      found = (char **) bsearch(&(pairs[pn].imageName), names, nNames,
+				sizeof(char *), SortByString);
+      section[pn][0] = found - names;
+      found = (char **) bsearch(&(pairs[pn].refName), names, nNames,
+				sizeof(char *), SortByString);
+      section[pn][1] = found - names;
+      pp[pn].pn = pn;
+      pp[pn].z[0] = section[pn][0] < section[pn][1] ? section[pn][0] : section[pn][1];
+      pp[pn].z[1] = section[pn][0] < section[pn][1] ? section[pn][1] : section[pn][0];
+    }
+  qsort(pp, nPairs, sizeof(PairPosition), SortByPosition);
+
+  if (nChains > nPairs)
+    nChains = nPairs;
+  if (nChains < 1)
+    nChains = 1;
+  runLength = (nPairs + nChains - 1) / nChains;
+  n = 0;
+  for (j = 0; j < runLength; ++j)
+    for (k = 0; k < nChains; ++k)
+      if ((i = k * runLength + j) < nPairs)
+	order[n++] = pp[i].pn;
+
+  free(pp);
+  free(names);
+}
+
 void
 PackContext ()
 {
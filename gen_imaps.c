@@ -36,7 +36,11 @@
  */
 
 #include <stdio.h>
+#if NO_MPI
+#include "nompi.h"
+#else
 #include <mpi.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -49,6 +53,7 @@
 #include <sched.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <pthread.h>
 
 #include "imio.h"
 #include "invert.h"
@@ -128,6 +133,20 @@ typedef struct CommPhase
   int *nImagesToReceive; /* number of images to receive for each MPI_Recv */
 } CommPhase;
 
+typedef struct MaxForce
+{
+  float maxF;		/* largest force found by a thread */
+  int image;		/* where it was found */
+  int x, y;
+  int level;		/* 0 for black, 1 for white */
+} MaxForce;
+
+typedef struct UpdateParams
+{
+  double scale;		/* step per unit of force */
+  float maxStep;	/* largest step any node may take */
+} UpdateParams;
+
 int p;      /* rank of this process */
 int np;     /* number of processes in this run */
 
@@ -160,6 +179,32 @@ int springsSize = 0;
 int nSprings = 0;
 Spring *springs = NULL;
 
+int nThreads = 1;	/* number of threads used for the relaxation
+			   within this process */
+int *imageThread = NULL;	/* thread whose springs reach each image,
+				   or -1 */
+int *threadFirstImage = NULL;	/* owned images updated by each thread */
+int *threadLastImage = NULL;
+int *nThreadSprings = NULL;	/* springs whose nodes all belong to
+				   the images of one thread */
+int **threadSprings = NULL;
+int nCrossThreadSprings = 0;	/* springs between the images of two
+				   threads, applied by thread 0 afterwards */
+int *crossThreadSprings = NULL;
+double *threadEnergy = NULL;
+MaxForce *threadMaxForce = NULL;
+
+/* thread pool used to spread the relaxation of this process
+   across several cores; thread 0 is always the main thread */
+pthread_t *workerThreads = NULL;
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolStartCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDoneCond = PTHREAD_COND_INITIALIZER;
+int poolGeneration = 0;
+int poolPending = 0;
+void (*poolFunc)(int thread, void *arg) = NULL;
+void *poolArg = NULL;
+
 FILE *logFile = 0;
 
 float levelK = 1.0;
@@ -185,6 +230,15 @@ void CommunicateIntensities ();
 unsigned int Hash (char *s);
 unsigned int HashMap (char *s, int nx, int ny);
 int CreateDirectories (char *fn);
+void StartThreads ();
+void *ThreadMain (void *arg);
+void RunThreads (void (*func)(int thread, void *arg), void *arg);
+void PlanThreads ();
+int NodeImage (Node *node, int *order, int nOrder);
+double ApplySpring (int i);
+void ForcesTask (int thread, void *arg);
+void MaxForceTask (int thread, void *arg);
+void UpdatePositionsTask (int thread, void *arg);
 
 
 int
@@ -211,7 +265,6 @@ main (int argc, char **argv)
   float deltaX, deltaY;
   float nomD;
   float d;
-  float force;
   float kdx, kdy;
   float dampingFactor;
   MPI_Status status;
@@ -258,7 +311,7 @@ main (int argc, char **argv)
   char imageName[PATH_MAX];
   int imageNameLen;
   int width, height;
-  double rotation, scale;
+  double rotation;
   double tx, ty;
   double weight;
   double kFactor;
@@ -316,12 +369,10 @@ main (int argc, char **argv)
   int requiredPixels;
   int cumulativePixels;
 
-  float maxStep;
+  UpdateParams up;
   char imgName[PATH_MAX];
-  double delta;
   int nPixels;
   double sum;
-  Spring *s;
 
   int ni, nix, niy, nlv;
 
@@ -454,6 +505,16 @@ main (int argc, char **argv)
 		break;
 	      }
 	  }
+	else if (strcmp(argv[i], "-threads") == 0)
+	  {
+	    if (++i == argc ||
+		sscanf(argv[i], "%d", &nThreads) != 1 ||
+		nThreads < 1)
+	      {
+		error = 1;
+		break;
+	      }
+	  }
 	else
 	  {
 	    fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
@@ -470,6 +531,7 @@ main (int argc, char **argv)
 	  fprintf(stderr, "             [-histograms histograms_prefix]\n");
 	  fprintf(stderr, "             [-black histogram_percentage]\n");
 	  fprintf(stderr, "             [-white histogram_percentage]\n");
+	  fprintf(stderr, "             [-threads threads_per_process]\n");
 	  exit(1);
 	}
       
@@ -497,7 +559,8 @@ main (int argc, char **argv)
       MPI_Bcast(outputName, PATH_MAX, MPI_CHAR, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&level, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
       MPI_Bcast(&blackLevel, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
-      MPI_Bcast(&whiteLevel, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+      MPI_Bcast(&whiteLevel, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD) != MPI_SUCCESS ||
+      MPI_Bcast(&nThreads, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
     Error("Broadcast of parameters failed.\n");
   spacing = 1 << level;
 
@@ -848,7 +911,10 @@ main (int argc, char **argv)
       }
   if (bufferSize < 4096*1024)
     bufferSize = 4096*1024;
-  buffer = (float *) malloc(bufferSize * sizeof(float));
+  /* a single process has no one to exchange intensities with; its
+     threads share the node arrays directly */
+  if (np > 1)
+    buffer = (float *) malloc(bufferSize * sizeof(float));
   
   /* eliminate unnecessary phases */
   Log("Eliminating unnecessary phases\n");
@@ -1043,6 +1109,8 @@ main (int argc, char **argv)
 
   /* set up communications with other nodes */
   PlanCommunications();
+  StartThreads();
+  PlanThreads();
 
   /* relax the spring system */
   Log("Starting relaxation iterations.\n");
@@ -1063,125 +1131,34 @@ main (int argc, char **argv)
 #endif
       CommunicateIntensities();
 
-      /* update all forces, also computing energy */
+      /* update all forces, also computing energy; each thread
+	 zeroes the forces of its own images and applies the springs
+	 that stay within them, and the springs between the images of
+	 two threads are applied afterwards */
+      RunThreads(ForcesTask, NULL);
       energy = 0.0;
       basis = energy;
-      for (i = myFirstImage; i <= myLastImage; ++i)
-	{
-	  nx = images[i].nx;
-	  ny = images[i].ny;
-	  nodes = images[i].nodes;
-
-	  /* zero all forces */
-	  for (y = 0; y < ny; ++y)
-	    for (x = 0; x < nx; ++x)
-	      {
-		if (nodes[y * nx + x].x < -512.0 ||
-		    nodes[y * nx + x].x > 512.0 ||
-		    nodes[ny*nx + (y * nx + x)].x < -512.0 ||
-		    nodes[ny*nx + (y * nx + x)].x > 512.0)
-		  {
-		    Log("out-of-bounds value: %s %d %d %f %f\n",
-			images[i].name, x, y,
-			nodes[y * nx + x].x,
-			nodes[ny*nx + (y * nx + x)].x);
-		    exit(1);
-		  }
-		nodes[y * nx + x].fx = 0.0;
-		nodes[ny*nx + (y * nx + x)].fx = 0.0;
-	      }
-
-	}
-
-      //      Log("FX 0: %f\n", images[2].nodes[98*74+34*98+41].fx);
-
-      /* update all forces, also computing energy */
-      for (i = 0; i < nSprings; ++i)
-	{
-	  s = &springs[i];
-	  if (s->node1 == NULL)
-	    {
-	      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->k))
-		{
-		  Log("invalid value: %f %f %f %d\n",
-		      s->offset, s->node0->x, s->k, i);
-		  exit(1);
-		}
-	      delta = s->offset - s->node0->x;
-	      force = s->k * delta;
-	      s->node0->fx += force;
-	      energy += force * delta;
-	    }
-	  else
-	    {
-	      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->node1->x) || isnan(s->k))
-		{
-		  Log("invalid value: %f %f %f %f %d\n",
-		      s->offset, s->node0->x, s->node1->x, s->k, i);
-		  exit(1);
-		}
-	      delta = s->node1->x - s->node0->x - s->offset;
-	      force = s->k * delta;
-	      s->node0->fx += force;
-	      s->node1->fx -= force;
-	      energy += force * delta;
-#if 0
-	      if ((i & ~1) == 234452)
-		Log("iter %d spr %d: %f %f %f %f  %f %f  %f %f\n",
-		    iter, i,
-		    s->offset, s->node0->x, s->node1->x, s->k,
-		    delta, force,
-		    s->node0->fx,
-		    s->node1->fx);
-#endif
-	    }
-	}
-
-      //      Log("FX 1: %f\n", images[2].nodes[98*74+34*98+41].fx);
+      for (i = 0; i < nThreads; ++i)
+	energy += threadEnergy[i];
+      for (i = 0; i < nCrossThreadSprings; ++i)
+	energy += ApplySpring(crossThreadSprings[i]);
 
+      RunThreads(MaxForceTask, NULL);
       maxF = 0.0;
-      for (i = myFirstImage; i <= myLastImage; ++i)
-	{
-	  nx = images[i].nx;
-	  ny = images[i].ny;
-	  nodes = images[i].nodes;
-	  for (iy = 0; iy < ny; ++iy)
-	    for (ix = 0; ix < nx; ++ix)
-	      {
-#if 0
-		if (i == 2 && ix == 41 && iy == 34)
-		  {
-		    Log("iter %d PT x = %f fx = %f nx = %d ny = %d\n",
-			iter,
-			nodes[iy*nx+ix].x,
-			nodes[iy*nx+ix].fx,
-			nx, ny);
-		  }
-#endif
-		if (nodes[iy * nx + ix].fx > maxF)
-		  {
-		    maxF = nodes[iy * nx + ix].fx;
-		    ni = i;
-		    nix = ix;
-		    niy = iy;
-		    nlv = 0;
-		  }
-		if (nodes[ny*nx + (iy * nx + ix)].fx > maxF)
-		  {
-		    maxF = nodes[ny*nx + (iy * nx + ix)].fx;
-		    ni = i;
-		    nix = ix;
-		    niy = iy;
-		    nlv = 1;
-		  }
-	      }
-	}
+      for (i = 0; i < nThreads; ++i)
+	if (threadMaxForce[i].maxF > maxF)
+	  {
+	    maxF = threadMaxForce[i].maxF;
+	    ni = threadMaxForce[i].image;
+	    nix = threadMaxForce[i].x;
+	    niy = threadMaxForce[i].y;
+	    nlv = threadMaxForce[i].level;
+	  }
       if (iter % 100 == 0)
 	Log("Iter %d: Node maxF occurred at %s %d %d %d: %f\n",
 	    iter,
 	    images[ni].name,
 	    nix, niy, nlv, maxF);
-      //      Log("FX 2: %f\n", images[2].nodes[98*74+34*98+41].fx);
 
       /* find global maximum */
       if (MPI_Allreduce(&maxF, &globalMaxF, 1, MPI_FLOAT, MPI_MAX,
@@ -1190,42 +1167,11 @@ main (int argc, char **argv)
 
       /* update all positions */
       if (globalMaxF > 0.5)
-	scale = dampingFactor * 0.5 / globalMaxF;
+	up.scale = dampingFactor * 0.5 / globalMaxF;
       else
-	scale = dampingFactor;
-      maxStep = 0.1;
-      for (i = myFirstImage; i <= myLastImage; ++i)
-	{
-	  nx = images[i].nx;
-	  ny = images[i].ny;
-	  nodes = images[i].nodes;
-	  for (iy = 0; iy < ny; ++iy)
-	    for (ix = 0; ix < nx; ++ix)
-	      {
-		delta = scale * nodes[iy * nx + ix].fx;
-		if (delta > maxStep)
-		  delta = maxStep;
-		nodes[iy * nx + ix].x += delta;
-#if 0
-		if (i == 2 && ix == 41 && iy == 34)
-		  Log("iter %d ADJ blk %f %f %f %f %f\n",
-		      iter, scale, nodes[iy*nx+ix].fx, delta,
-		      maxStep, nodes[iy*nx+ix].x);
-#endif
-		delta = scale * nodes[ny*nx + (iy * nx + ix)].fx;
-		if (delta > maxStep)
-		  delta = maxStep;
-		nodes[ny*nx + (iy * nx + ix)].x += delta;
-#if 0
-		if (i == 2 && ix == 41 && iy == 34)
-		  Log("iter %d ADJ wht %f %f %f %f %f\n",
-		      iter, scale, nodes[ny*nx + iy*nx+ix].fx, delta,
-		      maxStep, nodes[ny*nx + iy*nx+ix].x);
-#endif
-	      }
-	}
-
-      //      Log("FX 3: %f\n", images[2].nodes[98*74+34*98+41].fx);
+	up.scale = dampingFactor;
+      up.maxStep = 0.1;
+      RunThreads(UpdatePositionsTask, &up);
 
       if (MPI_Allreduce(&energy, &totalEnergy, 1, MPI_DOUBLE,
 			MPI_SUM, MPI_COMM_WORLD) != MPI_SUCCESS)
@@ -2238,3 +2184,353 @@ CreateDirectories (char *fn)
     }
   return(1);
 }
+
+void
+StartThreads ()
+{
+  int t;
+  pthread_attr_t attr;
+
+  imageThread = (int *) malloc(nImages * sizeof(int));
+  threadFirstImage = (int *) malloc(nThreads * sizeof(int));
+  threadLastImage = (int *) malloc(nThreads * sizeof(int));
+  nThreadSprings = (int *) malloc(nThreads * sizeof(int));
+  threadSprings = (int **) malloc(nThreads * sizeof(int *));
+  memset(threadSprings, 0, nThreads * sizeof(int *));
+  threadEnergy = (double *) malloc(nThreads * sizeof(double));
+  threadMaxForce = (MaxForce *) malloc(nThreads * sizeof(MaxForce));
+  if (nThreads <= 1)
+    return;
+
+  Log("Starting %d worker threads\n", nThreads - 1);
+  workerThreads = (pthread_t *) malloc(nThreads * sizeof(pthread_t));
+  if (pthread_attr_init(&attr) != 0)
+    Error("pthread_attr_init failed\n");
+  for (t = 1; t < nThreads; ++t)
+    if (pthread_create(&workerThreads[t], &attr, ThreadMain, (void *) (long) t) != 0)
+      Error("Could not create worker thread %d\n", t);
+  pthread_attr_destroy(&attr);
+}
+
+void *
+ThreadMain (void *arg)
+{
+  int thread = (int) (long) arg;
+  int generation = 0;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&poolMutex);
+      while (poolGeneration == generation)
+	pthread_cond_wait(&poolStartCond, &poolMutex);
+      generation = poolGeneration;
+      pthread_mutex_unlock(&poolMutex);
+
+      (*poolFunc)(thread, poolArg);
+
+      pthread_mutex_lock(&poolMutex);
+      if (--poolPending == 0)
+	pthread_cond_signal(&poolDoneCond);
+      pthread_mutex_unlock(&poolMutex);
+    }
+  return(NULL);
+}
+
+void
+RunThreads (void (*func)(int thread, void *arg), void *arg)
+{
+  /* run func on all threads of this process, with the
+     calling thread acting as thread 0, and wait for all of
+     them to finish */
+  if (nThreads <= 1)
+    {
+      (*func)(0, arg);
+      return;
+    }
+  pthread_mutex_lock(&poolMutex);
+  poolFunc = func;
+  poolArg = arg;
+  poolPending = nThreads - 1;
+  ++poolGeneration;
+  pthread_cond_broadcast(&poolStartCond);
+  pthread_mutex_unlock(&poolMutex);
+
+  (*func)(0, arg);
+
+  pthread_mutex_lock(&poolMutex);
+  while (poolPending > 0)
+    pthread_cond_wait(&poolDoneCond, &poolMutex);
+  pthread_mutex_unlock(&poolMutex);
+}
+
+void
+PlanThreads ()
+{
+  int t;
+  int i;
+  int i0, i1;
+  int t0, t1;
+  long long totalNodes;
+  long long cumNodes;
+  int *order;
+  int nOrder;
+  int n;
+
+  /* divide the owned images into contiguous blocks of
+     approximately equal numbers of nodes */
+  totalNodes = 0;
+  for (i = myFirstImage; i <= myLastImage; ++i)
+    totalNodes += images[i].nx * images[i].ny;
+  for (i = 0; i < nImages; ++i)
+    imageThread[i] = -1;
+  cumNodes = 0;
+  t = 0;
+  threadFirstImage[0] = myFirstImage;
+  for (i = myFirstImage; i <= myLastImage; ++i)
+    {
+      if (t < nThreads - 1 && i > threadFirstImage[t] &&
+	  cumNodes >= (t + 1) * totalNodes / nThreads)
+	{
+	  threadLastImage[t] = i - 1;
+	  ++t;
+	  threadFirstImage[t] = i;
+	}
+      imageThread[i] = t;
+      cumNodes += images[i].nx * images[i].ny;
+    }
+  threadLastImage[t] = myLastImage;
+  for (++t; t < nThreads; ++t)
+    {
+      /* more threads than images; leave these idle */
+      threadFirstImage[t] = myLastImage + 1;
+      threadLastImage[t] = myLastImage;
+    }
+
+  /* the images with nodes in this process, in order of the
+     address of their nodes, so that the image of a spring's
+     node can be found */
+  order = (int *) malloc(nImages * sizeof(int));
+  nOrder = 0;
+  for (i = 0; i < nImages; ++i)
+    if (images[i].nodes != NULL)
+      {
+	for (n = nOrder; n > 0 &&
+	       images[order[n-1]].nodes > images[i].nodes; --n)
+	  order[n] = order[n-1];
+	order[n] = i;
+	++nOrder;
+      }
+
+  /* give each spring to the thread that updates all of its
+     nodes; the forces on images of other processes are never
+     used, so such an image goes to the thread of the first
+     spring that reaches it */
+  for (t = 0; t < nThreads; ++t)
+    {
+      free(threadSprings[t]);
+      threadSprings[t] = (int *) malloc((nSprings + 1) * sizeof(int));
+      nThreadSprings[t] = 0;
+    }
+  free(crossThreadSprings);
+  crossThreadSprings = (int *) malloc((nSprings + 1) * sizeof(int));
+  nCrossThreadSprings = 0;
+  for (i = 0; i < nSprings; ++i)
+    {
+      i0 = NodeImage(springs[i].node0, order, nOrder);
+      t0 = imageThread[i0];
+      if (springs[i].node1 != NULL)
+	{
+	  i1 = NodeImage(springs[i].node1, order, nOrder);
+	  t1 = imageThread[i1];
+	  if (t0 < 0)
+	    t0 = imageThread[i0] = t1;
+	  else if (t1 < 0)
+	    t1 = imageThread[i1] = t0;
+	}
+      else
+	t1 = t0;
+      if (t0 < 0)
+	t0 = t1 = imageThread[i0] = 0;
+      if (t0 == t1)
+	threadSprings[t0][nThreadSprings[t0]++] = i;
+      else
+	crossThreadSprings[nCrossThreadSprings++] = i;
+    }
+  free(order);
+  for (t = 0; t < nThreads; ++t)
+    Log("Thread %d: images %d to %d, %d springs\n",
+	t, threadFirstImage[t], threadLastImage[t], nThreadSprings[t]);
+  Log("%d springs cross between the images of two threads\n",
+      nCrossThreadSprings);
+}
+
+/* returns the image whose nodes include node */
+int
+NodeImage (Node *node, int *order, int nOrder)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = nOrder - 1;
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (images[order[mid]].nodes <= node)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+  if (nOrder == 0 || node < images[order[lo]].nodes ||
+      node >= images[order[lo]].nodes +
+      2 * images[order[lo]].nx * images[order[lo]].ny)
+    Error("Internal error: spring node is not in any image\n");
+  return(order[lo]);
+}
+
+/* applies the force of spring i to its nodes and returns
+   its energy */
+double
+ApplySpring (int i)
+{
+  Spring *s;
+  double delta;
+  float force;
+
+  s = &springs[i];
+  if (s->node1 == NULL)
+    {
+      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->k))
+	{
+	  Log("invalid value: %f %f %f %d\n",
+	      s->offset, s->node0->x, s->k, i);
+	  exit(1);
+	}
+      delta = s->offset - s->node0->x;
+      force = s->k * delta;
+      s->node0->fx += force;
+    }
+  else
+    {
+      if (isnan(s->offset) || isnan(s->node0->x) || isnan(s->node1->x) || isnan(s->k))
+	{
+	  Log("invalid value: %f %f %f %f %d\n",
+	      s->offset, s->node0->x, s->node1->x, s->k, i);
+	  exit(1);
+	}
+      delta = s->node1->x - s->node0->x - s->offset;
+      force = s->k * delta;
+      s->node0->fx += force;
+      s->node1->fx -= force;
+    }
+  return(force * delta);
+}
+
+void
+ForcesTask (int thread, void *arg)
+{
+  int i;
+  int x, y;
+  int nx, ny;
+  Node *nodes;
+  double energy;
+
+  for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+    {
+      nx = images[i].nx;
+      ny = images[i].ny;
+      nodes = images[i].nodes;
+
+      /* zero all forces */
+      for (y = 0; y < ny; ++y)
+	for (x = 0; x < nx; ++x)
+	  {
+	    if (nodes[y * nx + x].x < -512.0 ||
+		nodes[y * nx + x].x > 512.0 ||
+		nodes[ny*nx + (y * nx + x)].x < -512.0 ||
+		nodes[ny*nx + (y * nx + x)].x > 512.0)
+	      {
+		Log("out-of-bounds value: %s %d %d %f %f\n",
+		    images[i].name, x, y,
+		    nodes[y * nx + x].x,
+		    nodes[ny*nx + (y * nx + x)].x);
+		exit(1);
+	      }
+	    nodes[y * nx + x].fx = 0.0;
+	    nodes[ny*nx + (y * nx + x)].fx = 0.0;
+	  }
+    }
+
+  energy = 0.0;
+  for (i = 0; i < nThreadSprings[thread]; ++i)
+    energy += ApplySpring(threadSprings[thread][i]);
+  threadEnergy[thread] = energy;
+}
+
+void
+MaxForceTask (int thread, void *arg)
+{
+  int i;
+  int ix, iy;
+  int nx, ny;
+  Node *nodes;
+  MaxForce *mf;
+
+  mf = &threadMaxForce[thread];
+  mf->maxF = 0.0;
+  for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+    {
+      nx = images[i].nx;
+      ny = images[i].ny;
+      nodes = images[i].nodes;
+      for (iy = 0; iy < ny; ++iy)
+	for (ix = 0; ix < nx; ++ix)
+	  {
+	    if (nodes[iy * nx + ix].fx > mf->maxF)
+	      {
+		mf->maxF = nodes[iy * nx + ix].fx;
+		mf->image = i;
+		mf->x = ix;
+		mf->y = iy;
+		mf->level = 0;
+	      }
+	    if (nodes[ny*nx + (iy * nx + ix)].fx > mf->maxF)
+	      {
+		mf->maxF = nodes[ny*nx + (iy * nx + ix)].fx;
+		mf->image = i;
+		mf->x = ix;
+		mf->y = iy;
+		mf->level = 1;
+	      }
+	  }
+    }
+}
+
+void
+UpdatePositionsTask (int thread, void *arg)
+{
+  UpdateParams *up = (UpdateParams *) arg;
+  int i;
+  int ix, iy;
+  int nx, ny;
+  Node *nodes;
+  double delta;
+
+  for (i = threadFirstImage[thread]; i <= threadLastImage[thread]; ++i)
+    {
+      nx = images[i].nx;
+      ny = images[i].ny;
+      nodes = images[i].nodes;
+      for (iy = 0; iy < ny; ++iy)
+	for (ix = 0; ix < nx; ++ix)
+	  {
+	    delta = up->scale * nodes[iy * nx + ix].fx;
+	    if (delta > up->maxStep)
+	      delta = up->maxStep;
+	    nodes[iy * nx + ix].x += delta;
+	    delta = up->scale * nodes[ny*nx + (iy * nx + ix)].fx;
+	    if (delta > up->maxStep)
+	      delta = up->maxStep;
+	    nodes[ny*nx + (iy * nx + ix)].x += delta;
+	  }
+    }
+}
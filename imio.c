@@ -1035,6 +1035,34 @@ ReadBitmap (char *filename, unsigned char **bitmap,
   return(1);
 }
 
+/* finds the file that ReadImage (or ReadBitmap, if bitmap is
+   nonzero) would read for filename, trying the usual extensions
+   when filename itself does not exist; returns 1 and stores the
+   name in found if there is such a file */
+int
+FindImageFile (char *filename, int bitmap, char *found)
+{
+  int i;
+  int n;
+  char **ext;
+  struct stat sb;
+
+  if (stat(filename, &sb) == 0 && S_ISREG(sb.st_mode))
+    {
+      strcpy(found, filename);
+      return(1);
+    }
+  n = bitmap ? N_BITMAP_EXTENSIONS : N_EXTENSIONS;
+  ext = bitmap ? bitmapExtensions : extensions;
+  for (i = 0; i < n; ++i)
+    {
+      sprintf(found, "%s%s", filename, ext[i]);
+      if (stat(found, &sb) == 0)
+	return(1);
+    }
+  return(0);
+}
+
 int
 ReadPbmBitmap (char *filename, unsigned char **buffer,
 	       int *width, int *height,
@@ -1356,8 +1384,7 @@ int ReadMap (char *filename,
 	     char *imageName, char *referenceName,
 	     char *error)
 {
-  char imgName[PATH_MAX], refName[PATH_MAX];
-  int mapWidth, mapHeight;
+  int ok;
 
   FILE *f = fopen(filename, "rb");
   if (f == NULL)
@@ -1365,6 +1392,27 @@ int ReadMap (char *filename,
       sprintf(error, "Cannot open file %s\n", filename);
       return(0);
     }
+  ok = ReadMapFromStream(f, filename, map, level,
+			 width, height, xMin, yMin,
+			 imageName, referenceName, error);
+  fclose(f);
+  return(ok);
+}
+
+/* reads one map from f, which is positioned at the start of its
+   header, and leaves f positioned just after the map; filename is
+   only used in error messages */
+int ReadMapFromStream (FILE *f, char *filename,
+		       MapElement** map,
+		       int *level,
+		       int *width, int *height,
+		       int *xMin, int *yMin,
+		       char *imageName, char *referenceName,
+		       char *error)
+{
+  char imgName[PATH_MAX], refName[PATH_MAX];
+  int mapWidth, mapHeight;
+
   if (fgetc(f) != 'M' || fgetc(f) != '1' || fgetc(f) != '\n' ||
       fscanf(f, "%d%d%d%d%d%s%s",
 	     level,
@@ -1391,9 +1439,46 @@ int ReadMap (char *filename,
   if (fread(*map, sizeof(MapElement), mapWidth * mapHeight, f) != mapWidth * mapHeight)
     {
       sprintf(error, "Could not read map from file %s\n", filename);
+      free(*map);
+      *map = NULL;
+      return(0);
+    }
+  return(1);
+}
+
+/* reads just the header of a map file, leaving the map itself
+   on disk */
+int ReadMapHeader (char *filename,
+		   int *level,
+		   int *width, int *height,
+		   int *xMin, int *yMin,
+		   char *imageName, char *referenceName,
+		   char *error)
+{
+  char imgName[PATH_MAX], refName[PATH_MAX];
+
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL)
+    {
+      sprintf(error, "Cannot open file %s\n", filename);
+      return(0);
+    }
+  if (fgetc(f) != 'M' || fgetc(f) != '1' || fgetc(f) != '\n' ||
+      fscanf(f, "%d%d%d%d%d%s%s",
+	     level,
+	     width, height,
+	     xMin, yMin,
+	     imgName, refName) != 7)
+    {
+      sprintf(error, "Cannot read header of map file %s\n", filename);
+      fclose(f);
       return(0);
     }
   fclose(f);
+  if (imageName != NULL)
+    strcpy(imageName, imgName);
+  if (referenceName != NULL)
+    strcpy(referenceName, refName);
   return(1);
 }
 
@@ -1418,6 +1503,40 @@ WriteMap (char *filename, MapElement *map,
       sprintf(error, "Cannot open file %s for writing\n", filename);
       return(0);
     }
+  if (!WriteMapToStream(f, filename, map, level,
+			width, height, xMin, yMin,
+			imageName, referenceName,
+			compressionMethod, error))
+    {
+      fclose(f);
+      return(0);
+    }
+  if (fclose(f) != 0)
+    {
+      sprintf(error, "Could not close file %s\n", filename);
+      return(0);
+    }
+  return(1);
+}
+
+/* writes one map, header first, at the current position of f, so
+   that several maps may be written one after another into the same
+   file; filename is only used in error messages */
+int
+WriteMapToStream (FILE *f, char *filename, MapElement *map,
+		  int level,
+		  int width, int height,
+		  int xMin, int yMin,
+		  char *imageName, char *referenceName,
+		  enum MapCompression compressionMethod,
+		  char *error)
+{
+  if (compressionMethod != UncompressedMap)
+    {
+      strcpy(error, "WriteMapToStream: unsupported compression method\n");
+      return(0);
+    }
+
   fprintf(f, "M1\n");
   fprintf(f, "%d\n", level);
   fprintf(f, "%d %d\n", width, height);
@@ -1428,6 +1547,5 @@ WriteMap (char *filename, MapElement *map,
       sprintf(error, "Could not write to file %s\n", filename);
       return(0);
     }
-  fclose(f);
   return(1);
 }
@@ -4,6 +4,8 @@
 #ifndef IMIO_H
 #define IMIO_H
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -62,6 +64,8 @@ extern "C" {
 		  int minX, int maxX, int minY, int maxY,
 		  char *error);
 
+  int FindImageFile (char *filename, int bitmap, char *found);
+
   int WriteBitmap (char *filename, unsigned char *bitmap,
 		   int width, int height,
 		   enum BitmapCompression compressionMethod,
@@ -74,6 +78,21 @@ extern "C" {
 	       char *imageName, char *referenceName,
 	       char *error);
 
+  int ReadMapFromStream (FILE *f, char *filename,
+			 MapElement **map,
+			 int *level,
+			 int *width, int *height,
+			 int *xMin, int *yMin,
+			 char *imageName, char *referenceName,
+			 char *error);
+
+  int ReadMapHeader (char *filename,
+		     int *level,
+		     int *width, int *height,
+		     int *xMin, int *yMin,
+		     char *imageName, char *referenceName,
+		     char *error);
+
   int WriteMap (char *filename, MapElement *map,
 		int level,
 		int width, int height,
@@ -82,6 +101,14 @@ extern "C" {
 		enum MapCompression compressionMethod,
 		char *error);
 
+  int WriteMapToStream (FILE *f, char *filename, MapElement *map,
+			int level,
+			int width, int height,
+			int xMin, int yMin,
+			char *imageName, char *referenceName,
+			enum MapCompression compressionMethod,
+			char *error);
+
 #ifdef __cplusplus
 }
 #endif
@@ -133,6 +133,8 @@ typedef struct Task {
   Context *context;	        /* context associated with the task */
   int number;			/* number of this task */
   Buffer buffer;		/* the task buffer */
+  int n_keys;			/* number of affinity keys */
+  int keys[PAR_MAX_AFFINITY_KEYS]; /* affinity keys of this task */
 } Task;
 
 typedef struct WorkerState {
@@ -150,12 +152,17 @@ typedef struct WorkerState {
 				   worker */
   Task *first_task;		/* the first task (of at most 2) assigned to
 				   this worker */
+  int n_keys;			/* number of affinity keys of the last task
+				   assigned to this worker */
+  int keys[PAR_MAX_AFFINITY_KEYS]; /* affinity keys of the last task
+				      assigned to this worker */
 } WorkerState;
 
 static Context *current_context = NULL;
 
 static Task *first_queued_task = NULL;
 static Task *last_queued_task = NULL;
+static int n_queued_tasks = 0;	/* number of tasks on the queue */
 
 static WorkerState workers[PAR_MAX_WORKERS];
 
@@ -196,6 +203,14 @@ static int idle_workers = -1;	/* a list of idle workers (i.e., those workers
 				   having 0 tasks currently assigned to them);
 				   a -1 terminates this list */
 
+static int n_next_keys = 0;	/* number of affinity keys for the next
+				   task to be delegated */
+static int next_keys[PAR_MAX_AFFINITY_KEYS];
+                                /* affinity keys for the next task to be
+				   delegated */
+static Boolean affinity_used = FALSE; /* TRUE if any task has been delegated
+					 with affinity keys */
+
 static int par_verbose = FALSE;	/* if TRUE, report on normal events such as
 				   task delegation and receiving worker
 				   results */
@@ -276,13 +291,16 @@ static void (*par_unpack_result)() = NULL;	/* optional */
 static void ScanEnvironment();
 static void DispatchTasks();
 static void DispatchTask();
-static int  FindReadyWorker();
+static Task *SelectTask();
+static Boolean SharesKey();
+static Boolean BroadcastsComplete();
 static void HandleMessage();
 static void HandleRequest();
 static void HandleBroadcastAck();
 static void HandleWorkerExit();
 static void QueueTask();
 static void RequeueTask();
+static void UnqueueTask();
 static Context *ReuseContext();
 static void DisuseContext();
 static void FreeBuffer ();
@@ -453,6 +471,7 @@ par_delegate_task ()
     {
       if (par_verbose)
 	Report("Performing task %d myself\n", task_number);
+      n_next_keys = 0;
       (*par_worker_task)();
       if (par_master_result != NULL)
 	(*par_master_result)(task_number);
@@ -508,6 +527,12 @@ par_delegate_task ()
   task->prev = NULL;
   task->context = ReuseContext(current_context);
   task->number = task_number;
+  task->n_keys = n_next_keys;
+  for (i = 0; i < n_next_keys; ++i)
+    task->keys[i] = next_keys[i];
+  if (n_next_keys > 0)
+    affinity_used = TRUE;
+  n_next_keys = 0;
 
   out_position = 0;
   par_pkint(task_number);
@@ -528,7 +553,12 @@ par_delegate_task ()
   if (par_verbose)
     Report("par_delegate_task dispatching tasks.\n");
 
-  DispatchTasks();
+  /* if tasks have affinity keys, a few may be left on the queue
+     so that they can be matched with workers as they become free */
+  if (affinity_used)
+    DispatchTasks(PAR_AFFINITY_LOOKAHEAD * (n_workers + n_workers_pending));
+  else
+    DispatchTasks(0);
 
   if (par_verbose)
     Report("par_delegate_task returning %d.\n", task_number+1);
@@ -552,6 +582,18 @@ par_set_context ()
   context_changed = TRUE;
 }
 
+void
+par_set_affinity (int n, int *keys)
+{
+  int i;
+
+  if (n > PAR_MAX_AFFINITY_KEYS)
+    n = PAR_MAX_AFFINITY_KEYS;
+  for (i = 0; i < n; ++i)
+    next_keys[i] = keys[i];
+  n_next_keys = n;
+}
+
 void
 par_broadcast_context ()
 {
@@ -678,6 +720,9 @@ par_finish ()
   if (!par)
     return;
 
+  /* dispatch any tasks held back for affinity scheduling */
+  DispatchTasks(0);
+
   while (tasks_outstanding > 0)
     (void) MasterReceiveMessage(PAR_FOREVER);
 
@@ -789,42 +834,54 @@ par_arch ()
   return arch;
 }
 
-/* DispatchTasks does not return until all queued tasks have been assigned to
-   workers for processing */
+/* DispatchTasks does not return until all but hold of the queued tasks
+   have been assigned to workers for processing; tasks are only held back
+   while no worker is idle */
 static void
-DispatchTasks ()
+DispatchTasks (int hold)
 {
   /* make sure all broadcasts have completed */
-  while (broadcast_first_ack_count < (broadcast_count - 1) ||
-	 broadcast_second_ack_count < (broadcast_count - 1))
+  while (!BroadcastsComplete())
     MasterReceiveMessage(PAR_FOREVER);
 
   if (par_verbose)
     Report("DispatchTasks: all broadcasts completed\n");
 
-  /* dispatch all tasks */
+  /* dispatch the tasks */
   while (first_queued_task != NULL)
+    if (idle_workers >= 0)
       DispatchTask();
+    else if (n_queued_tasks > hold)
+      (void) MasterReceiveMessage(PAR_FOREVER);
+    else
+      break;
 }
 
+/* DispatchTask sends a queued task to an idle worker; there must be
+   at least one idle worker */
 static void
 DispatchTask ()
 {
+  int i;
   int n;
-  int res;
   Task *task;
 
-  /* take the first task off the queue */
-  task = first_queued_task;
-  first_queued_task = task->next;
-  if (first_queued_task != NULL)
-    first_queued_task->prev = NULL;
-  else
-    last_queued_task = NULL;
-  task->next = NULL;
+  /* prefer an idle worker that can continue with the same data */
+  task = NULL;
+  for (n = idle_workers; n >= 0; n = workers[n].next_idle)
+    if ((task = SelectTask(n, TRUE)) != NULL)
+      break;
+  if (task == NULL)
+    {
+      n = idle_workers;
+      task = SelectTask(n, FALSE);
+    }
 
-  /* find a worker to run it on */
-  n = FindReadyWorker();
+  /* take the task off the queue */
+  UnqueueTask(task);
+  workers[n].n_keys = task->n_keys;
+  for (i = 0; i < task->n_keys; ++i)
+    workers[n].keys[i] = task->keys[i];
 
   /* check if the context needs to be sent */
   if (task->context != NULL &&
@@ -857,21 +914,52 @@ DispatchTask ()
   else Abort("Worker %d requested more than 1 task at a time.\n", n);
 }
 
-static int
-FindReadyWorker ()
+/* SelectTask chooses the queued task that worker n should run next:
+   the first task sharing an affinity key with the worker's previous
+   task or, if there is none and match_required is FALSE, the first
+   task not sharing a key with the task of a busy worker, or failing
+   that, the task at the head of the queue */
+static Task *
+SelectTask (int n, Boolean match_required)
 {
-  for (;;)
-    {
-      if (par_verbose)
-	Report("FindReadyWorker: idle_workers = %d\n", idle_workers);
+  int i;
+  Task *task;
 
-      /* if a worker is totally idle, choose it */
-      if (idle_workers >= 0)
-	return(idle_workers);
+  for (task = first_queued_task; task != NULL; task = task->next)
+    if (SharesKey(task, workers[n].n_keys, workers[n].keys))
+      return(task);
+  if (match_required)
+    return(NULL);
 
-      /* wait for something to happen */
-      (void) MasterReceiveMessage(PAR_FOREVER);
+  for (task = first_queued_task; task != NULL; task = task->next)
+    {
+      for (i = 0; i < n_workers; ++i)
+	if (workers[i].first_task != NULL &&
+	    SharesKey(task, workers[i].n_keys, workers[i].keys))
+	  break;
+      if (i >= n_workers)
+	return(task);
     }
+  return(first_queued_task);
+}
+
+static Boolean
+SharesKey (Task *task, int n_keys, int *keys)
+{
+  int i, j;
+
+  for (i = 0; i < task->n_keys; ++i)
+    for (j = 0; j < n_keys; ++j)
+      if (task->keys[i] == keys[j])
+	return(TRUE);
+  return(FALSE);
+}
+
+static Boolean
+BroadcastsComplete ()
+{
+  return(broadcast_first_ack_count >= (broadcast_count - 1) &&
+	 broadcast_second_ack_count >= (broadcast_count - 1));
 }
 
 static int
@@ -1044,10 +1132,15 @@ HandleRequest (int tid)
       workers[n_workers].idle = FALSE;
       workers[n_workers].last_context = NULL;
       workers[n_workers].first_task = NULL;
+      workers[n_workers].n_keys = 0;
       PutOnIdleList(n_workers);
       if (par_verbose)
         Report("Worker %d started on host %s\n", n_workers, workers[n_workers].host);
       ++n_workers;
+
+      /* give the worker any task held back for affinity scheduling */
+      if (first_queued_task != NULL && BroadcastsComplete())
+	DispatchTask();
       return;
     }
 
@@ -1100,7 +1193,13 @@ HandleRequest (int tid)
 	    n, workers[n].host, tc, workers[n].first_task->number);
 
   if (workers[n].first_task == NULL)
-    PutOnIdleList(n);
+    {
+      PutOnIdleList(n);
+
+      /* give the worker any task held back for affinity scheduling */
+      if (first_queued_task != NULL && BroadcastsComplete())
+	DispatchTask();
+    }
 }
 
 static void
@@ -1153,6 +1252,7 @@ QueueTask (Task* task)
   else
     first_queued_task = task;
   last_queued_task = task;
+  ++n_queued_tasks;
 }
      
 static void
@@ -1167,6 +1267,24 @@ RequeueTask (Task *task)
   else
     last_queued_task = task;
   first_queued_task = task;
+  ++n_queued_tasks;
+}
+
+static void
+UnqueueTask (Task *task)
+{
+  /* take the task off the queued task list */
+  if (task->prev != NULL)
+    task->prev->next = task->next;
+  else
+    first_queued_task = task->next;
+  if (task->next != NULL)
+    task->next->prev = task->prev;
+  else
+    last_queued_task = task->prev;
+  task->next = NULL;
+  task->prev = NULL;
+  --n_queued_tasks;
 }
      
 static Context*
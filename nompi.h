@@ -0,0 +1,256 @@
+//
+// nompi.h - stand-in for the subset of MPI used by align and gen_imaps,
+//           for building them as single-process programs that need
+//           neither mpicc nor an MPI launcher (compile with -DNO_MPI)
+//
+// The program always runs as process 0 of 1.  Collectives reduce to
+// copies, and point-to-point operations fail, since with one process
+// there is never another process to exchange data with.  Within align
+// and gen_imaps, the -threads option provides the parallelism instead,
+// with all threads working directly on the shared node arrays.
+//
+#ifndef NOMPI_H
+#define NOMPI_H
+
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int MPI_Comm;
+typedef int MPI_Datatype;
+typedef int MPI_Op;
+typedef int MPI_Request;
+typedef int MPI_Errhandler;
+typedef struct MPI_Status
+{
+  int MPI_SOURCE;
+  int MPI_TAG;
+  int MPI_ERROR;
+} MPI_Status;
+typedef void (MPI_User_function) (void *in, void *inout, int *len,
+				  MPI_Datatype *type);
+
+#define MPI_SUCCESS		0
+#define MPI_ERR_OTHER		15
+
+#define MPI_COMM_WORLD		0
+#define MPI_ERRORS_RETURN	0
+#define MPI_REQUEST_NULL	0
+#define MPI_STATUS_IGNORE	((MPI_Status *) 0)
+#define MPI_STATUSES_IGNORE	((MPI_Status *) 0)
+#define MPI_IN_PLACE		((void *) 1)
+
+#define MPI_THREAD_SINGLE	0
+#define MPI_THREAD_FUNNELED	1
+#define MPI_THREAD_SERIALIZED	2
+#define MPI_THREAD_MULTIPLE	3
+
+/* the datatypes are numbered so that MPI_TypeSize can look up their sizes */
+#define MPI_CHAR		0
+#define MPI_UNSIGNED_CHAR	1
+#define MPI_BYTE		2
+#define MPI_INT			3
+#define MPI_FLOAT		4
+#define MPI_DOUBLE		5
+#define MPI_DOUBLE_INT		6
+
+/* with one process every reduction operation is the identity */
+#define MPI_MAX			0
+#define MPI_MIN			1
+#define MPI_SUM			2
+#define MPI_BOR			3
+#define MPI_MAXLOC		4
+
+static inline int
+MPI_TypeSize (MPI_Datatype type)
+{
+  struct { double d; int i; } doubleInt;
+
+  switch (type)
+    {
+    case MPI_CHAR:
+    case MPI_UNSIGNED_CHAR:
+    case MPI_BYTE:
+      return(1);
+    case MPI_INT:
+      return(sizeof(int));
+    case MPI_FLOAT:
+      return(sizeof(float));
+    case MPI_DOUBLE:
+      return(sizeof(double));
+    case MPI_DOUBLE_INT:
+      return(sizeof(doubleInt));
+    }
+  return(0);
+}
+
+static inline int
+MPI_Init (int *argc, char ***argv)
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Init_thread (int *argc, char ***argv, int required, int *provided)
+{
+  *provided = MPI_THREAD_MULTIPLE;
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Finalize ()
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Comm_rank (MPI_Comm comm, int *rank)
+{
+  *rank = 0;
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Comm_size (MPI_Comm comm, int *size)
+{
+  *size = 1;
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Errhandler_set (MPI_Comm comm, MPI_Errhandler handler)
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Op_create (MPI_User_function *function, int commute, MPI_Op *op)
+{
+  *op = MPI_SUM;
+  return(MPI_SUCCESS);
+}
+
+static inline double
+MPI_Wtime ()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return(tv.tv_sec + 0.000001 * tv.tv_usec);
+}
+
+static inline int
+MPI_Barrier (MPI_Comm comm)
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Bcast (void *buffer, int count, MPI_Datatype type, int root,
+	   MPI_Comm comm)
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Reduce (void *sendBuffer, void *receiveBuffer, int count,
+	    MPI_Datatype type, MPI_Op op, int root, MPI_Comm comm)
+{
+  if (sendBuffer != MPI_IN_PLACE && sendBuffer != receiveBuffer)
+    memcpy(receiveBuffer, sendBuffer, count * MPI_TypeSize(type));
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Allreduce (void *sendBuffer, void *receiveBuffer, int count,
+	       MPI_Datatype type, MPI_Op op, MPI_Comm comm)
+{
+  return(MPI_Reduce(sendBuffer, receiveBuffer, count, type, op, 0, comm));
+}
+
+static inline int
+MPI_Iallreduce (void *sendBuffer, void *receiveBuffer, int count,
+		MPI_Datatype type, MPI_Op op, MPI_Comm comm,
+		MPI_Request *request)
+{
+  *request = MPI_REQUEST_NULL;
+  return(MPI_Reduce(sendBuffer, receiveBuffer, count, type, op, 0, comm));
+}
+
+static inline int
+MPI_Gather (void *sendBuffer, int sendCount, MPI_Datatype sendType,
+	    void *receiveBuffer, int receiveCount, MPI_Datatype receiveType,
+	    int root, MPI_Comm comm)
+{
+  memcpy(receiveBuffer, sendBuffer, sendCount * MPI_TypeSize(sendType));
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Gatherv (void *sendBuffer, int sendCount, MPI_Datatype sendType,
+	     void *receiveBuffer, int *receiveCounts, int *displacements,
+	     MPI_Datatype receiveType, int root, MPI_Comm comm)
+{
+  memcpy((char *) receiveBuffer +
+	 displacements[0] * MPI_TypeSize(receiveType),
+	 sendBuffer, sendCount * MPI_TypeSize(sendType));
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Send (void *buffer, int count, MPI_Datatype type, int dest, int tag,
+	  MPI_Comm comm)
+{
+  return(MPI_ERR_OTHER);
+}
+
+static inline int
+MPI_Recv (void *buffer, int count, MPI_Datatype type, int source, int tag,
+	  MPI_Comm comm, MPI_Status *status)
+{
+  return(MPI_ERR_OTHER);
+}
+
+static inline int
+MPI_Isend (void *buffer, int count, MPI_Datatype type, int dest, int tag,
+	   MPI_Comm comm, MPI_Request *request)
+{
+  return(MPI_ERR_OTHER);
+}
+
+static inline int
+MPI_Irecv (void *buffer, int count, MPI_Datatype type, int source, int tag,
+	   MPI_Comm comm, MPI_Request *request)
+{
+  return(MPI_ERR_OTHER);
+}
+
+static inline int
+MPI_Wait (MPI_Request *request, MPI_Status *status)
+{
+  *request = MPI_REQUEST_NULL;
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Waitall (int count, MPI_Request *requests, MPI_Status *statuses)
+{
+  return(MPI_SUCCESS);
+}
+
+static inline int
+MPI_Testall (int count, MPI_Request *requests, int *flag,
+	     MPI_Status *statuses)
+{
+  *flag = 1;
+  return(MPI_SUCCESS);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NOMPI_H */
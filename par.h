@@ -64,6 +64,12 @@
 #define PAR_MAX_OVERLAPPED_BROADCASTS	8   /* maximum # of broadcasts that may
 					       be issued before waiting for
 					       acknowledgements */
+#define PAR_MAX_AFFINITY_KEYS	4	/* maximum # of affinity keys that
+					   may be attached to a task */
+#define PAR_AFFINITY_LOOKAHEAD	2	/* # of tasks per worker that may be
+					   held back by the master so that
+					   they can be matched to workers
+					   by affinity */
 
 
 /*----------- nothing beyond this point----------------*/
@@ -113,6 +119,14 @@ extern void par_broadcast_context ();
    first available worker */
 extern Par_Task par_delegate_task ();
 
+/* par_set_affinity attaches up to PAR_MAX_AFFINITY_KEYS integer keys
+   (for example, indices of the images that the task reads) to the
+   next task to be delegated; such a task is preferentially dispatched
+   to a worker whose previous task shared one of its keys, and
+   par_delegate_task may return before the task has been dispatched
+   so that it can be matched with a worker that becomes free later */
+extern void par_set_affinity (int n, int *keys);
+
 /* par_finish waits for all delegated tasks to finish */
 extern void par_finish ();
 
@@ -37,6 +37,7 @@
 #include <limits.h>
 #include <math.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -48,12 +49,17 @@
 #include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_SIMD 0
+#endif
 
 #define GRAPHICS 0
 
 #if GRAPHICS
 #include <GL/glut.h>
-#include <pthread.h>
 #endif
 
 #include "imio.h"
@@ -78,7 +84,16 @@
 #define MAP(map,w,ix,iy)		map[(iy)*((size_t) w) + (ix)]
 #define GETMAP(map,w,ix,iy,xv,yv,cv)	{ MapElement *e = &MAP(map,w,ix,iy); *(xv) = e->x; *(yv) = e->y; *(cv) = e->c; }
 #define SETMAP(map,w,ix,iy,xv,yv,cv)	{ MapElement *e = &MAP(map,w,ix,iy); e->x = xv; e->y = yv; e->c = cv; }
+#define PIXEL(i,b,n)			((b) == 32 ? ((float *) (i))[n] : (b) == 16 ? ((unsigned short *) (i))[n] * (1.0f / 256.0f) : (float) ((unsigned char *) (i))[n])
+#define IMAGE_PIXEL(i,b,w,ix,iy)	PIXEL(i, b, (iy)*((size_t) w) + (ix))
+#define SETPIXEL(i,b,n,v)		{ if ((b) == 32) ((float *) (i))[n] = (v); else if ((b) == 16) ((unsigned short *) (i))[n] = (unsigned short) ((v) * 256.0 + 0.5); else ((unsigned char *) (i))[n] = (unsigned char) ((v) + 0.5); }
+#define PIXEL_PADDING	4	/* bytes allocated past the end of each pyramid
+				   level so that 32-bit gathers of 8- or
+				   16-bit pixels stay within the array */
 #define LINE_LENGTH	255
+#define MOVE_BATCH_SIZE	4096	/* most moves evaluated in parallel at once */
+#define SIMD_NONE	0
+#define SIMD_AVX2	1
 
 
 typedef struct Context {
@@ -123,6 +138,15 @@ typedef struct Context {
   int update;
   int partial;
   int nWorkers;
+  int nThreads;
+  int simdLevel;
+  int cacheSize;		/* megabytes of image pyramids kept by
+				   each worker between tasks */
+  int pyramidBits;		/* bits per pixel of the stored pyramid
+				   levels: 8 (rounded to integers),
+				   16 (8.8 fixed point), or 32 (float) */
+  char pyramidBasename[PATH_MAX]; /* prefix of the directories holding
+				   precomputed image pyramids, or empty */
 } Context;
 
 typedef struct Pair {
@@ -131,6 +155,12 @@ typedef struct Pair {
   char *pairName;
 } Pair;
 
+typedef struct PairPosition {
+  int pn;			/* index into the pairs array */
+  int z[2];			/* sections of the pair's images in
+				   slice-name order, lower first */
+} PairPosition;
+
 typedef struct Task {
   /* NOTE: any new fields added to this struct should
      be also added to PackTask and UnpackTask */ 
@@ -154,6 +184,81 @@ typedef struct CPoint {
   double newEnergy;
 } CPoint;
 
+/* a decoded image, with its mask, and the levels of its pyramid,
+   kept by a worker for later tasks that use the same image */
+typedef struct PyramidEntry {
+  struct PyramidEntry *next;	/* next less recently used entry */
+  char imageName[PATH_MAX];
+  char maskName[PATH_MAX];
+  time_t imageTime, maskTime;
+  int minX, maxX, minY, maxY;	/* region of the image that was read */
+  int nLevels;
+  int firstLevel;		/* the finer levels were never built */
+  int width[MAX_LEVELS], height[MAX_LEVELS];
+  int offsetX[MAX_LEVELS], offsetY[MAX_LEVELS];
+  void *images[MAX_LEVELS];
+  unsigned char *masks[MAX_LEVELS];
+  size_t nBytes;
+} PyramidEntry;
+
+/* the state of one level of Compute that a move evaluation
+   needs; it is only read while a batch of moves is evaluated */
+typedef struct MoveContext {
+  int level;
+  MapElement *map;
+  MapElement *prop;
+  MapElement *mapCons;
+  int mpw, mph;
+  int mox, moy;
+  int factor;
+  double lFactor, kFactor;
+  void *cimage, *cref;		/* levels stored as in c.pyramidBits */
+  unsigned char *cimask, *crmask;
+  unsigned char *crmaskBytes;	/* crmask with a byte per pixel, or NULL */
+  size_t icmbpl, rcmbpl;
+  unsigned int iw, ih;
+  unsigned int rw, rh;
+  int imgox, imgoy;
+  int refox, refoy;
+  double *nomArea;
+  double *nomL0, *nomL1, *nomL2, *nomL3;
+  double *nomThetaX, *nomThetaY;
+  double logMinRadius, logRadiusRange;
+  double udLimit, diagLimit;
+  size_t requiredPoints;	/* fewest overlapping points counted */
+  long dPoints;			/* number of cells in the distortion sum */
+} MoveContext;
+
+/* a single-node move proposed by EvaluateMove, with its
+   changes to the energy sums that do not depend on the
+   state of the rest of the map */
+typedef struct Move {
+  size_t index;			/* position of the move in the sequence */
+  int icx, icy;			/* the node that moves */
+  int valid;			/* 0 if the move was not proposed */
+  float rnd;
+  double theta;
+  double dsi, dsi2, dsir, dsr2, dsr;
+  long cPoints;
+  double dDistortion;
+  double dCorrespondence;
+  double dConstraining;
+} Move;
+
+/* the correlation sums and energy terms of the current map */
+typedef struct EnergyState {
+  size_t nPoints;
+  double si, si2, sr, sr2, sir;
+  double correlation, distortion, correspondence, constraining;
+  double energy;
+} EnergyState;
+
+typedef struct MoveBatch {
+  MoveContext *mc;
+  Move *moves;
+  int nMoves;
+} MoveBatch;
+
 /* GLOBAL VARIABLES FOR MASTER */
 int nResults = 0;
 Result* results = 0;
@@ -161,6 +266,9 @@ Result* results = 0;
 char *dirHash[DIR_HASH_SIZE];
 char summaryName[PATH_MAX] = "";
 int vis = 0;
+int affinity = 0;		/* if true, pairs are delegated in z-chains
+				   with affinity keys rather than in the
+				   order of the pairs file */
 
 /* GLOBAL VARIABLES FOR MASTER & WORKER */
 Context c;
@@ -176,8 +284,9 @@ int imageWidth[2][MAX_LEVELS],       /* image/reference width/height at */
 int imageOffsetX[2][MAX_LEVELS],     /* the amount each image is offset from */
     imageOffsetY[2][MAX_LEVELS];     /*   the origin in coordinates at that
 		                     /*   level */
-float* images[2][MAX_LEVELS];        /* images to be warped (at various */
-                                     /*    resolution levels) */
+void* images[2][MAX_LEVELS];         /* images to be warped (at various */
+                                     /*    resolution levels), with */
+                                     /*    c.pyramidBits per pixel */
 unsigned char *masks[2][MAX_LEVELS]; /* masks of images to be warped */
 unsigned char *idisc[2][MAX_LEVELS]; /* image discontinuity masks */
 
@@ -209,6 +318,27 @@ int offxc, offyc;
 int nCpts = 0;
 CPoint *cpts = 0;
 
+PyramidEntry *pyramidCache = NULL;   /* most recently used first */
+size_t pyramidCacheBytes = 0;
+PyramidEntry *taskPyramids[2];       /* cached pyramids of the images of
+					the current task, or NULL */
+int pyramidLevel[2];                 /* finest level of each image of the
+					current task that is in memory */
+
+/* pool of threads that evaluate batches of independent moves
+   within Compute; thread 0 is always the calling thread */
+int nMoveThreads = 0;
+pthread_t *moveThreads = NULL;
+pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolStartCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDoneCond = PTHREAD_COND_INITIALIZER;
+int poolGeneration = 0;
+int poolPending = 0;
+void (*poolFunc)(int thread, void *arg) = NULL;
+void *poolArg = NULL;
+
+char *simdNames[] = { "none", "avx2" };
+
 int windowWidth = 1024;
 int windowHeight = 1024;
 int displayLevel = -1;
@@ -225,11 +355,41 @@ void UnpackTask ();
 void PackResult ();
 void UnpackResult ();
 int Init ();
+PyramidEntry *FindPyramid (int imi, char *imageName, char *maskName,
+			   int firstLevel);
+void CachePyramids (char imageName[2][PATH_MAX], char maskName[2][PATH_MAX]);
+void FreePyramid (PyramidEntry *e);
+int FirstPyramidLevel (int width, int height);
+int PyramidUpToDate (char *pyramidName, char *imageName, char *maskName,
+		     int *width, int *height, int *levels, char *id);
+int ReadPyramid (int imi, char *pyramidName, char *id,
+		 int width, int height, int level);
+void WritePyramid (int imi, char *pyramidName, char *maskName);
+void RemovePyramidDirectory (char *dirName);
+void ReduceRange (int *minValue, int *maxValue);
 void Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName);
+int MoveKeepsSpacing (MoveContext *mc, int icx, int icy, double cx, double cy);
+double DistortionDelta (MoveContext *mc, int icx, int icy);
+double CorrespondenceDelta (MoveContext *mc, int icx, int icy);
+double ConstrainingDelta (MoveContext *mc, int icx, int icy);
+void AcceptCorrespondence (MoveContext *mc, int icx, int icy);
+int MoveLowersEnergy (MoveContext *mc, EnergyState *cur, Move *m,
+		      EnergyState *next);
+void EvaluateMove (MoveContext *mc, Move *m);
+void CorrelationDeltas (MoveContext *mc, Move *m);
+#if HAVE_X86_SIMD
+void CorrelationDeltasAVX2 (MoveContext *mc, Move *m)
+     __attribute__((target("avx2")));
+#endif
+void SelectSimd ();
+void EvaluateMovesTask (int thread, void *arg);
+void StartMoveThreads ();
+void *MoveThreadMain (void *arg);
+void RunMoveThreads (void (*func)(int thread, void *arg), void *arg);
 void ComputeWarpedImage (float *warped, unsigned char *valid,
 			 int w, int h,
 			 int imgox, int imgoy,
-			 float *image, unsigned char *mask,
+			 void *image, unsigned char *mask,
 			 int iw, int ih,
 			 int refox, int refoy,
 			 MapElement *map,
@@ -237,7 +397,7 @@ void ComputeWarpedImage (float *warped, unsigned char *valid,
 			 int mpw, int mph,
 			 int mox, int moy);
 void ComputeCorrelation (float *correlation,
-			 float *a, float *b,
+			 void *a, float *b,
 			 unsigned char *valid,
 			 int w, int h,
 			 int hw);
@@ -257,6 +417,10 @@ int Extrapolate (double *prx, double *pry, double *prc,
 int Compare (const void *x, const void *y);
 int SortBySlice (const void *x, const void *y);
 int SortByEnergy (const void *x, const void *y);
+int SortByString (const void *x, const void *y);
+int SortByPosition (const void *x, const void *y);
+void OrderPairs (Pair *pairs, int nPairs, int nChains,
+		 int *order, int (*section)[2]);
 int ParseRange (char *s, int *pos, int *minValue, int *maxValue);
 int ParseValue (char *s, int *pos, int *value);
 size_t CountBits (unsigned char *p, size_t n);
@@ -565,6 +729,8 @@ MasterTask (int argc,
   int imi;
   char line[LINE_LENGTH+1];
   FILE *opf;
+  int *order;
+  int (*section)[2];
 
   error = 0;
   c.type = '\0';
@@ -599,6 +765,11 @@ MasterTask (int argc,
   c.update = 0;
   c.partial = 0;
   c.nWorkers = par_workers();
+  c.nThreads = 1;
+  c.simdLevel = -1;
+  c.cacheSize = 0;
+  c.pyramidBits = 32;
+  c.pyramidBasename[0] = '\0';
   c.trimMapSourceThreshold = 0.0;
   c.trimMapTargetThreshold = 0.0;
   r.pair.imageName[0]  = r.pair.imageName[1] = NULL;
@@ -846,8 +1017,65 @@ MasterTask (int argc,
       c.writeAllMaps = 1;
     else if (strcmp(argv[i], "-update") == 0)
       c.update = 1;
+    else if (strcmp(argv[i], "-affinity") == 0)
+      affinity = 1;
     else if (strcmp(argv[i], "-partial") == 0)
       c.partial = 1;
+    else if (strcmp(argv[i], "-cache") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.cacheSize) != 1 ||
+	    c.cacheSize < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramid_bits") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.pyramidBits) != 1 ||
+	    (c.pyramidBits != 8 && c.pyramidBits != 16 && c.pyramidBits != 32))
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-pyramids") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	strcpy(c.pyramidBasename, argv[i]);
+      }
+    else if (strcmp(argv[i], "-simd") == 0)
+      {
+	if (++i == argc)
+	  {
+	    error = 1;
+	    break;
+	  }
+	for (c.simdLevel = SIMD_AVX2; c.simdLevel >= 0; --c.simdLevel)
+	  if (strcmp(argv[i], simdNames[c.simdLevel]) == 0)
+	    break;
+	if (c.simdLevel < 0)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
+    else if (strcmp(argv[i], "-threads") == 0)
+      {
+	if (++i == argc ||
+	    sscanf(argv[i], "%d", &c.nThreads) != 1 ||
+	    c.nThreads < 1)
+	  {
+	    error = 1;
+	    break;
+	  }
+      }
     else if (strcmp(argv[i], "-strict_masking") == 0)
       c.strictMasking = 1;
     else if (strcmp(argv[i], "-tif") == 0)
@@ -947,7 +1175,13 @@ MasterTask (int argc,
       fprintf(stderr, "              [-all_maps]\n");
       fprintf(stderr, "              [-update]\n");
       fprintf(stderr, "              [-partial]\n");
+      fprintf(stderr, "              [-threads threads_per_worker]\n");
+      fprintf(stderr, "              [-simd none|avx2]\n");
+      fprintf(stderr, "              [-cache megabytes_per_worker]\n");
+      fprintf(stderr, "              [-pyramid_bits 8|16|32]\n");
+      fprintf(stderr, "              [-pyramids <pyramid_prefix>]\n");
       fprintf(stderr, "              [-pairs <pair_file>]\n");
+      fprintf(stderr, "              [-affinity]\n");
       fprintf(stderr, "              [-initial_map <initial_map_prefix>]\n");
       fprintf(stderr, "              [-constraining_map <constraining_map_prefix>]\n");
       fprintf(stderr, "              [-constraining constraining_weight]\n");
@@ -1142,8 +1376,16 @@ MasterTask (int argc,
   for (imi = 0; imi < 2; ++imi)
     t.pair.imageMinX[imi] = t.pair.imageMaxX[imi] = t.pair.imageMinY[imi] = t.pair.imageMaxY[imi] = -1;
   Log("nPairs = %d\n", nPairs);
-  for (pn = 0; pn < nPairs; ++pn)
+  order = (int *) malloc(nPairs * sizeof(int));
+  section = (int (*)[2]) malloc(nPairs * 2 * sizeof(int));
+  if (affinity)
+    OrderPairs(pairs, nPairs, c.nWorkers, order, section);
+  else
+    for (i = 0; i < nPairs; ++i)
+      order[i] = i;
+  for (i = 0; i < nPairs; ++i)
     {
+      pn = order[i];
       for (imi = 0; imi < 2; ++imi)
 	{
 	  CopyString(&(t.pair.imageName[imi]), pairs[pn].imageName[imi]);
@@ -1172,9 +1414,13 @@ MasterTask (int argc,
 	}
 
       Log("Delegating pair %d\n", pn);
+      if (affinity)
+	par_set_affinity(2, section[pn]);
       par_delegate_task();
     }
   par_finish();
+  free(order);
+  free(section);
 
   if (outputPairsFile[0] != '\0')
     {
@@ -1416,6 +1662,124 @@ SortByEnergy (const void *x, const void *y)
     return(1);
 }
 
+/* compares two strings, treating each run of digits as a number
+   so that, for example, s9 sorts before s10; strings that differ
+   only in leading zeros are ordered as by strcmp */
+int
+SortByString (const void *x, const void *y)
+{
+  const char *s0, *s1;
+  const char *a, *b;
+  const char *ea, *eb;
+
+  s0 = *((char **) x);
+  s1 = *((char **) y);
+  a = s0;
+  b = s1;
+  while (*a != '\0' && *b != '\0')
+    if (*a >= '0' && *a <= '9' && *b >= '0' && *b <= '9')
+      {
+	while (*a == '0')
+	  ++a;
+	while (*b == '0')
+	  ++b;
+	for (ea = a; *ea >= '0' && *ea <= '9'; ++ea) ;
+	for (eb = b; *eb >= '0' && *eb <= '9'; ++eb) ;
+	if (ea - a != eb - b)
+	  return(ea - a < eb - b ? -1 : 1);
+	for (; a < ea; ++a, ++b)
+	  if (*a != *b)
+	    return(*a < *b ? -1 : 1);
+      }
+    else if (*a != *b)
+      return(((unsigned char) *a) - ((unsigned char) *b));
+    else
+      {
+	++a;
+	++b;
+      }
+  if (*a != *b)
+    return(((unsigned char) *a) - ((unsigned char) *b));
+  return(strcmp(s0, s1));
+}
+
+int
+SortByPosition (const void *x, const void *y)
+{
+  PairPosition *px, *py;
+  px = (PairPosition *) x;
+  py = (PairPosition *) y;
+  if (px->z[0] != py->z[0])
+    return(px->z[0] - py->z[0]);
+  if (px->z[1] != py->z[1])
+    return(px->z[1] - py->z[1]);
+  return(px->pn - py->pn);
+}
+
+/* OrderPairs decides the order in which the pairs are delegated.
+   Each image is numbered by its position in slice-name order (with
+   numbers within the names compared by value), and
+   section[pn] receives the numbers of pair pn's images.  The pairs are
+   sorted into a chain along z; the chain is cut into nChains runs of
+   consecutive pairs, and the runs are interleaved in order[] so that
+   each worker can follow one run, and the worker that registered a
+   pair will usually be handed a pair sharing one of its sections. */
+void
+OrderPairs (Pair *pairs, int nPairs, int nChains,
+	    int *order, int (*section)[2])
+{
+  int i, j, k;
+  int n;
+  int pn;
+  int imi;
+  int nNames;
+  char **names;
+  char **found;
+  PairPosition *pp;
+  int runLength;
+
+  if (nPairs == 0)
+    return;
+  names = (char **) malloc(2 * nPairs * sizeof(char *));
+  for (pn = 0; pn < nPairs; ++pn)
+    for (imi = 0; imi < 2; ++imi)
+      names[2*pn+imi] = pairs[pn].imageName[imi];
+  qsort(names, 2*nPairs, sizeof(char *), SortByString);
+  nNames = 0;
+  for (i = 0; i < 2*nPairs; ++i)
+    if (nNames == 0 || strcmp(names[i], names[nNames-1]) != 0)
+      names[nNames++] = names[i];
+
+  pp = (PairPosition *) malloc(nPairs * sizeof(PairPosition));
+  for (pn = 0; pn < nPairs; ++pn)
+    {
+      for (imi = 0; imi < 2; ++imi)
+	{
+	  found = (char **) bsearch(&(pairs[pn].imageName[imi]), names, nNames,
+				    sizeof(char *), SortByString);
+	  section[pn][imi] = found - names;
+	}
+      pp[pn].pn = pn;
+      pp[pn].z[0] = section[pn][0] < section[pn][1] ? section[pn][0] : section[pn][1];
+      pp[pn].z[1] = section[pn][0] < section[pn][1] ? section[pn][1] : section[pn][0];
+    }
+  qsort(pp, nPairs, sizeof(PairPosition), SortByPosition);
+
+  if (nChains > nPairs)
+    nChains = nPairs;
+  if (nChains < 1)
+    nChains = 1;
+  runLength = (nPairs + nChains - 1) / nChains;
+  n = 0;
+  for (j = 0; j < runLength; ++j)
+    for (k = 0; k < nChains; ++k)
+      if ((i = k * runLength + j) < nPairs)
+	order[n++] = pp[i].pn;
+
+  free(pp);
+  free(names);
+}
+
 int
 ParseRange (char *s, int *pos, int *minValue, int *maxValue)
 {
@@ -1479,6 +1843,7 @@ WorkerContext ()
   t.pair.imageName[0] = NULL;
   t.pair.imageName[1] = NULL;
   t.pair.pairName = NULL;
+  SelectSimd();
 }
 
 void
@@ -1519,6 +1884,11 @@ WorkerTask ()
   char cptsName[PATH_MAX], initialMapName[PATH_MAX], constrainingMapName[PATH_MAX];
   char outputName[PATH_MAX], outputWarpedName[PATH_MAX], outputCorrelationName[PATH_MAX];
   char outputMaskName[PATH_MAX];
+  char pyramidName[2][PATH_MAX];
+  int writePyramid[2];
+  int firstLevel;
+  int pyramidWidth, pyramidHeight, pyramidLevels;
+  char pyramidId[64];
   int cw, ch;
   int factor;
   int dx, dy;
@@ -1530,7 +1900,7 @@ WorkerTask ()
   char errorMsg[PATH_MAX+256];
   int imi;
   unsigned char *image_in;
-  float *img;
+  void *img;
   cpu_set_t cpumask;
 
   Log("WORKER starting on node %d\n", par_instance());
@@ -1552,6 +1922,13 @@ WorkerTask ()
 	sprintf(discontinuityName[imi], "%s%s", c.discontinuityBasename, t.pair.imageName[imi]);
       else
 	discontinuityName[imi][0] = '\0';
+      /* precomputed pyramids only describe whole images */
+      if (c.pyramidBasename[0] != '\0' &&
+	  t.pair.imageMinX[imi] < 0 && t.pair.imageMaxX[imi] < 0 &&
+	  t.pair.imageMinY[imi] < 0 && t.pair.imageMaxY[imi] < 0)
+	sprintf(pyramidName[imi], "%s%s", c.pyramidBasename, t.pair.imageName[imi]);
+      else
+	pyramidName[imi][0] = '\0';
     }
   if (c.cptsName[0] != '\0')
     sprintf(cptsName, "%s%s.pts", c.cptsName, t.pair.pairName);
@@ -1723,8 +2100,52 @@ WorkerTask ()
   initialMap = NULL;
   constrainingMap = NULL;
 
+  /* the levels finer than the first one Compute samples need not be
+     built when the images have precomputed pyramids */
+  firstLevel = 0;
+  if (pyramidName[0][0] != '\0' &&
+      ReadImageSize(imageName[0], &pyramidWidth, &pyramidHeight, errorMsg))
+    firstLevel = FirstPyramidLevel(pyramidWidth, pyramidHeight);
+
+  taskPyramids[0] = taskPyramids[1] = NULL;
   for (imi = 0; imi < 2; ++imi)
     {
+      writePyramid[imi] = 0;
+      pyramidLevel[imi] = 0;
+      taskPyramids[imi] = FindPyramid(imi, imageName[imi], maskName[imi],
+				      firstLevel);
+      if (taskPyramids[imi] != NULL)
+	{
+	  Log("WORKER using cached pyramid of image %s\n", imageName[imi]);
+	  imageWidth[imi][0] = taskPyramids[imi]->width[0];
+	  imageHeight[imi][0] = taskPyramids[imi]->height[0];
+	  imageOffsetX[imi][0] = taskPyramids[imi]->offsetX[0];
+	  imageOffsetY[imi][0] = taskPyramids[imi]->offsetY[0];
+	  images[imi][0] = taskPyramids[imi]->images[0];
+	  masks[imi][0] = taskPyramids[imi]->masks[0];
+	  pyramidLevel[imi] = taskPyramids[imi]->firstLevel;
+	  continue;
+	}
+
+      if (pyramidName[imi][0] != '\0')
+	{
+	  if (!PyramidUpToDate(pyramidName[imi], imageName[imi], maskName[imi],
+			       &pyramidWidth, &pyramidHeight, &pyramidLevels,
+			       pyramidId))
+	    writePyramid[imi] = 1;
+	  else if (firstLevel > 0 && firstLevel < pyramidLevels)
+	    {
+	      if (ReadPyramid(imi, pyramidName[imi], pyramidId,
+			      pyramidWidth, pyramidHeight, firstLevel))
+		{
+		  Log("WORKER read level %d of image %s from pyramid %s\n",
+		      firstLevel, imageName[imi], pyramidName[imi]);
+		  continue;
+		}
+	      writePyramid[imi] = 1;
+	    }
+	}
+
       Log("WORKER reading image %s\n", imageName[imi]);
 
       image_in = NULL;
@@ -1744,17 +2165,17 @@ WorkerTask ()
       Log("WORKER READ IMAGE: %s\n", imageName[imi]);
 
       imagePixels = ((size_t) imageWidth[imi][0]) * imageHeight[imi][0];
-      images[imi][0] = (float *) malloc(imagePixels * sizeof(float));
+      images[imi][0] = malloc(imagePixels * (c.pyramidBits / 8) + PIXEL_PADDING);
       if (images[imi][0] == NULL)
 	{
 	  SetMessage("Could not allocate image arrays (%zd)\n",
-		     imagePixels * sizeof(float));
+		     imagePixels * (c.pyramidBits / 8) + PIXEL_PADDING);
 	  return;
 	}
       Log("images[0] = %llx  imp = %llu\n", (long long) images[imi][0], imagePixels);
       img = images[imi][0];
       for (ii = 0; ii < imagePixels; ++ii)
-	img[ii] = image_in[ii];
+	SETPIXEL(img, c.pyramidBits, ii, image_in[ii]);
       free(image_in);
       image_in = NULL;
 
@@ -1789,7 +2210,7 @@ WorkerTask ()
 	  for (my = 0; my < imh; ++my)
 	    for (mx = 0; mx < imw; ++mx)
 	      if (!MASK(masks[imi][0], imbpl, mx, my))
-		IMAGE(img, imw, mx, my) = 0;
+		SETPIXEL(img, c.pyramidBits, my * ((size_t) imw) + mx, 0);
 	  Log("WORKER APPLIED THE IMAGE MASK\n");
 	  maskPresent = 1;
 	}
@@ -1926,6 +2347,11 @@ WorkerTask ()
       Log("Init was unsuccessful.\n");
       return;
     }
+  for (imi = 0; imi < 2; ++imi)
+    if (writePyramid[imi])
+      WritePyramid(imi, pyramidName[imi], maskName[imi]);
+  if (c.cacheSize > 0)
+    CachePyramids(imageName, maskName);
 
   Compute(outputName, outputWarpedName, outputCorrelationName);
 
@@ -1946,6 +2372,8 @@ WorkerTask ()
     {
       for (imi = 0; imi < 2; ++imi)
 	{
+	  if (taskPyramids[imi] != NULL)
+	    continue;
 	  free(images[imi][level]);
 #if MASKING
 	  free(masks[imi][level]);
@@ -1966,7 +2394,7 @@ Init ()
 {
   int level;
   unsigned int iw, ih;
-  float *image;
+  void *image;
   size_t imagePixels;
   size_t ii;
   int i;
@@ -1981,8 +2409,10 @@ Init ()
   int imi;
   size_t maskCount;
   int minX, maxX, minY, maxY;
-  float *src_image;
+  void *src_image;
   int src_iw, src_ih;
+  float sum;
+  double v;
   int src_x, src_y;
   unsigned char *src_mask;
   int src_mbpl;
@@ -2003,7 +2433,8 @@ Init ()
       ih = imageHeight[imi][0];
       imbpl = (iw + 7) >> 3;
 #if MASKING
-      Log("maskcount = %ld\n", CountBits(masks[imi][0], ih * imbpl));
+      if (masks[imi][0] != NULL)
+	Log("maskcount = %ld\n", CountBits(masks[imi][0], ih * imbpl));
 #endif
     }
   mapWidth[0] = imageWidth[0][0];
@@ -2037,15 +2468,8 @@ Init ()
 	  maxY = minY + imageHeight[imi][level-1] - 1;
 
 	  // now calculate the ranges for level
-	  minX = (minX + 1) / 2;
-	  maxX = (maxX + 1) / 2 - 1;
-	  minY = (minY + 1) / 2;
-	  maxY = (maxY + 1) / 2 - 1;
-
-	  if (minX > maxX)
-	    minX = maxX = imageOffsetX[imi][level-1] / 2;
-	  if (minY > maxY)
-	    minY = maxY = imageOffsetY[imi][level-1] / 2;
+	  ReduceRange(&minX, &maxX);
+	  ReduceRange(&minY, &maxY);
 
 	  iw = imageWidth[imi][level] = maxX - minX + 1;
 	  ih = imageHeight[imi][level] = maxY - minY + 1;
@@ -2057,12 +2481,24 @@ Init ()
 	  imph = ih + 1;
 	  impbpl = (impw  + 7) >> 3;
 
+	  if (taskPyramids[imi] != NULL && level < taskPyramids[imi]->nLevels)
+	    {
+	      /* this level was built during an earlier task */
+	      images[imi][level] = taskPyramids[imi]->images[level];
+	      masks[imi][level] = taskPyramids[imi]->masks[level];
+	      continue;
+	    }
+	  if (level <= pyramidLevel[imi])
+	    /* this level was read from a precomputed pyramid, or is
+	       finer than any level that will be used */
+	    continue;
+
 	  Log("imagePixels = %d\n", imagePixels);
-	  images[imi][level] = (float*) malloc(imagePixels * sizeof(float));
+	  images[imi][level] = malloc(imagePixels * (c.pyramidBits / 8) + PIXEL_PADDING);
 	  if (images[imi][level] == NULL)
 	    {
 	      SetMessage("Could not allocate image arrays (%zd)\n",
-			 imagePixels * sizeof(float));
+			 imagePixels * (c.pyramidBits / 8) + PIXEL_PADDING);
 	      return(0);
 	    }
 
@@ -2085,7 +2521,6 @@ Init ()
 #endif
 
 	  image = images[imi][level];
-	  memset(image, 0, imagePixels * sizeof(float));
 #if MASKING
 	  memset(iCount, 0, imagePixels*sizeof(unsigned char));
 #endif
@@ -2103,6 +2538,7 @@ Init ()
 	      for (x = 0; x < iw; ++x)
 		{
 		  ix = 2 * x + delta_x;
+		  sum = 0.0;
 		  for (dy = 0; dy < 2; ++dy)
 		    {
 		      src_y = iy + dy;
@@ -2113,7 +2549,7 @@ Init ()
 			  src_x = ix + dx;
 			  if (src_x < 0 || src_x >= src_iw)
 			    continue;
-			  IMAGE(image, iw, x, y) += IMAGE(src_image, src_iw, src_x, src_y);
+			  sum += IMAGE_PIXEL(src_image, c.pyramidBits, src_iw, src_x, src_y);
 #if MASKING
 			  if (MASK(src_mask, src_mbpl, ix+dx, iy+dy))
 			    ++IMAGE(iCount, iw, x, y);
@@ -2122,12 +2558,13 @@ Init ()
 		    }
 #if MASKING
 		  if (IMAGE(iCount, iw, x, y) > 0)
-		    IMAGE(image, iw, x, y) *= 1.0 / IMAGE(iCount, iw, x, y);
+		    v = sum * (1.0 / IMAGE(iCount, iw, x, y));
 		  else
-		    IMAGE(image, iw, x, y) = 0.0;
+		    v = 0.0;
 #else
-		  IMAGE(image, iw, x, y) *= 1.0 / 4.0;
+		  v = sum * (1.0 / 4.0);
 #endif		  
+		  SETPIXEL(image, c.pyramidBits, y * ((size_t) iw) + x, v);
 		}
 	    }
 
@@ -2301,6 +2738,8 @@ Init ()
 	  ih = imageHeight[imi][level];
 	  imagePixels = ((size_t) iw) * ih;
 	  imbpl = (iw + 7) >> 3;
+	  if (masks[imi][level] == NULL)
+	    continue;
 
 	  if (imi == 0 && outputMasks[level] != NULL)
 	    maskCount = CountIntersectionBits(masks[imi][level],
@@ -2329,42 +2768,550 @@ Init ()
 }
 
 
+PyramidEntry *
+FindPyramid (int imi, char *imageName, char *maskName, int firstLevel)
+{
+  PyramidEntry *e, **pe;
+  char fn[PATH_MAX];
+  struct stat sb;
+  time_t imageTime, maskTime;
+
+  if (c.cacheSize == 0 || pyramidCache == NULL)
+    return(NULL);
+  if (!FindImageFile(imageName, 0, fn) || stat(fn, &sb) != 0)
+    return(NULL);
+  imageTime = sb.st_mtime;
+  maskTime = 0;
+  if (maskName[0] != '\0')
+    {
+      if (!FindImageFile(maskName, 1, fn) || stat(fn, &sb) != 0)
+	return(NULL);
+      maskTime = sb.st_mtime;
+    }
+
+  pe = &pyramidCache;
+  while ((e = *pe) != NULL)
+    {
+      if (strcmp(e->imageName, imageName) != 0 ||
+	  strcmp(e->maskName, maskName) != 0)
+	{
+	  pe = &(e->next);
+	  continue;
+	}
+      if ((e->imageTime != imageTime || e->maskTime != maskTime) &&
+	  e != taskPyramids[0])
+	{
+	  /* the files have changed since they were read */
+	  *pe = e->next;
+	  pyramidCacheBytes -= e->nBytes;
+	  FreePyramid(e);
+	  continue;
+	}
+      if (e->imageTime != imageTime || e->maskTime != maskTime ||
+	  e->firstLevel > firstLevel ||
+	  e->minX != t.pair.imageMinX[imi] ||
+	  e->maxX != t.pair.imageMaxX[imi] ||
+	  e->minY != t.pair.imageMinY[imi] ||
+	  e->maxY != t.pair.imageMaxY[imi])
+	{
+	  pe = &(e->next);
+	  continue;
+	}
+
+      /* move the entry to the front of the list */
+      *pe = e->next;
+      e->next = pyramidCache;
+      pyramidCache = e;
+      return(e);
+    }
+  return(NULL);
+}
+
 void
-Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
+CachePyramids (char imageName[2][PATH_MAX], char maskName[2][PATH_MAX])
 {
+  PyramidEntry *e, **pe;
+  int imi;
   int level;
-  MapElement *prop;
-  int i;
+  size_t nBytes;
+  size_t budget;
+  char fn[PATH_MAX];
+  struct stat sb;
+
+  budget = ((size_t) c.cacheSize) << 20;
+  for (imi = 0; imi < 2; ++imi)
+    {
+      e = taskPyramids[imi];
+      if (e == NULL)
+	{
+	  /* an image used twice by this task is only cached once */
+	  if (imi == 1 && taskPyramids[0] != NULL &&
+	      strcmp(imageName[0], imageName[1]) == 0 &&
+	      strcmp(maskName[0], maskName[1]) == 0 &&
+	      t.pair.imageMinX[0] == t.pair.imageMinX[1] &&
+	      t.pair.imageMaxX[0] == t.pair.imageMaxX[1] &&
+	      t.pair.imageMinY[0] == t.pair.imageMinY[1] &&
+	      t.pair.imageMaxY[0] == t.pair.imageMaxY[1])
+	    continue;
+
+	  e = (PyramidEntry *) malloc(sizeof(PyramidEntry));
+	  if (e == NULL)
+	    continue;
+	  memset(e, 0, sizeof(PyramidEntry));
+	  strcpy(e->imageName, imageName[imi]);
+	  strcpy(e->maskName, maskName[imi]);
+	  if (!FindImageFile(imageName[imi], 0, fn) || stat(fn, &sb) != 0)
+	    {
+	      free(e);
+	      continue;
+	    }
+	  e->imageTime = sb.st_mtime;
+	  if (maskName[imi][0] != '\0')
+	    {
+	      if (!FindImageFile(maskName[imi], 1, fn) || stat(fn, &sb) != 0)
+		{
+		  free(e);
+		  continue;
+		}
+	      e->maskTime = sb.st_mtime;
+	    }
+	  e->minX = t.pair.imageMinX[imi];
+	  e->maxX = t.pair.imageMaxX[imi];
+	  e->minY = t.pair.imageMinY[imi];
+	  e->maxY = t.pair.imageMaxY[imi];
+	  e->firstLevel = pyramidLevel[imi];
+	}
+
+      /* add the levels built by this task */
+      nBytes = 0;
+      for (level = e->nLevels; level < nLevels; ++level)
+	if (images[imi][level] != NULL)
+	  nBytes += ((size_t) imageWidth[imi][level]) * imageHeight[imi][level] * (c.pyramidBits / 8) +
+	    ((size_t) imageHeight[imi][level]) * ((imageWidth[imi][level] + 7) >> 3);
+      if (e != taskPyramids[imi] && e->nBytes + nBytes > budget)
+	{
+	  /* this image alone would overflow the cache */
+	  free(e);
+	  continue;
+	}
+      for (level = e->nLevels; level < nLevels; ++level)
+	{
+	  e->width[level] = imageWidth[imi][level];
+	  e->height[level] = imageHeight[imi][level];
+	  e->offsetX[level] = imageOffsetX[imi][level];
+	  e->offsetY[level] = imageOffsetY[imi][level];
+	  e->images[level] = images[imi][level];
+	  e->masks[level] = masks[imi][level];
+	}
+      if (nLevels > e->nLevels)
+	e->nLevels = nLevels;
+      e->nBytes += nBytes;
+      pyramidCacheBytes += nBytes;
+      if (e != taskPyramids[imi])
+	{
+	  e->next = pyramidCache;
+	  pyramidCache = e;
+	  taskPyramids[imi] = e;
+	}
+    }
+
+  /* evict the least recently used pyramids that are not used by
+     this task until the cache fits within its budget */
+  while (pyramidCacheBytes > budget)
+    {
+      e = NULL;
+      for (pe = &pyramidCache; *pe != NULL; pe = &((*pe)->next))
+	if (*pe != taskPyramids[0] && *pe != taskPyramids[1])
+	  e = *pe;
+      if (e == NULL)
+	break;
+      for (pe = &pyramidCache; *pe != e; pe = &((*pe)->next)) ;
+      *pe = e->next;
+      pyramidCacheBytes -= e->nBytes;
+      Log("WORKER evicting cached pyramid of image %s\n", e->imageName);
+      FreePyramid(e);
+    }
+  Log("WORKER pyramid cache holds %zd MB\n", pyramidCacheBytes >> 20);
+}
+
+void
+FreePyramid (PyramidEntry *e)
+{
+  int level;
+
+  for (level = 0; level < e->nLevels; ++level)
+    {
+      free(e->images[level]);
+      free(e->masks[level]);
+    }
+  free(e);
+}
+
+/* FirstPyramidLevel returns the finest level that Compute will sample
+   when the first image of the pair has the given size; as in Compute,
+   the level is moved finer while the image would be smaller than
+   c.minResolution there. */
+int
+FirstPyramidLevel (int width, int height)
+{
+  int level;
+  int first;
+  int minX[MAX_LEVELS], maxX[MAX_LEVELS], minY[MAX_LEVELS], maxY[MAX_LEVELS];
+
+  first = c.outputLevel - c.depth;
+  if (first < 0)
+    first = 0;
+  if (first >= MAX_LEVELS)
+    first = MAX_LEVELS - 1;
+  minX[0] = 0;
+  maxX[0] = width - 1;
+  minY[0] = 0;
+  maxY[0] = height - 1;
+  for (level = 1; level <= first; ++level)
+    {
+      minX[level] = minX[level-1];
+      maxX[level] = maxX[level-1];
+      minY[level] = minY[level-1];
+      maxY[level] = maxY[level-1];
+      ReduceRange(&minX[level], &maxX[level]);
+      ReduceRange(&minY[level], &maxY[level]);
+    }
+  while (first > 0 &&
+	 (maxX[first] - minX[first] + 1 < c.minResolution ||
+	  maxY[first] - minY[first] + 1 < c.minResolution))
+    --first;
+  return(first);
+}
+
+/* PyramidUpToDate checks that the pyramid directory pyramidName was
+   written after the image and mask files were last modified, from the
+   same mask, with the same masking mode and the same c.pyramidBits,
+   and returns the size of the full-resolution image, the number of
+   levels in the directory, and the id of the writer.  The description
+   file pyramid.txt holds the width, height, number of levels, strict
+   masking flag, pixel bits, and writer id on its first line, and the
+   mask name (empty if none) on its second. */
+int
+PyramidUpToDate (char *pyramidName, char *imageName, char *maskName,
+		 int *width, int *height, int *levels, char *id)
+{
+  char fn[PATH_MAX];
+  char line[PATH_MAX+2];
+  struct stat sb;
+  time_t pyramidTime;
+  FILE *f;
+  int strict;
+  int bits;
+  int len;
+  int valid;
+
+  sprintf(fn, "%s/pyramid.txt", pyramidName);
+  if (stat(fn, &sb) != 0)
+    return(0);
+  pyramidTime = sb.st_mtime;
+  f = fopen(fn, "r");
+  if (f == NULL)
+    return(0);
+  valid = fgets(line, PATH_MAX+2, f) != NULL &&
+    sscanf(line, "%d%d%d%d%d%63s", width, height, levels,
+	   &strict, &bits, id) == 6 &&
+    strict == c.strictMasking &&
+    bits == c.pyramidBits &&
+    fgets(line, PATH_MAX+2, f) != NULL;
+  fclose(f);
+  if (!valid)
+    return(0);
+  len = strlen(line);
+  if (len > 0 && line[len-1] == '\n')
+    line[len-1] = '\0';
+  if (strcmp(line, maskName) != 0)
+    return(0);
+
+  if (!FindImageFile(imageName, 0, fn) || stat(fn, &sb) != 0 ||
+      sb.st_mtime > pyramidTime)
+    return(0);
+  if (maskName[0] != '\0' &&
+      (!FindImageFile(maskName, 1, fn) || stat(fn, &sb) != 0 ||
+       sb.st_mtime > pyramidTime))
+    return(0);
+  return(1);
+}
+
+/* ReadPyramid reads the given level of image imi, and its mask, from
+   the pyramid directory pyramidName in place of the full-resolution
+   image.  The finer levels are left unbuilt; only their dimensions
+   are set.  The level files carry the id of the writer that
+   PyramidUpToDate found, so if the directory has since been replaced
+   they are missing rather than mismatched.  Returns 0 if the level is
+   missing or does not match the size of the image. */
+int
+ReadPyramid (int imi, char *pyramidName, char *id,
+	     int width, int height, int level)
+{
+  char fn[PATH_MAX];
+  char errorMsg[PATH_MAX+256];
+  unsigned char *pixels;
+  unsigned char *mask;
+  void *img;
+  FILE *f;
+  int w, h;
+  int maxValue;
+  int mw, mh;
+  int l;
+  int minX, maxX, minY, maxY;
+  size_t imagePixels;
   size_t ii;
-  int x, y;
-  double x00, x01, x10, x11;
-  double y00, y01, y10, y11;
-  double c00, c01, c10, c11;
-  double rx, ry;
-  int irx, iry;
-  double rrx, rry;
-  double r00, r01, r10, r11;
-  double xd, yd;
-  double sir, si2, sr2;
-  double de;
-  double dx, dy;
-  double radius;
-  double offset;
-  double sqrtRadius, sqrtOffset;
-  double theta;
-  int changeMinX, changeMaxX, changeMinY, changeMaxY;
-  int icx, icy;
-  double cx, cy, cc;
-  int xdir, ydir;
+
+  minX = 0;
+  maxX = width - 1;
+  minY = 0;
+  maxY = height - 1;
+  for (l = 0; l <= level; ++l)
+    {
+      if (l > 0)
+	{
+	  ReduceRange(&minX, &maxX);
+	  ReduceRange(&minY, &maxY);
+	}
+      imageWidth[imi][l] = maxX - minX + 1;
+      imageHeight[imi][l] = maxY - minY + 1;
+      imageOffsetX[imi][l] = minX;
+      imageOffsetY[imi][l] = minY;
+      images[imi][l] = NULL;
+      masks[imi][l] = NULL;
+    }
+
+  sprintf(fn, "%s/%d.%s.pgm", pyramidName, level, id);
+  f = fopen(fn, "rb");
+  if (f == NULL)
+    return(0);
+  if (fscanf(f, "P5%d%d%d", &w, &h, &maxValue) != 3 ||
+      maxValue != 65535 || fgetc(f) == EOF ||
+      w != imageWidth[imi][level] || h != imageHeight[imi][level])
+    {
+      fclose(f);
+      return(0);
+    }
+  imagePixels = ((size_t) w) * h;
+  pixels = (unsigned char *) malloc(2 * imagePixels);
+  if (pixels == NULL || fread(pixels, 2 * imagePixels, 1, f) != 1)
+    {
+      fclose(f);
+      free(pixels);
+      return(0);
+    }
+  fclose(f);
+
+  mask = NULL;
+  sprintf(fn, "%s/%d.%s.pbm", pyramidName, level, id);
+  if (!ReadBitmap(fn, &mask, &mw, &mh, -1, -1, -1, -1, errorMsg) ||
+      mw != w || mh != h)
+    {
+      free(pixels);
+      free(mask);
+      return(0);
+    }
+
+  img = malloc(imagePixels * (c.pyramidBits / 8) + PIXEL_PADDING);
+  if (img == NULL)
+    {
+      free(pixels);
+      free(mask);
+      return(0);
+    }
+  for (ii = 0; ii < imagePixels; ++ii)
+    SETPIXEL(img, c.pyramidBits, ii,
+	     ((pixels[2*ii] << 8) | pixels[2*ii+1]) * (1.0 / 256.0));
+  free(pixels);
+  images[imi][level] = img;
+  masks[imi][level] = mask;
+  pyramidLevel[imi] = level;
+  return(1);
+}
+
+/* WritePyramid stores levels 1 and up of image imi, with their masks,
+   in the pyramid directory pyramidName, so that later runs can start
+   from a coarser level without reading the full-resolution image.
+   Levels are stored as 16-bit PGM files holding 8.8 fixed point
+   values, since rounding the coarse levels to 8 bits noticeably
+   lowers the correlations found there.  The whole pyramid is written
+   into a new directory that is then renamed into place, replacing
+   any older one, so that other workers see either the old pyramid or
+   the new one, never a mixture. */
+void
+WritePyramid (int imi, char *pyramidName, char *maskName)
+{
+  char id[64];
+  char tmpDir[PATH_MAX+72], oldDir[PATH_MAX+72];
+  char fn[PATH_MAX+160];
+  char errorMsg[PATH_MAX+256];
+  unsigned char *pixels;
+  size_t imagePixels;
+  size_t ii;
+  double v;
+  unsigned int q;
+  int level;
+  int w, h;
+  int written;
+  FILE *f;
+
+  sprintf(id, "%d_%d_%ld", par_instance(), (int) getpid(),
+	  (long) time(NULL));
+  sprintf(tmpDir, "%s.tmp%s", pyramidName, id);
+  sprintf(fn, "%s/pyramid.txt", tmpDir);
+  if (!CreateDirectories(fn))
+    {
+      Log("WORKER could not create pyramid directory %s\n", tmpDir);
+      return;
+    }
+  for (level = 1; level < nLevels; ++level)
+    {
+      w = imageWidth[imi][level];
+      h = imageHeight[imi][level];
+      imagePixels = ((size_t) w) * h;
+      pixels = (unsigned char *) malloc(2 * imagePixels);
+      if (pixels == NULL)
+	{
+	  RemovePyramidDirectory(tmpDir);
+	  return;
+	}
+      for (ii = 0; ii < imagePixels; ++ii)
+	{
+	  v = PIXEL(images[imi][level], c.pyramidBits, ii) * 256.0 + 0.5;
+	  q = (v >= 65535.0) ? 65535 : (unsigned int) v;
+	  pixels[2*ii] = q >> 8;
+	  pixels[2*ii+1] = q & 0xff;
+	}
+      sprintf(fn, "%s/%d.%s.pgm", tmpDir, level, id);
+      f = fopen(fn, "wb");
+      written = f != NULL &&
+	fprintf(f, "P5\n%d %d\n65535\n", w, h) > 0 &&
+	fwrite(pixels, 2 * imagePixels, 1, f) == 1;
+      if (f != NULL && fclose(f) != 0)
+	written = 0;
+      free(pixels);
+      if (!written)
+	{
+	  Log("WORKER could not write pyramid level %s\n", fn);
+	  RemovePyramidDirectory(tmpDir);
+	  return;
+	}
+
+      sprintf(fn, "%s/%d.%s.pbm", tmpDir, level, id);
+      if (!WriteBitmap(fn, masks[imi][level], w, h,
+		       UncompressedBitmap, errorMsg))
+	{
+	  Log("WORKER could not write pyramid mask %s\n", fn);
+	  RemovePyramidDirectory(tmpDir);
+	  return;
+	}
+    }
+
+  sprintf(fn, "%s/pyramid.txt", tmpDir);
+  f = fopen(fn, "w");
+  if (f == NULL)
+    {
+      Log("WORKER could not write pyramid description %s\n", fn);
+      RemovePyramidDirectory(tmpDir);
+      return;
+    }
+  fprintf(f, "%d %d %d %d %d %s\n%s\n",
+	  imageWidth[imi][0], imageHeight[imi][0], nLevels,
+	  c.strictMasking, c.pyramidBits, id, maskName);
+  if (fclose(f) != 0)
+    {
+      Log("WORKER could not write pyramid description %s\n", fn);
+      RemovePyramidDirectory(tmpDir);
+      return;
+    }
+
+  /* rename will not replace a nonempty directory, so an older
+     pyramid is first moved aside and removed afterwards */
+  if (rename(tmpDir, pyramidName) != 0)
+    {
+      sprintf(oldDir, "%s.old%s", pyramidName, id);
+      if (rename(pyramidName, oldDir) != 0 ||
+	  rename(tmpDir, pyramidName) != 0)
+	{
+	  Log("WORKER could not replace pyramid directory %s\n", pyramidName);
+	  RemovePyramidDirectory(tmpDir);
+	  return;
+	}
+      RemovePyramidDirectory(oldDir);
+    }
+  Log("WORKER wrote %d pyramid levels to %s\n", nLevels - 1, pyramidName);
+}
+
+/* RemovePyramidDirectory removes a pyramid directory and the files in
+   it; pyramid directories have no subdirectories */
+void
+RemovePyramidDirectory (char *dirName)
+{
+  char fn[PATH_MAX];
+  DIR *dir;
+  struct dirent *de;
+
+  dir = opendir(dirName);
+  if (dir != NULL)
+    {
+      while ((de = readdir(dir)) != NULL)
+	{
+	  if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+	    continue;
+	  if (snprintf(fn, PATH_MAX, "%s/%s", dirName, de->d_name) < PATH_MAX)
+	    unlink(fn);
+	}
+      closedir(dir);
+    }
+  rmdir(dirName);
+}
+
+/* ReduceRange converts an inclusive range of pixel coordinates at one
+   level into the range covered at the next coarser level */
+void
+ReduceRange (int *minValue, int *maxValue)
+{
+  int offset;
+
+  offset = *minValue;
+  *minValue = (*minValue + 1) / 2;
+  *maxValue = (*maxValue + 1) / 2 - 1;
+  if (*minValue > *maxValue)
+    *minValue = *maxValue = offset / 2;
+}
+
+
+void
+Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
+{
+  int level;
+  MapElement *prop;
+  int i;
+  size_t ii;
+  int x, y;
+  double x00, x01, x10, x11;
+  double y00, y01, y10, y11;
+  double c00, c01, c10, c11;
+  double rx, ry;
+  int irx, iry;
+  double rrx, rry;
+  double r00, r01, r10, r11;
+  double xd, yd;
+  double sir, si2, sr2;
+  double de;
+  double dx, dy;
+  double radius;
+  double offset;
+  double sqrtRadius, sqrtOffset;
+  double theta;
+  int icx, icy;
+  double cx, cy, cc;
+  int xdir, ydir;
   int ix, iy;
   double dxp, dyp;
   double mrd;
   double nx, ny;
-  double ode, nde;
-  double newDistortion, newCorrelation, newCorrespondence, newConstraining;
-  double newEnergy;
   double aCorrelation, aDistortion, aCorrespondence;
-  int upd0, upd1, upd2, upd3;
   double iv, rv;
   double distortion, correlation, correspondence, constraining;
   double corr;
@@ -2377,9 +3324,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   int mpw1, mph1;
   MapElement *map;
   MapElement *map1;
-  double dsi, dsi2, dsir, dsr2, dsr;
   long dPoints;
-  long newDPoints;
   unsigned int iw, ih;
   unsigned int rw, rh;
   size_t effectivePoints;
@@ -2387,28 +3332,13 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double si, sr;
   double mi, mr;
   double denom;
-  double newsi, newsr;
-  double newsi2, newsr2;
-  double newsir;
-  double newmi, newmr;
-  double newDenom;
-  size_t newPoints;
-  size_t newEffectivePoints;
-  double newCorr;
-  long cPoints;
   size_t n;
-  size_t updcnt;
   double x0, x1, x2, x3;
   double y0, y1, y2, y3;
   double c0, c1, c2, c3;
   double area;
-  double nx0, nx1, nx2, nx3;
-  double ny0, ny1, ny2, ny3;
-  double nc0, nc1, nc2, nc3;
-  double narea;
   size_t moveCount, goalMoveCount, acceptedMoveCount;
   double l0, l1, l2, l3;
-  double nl0, nl1, nl2, nl3;
   size_t imbpl, rmbpl;
   size_t ombpl;
   unsigned char *mask;
@@ -2416,18 +3346,18 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   int nb;
   unsigned char *cimask, *crmask;
   size_t icmbpl, rcmbpl;
-  float *cimage;
-  float *cref;
+  void *cimage;
+  void *cref;
   double rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
   size_t nPoints;
   size_t requiredPoints;
   int factor;
-  int sx, sy, ex, ey;
   int mpw, mph;
   int mpw_minus_1, mph_minus_1;
   int ixv, iyv;
   double xv, yv;
   double energy;
+  EnergyState es, newEs;
   double ea;
   double check_sir, check_si2, check_sr2, check_si, check_sr;
   double check_sum;
@@ -2438,7 +3368,6 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double kFactor;
   double lFactor;
   double distance;
-  double ce;
   double ces;
   size_t mSize;
   double cth;
@@ -2447,10 +3376,8 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   size_t statTheta[21];
   double statDeltaE[21];
   MapElement *mapCons;
-  double oldEnergy;
   double logMinRadius, logMaxRadius, logRadiusRange;
   double minDist2;
-  double d2;
   int ix0, iy0;
   double rc;
   double rc00, rc01, rc10, rc11;
@@ -2465,8 +3392,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   float scc;
   double udLimit, diagLimit;
   unsigned char *trimmed;
-  MapElement *e, *ec, *ep;
-  MapElement *mp;
+  MapElement *e, *ec;
   int imgox, imgoy;
   int refox, refoy;
   int mox1, moy1;
@@ -2497,14 +3423,21 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
   double *nomThetaX, *nomThetaY;
   double thetaX, thetaY;
   double txd, tyd;
-  double nThetaX, nThetaY;
-  double ntxd, ntyd;
   int imi;
   int dnx, dny;
   int immbpl;
   unsigned char *initialMapMask;
   float *initialMapDist;
   double lb;
+  MoveContext mc;
+  MoveBatch batch;
+  Move move;
+  Move *moves;
+  Move *mv;
+  size_t *order;
+  int nMoves;
+  int color;
+  int j;
 
   for (imi = 0; imi < 2; ++imi)
     {
@@ -2593,7 +3526,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  int x, y;
 	  for (y = 0; y < ih; ++y)
 	    for (x = 0; x < iw; ++x)
-	      img[y*iw+x] = (int) cimage[y*iw+x];
+	      img[y*iw+x] = (int) PIXEL(cimage, c.pyramidBits, y*iw+x);
 	  FILE *of = fopen("testimg.pgm", "w");
 	  fprintf(of, "P5\n%d %d\n255\n", iw, ih);
 	  fwrite(img, iw * ih, 1, of);
@@ -2604,7 +3537,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	  img = (unsigned char *) malloc(rw * rh);
 	  for (y = 0; y < rh; ++y)
 	    for (x = 0; x < rw; ++x)
-	      img[y*rw+x] = (int) cref[y*rw+x];
+	      img[y*rw+x] = (int) PIXEL(cref, c.pyramidBits, y*rw+x);
 	  fwrite(img, rw * rh, 1, of);
 	  fclose(of);
 	  free(img);
@@ -3368,10 +4301,10 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	      continue;
 #endif
 	    ++nPoints;
-	    r00 = IMAGE(cref, rw, irx, iry);
-	    r01 = IMAGE(cref, rw, irx, iry + 1);
-	    r10 = IMAGE(cref, rw, irx + 1, iry);
-	    r11 = IMAGE(cref, rw, irx + 1, iry + 1);
+	    r00 = IMAGE_PIXEL(cref, c.pyramidBits, rw, irx, iry);
+	    r01 = IMAGE_PIXEL(cref, c.pyramidBits, rw, irx, iry + 1);
+	    r10 = IMAGE_PIXEL(cref, c.pyramidBits, rw, irx + 1, iry);
+	    r11 = IMAGE_PIXEL(cref, c.pyramidBits, rw, irx + 1, iry + 1);
 
 	    rv = r00 * (rrx - 1.0) * (rry - 1.0)
 	      - r10 * rrx * (rry - 1.0) 
@@ -3380,7 +4313,7 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 	    if (isnan(rv))
 	      Error("ISNAN internal error\nrx = %f irx = %d ry = %f iry = %d rrx = %f rry = %f\n",
 		    rx, irx, ry, iry, rrx, rry);
-	    iv = IMAGE(cimage, iw, x, y);
+	    iv = IMAGE_PIXEL(cimage, c.pyramidBits, iw, x, y);
 	    si += iv;
 	    si2 += iv * iv;
 	    sr += rv;
@@ -3593,6 +4526,163 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       memset(statTheta, 0, 21*sizeof(size_t));
       memset(statDeltaE, 0, 21*sizeof(double));
 
+      mc.level = level;
+      mc.map = map;
+      mc.prop = prop;
+      mc.mapCons = mapCons;
+      mc.mpw = mpw;
+      mc.mph = mph;
+      mc.mox = mox;
+      mc.moy = moy;
+      mc.factor = factor;
+      mc.lFactor = lFactor;
+      mc.kFactor = kFactor;
+      mc.cimage = cimage;
+      mc.cref = cref;
+      mc.cimask = cimask;
+      mc.crmask = crmask;
+      mc.icmbpl = icmbpl;
+      mc.rcmbpl = rcmbpl;
+      mc.iw = iw;
+      mc.ih = ih;
+      mc.rw = rw;
+      mc.rh = rh;
+      mc.imgox = imgox;
+      mc.imgoy = imgoy;
+      mc.refox = refox;
+      mc.refoy = refoy;
+      mc.nomArea = nomArea;
+      mc.nomL0 = nomL0;
+      mc.nomL1 = nomL1;
+      mc.nomL2 = nomL2;
+      mc.nomL3 = nomL3;
+      mc.nomThetaX = nomThetaX;
+      mc.nomThetaY = nomThetaY;
+      mc.logMinRadius = logMinRadius;
+      mc.logRadiusRange = logRadiusRange;
+      mc.udLimit = udLimit;
+      mc.diagLimit = diagLimit;
+      mc.requiredPoints = requiredPoints;
+      mc.dPoints = dPoints;
+      mc.crmaskBytes = NULL;
+#if HAVE_X86_SIMD && MASKING
+      if (c.simdLevel == SIMD_AVX2)
+	{
+	  /* the vector kernel tests the reference mask a byte per
+	     pixel; 4 bytes of padding let it load any pixel and its
+	     right neighbor as one word */
+	  mc.crmaskBytes = (unsigned char *) malloc(((size_t) rw) * rh + 4);
+	  if (mc.crmaskBytes == NULL)
+	    {
+	      SetMessage("Could not allocate byte mask (%zd)\n",
+			 ((size_t) rw) * rh + 4);
+	      return;
+	    }
+	  for (y = 0; y < rh; ++y)
+	    for (x = 0; x < rw; ++x)
+	      mc.crmaskBytes[((size_t) y) * rw + x] =
+		(crmask[y*rcmbpl + (x >> 3)] & (0x80 >> (x & 7))) != 0;
+	  memset(&mc.crmaskBytes[((size_t) rw) * rh], 0, 4);
+	}
+#endif
+
+      /* the moves below update the sums and energy terms in es */
+      es.nPoints = nPoints;
+      es.si = si;
+      es.si2 = si2;
+      es.sr = sr;
+      es.sr2 = sr2;
+      es.sir = sir;
+      es.correlation = correlation;
+      es.distortion = distortion;
+      es.correspondence = correspondence;
+      es.constraining = constraining;
+      es.energy = energy;
+
+      if (c.nThreads > 1)
+	{
+	  /* Nodes that differ by at least 2 in x or y share no map
+	     cells, so the moves of nodes with the same parity of x
+	     and y are independent of one another.  The nodes are
+	     therefore visited one parity class at a time; the moves
+	     of a class are evaluated in parallel in batches, and then
+	     accepted or rejected one at a time in order, so that the
+	     energy sums are exactly those of making the same moves
+	     one after another.  Each move draws its random numbers
+	     from its own sequence, so the result does not depend on
+	     the number of threads. */
+	  StartMoveThreads();
+	  order = (size_t *) malloc(mSize * sizeof(size_t));
+	  moves = (Move *) malloc(MOVE_BATCH_SIZE * sizeof(Move));
+	  if (order == NULL || moves == NULL)
+	    {
+	      SetMessage("Could not allocate move arrays\n");
+	      return;
+	    }
+	  ii = 0;
+	  for (color = 0; color < 4; ++color)
+	    for (y = color >> 1; y < mph; y += 2)
+	      for (x = color & 1; x < mpw; x += 2)
+		order[ii++] = ((size_t) y) * mpw + x;
+
+	  batch.mc = &mc;
+	  batch.moves = moves;
+	  while (moveCount < goalMoveCount)
+	    {
+	      /* gather a batch of moves of nodes of one color */
+	      nMoves = 0;
+	      color = -1;
+	      while (nMoves < MOVE_BATCH_SIZE && moveCount < goalMoveCount)
+		{
+		  k = order[moveCount % mSize];
+		  icx = k % mpw;
+		  icy = k / mpw;
+		  if (color < 0)
+		    color = ((icy & 1) << 1) | (icx & 1);
+		  else if ((((icy & 1) << 1) | (icx & 1)) != color)
+		    break;
+		  mv = &moves[nMoves++];
+		  mv->index = moveCount++;
+		  mv->icx = icx;
+		  mv->icy = icy;
+		}
+	      batch.nMoves = nMoves;
+	      RunMoveThreads(EvaluateMovesTask, &batch);
+
+	      /* accept or reject the moves in order */
+	      for (j = 0; j < nMoves; ++j)
+		{
+		  mv = &moves[j];
+		  if (!mv->valid)
+		    continue;
+		  icx = mv->icx;
+		  icy = mv->icy;
+		  accept = MoveLowersEnergy(&mc, &es, mv, &newEs);
+		  MAP(prop, mpw, icx, icy).c = 0;
+		  if (!accept)
+		    continue;
+
+		  /* make the provisional state the new state */
+		  GETMAP(prop, mpw, icx, icy, &rx00, &ry00, &rc00);
+		  rc00 = 1.0;
+		  SETMAP(map, mpw, icx, icy, rx00, ry00, rc00);
+
+		  ++statLogRadius[(int) (20.0 * mv->rnd)];
+		  ++statTheta[(int) (20.0 * mv->theta / (2.0 * M_PI))];
+		  statDeltaE[(int) (20.0 * mv->rnd)] += es.energy - newEs.energy;
+		  AcceptCorrespondence(&mc, icx, icy);
+
+		  es = newEs;
+		  ++acceptedMoveCount;
+		  displayLevel = level;
+		}
+	    }
+	  free(order);
+	  free(moves);
+	}
+
+      /* any moves not made by the threads above are made
+	 one at a time */
       while (moveCount < goalMoveCount)
 	{
 #if GRAPHICS
@@ -3631,653 +4721,93 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 #endif
 #endif
 
-	  // check that the move will not distort the grid too much;
-	  //  we check that the distance to each neighboring point
-	  //  is not less than half the nominal distance
-	  if (icx >= 1)
-	    {
-	      if (icy >= 1)
-		{
-		  e = &MAP(map, mpw, icx-1, icy-1);
-		  if (e->c != 0.0)
-		    {
-		      dx = e->x - cx;
-		      dy = e->y - cy;
-		      d2 = dx*dx + dy*dy;
-		      if (d2 < diagLimit)
-			continue;
-		    }
-		}
-	      if (icy < mph_minus_1)
-		{
-		  e = &MAP(map, mpw, icx-1, icy+1);
-		  if (e->c != 0.0)
-		    {
-		      dx = e->x - cx;
-		      dy = e->y - cy;
-		      d2 = dx*dx + dy*dy;
-		      if (d2 < diagLimit)
-			continue;
-		    }
-		}
-	      e = &MAP(map, mpw, icx-1, icy);
-	      if (e->c != 0.0)
-		{
-		  dx = e->x - cx;
-		  dy = e->y - cy;
-		  d2 = dx*dx + dy*dy;
-		  if (d2 < udLimit)
-		    continue;
-		}
-	    }
-	  if (icx < mpw_minus_1)
-	    {
-	      if (icy >= 1)
-		{
-		  e = &MAP(map, mpw, icx+1, icy-1);
-		  if (e->c != 0.0)
-		    {
-		      dx = e->x - cx;
-		      dy = e->y - cy;
-		      d2 = dx*dx + dy*dy;
-		      if (d2 < diagLimit)
-			continue;
-		    }
-		}
-	      if (icy < mph_minus_1)
-		{
-		  e = &MAP(map, mpw, icx+1, icy+1);
-		  if (e->c != 0.0)
-		    {
-		      dx = e->x - cx;
-		      dy = e->y - cy;
-		      d2 = dx*dx + dy*dy;
-		      if (d2 < diagLimit)
-			continue;
-		    }
-		}
-	      e = &MAP(map, mpw, icx+1, icy);
-	      if (e->c != 0.0)
-		{
-		  dx = e->x - cx;
-		  dy = e->y - cy;
-		  d2 = dx*dx + dy*dy;
-		  if (d2 < udLimit)
-		    continue;
-		}
-	    }
-	  if (icy >= 1)
-	    {
-	      e = &MAP(map, mpw, icx, icy-1);
-	      if (e->c != 0.0)
-		{
-		  dx = e->x - cx;
-		  dy = e->y - cy;
-		  d2 = dx*dx + dy*dy;
-		  if (d2 < udLimit)
-		    continue;
-		}
-	    }
-	  if (icy < mph_minus_1)
-	    {
-	      e = &MAP(map, mpw, icx, icy+1);
-	      if (e->c != 0.0)
-		{
-		  dx = e->x - cx;
-		  dy = e->y - cy;
-		  d2 = dx*dx + dy*dy;
-		  if (d2 < udLimit)
-		    continue;
-		}
-	    }
-	  
+	  if (!MoveKeepsSpacing(&mc, icx, icy, cx, cy))
+	    continue;
 	  SETMAP(prop, mpw, icx, icy, cx, cy, 1.0);
-	  
-	  changeMinX = icx;
-	  changeMaxX = icx;
-	  changeMinY = icy;
-	  changeMaxY = icy;
 
 	  /* evaluate effect of that move on energy */
 
 	  /* add in contribution from correlation */
-	  dsir = 0.0;
-	  dsr2 = 0.0;
-	  dsr = 0.0;
-	  dsi = 0.0;
-	  dsi2 = 0.0;
-	  cPoints = 0;
-	  sx = (changeMinX - 1 + mox) * factor - imgox;
-	  if (sx < 0)
-	    sx = 0;
-	  ex = (changeMaxX + 1 + mox) * factor - 1 - imgox;
-	  if (ex >= iw)
-	    ex = iw - 1;
-	  sy = (changeMinY - 1 + moy) * factor - imgoy;
-	  if (sy < 0)
-	    sy = 0;
-	  ey = (changeMaxY + 1 + moy) * factor - 1 - imgoy;
-	  if (ey >= ih)
-	    ey = ih - 1;
-
-	  //	  printf("sx = %d ex = %d sy = %d ey = %d\n",
-	  //		 sx, ex, sy, ey);
-	  for (y = sy; y <= ey; ++y)
-            for (x = sx; x <= ex; ++x)
-	      {
-#if MASKING
-		if ((cimask[y*icmbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
-		  continue;
-#endif
-		xv = (x + 0.5 + imgox) / factor - mox;
-		yv = (y + 0.5 + imgoy) / factor - moy;
-		ixv = ((int) (xv + 2.0)) - 2;
-		iyv = ((int) (yv + 2.0)) - 2;
-		rrx = xv - ixv;
-		rry = yv - iyv;
-
-		if (ixv < 0 || ixv >= mpw_minus_1 ||
-		    iyv < 0 || iyv >= mph_minus_1)
-		  continue;
-
-		if (MAP(prop, mpw, ixv, iyv).c == 0.0 &&
-		    MAP(prop, mpw, ixv+1, iyv).c == 0.0 &&
-		    MAP(prop, mpw, ixv, iyv+1).c == 0.0 &&
-		    MAP(prop, mpw, ixv+1, iyv+1).c == 0.0)
-		    continue;
-
-		/* use bilinear interpolation to find value */
-		iv = IMAGE(cimage, iw, x, y);
-		if (iv < 0.0)
-		  Error("Internal error: iv out of range: %f\n", iv);
-		GETMAP(map, mpw, ixv, iyv, &rx00, &ry00, &rc00);
-		GETMAP(map, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
-		GETMAP(map, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
-		GETMAP(map, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
-		if (rc00 != 0.0 && rc01 != 0.0 && rc10 != 0.0 && rc11 != 0.0)
-		  {
-		    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-		      - rx10 * rrx * (rry - 1.0) 
-		      - rx01 * (rrx - 1.0) * rry
-		      + rx11 * rrx * rry;
-		    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-		      - ry10 * rrx * (rry - 1.0) 
-		      - ry01 * (rrx - 1.0) * rry
-		      + ry11 * rrx * rry;
-		    rx = factor * rx - 0.5 - refox;
-		    ry = factor * ry - 0.5 - refoy;
-		    irx = ((int) (rx + 1.0)) - 1;
-		    iry = ((int) (ry + 1.0)) - 1;
-		    rrx = rx - irx;
-		    rry = ry - iry;
-		    if (irx >= 0 && irx < rw-1 && iry >= 0 && iry < rh-1)
-		      {
-#if MASKING
-			if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0 &&
-			    ((rrx <= 0.0) || (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0) &&
-			    ((rry <= 0.0) || (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0) &&
-			    ((rrx <= 0.0) || (rry <= 0.0) || (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0))
-			  {
-#endif
-			    r00 = IMAGE(cref, rw, irx, iry);
-			    r01 = IMAGE(cref, rw, irx, iry + 1);
-			    r10 = IMAGE(cref, rw, irx + 1, iry);
-			    r11 = IMAGE(cref, rw, irx + 1, iry + 1);
-
-			    rv = r00 * (rrx - 1.0) * (rry - 1.0)
-			      - r10 * rrx * (rry - 1.0) 
-			      - r01 * (rrx - 1.0) * rry
-			      + r11 * rrx * rry;
-			    dsi -= iv;
-			    dsi2 -= iv * iv;
-			    dsir -= iv * rv;
-			    dsr2 -= rv * rv;
-			    dsr -= rv;
-			    cPoints -= 1;
-#if MASKING
-			  }
-#endif
-		      }
-		  }
-
-		/* use bilinear interpolation to find value */
-		mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
-		GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
-		mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
-		GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
-		mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
-		GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
-		mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
-		GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
-		if (isnan(ry11))
-		  Error("ISNAN ry11 %d %d %d %d %f %d\n",
-			ixv, iyv, mpw, mph, MAP(prop, mpw, ixv+1, iyv+1).c, level);
-		if (rc00 == 0.0 || rc01 == 0.0 || rc10 == 0.0 || rc11 == 0.0)
-		  continue;
+	  move.icx = icx;
+	  move.icy = icy;
+	  CorrelationDeltas(&mc, &move);
 
-		rrx = xv - ixv;
-		rry = yv - iyv;
-		rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-		  - rx10 * rrx * (rry - 1.0) 
-		  - rx01 * (rrx - 1.0) * rry
-		  + rx11 * rrx * rry;
-		ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-		  - ry10 * rrx * (rry - 1.0) 
-		  - ry01 * (rrx - 1.0) * rry
-		  + ry11 * rrx * rry;
-		if (isnan(ry))
-		  Error("Internal error: RY ISNAN %f %f %f %f %f %f\n%d %d %d %d\n",
-			ry00, ry01, ry10, ry11, rrx, rry,
-			ixv, iyv, mpw, mph);
-		rx = factor * rx - 0.5 - refox;
-		ry = factor * ry - 0.5 - refoy;
-
-		irx = ((int) (rx + 1.0)) - 1;
-		iry = ((int) (ry + 1.0)) - 1;
-		if (irx < 0 || irx >= rw-1 || iry < 0 || iry >= rh-1)
-		  continue;
-		rrx = rx - irx;
-		rry = ry - iry;
-		//		printf("irx = %d iry = %d rw = %d rh = %d factor = %d ixv = %d iyv = %d\n",
-		//		       irx, iry, rw, rh, factor, ixv, iyv);
-#if MASKING
-		if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		    rrx > 0.0 && (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0 ||
-		    rry > 0.0 && (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
-		    rrx > 0.0 && rry > 0.0 && (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0)
-		  continue;
-#endif
-		r00 = IMAGE(cref, rw, irx, iry);
-		r01 = IMAGE(cref, rw, irx, iry + 1);
-		r10 = IMAGE(cref, rw, irx + 1, iry);
-		r11 = IMAGE(cref, rw, irx + 1, iry + 1);
-		    
-		rv = r00 * (rrx - 1.0) * (rry - 1.0)
-		  - r10 * rrx * (rry - 1.0) 
-		  - r01 * (rrx - 1.0) * rry
-		  + r11 * rrx * rry;
-		dsi += iv;
-		dsi2 += iv * iv;
-		dsir += iv * rv;
-		dsr2 += rv * rv;
-		dsr += rv;
-		cPoints += 1;
-	      }
+	  /* add in contributions from distortion, correspondence
+	     points, and constraining map */
+	  move.dDistortion = DistortionDelta(&mc, icx, icy);
+	  move.dCorrespondence = CorrespondenceDelta(&mc, icx, icy);
+	  move.dConstraining = ConstrainingDelta(&mc, icx, icy);
 
-	  if (nPoints < requiredPoints)
+	  /* accept or reject move */
+	  accept = MoveLowersEnergy(&mc, &es, &move, &newEs);
+	  MAP(prop, mpw, icx, icy).c = 0;
+	  if (accept)
 	    {
-	      dsr -= (requiredPoints - nPoints) * 255.0;
-	      dsr2 -= (requiredPoints - nPoints) * 255.0 * 255.0;
+	      /* make the provisional state the new state */
+	      GETMAP(prop, mpw, icx, icy, &rx00, &ry00, &rc00);
+	      rc00 = 1.0;
+	      SETMAP(map, mpw, icx, icy, rx00, ry00, rc00);
 	    }
-	  newPoints = nPoints + cPoints;
-	  if (newPoints < requiredPoints)
+#if 0
+	  if (moveDebug)
 	    {
-	      dsr += (requiredPoints - newPoints) * 255.0;
-	      dsr2 += (requiredPoints - newPoints) * 255.0 * 255.0;
-	      newEffectivePoints = requiredPoints;
+	      Log("%s move %d since deltaE = %f\n",
+		  accept ? "Accepted" : "Rejected",
+		  moveCount, newEs.energy - es.energy,
+		      (newEs.distortion - es.distortion) * c.distortion,
+		      newEs.correlation - es.correlation,
+		      (newEs.correspondence - es.correspondence) * c.correspondence,
+		      (newEs.constraining - es.constraining) * c.constraining);
+	      Log("  old energy = %f (%f * dist %f - correl %f + %f * corres %f + %f * constr %f)\n",
+		  es.energy,
+		  c.distortion, es.distortion,
+		  es.correlation,
+		  c.correspondence, es.correspondence,
+		  c.constraining, es.constraining);
+	      Log("  new energy = %f (%f * dist %f - correl %f + %f * corres %f + %f * constr %f)\n",
+		  newEs.energy,
+		  c.distortion, newEs.distortion,
+		  newEs.correlation,
+		  c.correspondence, newEs.correspondence,
+		  c.constraining, newEs.constraining);
+	      Log("  cx = %f cy = %f radius = %f offset = %f theta = %f\n",
+		  cx, cy, radius, offset, theta);
 	    }
-	  else
-	    newEffectivePoints = newPoints;
-	  newsi = si + dsi;
-	  if (newsi < -0.1)
-	    Error("Internal error: negative newsi\nsi = %f  dsi = %f  newsi = %f\n",
-		  si, dsi, newsi);
-	  newsi2 = si2 + dsi2;
-	  newsir = sir + dsir;
-	  newsr = sr + dsr;
-	  newsr2 = sr2 + dsr2;
-	  if (newEffectivePoints != 0)
-	    {
-	      newmi = newsi / newEffectivePoints;
-	      newmr = newsr / newEffectivePoints;
-
-	      newDenom = (newsi2 - 2.0 * newmi * newsi + newEffectivePoints * newmi * newmi) *
-		(newsr2 - 2.0 * newmr * newsr + newEffectivePoints * newmr * newmr);
-	      if (newDenom < 0.001)
-		newCorr = -1000000.0;
-	      else
-		newCorr = (newsir - newmi * newsr - newmr * newsi + newEffectivePoints * newmi * newmr) / sqrt(newDenom);
-	    }
-	  else
-	    newCorr = -1000000.0;
-	  newCorrelation = newCorr;
-	  if (newCorrelation > 1.1)
-	    {
-	      Log("mi %f mr %f si %f sr %f ih %d iw %d si2 %f sr2 %f denom %f sir %f r %f\n",
-		  newmi, newmr, newsi, newsr, ih, iw, newsi2, newsr2, newDenom,
-		  newsir, newCorr);
-	      Log("nPoints = %d requiredPoints = %d effectivePoints = %d\n",
-		  newPoints, requiredPoints, newEffectivePoints);
-	      Error("Internal error: Level %d map has new correlation energy of %f\n",
-		    level, newCorrelation);
-	    }
-
-	  /* add in contribution from distortion */
-	  de = 0.0;
-	  newDPoints = dPoints;
-          for (y = changeMinY - 1; y <= changeMaxY; ++y)
-	    {
-              if (y < 0 || y >= mph_minus_1)
-		continue;
-              for (x = changeMinX - 1; x <= changeMaxX; ++x)
-      	        {
-	          if (x < 0 || x >= mpw_minus_1)
-	            continue;
-
-#if FOLDING
-		  nirdisc[y*imbpl + (x >> 3)] &= ~(0x80 >> (x & 7));
-		  nirdisc[y*imbpl + (x >> 3)] |= irdisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7));
-		  if ((idisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
-		    continue;
-#endif
-
-		  upd0 = MAP(prop, mpw, x, y).c != 0.0;
-		  upd1 = MAP(prop, mpw, x, y+1).c != 0.0;
-		  upd2 = MAP(prop, mpw, x+1, y+1).c != 0.0;
-		  upd3 = MAP(prop, mpw, x+1, y).c != 0.0;
-		      
-		  if (!upd0 && !upd1 && !upd2 && !upd3)
-		    continue;
-#if FOLDING
-		  if ((idisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
-		    continue;
-		  if ((irdisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
-		    continue;
-#endif
-
-		  GETMAP(map, mpw, x, y, &x0, &y0, &c0);
-		  GETMAP(map, mpw, x, y+1, &x1, &y1, &c1);
-		  GETMAP(map, mpw, x+1, y+1, &x2, &y2, &c2);
-		  GETMAP(map, mpw, x+1, y, &x3, &y3, &c3);
-
-		  if (c0 == 0.0 || c1 == 0.0 || c2 == 0.0 || c3 == 0.0)
-		    continue;
-
-		  nx0 = x0; ny0 = y0; nc0 = c0;
-		  nx1 = x1; ny1 = y1; nc1 = c1;
-		  nx2 = x2; ny2 = y2; nc2 = c2;
-		  nx3 = x3; ny3 = y3; nc3 = c3;
-
-		  if (upd0)
-		    GETMAP(prop, mpw, x, y, &nx0, &ny0, &nc0);
-		  if (upd1)
-		    GETMAP(prop, mpw, x, y+1, &nx1, &ny1, &nc1);
-		  if (upd2)
-		    GETMAP(prop, mpw, x+1, y+1, &nx2, &ny2, &nc2);
-		  if (upd3)
-		    GETMAP(prop, mpw, x+1, y, &nx3, &ny3, &nc3);
-
-#if FOLDING
-		  rx = 0.25 * (nx0 + nx1 + nx2 + nx3);
-		  ry = 0.25 * (ny0 + ny1 + ny2 + ny3);
-		  ix = floor(rx);
-		  iy = floor(ry);
-		  if (ix >= 0 && ix < refw && iy >= 0 && iy < refh &&
-		      (rdisc[iy*rmbpl + (ix >> 3)] & (0x80 >> (ix & 7))) == 0)
-		    {
-		      nirdisc[y*imbpl + (x >> 3)] &= ~(0x80 >> (x & 7));
-		      continue;
-		    }
-#endif
-
-		  k = y * mpw_minus_1 + x;
-		  area = - 0.5 *((x2 - x0) * (y3 - y1) -
-				 (x3 - x1) * (y2 - y0));
-		  l0 = sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
-		  l1 = sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
-		  l2 = sqrt((x3 - x2) * (x3 - x2) + (y3 - y2) * (y3 - y2));
-		  l3 = sqrt((x0 - x3) * (x0 - x3) + (y0 - y3) * (y0 - y3));
-		  thetaX = atan2(y3 - y0, x3 - x0);
-		  thetaY = atan2(y1 - y0, x1 - x0);
-		  txd = fabs(fmod(nomThetaX[k] - thetaX + 3.0*M_PI,
-				  2.0*M_PI) - M_PI);
-		  tyd = fabs(fmod(nomThetaY[k] - thetaY + 3.0*M_PI,
-				  2.0*M_PI) - M_PI);
-		  narea = - 0.5 *((nx2 - nx0) * (ny3 - ny1) -
-				  (nx3 - nx1) * (ny2 - ny0));
-		  nl0 = sqrt((nx1 - nx0) * (nx1 - nx0) +
-			     (ny1 - ny0) * (ny1 - ny0));
-		  nl1 = sqrt((nx2 - nx1) * (nx2 - nx1) +
-			     (ny2 - ny1) * (ny2 - ny1));
-		  nl2 = sqrt((nx3 - nx2) * (nx3 - nx2) +
-			     (ny3 - ny2) * (ny3 - ny2));
-		  nl3 = sqrt((nx0 - nx3) * (nx0 - nx3) +
-			     (ny0 - ny3) * (ny0 - ny3));
-		  nThetaX = atan2(ny3 - ny0, nx3 - nx0);
-		  nThetaY = atan2(ny1 - ny0, nx1 - nx0);
-		  ntxd = fabs(fmod(nomThetaX[k] - nThetaX + 3.0*M_PI,
-				   2.0*M_PI) - M_PI);
-		  ntyd = fabs(fmod(nomThetaY[k] - nThetaY + 3.0*M_PI,
-				   2.0*M_PI) - M_PI);
-#if 0
-		  ode = (area - nomArea[k]) * (area - nomArea[k]) +
-		    (l0 - nomL0[k]) * (l0 - nomL0[k]) +
-		    (l1 - nomL1[k]) * (l1 - nomL1[k]) +
-		    (l2 - nomL2[k]) * (l2 - nomL2[k]) +
-		    (l3 - nomL3[k]) * (l3 - nomL3[k]);
-		  nde = (narea - nomArea[k]) * (narea - nomArea[k]) +
-		    (nl0 - nomL0[k]) * (nl0 - nomL0[k]) +
-		    (nl1 - nomL1[k]) * (nl1 - nomL1[k]) +
-		    (nl2 - nomL2[k]) * (nl2 - nomL2[k]) +
-		    (nl3 - nomL3[k]) * (nl3 - nomL3[k]);
-#else
-		  ode = txd * txd + tyd * tyd +
-		    (l0 - nomL0[k]) * (l0 - nomL0[k]) +
-		    (l1 - nomL1[k]) * (l1 - nomL1[k]) +
-		    (l2 - nomL2[k]) * (l2 - nomL2[k]) +
-		    (l3 - nomL3[k]) * (l3 - nomL3[k]);
-		  nde = ntxd * ntxd + ntyd * ntyd +
-		    (nl0 - nomL0[k]) * (nl0 - nomL0[k]) +
-		    (nl1 - nomL1[k]) * (nl1 - nomL1[k]) +
-		    (nl2 - nomL2[k]) * (nl2 - nomL2[k]) +
-		    (nl3 - nomL3[k]) * (nl3 - nomL3[k]);
-#endif
-		  de += nde - ode;
-		  ++updcnt;
-		}
-	    }
-	  // FIX to divide by adjusted dpoints
-	  newDistortion = distortion + de / dPoints;
-
-	  /* add in contribution from correspondence energy */
-	  ce = 0.0;
-	  for (i = 0; i < nCpts; ++i)
-	    {
-	      xv = cpts[i].ix / lFactor - mox;
-	      yv = cpts[i].iy / lFactor - moy;
-	      ixv = ((int) (xv + 2.0)) - 2;
-	      iyv = ((int) (yv + 2.0)) - 2;
-	      if (ixv < changeMinX-1 || ixv > changeMaxX ||
-		  iyv < changeMinY-1 || iyv > changeMaxY)
-		{
-		  cpts[i].newEnergy = cpts[i].energy;
-		  continue;
-		}
-	      rrx = xv - ixv;
-	      rry = yv - iyv;
-	      if (ixv < 0 || ixv >= mpw_minus_1 || iyv < 0 || iyv >= mph_minus_1)
-		{
-		  cpts[i].newEnergy = 1000000.0;
-		  continue;
-		}
-	      mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
-	      mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
-	      mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
-	      mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
-	      GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
-
-	      rx = rx00 * (rrx - 1.0) * (rry - 1.0)
-		- rx10 * rrx * (rry - 1.0) 
-		- rx01 * (rrx - 1.0) * rry
-		+ rx11 * rrx * rry;
-	      ry = ry00 * (rrx - 1.0) * (rry - 1.0)
-		- ry10 * rrx * (rry - 1.0) 
-		- ry01 * (rrx - 1.0) * rry
-		+ ry11 * rrx * rry;
-	      rx = lFactor * rx;
-	      ry = lFactor * ry;
-	      rrx = cpts[i].rx;
-	      rry = cpts[i].ry;
-	      distance = kFactor * (hypot(rrx-rx, rry-ry) - c.correspondenceThreshold);
-	      if (distance < 0.0)
-		cpts[i].newEnergy = 0.0;
-	      else
-		cpts[i].newEnergy = distance;
-	      ce += cpts[i].newEnergy - cpts[i].energy;
-	    }
-	  newCorrespondence = correspondence + ce;
-
-	  /* add in contribution from constraining map */
-	  de = 0.0;
-	  if (constrainingMapFactor != 0)
-	    {
-	      cth = c.constrainingThreshold / lFactor;
-	      for (y = changeMinY; y <= changeMaxY; ++y)
-		{
-		  if (y < 0 || y >= mph)
-		    continue;
-		  for (x = changeMinX; x <= changeMaxX; ++x)
-		    {
-		      if (x < -1 || x >= mpw)
-			continue;
-
-		      if (MAP(prop, mpw, x, y).c != 0.0)
-			{
-			  e = &MAP(map, mpw, x, y);
-			  if (e->c == 0.0)
-			    continue;
-			  ec = &MAP(mapCons, mpw, x, y);
-			  if (ec->c < c.constrainingConfidenceThreshold)
-			    continue;
-			  ep = &MAP(prop, mpw, x, y);
-			  distance = hypot(e->x - ec->x, e->y - ec->y) - cth;
-			  if (distance < 0.0)
-			    distance = 0.0;
-			  oldEnergy = distance;
-			  distance = hypot(ep->x - ec->x, ep->y - ec->y) - cth;
-			  if (distance < 0.0)
-			    distance = 0.0;
-			  de += distance - oldEnergy;
-#if 0
-			  if (x * lFactor == 32*64 && y * lFactor == 160*64)
-			    {
-			      moveDebug = 1;
-			      Log("cons constr move: old = %f new = %f de = %f  cct = %f mpw = %d mph = %d cth = %f lFactor = %d\n",
-				  oldEnergy, distance, de,
-				  c.constrainingThreshold, mpw, mph,
-				  cth, lFactor);
-			    }
-#endif
-			}
-		    }
-		}
-	    }
-	  newConstraining = constraining + de / mph / mpw;
-
-	  newEnergy = newDistortion * c.distortion - newCorrelation +
-	    newCorrespondence * c.correspondence + newConstraining * c.constraining;
-
-	  /* accept or reject move */
-	  accept = (newEnergy < energy);
-	  for (y = changeMinY; y <= changeMaxY; ++y)
-	    for (x = changeMinX; x <= changeMaxX; ++x)
-	      if (MAP(prop, mpw, x, y).c != 0.0)
-		{
-#if 0
-		  if (x == 210 && y == 175)
-		    Log("SCB 3: %d\n", accept);
-#endif
-		  MAP(prop, mpw, x, y).c = 0;
-		  if (accept)
-		    {
-		      /* make the provisional state the new state */
-		      GETMAP(prop, mpw, x, y, &rx00, &ry00, &rc00);
-		      rc00 = 1.0;
-		      SETMAP(map, mpw, x, y, rx00, ry00, rc00);
-		    }
-		}
-#if 0
-	  if (moveDebug)
-	    {
-	      Log("%s move %d since deltaE = %f\n",
-		  accept ? "Accepted" : "Rejected",
-		  moveCount, newEnergy - energy,
-		      (newDistortion - distortion) * c.distortion,
-		      newCorrelation - correlation,
-		      (newCorrespondence - correspondence) * c.correspondence,
-		      (newConstraining - constraining) * c.constraining);
-	      Log("  old energy = %f (%f * dist %f - correl %f + %f * corres %f + %f * constr %f)\n",
-		  energy,
-		  c.distortion, distortion,
-		  correlation,
-		  c.correspondence, correspondence,
-		  c.constraining, constraining);
-	      Log("  new energy = %f (%f * dist %f - correl %f + %f * corres %f + %f * constr %f)\n",
-		  newEnergy,
-		  c.distortion, newDistortion,
-		  newCorrelation,
-		  c.correspondence, newCorrespondence,
-		  c.constraining, newConstraining);
-	      Log("  cx = %f cy = %f radius = %f offset = %f theta = %f\n",
-		  cx, cy, radius, offset, theta);
-	    }
-#endif
+#endif
 
 	  if (accept)
 	    {
 #if DEBUG_MOVES
 	      Log("Accepted move %d since deltaE = %f (dist %f - correl %f + corres %f + constr %f)\n",
-		  moveCount, newEnergy - energy,
-		  (newDistortion - distortion) * c.distortion,
-		  newCorrelation - correlation,
-		  (newCorrespondence - correspondence) * c.correspondence,
-		  (newConstraining - constraining) * c.constraining);
+		  moveCount, newEs.energy - es.energy,
+		  (newEs.distortion - es.distortion) * c.distortion,
+		  newEs.correlation - es.correlation,
+		  (newEs.correspondence - es.correspondence) * c.correspondence,
+		  (newEs.constraining - es.constraining) * c.constraining);
 	      Log("  cx = %f cy = %f radius = %f offset = %f theta = %f\n",
 		  cx, cy, radius, offset, theta);
 	      Log("  old energy = %f  estimated new energy = %f (dist %f - correl %f + corres %f + constr %f)\n",
-		  energy,
-		  newEnergy, newDistortion * c.distortion, newCorrelation,
-		  newCorrespondence * c.correspondence,
-		  newConstraining * c.constraining);
+		  es.energy,
+		  newEs.energy, newEs.distortion * c.distortion, newEs.correlation,
+		  newEs.correspondence * c.correspondence,
+		  newEs.constraining * c.constraining);
 #endif
 	      ++statLogRadius[(int) (20.0 * rnd)];
 	      ++statTheta[(int) (20.0 * theta / (2.0 * M_PI))];
-	      statDeltaE[(int) (20.0 * rnd)] += energy - newEnergy;
+	      statDeltaE[(int) (20.0 * rnd)] += es.energy - newEs.energy;
+	      AcceptCorrespondence(&mc, icx, icy);
 
-#if FOLDING
-	      for (y = changeMinY - 1; y <= changeMaxY; ++y)
-		{
-		  FIX;
-		  for (x = changeMinX - 1; x <= changeMaxX; ++x)
-		    {
-		      irdisc[y*imbpl + (x >> 3)] &= ~(0x80 >> (x & 7));
-		      irdisc[y*imbpl + (x >> 3)] |= nirdisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7));
-		    }
-		}
-#endif	      
-
-	      for (i = 0; i < nCpts; ++i)
-		cpts[i].energy = cpts[i].newEnergy;
-
-	      nPoints = newPoints;
-	      si = newsi;
-	      si2 = newsi2;
-	      sr = newsr;
-	      sr2 = newsr2;
-	      sir = newsir;
-	      correlation = newCorrelation;
-	      distortion = newDistortion;
-	      correspondence = newCorrespondence;
-	      constraining = newConstraining;
-	      energy = newEnergy;
+	      es = newEs;
 	      ++acceptedMoveCount;
 	      displayLevel = level;
 	      //	      sleep(1);
 	    }
 	}
+      correlation = es.correlation;
+      distortion = es.distortion;
+      correspondence = es.correspondence;
+      constraining = es.constraining;
+      energy = es.energy;
 
       Log("Level %d: after %d moves, and %d accepted moves...\n",
 	  level, moveCount, acceptedMoveCount);
@@ -4297,6 +4827,8 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
       Log("--- done with level %d ---\n", level);
       
       free(prop);
+      if (mc.crmaskBytes != NULL)
+	free(mc.crmaskBytes);
       free(nomArea);
       free(nomL0);
       free(nomL1);
@@ -4422,6 +4954,1058 @@ Compute (char *outputName, char *outputWarpedName, char *outputCorrelationName)
 }
 
 
+void
+CorrelationDeltas (MoveContext *mc, Move *m)
+{
+  MapElement *map = mc->map;
+  MapElement *prop = mc->prop;
+  int mpw = mc->mpw;
+  int mph = mc->mph;
+  int mpw_minus_1 = mpw - 1;
+  int mph_minus_1 = mph - 1;
+  int mox = mc->mox;
+  int moy = mc->moy;
+  int factor = mc->factor;
+  void *cimage = mc->cimage;
+  void *cref = mc->cref;
+  int bits = c.pyramidBits;
+  unsigned char *cimask = mc->cimask;
+  unsigned char *crmask = mc->crmask;
+  size_t icmbpl = mc->icmbpl;
+  size_t rcmbpl = mc->rcmbpl;
+  unsigned int iw = mc->iw;
+  unsigned int ih = mc->ih;
+  unsigned int rw = mc->rw;
+  unsigned int rh = mc->rh;
+  int imgox = mc->imgox;
+  int imgoy = mc->imgoy;
+  int refox = mc->refox;
+  int refoy = mc->refoy;
+  int icx = m->icx;
+  int icy = m->icy;
+  MapElement *mp;
+  int x, y;
+  int sx, sy, ex, ey;
+  int ixv, iyv;
+  double xv, yv;
+  double rrx, rry;
+  double rx, ry;
+  int irx, iry;
+  double iv, rv;
+  double r00, r01, r10, r11;
+  double rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
+  double rc00, rc01, rc10, rc11;
+
+#if HAVE_X86_SIMD && MASKING
+  if (c.simdLevel == SIMD_AVX2 && mc->crmaskBytes != NULL)
+    {
+      CorrelationDeltasAVX2(mc, m);
+      return;
+    }
+#endif
+
+  /* remove the contribution of each image pixel in the cells
+     around the node as mapped by the current map, and add it
+     as mapped by the proposed one */
+  m->dsir = 0.0;
+  m->dsr2 = 0.0;
+  m->dsr = 0.0;
+  m->dsi = 0.0;
+  m->dsi2 = 0.0;
+  m->cPoints = 0;
+  sx = (icx - 1 + mox) * factor - imgox;
+  if (sx < 0)
+    sx = 0;
+  ex = (icx + 1 + mox) * factor - 1 - imgox;
+  if (ex >= iw)
+    ex = iw - 1;
+  sy = (icy - 1 + moy) * factor - imgoy;
+  if (sy < 0)
+    sy = 0;
+  ey = (icy + 1 + moy) * factor - 1 - imgoy;
+  if (ey >= ih)
+    ey = ih - 1;
+  for (y = sy; y <= ey; ++y)
+    for (x = sx; x <= ex; ++x)
+      {
+#if MASKING
+	if ((cimask[y*icmbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
+	  continue;
+#endif
+	xv = (x + 0.5 + imgox) / factor - mox;
+	yv = (y + 0.5 + imgoy) / factor - moy;
+	ixv = ((int) (xv + 2.0)) - 2;
+	iyv = ((int) (yv + 2.0)) - 2;
+	rrx = xv - ixv;
+	rry = yv - iyv;
+
+	if (ixv < 0 || ixv >= mpw_minus_1 ||
+	    iyv < 0 || iyv >= mph_minus_1)
+	  continue;
+
+	if (MAP(prop, mpw, ixv, iyv).c == 0.0 &&
+	    MAP(prop, mpw, ixv+1, iyv).c == 0.0 &&
+	    MAP(prop, mpw, ixv, iyv+1).c == 0.0 &&
+	    MAP(prop, mpw, ixv+1, iyv+1).c == 0.0)
+	  continue;
+
+	/* remove the old value */
+	iv = IMAGE_PIXEL(cimage, bits, iw, x, y);
+	if (iv < 0.0)
+	  Error("Internal error: iv out of range: %f\n", iv);
+	GETMAP(map, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	GETMAP(map, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	GETMAP(map, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	GETMAP(map, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+	if (rc00 != 0.0 && rc01 != 0.0 && rc10 != 0.0 && rc11 != 0.0)
+	  {
+	    rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	      - rx10 * rrx * (rry - 1.0) 
+	      - rx01 * (rrx - 1.0) * rry
+	      + rx11 * rrx * rry;
+	    ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	      - ry10 * rrx * (rry - 1.0) 
+	      - ry01 * (rrx - 1.0) * rry
+	      + ry11 * rrx * rry;
+	    rx = factor * rx - 0.5 - refox;
+	    ry = factor * ry - 0.5 - refoy;
+	    irx = ((int) (rx + 1.0)) - 1;
+	    iry = ((int) (ry + 1.0)) - 1;
+	    rrx = rx - irx;
+	    rry = ry - iry;
+	    if (irx >= 0 && irx < rw-1 && iry >= 0 && iry < rh-1)
+	      {
+#if MASKING
+		if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0 &&
+		    ((rrx <= 0.0) || (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0) &&
+		    ((rry <= 0.0) || (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) != 0) &&
+		    ((rrx <= 0.0) || (rry <= 0.0) || (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) != 0))
+		  {
+#endif
+		    r00 = IMAGE_PIXEL(cref, bits, rw, irx, iry);
+		    r01 = IMAGE_PIXEL(cref, bits, rw, irx, iry + 1);
+		    r10 = IMAGE_PIXEL(cref, bits, rw, irx + 1, iry);
+		    r11 = IMAGE_PIXEL(cref, bits, rw, irx + 1, iry + 1);
+
+		    rv = r00 * (rrx - 1.0) * (rry - 1.0)
+		      - r10 * rrx * (rry - 1.0) 
+		      - r01 * (rrx - 1.0) * rry
+		      + r11 * rrx * rry;
+		    m->dsi -= iv;
+		    m->dsi2 -= iv * iv;
+		    m->dsir -= iv * rv;
+		    m->dsr2 -= rv * rv;
+		    m->dsr -= rv;
+		    m->cPoints -= 1;
+#if MASKING
+		  }
+#endif
+	      }
+	  }
+
+	/* add the new value */
+	mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+	mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+	mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+	mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
+	GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+	if (rc00 == 0.0 || rc01 == 0.0 || rc10 == 0.0 || rc11 == 0.0)
+	  continue;
+
+	rrx = xv - ixv;
+	rry = yv - iyv;
+	rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	  - rx10 * rrx * (rry - 1.0) 
+	  - rx01 * (rrx - 1.0) * rry
+	  + rx11 * rrx * rry;
+	ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	  - ry10 * rrx * (rry - 1.0) 
+	  - ry01 * (rrx - 1.0) * rry
+	  + ry11 * rrx * rry;
+	rx = factor * rx - 0.5 - refox;
+	ry = factor * ry - 0.5 - refoy;
+
+	irx = ((int) (rx + 1.0)) - 1;
+	iry = ((int) (ry + 1.0)) - 1;
+	if (irx < 0 || irx >= rw-1 || iry < 0 || iry >= rh-1)
+	  continue;
+	rrx = rx - irx;
+	rry = ry - iry;
+#if MASKING
+	if ((crmask[iry*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
+	    rrx > 0.0 && (crmask[iry*rcmbpl + ((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0 ||
+	    rry > 0.0 && (crmask[(iry+1)*rcmbpl + (irx >> 3)] & (0x80 >> (irx & 7))) == 0 ||
+	    rrx > 0.0 && rry > 0.0 && (crmask[(iry+1)*rcmbpl +((irx+1) >> 3)] & (0x80 >> ((irx+1) & 7))) == 0)
+	  continue;
+#endif
+	r00 = IMAGE_PIXEL(cref, bits, rw, irx, iry);
+	r01 = IMAGE_PIXEL(cref, bits, rw, irx, iry + 1);
+	r10 = IMAGE_PIXEL(cref, bits, rw, irx + 1, iry);
+	r11 = IMAGE_PIXEL(cref, bits, rw, irx + 1, iry + 1);
+
+	rv = r00 * (rrx - 1.0) * (rry - 1.0)
+	  - r10 * rrx * (rry - 1.0) 
+	  - r01 * (rrx - 1.0) * rry
+	  + r11 * rrx * rry;
+	m->dsi += iv;
+	m->dsi2 += iv * iv;
+	m->dsir += iv * rv;
+	m->dsr2 += rv * rv;
+	m->dsr += rv;
+	m->cPoints += 1;
+      }
+
+}
+
+#if HAVE_X86_SIMD && MASKING
+static inline __m256d
+BilinearAVX2 (__m256d v00, __m256d v10, __m256d v01, __m256d v11,
+	      __m256d rrx, __m256d rry)
+     __attribute__((always_inline, target("avx2")));
+static inline __m256d
+SampleReferenceAVX2 (MoveContext *mc,
+		     double rx00, double rx10, double rx01, double rx11,
+		     double ry00, double ry10, double ry01, double ry11,
+		     __m256d rrx, __m256d rry, __m256d active,
+		     __m256d *valid)
+     __attribute__((always_inline, target("avx2")));
+static inline __m128
+GatherPixelsAVX2 (void *image, __m256i idx, __m128i ok32, __m128 *right)
+     __attribute__((always_inline, target("avx2")));
+static inline __m128
+LoadPixelsAVX2 (void *image, size_t i, __m128i lane)
+     __attribute__((always_inline, target("avx2")));
+
+static inline __m256d
+BilinearAVX2 (__m256d v00, __m256d v10, __m256d v01, __m256d v11,
+	      __m256d rrx, __m256d rry)
+{
+  __m256d one, rrxm, rrym;
+
+  /* the same operations in the same order as the scalar
+     interpolations, so that each lane rounds identically */
+  one = _mm256_set1_pd(1.0);
+  rrxm = _mm256_sub_pd(rrx, one);
+  rrym = _mm256_sub_pd(rry, one);
+  return(_mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_mul_pd(v00, rrxm), rrym),
+						   _mm256_mul_pd(_mm256_mul_pd(v10, rrx), rrym)),
+				     _mm256_mul_pd(_mm256_mul_pd(v01, rrxm), rry)),
+		       _mm256_mul_pd(_mm256_mul_pd(v11, rrx), rry)));
+}
+
+static inline __m256d
+SampleReferenceAVX2 (MoveContext *mc,
+		     double rx00, double rx10, double rx01, double rx11,
+		     double ry00, double ry10, double ry01, double ry11,
+		     __m256d rrx, __m256d rry, __m256d active,
+		     __m256d *valid)
+{
+  __m256d rx, ry, fx, fy, ok, zero;
+  __m256d rxz, ryz, m00, m10, m01, m11;
+  __m256i idx, idx1, okm;
+  __m128i ok32, w0, w1, lo, hi, zero32;
+  __m128 r00, r10, r01, r11;
+
+  /* map the pixel centers into the reference image */
+  rx = BilinearAVX2(_mm256_set1_pd(rx00), _mm256_set1_pd(rx10),
+		    _mm256_set1_pd(rx01), _mm256_set1_pd(rx11), rrx, rry);
+  ry = BilinearAVX2(_mm256_set1_pd(ry00), _mm256_set1_pd(ry10),
+		    _mm256_set1_pd(ry01), _mm256_set1_pd(ry11), rrx, rry);
+  rx = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd((double) mc->factor), rx),
+				   _mm256_set1_pd(0.5)),
+		     _mm256_set1_pd((double) mc->refox));
+  ry = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd((double) mc->factor), ry),
+				   _mm256_set1_pd(0.5)),
+		     _mm256_set1_pd((double) mc->refoy));
+  fx = _mm256_floor_pd(rx);
+  fy = _mm256_floor_pd(ry);
+  zero = _mm256_setzero_pd();
+  ok = _mm256_and_pd(active,
+		     _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(fx, zero, _CMP_GE_OQ),
+						 _mm256_cmp_pd(fx, _mm256_set1_pd((double) mc->rw - 1.0), _CMP_LT_OQ)),
+				   _mm256_and_pd(_mm256_cmp_pd(fy, zero, _CMP_GE_OQ),
+						 _mm256_cmp_pd(fy, _mm256_set1_pd((double) mc->rh - 1.0), _CMP_LT_OQ))));
+  rx = _mm256_sub_pd(rx, fx);
+  ry = _mm256_sub_pd(ry, fy);
+
+  /* pixel indices, zero in the lanes that are not sampled */
+  okm = _mm256_castpd_si256(ok);
+  ok32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(okm, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0)));
+  lo = _mm_and_si128(_mm256_cvttpd_epi32(fx), ok32);
+  hi = _mm_and_si128(_mm256_cvttpd_epi32(fy), ok32);
+  idx = _mm256_add_epi64(_mm256_cvtepi32_epi64(lo),
+			 _mm256_mul_epu32(_mm256_cvtepi32_epi64(hi),
+					  _mm256_set1_epi64x((long long) mc->rw)));
+  idx1 = _mm256_add_epi64(idx, _mm256_set1_epi64x((long long) mc->rw));
+
+  /* each word holds the mask bytes of a pixel and its right neighbor */
+  zero32 = _mm_setzero_si128();
+  w0 = _mm256_mask_i64gather_epi32(zero32, (int *) mc->crmaskBytes, idx, ok32, 1);
+  w1 = _mm256_mask_i64gather_epi32(zero32, (int *) mc->crmaskBytes, idx1, ok32, 1);
+  m00 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(w0, _mm_set1_epi32(0xff)), zero32),
+								 _mm_set1_epi32(-1))));
+  m10 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(w0, _mm_set1_epi32(0xff00)), zero32),
+								 _mm_set1_epi32(-1))));
+  m01 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(w1, _mm_set1_epi32(0xff)), zero32),
+								 _mm_set1_epi32(-1))));
+  m11 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(_mm_xor_si128(_mm_cmpeq_epi32(_mm_and_si128(w1, _mm_set1_epi32(0xff00)), zero32),
+								 _mm_set1_epi32(-1))));
+  rxz = _mm256_cmp_pd(rx, zero, _CMP_LE_OQ);
+  ryz = _mm256_cmp_pd(ry, zero, _CMP_LE_OQ);
+  ok = _mm256_and_pd(ok,
+		     _mm256_and_pd(_mm256_and_pd(m00, _mm256_or_pd(rxz, m10)),
+				   _mm256_and_pd(_mm256_or_pd(ryz, m01),
+						 _mm256_or_pd(_mm256_or_pd(rxz, ryz), m11))));
+  *valid = ok;
+
+  r00 = GatherPixelsAVX2(mc->cref, idx, ok32, &r10);
+  r01 = GatherPixelsAVX2(mc->cref, idx1, ok32, &r11);
+  return(BilinearAVX2(_mm256_cvtps_pd(r00), _mm256_cvtps_pd(r10),
+		      _mm256_cvtps_pd(r01), _mm256_cvtps_pd(r11), rx, ry));
+}
+
+static inline __m128
+GatherPixelsAVX2 (void *image, __m256i idx, __m128i ok32, __m128 *right)
+{
+  __m128i w, zero;
+
+  /* gather the pixels at idx and their right neighbors; a single
+     32-bit word holds both when the level is stored in 8 or 16 bits */
+  zero = _mm_setzero_si128();
+  switch (c.pyramidBits)
+    {
+    case 8:
+      w = _mm256_mask_i64gather_epi32(zero, (int *) image, idx, ok32, 1);
+      *right = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(w, 8), _mm_set1_epi32(0xff)));
+      return(_mm_cvtepi32_ps(_mm_and_si128(w, _mm_set1_epi32(0xff))));
+    case 16:
+      w = _mm256_mask_i64gather_epi32(zero, (int *) image, idx, ok32, 2);
+      *right = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(w, 16)),
+			  _mm_set1_ps(1.0f / 256.0f));
+      return(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(w, _mm_set1_epi32(0xffff))),
+			_mm_set1_ps(1.0f / 256.0f)));
+    }
+  *right = _mm256_mask_i64gather_ps(_mm_setzero_ps(), (float *) image + 1, idx, _mm_castsi128_ps(ok32), 4);
+  return(_mm256_mask_i64gather_ps(_mm_setzero_ps(), (float *) image, idx, _mm_castsi128_ps(ok32), 4));
+}
+
+static inline __m128
+LoadPixelsAVX2 (void *image, size_t i, __m128i lane)
+{
+  __m128i w, zero, offsets;
+
+  /* load pixels i through i+3 in the selected lanes */
+  zero = _mm_setzero_si128();
+  offsets = _mm_setr_epi32(0, 1, 2, 3);
+  switch (c.pyramidBits)
+    {
+    case 8:
+      w = _mm_mask_i32gather_epi32(zero, (int *) ((unsigned char *) image + i), offsets, lane, 1);
+      return(_mm_cvtepi32_ps(_mm_and_si128(w, _mm_set1_epi32(0xff))));
+    case 16:
+      w = _mm_mask_i32gather_epi32(zero, (int *) ((unsigned short *) image + i), offsets, lane, 2);
+      return(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(w, _mm_set1_epi32(0xffff))),
+			_mm_set1_ps(1.0f / 256.0f)));
+    }
+  return(_mm_maskload_ps((float *) image + i, lane));
+}
+
+void
+CorrelationDeltasAVX2 (MoveContext *mc, Move *m)
+{
+  MapElement *map = mc->map;
+  MapElement *prop = mc->prop;
+  int mpw = mc->mpw;
+  int mph = mc->mph;
+  int mpw_minus_1 = mpw - 1;
+  int mph_minus_1 = mph - 1;
+  int mox = mc->mox;
+  int moy = mc->moy;
+  int factor = mc->factor;
+  void *cimage = mc->cimage;
+  unsigned char *cimask = mc->cimask;
+  size_t icmbpl = mc->icmbpl;
+  unsigned int iw = mc->iw;
+  unsigned int ih = mc->ih;
+  int imgox = mc->imgox;
+  int imgoy = mc->imgoy;
+  int icx = m->icx;
+  int icy = m->icy;
+  MapElement *mp;
+  int x, y;
+  int k;
+  int sx, sy, ex, ey;
+  int px0, px1;
+  int ixc, iyv;
+  double yv;
+  int oldValid, newValid;
+  double ox00, ox01, ox10, ox11, oy00, oy01, oy10, oy11;
+  double nx00, nx01, nx10, nx11, ny00, ny01, ny10, ny11;
+  double rc00, rc01, rc10, rc11;
+  int inside[4];
+  __m256d xv, rrx, rry, iv, ivm, rv, ok, active, one;
+  __m256d si, si2, sir, sr2, sr, count;
+  __m128i ixv, lane;
+  double e[4];
+
+  one = _mm256_set1_pd(1.0);
+  si = si2 = sir = sr2 = sr = count = _mm256_setzero_pd();
+  sx = (icx - 1 + mox) * factor - imgox;
+  if (sx < 0)
+    sx = 0;
+  ex = (icx + 1 + mox) * factor - 1 - imgox;
+  if (ex >= iw)
+    ex = iw - 1;
+  sy = (icy - 1 + moy) * factor - imgoy;
+  if (sy < 0)
+    sy = 0;
+  ey = (icy + 1 + moy) * factor - 1 - imgoy;
+  if (ey >= ih)
+    ey = ih - 1;
+  for (y = sy; y <= ey; ++y)
+    {
+      yv = (y + 0.5 + imgoy) / factor - moy;
+      iyv = ((int) (yv + 2.0)) - 2;
+      if (iyv < 0 || iyv >= mph_minus_1)
+	continue;
+      rry = _mm256_set1_pd(yv - iyv);
+
+      /* within a row of a cell the corners of the old and new
+	 maps are fixed, so 4 pixels are mapped at a time */
+      for (ixc = icx - 1; ixc <= icx; ++ixc)
+	{
+	  if (ixc < 0 || ixc >= mpw_minus_1)
+	    continue;
+	  if (MAP(prop, mpw, ixc, iyv).c == 0.0 &&
+	      MAP(prop, mpw, ixc+1, iyv).c == 0.0 &&
+	      MAP(prop, mpw, ixc, iyv+1).c == 0.0 &&
+	      MAP(prop, mpw, ixc+1, iyv+1).c == 0.0)
+	    continue;
+	  GETMAP(map, mpw, ixc, iyv, &ox00, &oy00, &rc00);
+	  GETMAP(map, mpw, ixc, iyv+1, &ox01, &oy01, &rc01);
+	  GETMAP(map, mpw, ixc+1, iyv, &ox10, &oy10, &rc10);
+	  GETMAP(map, mpw, ixc+1, iyv+1, &ox11, &oy11, &rc11);
+	  oldValid = rc00 != 0.0 && rc01 != 0.0 && rc10 != 0.0 && rc11 != 0.0;
+	  mp = (MAP(prop, mpw, ixc, iyv).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixc, iyv, &nx00, &ny00, &rc00);
+	  mp = (MAP(prop, mpw, ixc, iyv+1).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixc, iyv+1, &nx01, &ny01, &rc01);
+	  mp = (MAP(prop, mpw, ixc+1, iyv).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixc+1, iyv, &nx10, &ny10, &rc10);
+	  mp = (MAP(prop, mpw, ixc+1, iyv+1).c != 0.0) ? prop : map;
+	  GETMAP(mp, mpw, ixc+1, iyv+1, &nx11, &ny11, &rc11);
+	  newValid = rc00 != 0.0 && rc01 != 0.0 && rc10 != 0.0 && rc11 != 0.0;
+	  if (!oldValid && !newValid)
+	    continue;
+
+	  /* the pixels of the cell, with a pixel of slack on each side;
+	     the lanes are then selected by the cell they fall in */
+	  px0 = (ixc + mox) * factor - imgox - 1;
+	  if (px0 < sx)
+	    px0 = sx;
+	  px1 = (ixc + 1 + mox) * factor - imgox;
+	  if (px1 > ex)
+	    px1 = ex;
+	  for (x = px0; x <= px1; x += 4)
+	    {
+	      for (k = 0; k < 4; ++k)
+		inside[k] = (x + k <= px1 &&
+			     (cimask[y*icmbpl + ((x+k) >> 3)] & (0x80 >> ((x+k) & 7))) != 0) ? -1 : 0;
+	      if ((inside[0] | inside[1] | inside[2] | inside[3]) == 0)
+		continue;
+	      xv = _mm256_sub_pd(_mm256_div_pd(_mm256_add_pd(_mm256_add_pd(_mm256_setr_pd(x, x + 1, x + 2, x + 3),
+									   _mm256_set1_pd(0.5)),
+							     _mm256_set1_pd((double) imgox)),
+					       _mm256_set1_pd((double) factor)),
+				 _mm256_set1_pd((double) mox));
+	      ixv = _mm_sub_epi32(_mm256_cvttpd_epi32(_mm256_add_pd(xv, _mm256_set1_pd(2.0))),
+				  _mm_set1_epi32(2));
+	      lane = _mm_and_si128(_mm_cmpeq_epi32(ixv, _mm_set1_epi32(ixc)),
+				   _mm_setr_epi32(inside[0], inside[1], inside[2], inside[3]));
+	      if (_mm_movemask_ps(_mm_castsi128_ps(lane)) == 0)
+		continue;
+	      active = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(lane));
+	      rrx = _mm256_sub_pd(xv, _mm256_cvtepi32_pd(ixv));
+	      iv = _mm256_cvtps_pd(LoadPixelsAVX2(cimage, ((size_t) y) * iw + x, lane));
+
+	      if (oldValid)
+		{
+		  rv = SampleReferenceAVX2(mc, ox00, ox10, ox01, ox11,
+					   oy00, oy10, oy01, oy11,
+					   rrx, rry, active, &ok);
+		  rv = _mm256_and_pd(rv, ok);
+		  ivm = _mm256_and_pd(iv, ok);
+		  si = _mm256_sub_pd(si, ivm);
+		  si2 = _mm256_sub_pd(si2, _mm256_mul_pd(ivm, ivm));
+		  sir = _mm256_sub_pd(sir, _mm256_mul_pd(ivm, rv));
+		  sr2 = _mm256_sub_pd(sr2, _mm256_mul_pd(rv, rv));
+		  sr = _mm256_sub_pd(sr, rv);
+		  count = _mm256_sub_pd(count, _mm256_and_pd(one, ok));
+		}
+	      if (newValid)
+		{
+		  rv = SampleReferenceAVX2(mc, nx00, nx10, nx01, nx11,
+					   ny00, ny10, ny01, ny11,
+					   rrx, rry, active, &ok);
+		  rv = _mm256_and_pd(rv, ok);
+		  ivm = _mm256_and_pd(iv, ok);
+		  si = _mm256_add_pd(si, ivm);
+		  si2 = _mm256_add_pd(si2, _mm256_mul_pd(ivm, ivm));
+		  sir = _mm256_add_pd(sir, _mm256_mul_pd(ivm, rv));
+		  sr2 = _mm256_add_pd(sr2, _mm256_mul_pd(rv, rv));
+		  sr = _mm256_add_pd(sr, rv);
+		  count = _mm256_add_pd(count, _mm256_and_pd(one, ok));
+		}
+	    }
+	}
+    }
+
+#define HSUM(v)	(_mm256_storeu_pd(e, v), (e[0] + e[1]) + (e[2] + e[3]))
+  m->dsi = HSUM(si);
+  m->dsi2 = HSUM(si2);
+  m->dsir = HSUM(sir);
+  m->dsr2 = HSUM(sr2);
+  m->dsr = HSUM(sr);
+  m->cPoints = (long) HSUM(count);
+#undef HSUM
+}
+#endif
+
+void
+SelectSimd ()
+{
+  int best;
+
+  best = SIMD_NONE;
+#if HAVE_X86_SIMD && MASKING
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    best = SIMD_AVX2;
+#endif
+  if (c.simdLevel > best)
+    Log("Vector instructions %s are not available on this processor.\n",
+	simdNames[c.simdLevel]);
+  if (c.simdLevel < 0 || c.simdLevel > best)
+    c.simdLevel = best;
+  Log("Using vector instructions: %s\n", simdNames[c.simdLevel]);
+}
+
+/* MoveKeepsSpacing checks that moving node (icx, icy) of the map to
+   (cx, cy) leaves it at least half the nominal distance from each of
+   its neighbors, so that the move will not distort the grid too
+   much */
+int
+MoveKeepsSpacing (MoveContext *mc, int icx, int icy, double cx, double cy)
+{
+  MapElement *e;
+  int x, y;
+  double dx, dy, d2;
+
+  for (y = icy - 1; y <= icy + 1; ++y)
+    for (x = icx - 1; x <= icx + 1; ++x)
+      {
+	if (x < 0 || x >= mc->mpw || y < 0 || y >= mc->mph ||
+	    x == icx && y == icy)
+	  continue;
+	e = &MAP(mc->map, mc->mpw, x, y);
+	if (e->c == 0.0)
+	  continue;
+	dx = e->x - cx;
+	dy = e->y - cy;
+	d2 = dx*dx + dy*dy;
+	if (d2 < ((x == icx || y == icy) ? mc->udLimit : mc->diagLimit))
+	  return(0);
+      }
+  return(1);
+}
+
+/* DistortionDelta, CorrespondenceDelta, and ConstrainingDelta return
+   the change in each energy term if node (icx, icy) took its position
+   in mc->prop.  They only touch the map cells around the node, so the
+   moves of nodes at least 2 apart may be evaluated concurrently. */
+double
+DistortionDelta (MoveContext *mc, int icx, int icy)
+{
+  MapElement *map = mc->map;
+  MapElement *prop = mc->prop;
+  int mpw = mc->mpw;
+  int mpw_minus_1 = mc->mpw - 1;
+  int mph_minus_1 = mc->mph - 1;
+  int x, y;
+  int upd0, upd1, upd2, upd3;
+  double x0, x1, x2, x3;
+  double y0, y1, y2, y3;
+  double c0, c1, c2, c3;
+  double nx0, nx1, nx2, nx3;
+  double ny0, ny1, ny2, ny3;
+  double nc0, nc1, nc2, nc3;
+  double l0, l1, l2, l3;
+  double area, narea;
+  double nl0, nl1, nl2, nl3;
+  double thetaX, thetaY, nThetaX, nThetaY;
+  double txd, tyd, ntxd, ntyd;
+  double ode, nde;
+  double de;
+  size_t k;
+
+  de = 0.0;
+  for (y = icy - 1; y <= icy; ++y)
+    {
+      if (y < 0 || y >= mph_minus_1)
+	continue;
+      for (x = icx - 1; x <= icx; ++x)
+	{
+	  if (x < 0 || x >= mpw_minus_1)
+	    continue;
+
+#if FOLDING
+	  nirdisc[y*imbpl + (x >> 3)] &= ~(0x80 >> (x & 7));
+	  nirdisc[y*imbpl + (x >> 3)] |= irdisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7));
+	  if ((idisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
+	    continue;
+#endif
+
+	  upd0 = MAP(prop, mpw, x, y).c != 0.0;
+	  upd1 = MAP(prop, mpw, x, y+1).c != 0.0;
+	  upd2 = MAP(prop, mpw, x+1, y+1).c != 0.0;
+	  upd3 = MAP(prop, mpw, x+1, y).c != 0.0;
+
+	  if (!upd0 && !upd1 && !upd2 && !upd3)
+	    continue;
+#if FOLDING
+	  if ((idisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
+	    continue;
+	  if ((irdisc[y*imbpl + (x >> 3)] & (0x80 >> (x & 7))) == 0)
+	    continue;
+#endif
+
+	  GETMAP(map, mpw, x, y, &x0, &y0, &c0);
+	  GETMAP(map, mpw, x, y+1, &x1, &y1, &c1);
+	  GETMAP(map, mpw, x+1, y+1, &x2, &y2, &c2);
+	  GETMAP(map, mpw, x+1, y, &x3, &y3, &c3);
+
+	  if (c0 == 0.0 || c1 == 0.0 || c2 == 0.0 || c3 == 0.0)
+	    continue;
+
+	  nx0 = x0; ny0 = y0; nc0 = c0;
+	  nx1 = x1; ny1 = y1; nc1 = c1;
+	  nx2 = x2; ny2 = y2; nc2 = c2;
+	  nx3 = x3; ny3 = y3; nc3 = c3;
+
+	  if (upd0)
+	    GETMAP(prop, mpw, x, y, &nx0, &ny0, &nc0);
+	  if (upd1)
+	    GETMAP(prop, mpw, x, y+1, &nx1, &ny1, &nc1);
+	  if (upd2)
+	    GETMAP(prop, mpw, x+1, y+1, &nx2, &ny2, &nc2);
+	  if (upd3)
+	    GETMAP(prop, mpw, x+1, y, &nx3, &ny3, &nc3);
+
+#if FOLDING
+	  rx = 0.25 * (nx0 + nx1 + nx2 + nx3);
+	  ry = 0.25 * (ny0 + ny1 + ny2 + ny3);
+	  ix = floor(rx);
+	  iy = floor(ry);
+	  if (ix >= 0 && ix < refw && iy >= 0 && iy < refh &&
+	      (rdisc[iy*rmbpl + (ix >> 3)] & (0x80 >> (ix & 7))) == 0)
+	    {
+	      nirdisc[y*imbpl + (x >> 3)] &= ~(0x80 >> (x & 7));
+	      continue;
+	    }
+#endif
+
+	  k = y * mpw_minus_1 + x;
+	  area = - 0.5 *((x2 - x0) * (y3 - y1) -
+			 (x3 - x1) * (y2 - y0));
+	  l0 = sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+	  l1 = sqrt((x2 - x1) * (x2 - x1) + (y2 - y1) * (y2 - y1));
+	  l2 = sqrt((x3 - x2) * (x3 - x2) + (y3 - y2) * (y3 - y2));
+	  l3 = sqrt((x0 - x3) * (x0 - x3) + (y0 - y3) * (y0 - y3));
+	  thetaX = atan2(y3 - y0, x3 - x0);
+	  thetaY = atan2(y1 - y0, x1 - x0);
+	  txd = fabs(fmod(mc->nomThetaX[k] - thetaX + 3.0*M_PI,
+			  2.0*M_PI) - M_PI);
+	  tyd = fabs(fmod(mc->nomThetaY[k] - thetaY + 3.0*M_PI,
+			  2.0*M_PI) - M_PI);
+	  narea = - 0.5 *((nx2 - nx0) * (ny3 - ny1) -
+			  (nx3 - nx1) * (ny2 - ny0));
+	  nl0 = sqrt((nx1 - nx0) * (nx1 - nx0) +
+		     (ny1 - ny0) * (ny1 - ny0));
+	  nl1 = sqrt((nx2 - nx1) * (nx2 - nx1) +
+		     (ny2 - ny1) * (ny2 - ny1));
+	  nl2 = sqrt((nx3 - nx2) * (nx3 - nx2) +
+		     (ny3 - ny2) * (ny3 - ny2));
+	  nl3 = sqrt((nx0 - nx3) * (nx0 - nx3) +
+		     (ny0 - ny3) * (ny0 - ny3));
+	  nThetaX = atan2(ny3 - ny0, nx3 - nx0);
+	  nThetaY = atan2(ny1 - ny0, nx1 - nx0);
+	  ntxd = fabs(fmod(mc->nomThetaX[k] - nThetaX + 3.0*M_PI,
+			   2.0*M_PI) - M_PI);
+	  ntyd = fabs(fmod(mc->nomThetaY[k] - nThetaY + 3.0*M_PI,
+			   2.0*M_PI) - M_PI);
+#if 0
+	  ode = (area - mc->nomArea[k]) * (area - mc->nomArea[k]) +
+	    (l0 - mc->nomL0[k]) * (l0 - mc->nomL0[k]) +
+	    (l1 - mc->nomL1[k]) * (l1 - mc->nomL1[k]) +
+	    (l2 - mc->nomL2[k]) * (l2 - mc->nomL2[k]) +
+	    (l3 - mc->nomL3[k]) * (l3 - mc->nomL3[k]);
+	  nde = (narea - mc->nomArea[k]) * (narea - mc->nomArea[k]) +
+	    (nl0 - mc->nomL0[k]) * (nl0 - mc->nomL0[k]) +
+	    (nl1 - mc->nomL1[k]) * (nl1 - mc->nomL1[k]) +
+	    (nl2 - mc->nomL2[k]) * (nl2 - mc->nomL2[k]) +
+	    (nl3 - mc->nomL3[k]) * (nl3 - mc->nomL3[k]);
+#else
+	  ode = txd * txd + tyd * tyd +
+	    (l0 - mc->nomL0[k]) * (l0 - mc->nomL0[k]) +
+	    (l1 - mc->nomL1[k]) * (l1 - mc->nomL1[k]) +
+	    (l2 - mc->nomL2[k]) * (l2 - mc->nomL2[k]) +
+	    (l3 - mc->nomL3[k]) * (l3 - mc->nomL3[k]);
+	  nde = ntxd * ntxd + ntyd * ntyd +
+	    (nl0 - mc->nomL0[k]) * (nl0 - mc->nomL0[k]) +
+	    (nl1 - mc->nomL1[k]) * (nl1 - mc->nomL1[k]) +
+	    (nl2 - mc->nomL2[k]) * (nl2 - mc->nomL2[k]) +
+	    (nl3 - mc->nomL3[k]) * (nl3 - mc->nomL3[k]);
+#endif
+	  de += nde - ode;
+	}
+    }
+  return(de);
+}
+
+/* CorrespondenceDelta also leaves the energy each correspondence
+   point near the node would have after the move in its newEnergy */
+double
+CorrespondenceDelta (MoveContext *mc, int icx, int icy)
+{
+  MapElement *map = mc->map;
+  MapElement *prop = mc->prop;
+  int mpw = mc->mpw;
+  int mpw_minus_1 = mc->mpw - 1;
+  int mph_minus_1 = mc->mph - 1;
+  int mox = mc->mox;
+  int moy = mc->moy;
+  double lFactor = mc->lFactor;
+  double kFactor = mc->kFactor;
+  MapElement *mp;
+  int i;
+  int ixv, iyv;
+  double xv, yv;
+  double rrx, rry;
+  double rx, ry;
+  double rx00, rx01, rx10, rx11, ry00, ry01, ry10, ry11;
+  double rc00, rc01, rc10, rc11;
+  double distance;
+  double ce;
+
+  ce = 0.0;
+  for (i = 0; i < nCpts; ++i)
+    {
+      xv = cpts[i].ix / lFactor - mox;
+      yv = cpts[i].iy / lFactor - moy;
+      ixv = ((int) (xv + 2.0)) - 2;
+      iyv = ((int) (yv + 2.0)) - 2;
+      if (ixv < icx-1 || ixv > icx ||
+	  iyv < icy-1 || iyv > icy)
+	continue;
+      rrx = xv - ixv;
+      rry = yv - iyv;
+      if (ixv < 0 || ixv >= mpw_minus_1 || iyv < 0 || iyv >= mph_minus_1)
+	{
+	  cpts[i].newEnergy = 1000000.0;
+	  ce += cpts[i].newEnergy - cpts[i].energy;
+	  continue;
+	}
+      mp = (MAP(prop, mpw, ixv, iyv).c != 0.0) ? prop : map;
+      GETMAP(mp, mpw, ixv, iyv, &rx00, &ry00, &rc00);
+      mp = (MAP(prop, mpw, ixv, iyv+1).c != 0.0) ? prop : map;
+      GETMAP(mp, mpw, ixv, iyv+1, &rx01, &ry01, &rc01);
+      mp = (MAP(prop, mpw, ixv+1, iyv).c != 0.0) ? prop : map;
+      GETMAP(mp, mpw, ixv+1, iyv, &rx10, &ry10, &rc10);
+      mp = (MAP(prop, mpw, ixv+1, iyv+1).c != 0.0) ? prop : map;
+      GETMAP(mp, mpw, ixv+1, iyv+1, &rx11, &ry11, &rc11);
+
+      rx = rx00 * (rrx - 1.0) * (rry - 1.0)
+	- rx10 * rrx * (rry - 1.0) 
+	- rx01 * (rrx - 1.0) * rry
+	+ rx11 * rrx * rry;
+      ry = ry00 * (rrx - 1.0) * (rry - 1.0)
+	- ry10 * rrx * (rry - 1.0) 
+	- ry01 * (rrx - 1.0) * rry
+	+ ry11 * rrx * rry;
+      rx = lFactor * rx;
+      ry = lFactor * ry;
+      rrx = cpts[i].rx;
+      rry = cpts[i].ry;
+      distance = kFactor * (hypot(rrx-rx, rry-ry) - c.correspondenceThreshold);
+      if (distance < 0.0)
+	cpts[i].newEnergy = 0.0;
+      else
+	cpts[i].newEnergy = distance;
+      ce += cpts[i].newEnergy - cpts[i].energy;
+    }
+  return(ce);
+}
+
+double
+ConstrainingDelta (MoveContext *mc, int icx, int icy)
+{
+  MapElement *e, *ec, *ep;
+  double cth;
+  double distance, oldEnergy;
+  double de;
+
+  de = 0.0;
+  if (constrainingMapFactor != 0)
+    {
+      cth = c.constrainingThreshold / mc->lFactor;
+      e = &MAP(mc->map, mc->mpw, icx, icy);
+      ec = &MAP(mc->mapCons, mc->mpw, icx, icy);
+      ep = &MAP(mc->prop, mc->mpw, icx, icy);
+      if (ec->c >= c.constrainingConfidenceThreshold)
+	{
+	  distance = hypot(e->x - ec->x, e->y - ec->y) - cth;
+	  if (distance < 0.0)
+	    distance = 0.0;
+	  oldEnergy = distance;
+	  distance = hypot(ep->x - ec->x, ep->y - ec->y) - cth;
+	  if (distance < 0.0)
+	    distance = 0.0;
+	  de += distance - oldEnergy;
+	}
+    }
+  return(de);
+}
+
+/* AcceptCorrespondence makes the energies that CorrespondenceDelta
+   computed for the points near node (icx, icy) current */
+void
+AcceptCorrespondence (MoveContext *mc, int icx, int icy)
+{
+  int i;
+  int ixv, iyv;
+  double xv, yv;
+
+  for (i = 0; i < nCpts; ++i)
+    {
+      xv = cpts[i].ix / mc->lFactor - mc->mox;
+      yv = cpts[i].iy / mc->lFactor - mc->moy;
+      ixv = ((int) (xv + 2.0)) - 2;
+      iyv = ((int) (yv + 2.0)) - 2;
+      if (ixv >= icx-1 && ixv <= icx &&
+	  iyv >= icy-1 && iyv <= icy)
+	cpts[i].energy = cpts[i].newEnergy;
+    }
+}
+
+/* computes in next the state that making move m would give,
+   from the current state cur, and returns 1 if the move
+   lowers the energy */
+int
+MoveLowersEnergy (MoveContext *mc, EnergyState *cur, Move *m,
+		  EnergyState *next)
+{
+  size_t requiredPoints = mc->requiredPoints;
+  double dsr, dsr2;
+  size_t newEffectivePoints;
+  double newmi = 0.0, newmr = 0.0;
+  double newDenom = 0.0;
+  double newCorr;
+
+  dsr = m->dsr;
+  dsr2 = m->dsr2;
+  if (cur->nPoints < requiredPoints)
+    {
+      dsr -= (requiredPoints - cur->nPoints) * 255.0;
+      dsr2 -= (requiredPoints - cur->nPoints) * 255.0 * 255.0;
+    }
+  next->nPoints = cur->nPoints + m->cPoints;
+  if (next->nPoints < requiredPoints)
+    {
+      dsr += (requiredPoints - next->nPoints) * 255.0;
+      dsr2 += (requiredPoints - next->nPoints) * 255.0 * 255.0;
+      newEffectivePoints = requiredPoints;
+    }
+  else
+    newEffectivePoints = next->nPoints;
+  next->si = cur->si + m->dsi;
+  if (next->si < -0.1)
+    Error("Internal error: negative newsi\nsi = %f  dsi = %f  newsi = %f\n",
+	  cur->si, m->dsi, next->si);
+  next->si2 = cur->si2 + m->dsi2;
+  next->sir = cur->sir + m->dsir;
+  next->sr = cur->sr + dsr;
+  next->sr2 = cur->sr2 + dsr2;
+  if (newEffectivePoints != 0)
+    {
+      newmi = next->si / newEffectivePoints;
+      newmr = next->sr / newEffectivePoints;
+
+      newDenom = (next->si2 - 2.0 * newmi * next->si + newEffectivePoints * newmi * newmi) *
+	(next->sr2 - 2.0 * newmr * next->sr + newEffectivePoints * newmr * newmr);
+      if (newDenom < 0.001)
+	newCorr = -1000000.0;
+      else
+	newCorr = (next->sir - newmi * next->sr - newmr * next->si + newEffectivePoints * newmi * newmr) / sqrt(newDenom);
+    }
+  else
+    newCorr = -1000000.0;
+  next->correlation = newCorr;
+  if (next->correlation > 1.1)
+    {
+      Log("mi %f mr %f si %f sr %f ih %d iw %d si2 %f sr2 %f denom %f sir %f r %f\n",
+	  newmi, newmr, next->si, next->sr, mc->ih, mc->iw,
+	  next->si2, next->sr2, newDenom, next->sir, newCorr);
+      Log("nPoints = %d requiredPoints = %d effectivePoints = %d\n",
+	  next->nPoints, requiredPoints, newEffectivePoints);
+      Error("Internal error: Level %d map has new correlation energy of %f\n",
+	    mc->level, next->correlation);
+    }
+
+  /* add in contributions from distortion, correspondence
+     points, and constraining map */
+  // FIX to divide by adjusted dpoints
+  next->distortion = cur->distortion + m->dDistortion / mc->dPoints;
+  next->correspondence = cur->correspondence + m->dCorrespondence;
+  next->constraining = cur->constraining +
+    m->dConstraining / mc->mph / mc->mpw;
+
+  next->energy = next->distortion * c.distortion - next->correlation +
+    next->correspondence * c.correspondence + next->constraining * c.constraining;
+
+  return(next->energy < cur->energy);
+}
+
+void
+EvaluateMove (MoveContext *mc, Move *m)
+{
+  int icx = m->icx;
+  int icy = m->icy;
+  unsigned short xsubi[3];
+  unsigned long long seed;
+  double cx, cy, cc;
+  float logRadius;
+  double radius;
+
+  m->valid = 0;
+  GETMAP(mc->map, mc->mpw, icx, icy, &cx, &cy, &cc);
+  if (cc == 0.0)
+    return;
+  if (isnan(cx) || isnan(cy))
+    Error("ISNAN cx %f cy %f\n", cx, cy);
+
+  /* derive the random sequence of this move from its position in
+     the overall sequence of moves at this level */
+  seed = (((unsigned long long) mc->level) << 56) ^ m->index;
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  seed ^= seed >> 31;
+  xsubi[0] = (unsigned short) seed;
+  xsubi[1] = (unsigned short) (seed >> 16);
+  xsubi[2] = (unsigned short) (seed >> 32);
+
+  m->rnd = erand48(xsubi);
+  logRadius = m->rnd * mc->logRadiusRange + mc->logMinRadius;
+  radius = exp(logRadius);
+  m->theta = erand48(xsubi) * 2.0 * M_PI;
+  cx += radius * cos(m->theta);
+  cy += radius * sin(m->theta);
+
+  if (!MoveKeepsSpacing(mc, icx, icy, cx, cy))
+    return;
+
+  SETMAP(mc->prop, mc->mpw, icx, icy, cx, cy, 1.0);
+  m->valid = 1;
+  CorrelationDeltas(mc, m);
+  m->dDistortion = DistortionDelta(mc, icx, icy);
+  m->dCorrespondence = CorrespondenceDelta(mc, icx, icy);
+  m->dConstraining = ConstrainingDelta(mc, icx, icy);
+}
+
+void
+EvaluateMovesTask (int thread, void *arg)
+{
+  MoveBatch *b = (MoveBatch *) arg;
+  int i;
+
+  for (i = thread; i < b->nMoves; i += nMoveThreads)
+    EvaluateMove(b->mc, &b->moves[i]);
+}
+
+void
+StartMoveThreads ()
+{
+  int i;
+  pthread_attr_t attr;
+
+  if (nMoveThreads != 0)
+    return;
+  nMoveThreads = c.nThreads;
+  Log("Starting %d move evaluation threads\n", nMoveThreads - 1);
+  moveThreads = (pthread_t *) malloc(nMoveThreads * sizeof(pthread_t));
+  if (pthread_attr_init(&attr) != 0)
+    Error("pthread_attr_init failed\n");
+  for (i = 1; i < nMoveThreads; ++i)
+    if (pthread_create(&moveThreads[i], &attr, MoveThreadMain,
+		       (void *) (long) i) != 0)
+      Error("Could not create move evaluation thread %d\n", i);
+  pthread_attr_destroy(&attr);
+}
+
+void *
+MoveThreadMain (void *arg)
+{
+  int thread = (int) (long) arg;
+  int generation = 0;
+
+  for (;;)
+    {
+      pthread_mutex_lock(&poolMutex);
+      while (poolGeneration == generation)
+	pthread_cond_wait(&poolStartCond, &poolMutex);
+      generation = poolGeneration;
+      pthread_mutex_unlock(&poolMutex);
+
+      (*poolFunc)(thread, poolArg);
+
+      pthread_mutex_lock(&poolMutex);
+      if (--poolPending == 0)
+	pthread_cond_signal(&poolDoneCond);
+      pthread_mutex_unlock(&poolMutex);
+    }
+  return(NULL);
+}
+
+void
+RunMoveThreads (void (*func)(int thread, void *arg), void *arg)
+{
+  /* run func on all threads of the pool, with the calling
+     thread acting as thread 0, and wait for all of them to finish */
+  if (nMoveThreads <= 1)
+    {
+      (*func)(0, arg);
+      return;
+    }
+  pthread_mutex_lock(&poolMutex);
+  poolFunc = func;
+  poolArg = arg;
+  poolPending = nMoveThreads - 1;
+  ++poolGeneration;
+  pthread_cond_broadcast(&poolStartCond);
+  pthread_mutex_unlock(&poolMutex);
+
+  (*func)(0, arg);
+
+  pthread_mutex_lock(&poolMutex);
+  while (poolPending > 0)
+    pthread_cond_wait(&poolDoneCond, &poolMutex);
+  pthread_mutex_unlock(&poolMutex);
+}
+
+
 void
 TrimOutputMap (MapElement *map, int mpw, int mph, int mox, int moy,
 	       int factor,
@@ -4787,7 +6371,7 @@ void
 ComputeWarpedImage (float *warped, unsigned char *valid,
 		    int w, int h,           /* of the warped reference */
 		    int imgox, int imgoy,   /* of the warped reference */
-		    float *image, unsigned char *mask,
+		    void *image, unsigned char *mask,
 		    int iw, int ih,         /* of the reference (image & mask) */
 		    int refox, int refoy,   /* of the reference (image & mask) */
 		    MapElement *map,
@@ -4879,10 +6463,10 @@ ComputeWarpedImage (float *warped, unsigned char *valid,
 	  }
 #endif
 
-	r00 = image[iry * iw + irx];
-	r01 = image[(iry + 1) * iw + irx];
-	r10 = image[iry * iw + (irx + 1)];
-	r11 = image[(iry + 1) * iw + irx + 1];
+	r00 = PIXEL(image, c.pyramidBits, iry * iw + irx);
+	r01 = PIXEL(image, c.pyramidBits, (iry + 1) * iw + irx);
+	r10 = PIXEL(image, c.pyramidBits, iry * iw + (irx + 1));
+	r11 = PIXEL(image, c.pyramidBits, (iry + 1) * iw + irx + 1);
 	rv = r00 * (rrx - 1.0) * (rry - 1.0)
 	  - r10 * rrx * (rry - 1.0)
 	  - r01 * (rrx - 1.0) * rry
@@ -4897,7 +6481,7 @@ ComputeWarpedImage (float *warped, unsigned char *valid,
 
 void
 ComputeCorrelation (float *correlation,
-		    float *a, float *b,
+		    void *a, float *b,
 		    unsigned char *valid,
 		    int w, int h,
 		    int hw)
@@ -4945,7 +6529,7 @@ ComputeCorrelation (float *correlation,
       {
 	if (x >= w || y >= h || !valid[y*w+x])
 	  continue;
-	av = a[y*w+x];
+	av = PIXEL(a, c.pyramidBits, y*w+x);
 	bv = b[y*w+x];
 	startSumA += av;
 	startSumA2 += av * av;
@@ -4966,7 +6550,7 @@ ComputeCorrelation (float *correlation,
 	  y = yc - lim[i] - 1;
 	  if (y >= 0 && y < h && x < w && valid[y*w+x])
 	    {
-	      av = a[y*w+x];
+	      av = PIXEL(a, c.pyramidBits, y*w+x);
 	      bv = b[y*w+x];
 	      startSumA -= av;
 	      startSumA2 -= av * av;
@@ -4981,7 +6565,7 @@ ComputeCorrelation (float *correlation,
 	  y = yc + lim[i];
 	  if (y < h && x < w && valid[y*w+x])
 	    {
-	      av = a[y*w+x];
+	      av = PIXEL(a, c.pyramidBits, y*w+x);
 	      bv = b[y*w+x];
 	      startSumA += av;
 	      startSumA2 += av * av;
@@ -5021,7 +6605,7 @@ ComputeCorrelation (float *correlation,
 		  continue;
 		if (!valid[cy*w+cx])
 		  continue;
-		av = a[cy*w+cx];
+		av = PIXEL(a, c.pyramidBits, cy*w+cx);
 		bv = b[cy*w+cx];
 		checkSumA += av;
 		checkSumA2 += av * av;
@@ -5060,7 +6644,7 @@ ComputeCorrelation (float *correlation,
 	  x = xc - lim[0] - 1;
 	  if (x >= 0 && x < w && valid[yc*w+x])
 	    {
-	      av = a[yc*w+x];
+	      av = PIXEL(a, c.pyramidBits, yc*w+x);
 	      bv = b[yc*w+x];
 	      sumA -= av;
 	      sumA2 -= av * av;
@@ -5075,7 +6659,7 @@ ComputeCorrelation (float *correlation,
 	  x = xc + lim[0];
 	  if (x >= 0 && x < w && valid[yc*w+x])
 	    {
-	      av = a[yc*w+x];
+	      av = PIXEL(a, c.pyramidBits, yc*w+x);
 	      bv = b[yc*w+x];
 	      sumA += av;
 	      sumA2 += av * av;
@@ -5095,7 +6679,7 @@ ComputeCorrelation (float *correlation,
 		  y = yc - i;
 		  if (y >= 0 && valid[y*w+x])
 		    {
-		      av = a[y*w+x];
+		      av = PIXEL(a, c.pyramidBits, y*w+x);
 		      bv = b[y*w+x];
 		      sumA -= av;
 		      sumA2 -= av * av;
@@ -5108,7 +6692,7 @@ ComputeCorrelation (float *correlation,
 		  y = yc + i;
 		  if (y < h && valid[y*w+x])
 		    {
-		      av = a[y*w+x];
+		      av = PIXEL(a, c.pyramidBits, y*w+x);
 		      bv = b[y*w+x];
 		      sumA -= av;
 		      sumA2 -= av * av;
@@ -5127,7 +6711,7 @@ ComputeCorrelation (float *correlation,
 		  y = yc - i;
 		  if (y >= 0 && valid[y*w+x])
 		    {
-		      av = a[y*w+x];
+		      av = PIXEL(a, c.pyramidBits, y*w+x);
 		      bv = b[y*w+x];
 		      sumA += av;
 		      sumA2 += av * av;
@@ -5140,7 +6724,7 @@ ComputeCorrelation (float *correlation,
 		  y = yc + i;
 		  if (y < h && valid[y*w+x])
 		    {
-		      av = a[y*w+x];
+		      av = PIXEL(a, c.pyramidBits, y*w+x);
 		      bv = b[y*w+x];
 		      sumA += av;
 		      sumA2 += av * av;
@@ -5238,6 +6822,11 @@ PackContext ()
   par_pkint(c.update);
   par_pkint(c.partial);
   par_pkint(c.nWorkers);
+  par_pkint(c.nThreads);
+  par_pkint(c.simdLevel);
+  par_pkint(c.cacheSize);
+  par_pkint(c.pyramidBits);
+  par_pkstr(c.pyramidBasename);
 }
 
 void
@@ -5283,6 +6872,11 @@ UnpackContext ()
   c.update = par_upkint();
   c.partial = par_upkint();
   c.nWorkers = par_upkint();
+  c.nThreads = par_upkint();
+  c.simdLevel = par_upkint();
+  c.cacheSize = par_upkint();
+  c.pyramidBits = par_upkint();
+  par_upkstr(c.pyramidBasename);
 }
 
 void
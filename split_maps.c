@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "imio.h"
+
+/* splits the aggregate.NN.maps files written by align -output_aggregate
+   back into one image_name.map file per image, as align writes without
+   that option, so that apply_map, gen_imaps and align -initial_maps
+   can read them */
+int
+main (int argc, char **argv)
+{
+  FILE *f;
+  MapElement *map;
+  char imName0[PATH_MAX], imName1[PATH_MAX];
+  char fn[PATH_MAX];
+  char msg[PATH_MAX+256];
+  int level;
+  int mw, mh;
+  int mxMin, myMin;
+  int c;
+  int i;
+  int n;
+
+  if (argc < 3)
+    {
+      fprintf(stderr, "Usage: split_maps output_prefix aggregate_file ...\n");
+      fprintf(stderr, "  writes output_prefix<image_name>.map for each map in the\n");
+      fprintf(stderr, "  aggregate files written by align -output_aggregate\n");
+      exit(1);
+    }
+
+  for (i = 2; i < argc; ++i)
+    {
+      f = fopen(argv[i], "rb");
+      if (f == NULL)
+	{
+	  fprintf(stderr, "Could not open aggregate file %s\n", argv[i]);
+	  exit(1);
+	}
+      n = 0;
+      while ((c = fgetc(f)) != EOF)
+	{
+	  ungetc(c, f);
+	  if (!ReadMapFromStream(f, argv[i], &map, &level, &mw, &mh,
+				 &mxMin, &myMin, imName0, imName1,
+				 msg))
+	    {
+	      fprintf(stderr, "Could not read map %d of %s:\n%s\n",
+		      n, argv[i], msg);
+	      exit(1);
+	    }
+	  if (snprintf(fn, PATH_MAX, "%s%s.map", argv[1], imName0) >= PATH_MAX)
+	    {
+	      fprintf(stderr, "Map path %s%s.map is too long\n",
+		      argv[1], imName0);
+	      exit(1);
+	    }
+	  if (!WriteMap(fn, map, level, mw, mh, mxMin, myMin,
+			imName0, imName1,
+			UncompressedMap, msg))
+	    {
+	      fprintf(stderr, "Could not write map %s:\n%s\n", fn, msg);
+	      exit(1);
+	    }
+	  free(map);
+	  ++n;
+	}
+      fclose(f);
+      printf("Wrote %d maps from %s\n", n, argv[i]);
+    }
+
+  return(0);
+}